@@ -2170,6 +2170,8 @@ template<bool SKIP> static void GPU_RenderLine_DispCapture(u16 l)
 		if(!skip)
 		if (l < gpu->dispCapCnt.capy)
 		{
+			vram_bank_dirty[gpu->dispCapCnt.writeBlock] = 1;
+
 			switch (gpu->dispCapCnt.capSrc)
 			{
 				case 0:		// Capture source is SourceA
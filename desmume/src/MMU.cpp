@@ -22,6 +22,7 @@
 #include <string.h>
 #include <assert.h>
 #include <sstream>
+#include <algorithm>
 
 #include "common.h"
 #include "debug.h"
@@ -39,6 +40,7 @@
 #include "movie.h"
 #include "readwrite.h"
 #include "MMU_timing.h"
+#include "utils/task.h"
 
 #ifdef DO_ASSERT_UNALIGNED
 #define ASSERT_UNALIGNED(x) assert(x)
@@ -275,6 +277,64 @@ u8 vram_arm9_map[VRAM_ARM9_PAGES];
 //this chooses which banks are mapped in the 128K banks starting at 0x06000000 in ARM7
 u8 vram_arm7_map[2];
 
+u8 vram_bank_dirty[VRAM_BANKS+1];
+static u32 vram_bank_generation[VRAM_BANKS+1];
+
+//the bank each 16KB page in the LCDC buffer belongs to. pages past the end of the banks are blank memory
+const u8 vram_lcdc_page_bank[64] = {
+	VRAM_BANK_A,VRAM_BANK_A,VRAM_BANK_A,VRAM_BANK_A,VRAM_BANK_A,VRAM_BANK_A,VRAM_BANK_A,VRAM_BANK_A,
+	VRAM_BANK_B,VRAM_BANK_B,VRAM_BANK_B,VRAM_BANK_B,VRAM_BANK_B,VRAM_BANK_B,VRAM_BANK_B,VRAM_BANK_B,
+	VRAM_BANK_C,VRAM_BANK_C,VRAM_BANK_C,VRAM_BANK_C,VRAM_BANK_C,VRAM_BANK_C,VRAM_BANK_C,VRAM_BANK_C,
+	VRAM_BANK_D,VRAM_BANK_D,VRAM_BANK_D,VRAM_BANK_D,VRAM_BANK_D,VRAM_BANK_D,VRAM_BANK_D,VRAM_BANK_D,
+	VRAM_BANK_E,VRAM_BANK_E,VRAM_BANK_E,VRAM_BANK_E,
+	VRAM_BANK_F,
+	VRAM_BANK_G,
+	VRAM_BANK_H,VRAM_BANK_H,
+	VRAM_BANK_I,
+	VRAM_BANKS,VRAM_BANKS,VRAM_BANKS,VRAM_BANKS,VRAM_BANKS,VRAM_BANKS,VRAM_BANKS,
+	VRAM_BANKS,VRAM_BANKS,VRAM_BANKS,VRAM_BANKS,VRAM_BANKS,VRAM_BANKS,VRAM_BANKS,VRAM_BANKS,
+	VRAM_BANKS,VRAM_BANKS,VRAM_BANKS,VRAM_BANKS,VRAM_BANKS,VRAM_BANKS,VRAM_BANKS,VRAM_BANKS,
+};
+
+u32 MMU_VRAM_generation(const u8* ptr)
+{
+	u32 page = (u32)(ptr - MMU.ARM9_LCD) >> 14;
+	if(page >= 64) return 0;
+	const int bank = vram_lcdc_page_bank[page];
+	if(vram_bank_dirty[bank])
+	{
+		vram_bank_dirty[bank] = 0;
+		vram_bank_generation[bank]++;
+	}
+	return vram_bank_generation[bank];
+}
+
+void MMU_VRAM_dirty_all()
+{
+	for(int i=0;i<VRAM_BANKS;i++)
+		vram_bank_dirty[i] = 1;
+}
+
+bool MMU_dirty_tracking = false;
+u32 MMU_dirty_pages[MMU_DIRTY_PAGES/32];
+
+void MMU_MAIN_MEM_dirty_range(u32 addr, u32 bytes)
+{
+	if(!MMU_dirty_tracking || bytes == 0) return;
+	const u32 first = (addr & _MMU_MAIN_MEM_MASK) >> MMU_DIRTY_PAGE_SHIFT;
+	const u32 last = ((addr & _MMU_MAIN_MEM_MASK) + bytes - 1) >> MMU_DIRTY_PAGE_SHIFT;
+	for(u32 page = first; page <= last; page++)
+	{
+		const u32 wrapped = page & (_MMU_MAIN_MEM_MASK >> MMU_DIRTY_PAGE_SHIFT);
+		MMU_dirty_pages[wrapped>>5] |= 1 << (wrapped&31);
+	}
+}
+
+void MMU_MAIN_MEM_dirty_all()
+{
+	memset(MMU_dirty_pages, 0xFF, sizeof(MMU_dirty_pages));
+}
+
 //----->
 //consider these later, for better recordkeeping, instead of using the u8* in MMU
 
@@ -897,6 +957,8 @@ static inline void MMU_VRAMmapControl(u8 block, u8 VRAMBankCnt)
 
 
 
+static void MMU_IOInit();
+
 void MMU_Init(void) {
 	LOG("MMU init\n");
 
@@ -915,6 +977,7 @@ void MMU_Init(void) {
 	GFX_FIFOclear();
 	DISP_FIFOinit();
 	new(&MMU_new) MMU_struct_new;	
+	MMU_IOInit();
 
 	mc_init(&MMU.fw, MC_TYPE_FLASH);  /* init fw device */
 	mc_alloc(&MMU.fw, NDS_FW_SIZE_V1);
@@ -956,6 +1019,7 @@ void MMU_Reset()
 	memset(MMU.ARM9_REG,  0, sizeof(MMU.ARM9_REG));
 	memset(MMU.ARM9_VMEM, 0, sizeof(MMU.ARM9_VMEM));
 	memset(MMU.MAIN_MEM,  0, sizeof(MMU.MAIN_MEM));
+	MMU_MAIN_MEM_dirty_all();
 
 	memset(MMU.blank_memory,  0, sizeof(MMU.blank_memory));
 	memset(MMU.UNUSED_RAM,    0, sizeof(MMU.UNUSED_RAM));
@@ -1009,6 +1073,7 @@ void MMU_Reset()
 	SubScreen.offset  = 192;
 	
 	MMU_VRAM_unmap_all();
+	MMU_VRAM_dirty_all();
 
 	MMU.powerMan_CntReg = 0x00;
 	MMU.powerMan_CntRegWritten = FALSE;
@@ -1093,7 +1158,7 @@ static void execsqrt() {
 	MMU.sqrtCycles = nds_timer + 26;
 	MMU.sqrtResult = ret;
 	MMU.sqrtRunning = TRUE;
-	NDS_Reschedule();
+	NDS_RescheduleSqrt();
 }
 
 static void execdiv() {
@@ -1152,7 +1217,7 @@ static void execdiv() {
 	MMU.divResult = res;
 	MMU.divMod = mod;
 	MMU.divRunning = TRUE;
-	NDS_Reschedule();
+	NDS_RescheduleDivider();
 }
 
 DSI_TSC::DSI_TSC()
@@ -2003,6 +2068,111 @@ void DmaController::exec()
 	driver->DEBUG_UpdateIORegView(BaseDriver::EDEBUG_IOREG_DMA);
 }
 
+//lua memory hooks and the developer debug events want to see every element a dma moves
+#if !defined(HAVE_LUA) && !defined(DEVELOPER)
+#define DMA_BULK
+#endif
+
+#ifdef DMA_BULK
+//elements of sz bytes left before addr steps out of its 16KB page, walking in the direction of inc
+static FORCEINLINE u32 DMA_pageElements(u32 addr, u32 inc, u32 sz)
+{
+	addr &= ~(sz-1);
+	if(inc == 0) return 0xFFFFFFFF;
+	if((s32)inc > 0) return (0x4000 - (addr & 0x3FFF)) / sz;
+	return (addr & 0x3FFF) / sz + 1;
+}
+
+//where an address a dma can read and write without side effects lives in host memory: main memory,
+//shared/arm7 wram and mapped vram. returns NULL for anything that has to go through the read/write handlers.
+//mapped is the address the write handlers would use for jit invalidation and vram dirty tracking
+template<int PROCNUM> static u8* DMA_plainMemory(u32 addr, u32& mapped, bool& mainmem)
+{
+	if(PROCNUM==ARMCPU_ARM9)
+	{
+		if(addr<0x02000000) return NULL; //itcm
+		if((addr&(~0x3FFF)) == MMU.DTCMRegion) return NULL; //dtcm
+	}
+
+	mainmem = (addr & 0x0F000000) == 0x02000000;
+	if(mainmem)
+	{
+		mapped = addr;
+		return MMU.MAIN_MEM + (addr & _MMU_MAIN_MEM_MASK);
+	}
+
+	addr &= 0x0FFFFFFF;
+	if((addr>>24) != 3 && (addr>>24) != 6)
+		return NULL;
+
+	bool unmapped, restricted;
+	mapped = MMU_LCDmap<PROCNUM>(addr, unmapped, restricted);
+	if(unmapped) return NULL;
+	return MMU.MMU_MEM[PROCNUM][mapped>>20] + (mapped & MMU.MMU_MASK[PROCNUM][mapped>>20]);
+}
+
+//copies (or fills, for a fixed source) a run of n elements that doesn't leave the 16KB page
+//of either address with a memcpy, when both sides are plain memory and the result is the same
+//as moving the elements one at a time. returns false to leave the run to the element loop.
+template<int PROCNUM> static bool DMA_bulkCopy(u32 src, u32 dst, u32 srcinc, u32 dstinc, u32 sz, u32 n)
+{
+	//a fixed destination is a fifo, and mixed directions reverse the data
+	if(dstinc == 0) return false;
+	if(srcinc != 0 && srcinc != dstinc) return false;
+
+	u32 srcmapped, dstmapped;
+	bool srcmain, dstmain;
+	u8* s = DMA_plainMemory<PROCNUM>(src & ~(sz-1), srcmapped, srcmain);
+	if(!s) return false;
+	u8* d = DMA_plainMemory<PROCNUM>(dst & ~(sz-1), dstmapped, dstmain);
+	if(!d) return false;
+
+	//a decrementing run covers the n-1 elements below its starting address
+	const u32 bytes = n * sz;
+	if((s32)dstinc < 0)
+	{
+		d -= bytes - sz;
+		dstmapped -= bytes - sz;
+		if(srcinc) s -= bytes - sz;
+	}
+
+	//the element loop would replicate data through an overlap, so only take disjoint runs
+	if(srcinc)
+	{
+		if(s < d + bytes && d < s + bytes) return false;
+	}
+	else if(s >= d && s < d + bytes) return false;
+
+#ifdef HAVE_JIT
+	if(dstmain)
+		JIT_INVALIDATE_RANGE(JIT_COMPILED_FUNC_KNOWNBANK(dstmapped, MAIN_MEM, _MMU_MAIN_MEM_MASK, 0), bytes >> 1);
+	else if(JIT_MAPPED(dstmapped, PROCNUM))
+		JIT_INVALIDATE_RANGE(JIT_COMPILED_FUNC_PREMASKED(dstmapped, PROCNUM, 0), bytes >> 1);
+#endif
+
+	if(dstmain)
+		MMU_MAIN_MEM_dirty_range(dstmapped, bytes);
+	else if((dstmapped & 0x0F000000) == 0x06000000)
+		MMU_VRAM_dirty(dstmapped);
+
+	if(srcinc)
+		memcpy(d, s, bytes);
+	else if(sz == 4)
+	{
+		const u32 val = *(u32*)s;
+		u32* out = (u32*)d;
+		for(u32 i = 0; i < n; i++) out[i] = val;
+	}
+	else
+	{
+		const u16 val = *(u16*)s;
+		u16* out = (u16*)d;
+		for(u32 i = 0; i < n; i++) out[i] = val;
+	}
+	return true;
+}
+#endif
+
 template<int PROCNUM>
 void DmaController::doCopy()
 {
@@ -2052,30 +2222,51 @@ void DmaController::doCopy()
 
 	//if these do not use MMU_AT_DMA and the corresponding code in the read/write routines,
 	//then danny phantom title screen will be filled with a garbage char which is made by
-	//dmaing from 0x00000000 to 0x06000000
-	//TODO - these might be losing out a lot by not going through the templated version anymore.
-	//we might make another function to do just the raw copy op which can use them with checks
-	//outside the loop
+	//dmaing from 0x00000000 to 0x06000000.
+	//runs of the transfer between plain memory skip them (see DMA_bulkCopy); everything else goes element by element.
 	int time_elapsed = 0;
-	if(sz==4) {
-		for(s32 i=(s32)todo; i>0; i--)
+	for(u32 left = todo; left > 0; )
+	{
+		u32 n = left;
+#ifdef DMA_BULK
+		//take the transfer a 16KB page at a time, so each run of it either lives in plain memory or it doesn't.
+		//the access time of a dma only depends on the memory region, so a run costs n times one element
+		n = std::min(n, std::min(DMA_pageElements(src,srcinc,sz), DMA_pageElements(dst,dstinc,sz)));
+		if(DMA_bulkCopy<PROCNUM>(src,dst,srcinc,dstinc,sz,n))
 		{
-			time_elapsed += _MMU_accesstime<PROCNUM,MMU_AT_DMA,32,MMU_AD_READ,TRUE>(src,true);
-			time_elapsed += _MMU_accesstime<PROCNUM,MMU_AT_DMA,32,MMU_AD_WRITE,TRUE>(dst,true);
-			u32 temp = _MMU_read32(procnum,MMU_AT_DMA,src);
-			_MMU_write32(procnum,MMU_AT_DMA,dst, temp);
-			dst += dstinc;
-			src += srcinc;
+			if(sz==4)
+				time_elapsed += n * (_MMU_accesstime<PROCNUM,MMU_AT_DMA,32,MMU_AD_READ,TRUE>(src,true)
+				                   + _MMU_accesstime<PROCNUM,MMU_AT_DMA,32,MMU_AD_WRITE,TRUE>(dst,true));
+			else
+				time_elapsed += n * (_MMU_accesstime<PROCNUM,MMU_AT_DMA,16,MMU_AD_READ,TRUE>(src,true)
+				                   + _MMU_accesstime<PROCNUM,MMU_AT_DMA,16,MMU_AD_WRITE,TRUE>(dst,true));
+			dst += dstinc * n;
+			src += srcinc * n;
+			left -= n;
+			continue;
 		}
-	} else {
-		for(s32 i=(s32)todo; i>0; i--)
-		{
-			time_elapsed += _MMU_accesstime<PROCNUM,MMU_AT_DMA,16,MMU_AD_READ,TRUE>(src,true);
-			time_elapsed += _MMU_accesstime<PROCNUM,MMU_AT_DMA,16,MMU_AD_WRITE,TRUE>(dst,true);
-			u16 temp = _MMU_read16(procnum,MMU_AT_DMA,src);
-			_MMU_write16(procnum,MMU_AT_DMA,dst, temp);
-			dst += dstinc;
-			src += srcinc;
+#endif
+		left -= n;
+		if(sz==4) {
+			for(s32 i=(s32)n; i>0; i--)
+			{
+				time_elapsed += _MMU_accesstime<PROCNUM,MMU_AT_DMA,32,MMU_AD_READ,TRUE>(src,true);
+				time_elapsed += _MMU_accesstime<PROCNUM,MMU_AT_DMA,32,MMU_AD_WRITE,TRUE>(dst,true);
+				u32 temp = _MMU_read32(procnum,MMU_AT_DMA,src);
+				_MMU_write32(procnum,MMU_AT_DMA,dst, temp);
+				dst += dstinc;
+				src += srcinc;
+			}
+		} else {
+			for(s32 i=(s32)n; i>0; i--)
+			{
+				time_elapsed += _MMU_accesstime<PROCNUM,MMU_AT_DMA,16,MMU_AD_READ,TRUE>(src,true);
+				time_elapsed += _MMU_accesstime<PROCNUM,MMU_AT_DMA,16,MMU_AD_WRITE,TRUE>(dst,true);
+				u16 temp = _MMU_read16(procnum,MMU_AT_DMA,src);
+				_MMU_write16(procnum,MMU_AT_DMA,dst, temp);
+				dst += dstinc;
+				src += srcinc;
+			}
 		}
 	}
 
@@ -2130,7 +2321,7 @@ void DmaController::doSchedule()
 {
 	dmaCheck = TRUE;
 	nextEvent = nds_timer;
-	NDS_RescheduleDMA();
+	NDS_RescheduleDMA(procnum, chan);
 }
 
 
@@ -2189,6 +2380,258 @@ static INLINE void write_auxspicnt(const int proc, const int size, const int adr
 }
 
 
+//================================================================================================== I/O dispatch
+//the registers that get polled or hammered in tight loops (vcount, interrupt control, timers, ipc, div/sqrt),
+//and the runs of registers that share one implementation (the fog, toon and edge color tables, clear color,
+//the vram bank controls, the bytes of IF), are looked up in per-cpu tables indexed by their offset in the
+//first 0x400 bytes of the io page, ahead of the dma range check and the big switches below.
+//everything else still goes through the switches.
+//8 and 16bit handlers are registered for each byte or halfword; the read handlers return the register
+//shifted down to the part that was asked for, and the 8 and 16bit read functions truncate it.
+#define MMU_IO_TABLE_SIZE 0x400
+#define MMU_IO_IN_TABLE(adr) (((adr) & 0x0FFFFC00) == 0x04000000)
+
+typedef u32 (FASTCALL *MMU_IOReadHandler)(u32 adr);
+typedef void (FASTCALL *MMU_IOWriteHandler)(u32 adr, u32 val);
+
+static MMU_IOReadHandler MMU_IOread08[2][MMU_IO_TABLE_SIZE];
+static MMU_IOReadHandler MMU_IOread16[2][MMU_IO_TABLE_SIZE>>1];
+static MMU_IOReadHandler MMU_IOread32[2][MMU_IO_TABLE_SIZE>>2];
+static MMU_IOWriteHandler MMU_IOwrite08[2][MMU_IO_TABLE_SIZE];
+static MMU_IOWriteHandler MMU_IOwrite16[2][MMU_IO_TABLE_SIZE>>1];
+static MMU_IOWriteHandler MMU_IOwrite32[2][MMU_IO_TABLE_SIZE>>2];
+
+static u32 FASTCALL ioread_VCOUNT(u32 adr) { return nds.VCount; }
+static u32 FASTCALL ioread_VCOUNT_ensata(u32 adr)
+{
+	if(nds.ensataEmulation && nds.ensataHandshake == ENSATA_HANDSHAKE_query)
+	{
+		nds.ensataHandshake = ENSATA_HANDSHAKE_ack;
+		return 270;
+	}
+	return nds.VCount;
+}
+template<int PROCNUM> static u32 FASTCALL ioread_IME(u32 adr) { return MMU.reg_IME[PROCNUM]; }
+template<int PROCNUM> static u32 FASTCALL ioread_IE(u32 adr) { return MMU.reg_IE[PROCNUM] >> ((adr&2)<<3); }
+template<int PROCNUM> static u32 FASTCALL ioread_IF(u32 adr) { return MMU.gen_IF<PROCNUM>() >> ((adr&2)<<3); }
+template<int PROCNUM> static u32 FASTCALL ioread16_TMCNT(u32 adr) { return read_timer(PROCNUM,(adr&0xF)>>2); }
+template<int PROCNUM> static u32 FASTCALL ioread32_TMCNT(u32 adr)
+{
+	u32 val = T1ReadWord(MMU.MMU_MEM[PROCNUM][0x40], (adr + 2) & 0xFFF);
+	return MMU.timer[PROCNUM][(adr&0xF)>>2] | (val<<16);
+}
+static u32 FASTCALL ioread_DIVCNT(u32 adr) { return MMU_new.div.read16(); }
+static u32 FASTCALL ioread_SQRTCNT(u32 adr) { return MMU_new.sqrt.read16(); }
+static u32 FASTCALL ioread08_VCOUNT(u32 adr) { return nds.VCount >> ((adr&1)<<3); }
+template<int PROCNUM> static u32 FASTCALL ioread08_IF(u32 adr) { return MMU.gen_IF<PROCNUM>() >> ((adr&3)<<3); }
+static u32 FASTCALL ioread_WRITEONLY(u32 adr) { return 0; }
+
+template<int PROCNUM> static void FASTCALL iowrite_IME(u32 adr, u32 val)
+{
+	NDS_Reschedule();
+	MMU.reg_IME[PROCNUM] = val & 0x01;
+	T1WriteLong(MMU.MMU_MEM[PROCNUM][0x40], 0x208, val);
+}
+template<int PROCNUM> static void FASTCALL iowrite16_IE(u32 adr, u32 val)
+{
+	NDS_Reschedule();
+	if(adr & 2)
+		MMU.reg_IE[PROCNUM] = (MMU.reg_IE[PROCNUM]&0xFFFF) | (val<<16);
+	else
+		MMU.reg_IE[PROCNUM] = (MMU.reg_IE[PROCNUM]&0xFFFF0000) | val;
+}
+template<int PROCNUM> static void FASTCALL iowrite32_IE(u32 adr, u32 val)
+{
+	NDS_Reschedule();
+	MMU.reg_IE[PROCNUM] = val;
+}
+template<int PROCNUM> static void FASTCALL iowrite16_IF(u32 adr, u32 val) { REG_IF_WriteWord<PROCNUM>(adr&2,val); }
+template<int PROCNUM> static void FASTCALL iowrite32_IF(u32 adr, u32 val) { REG_IF_WriteLong<PROCNUM>(val); }
+template<int PROCNUM> static void FASTCALL iowrite_IPCSYNC(u32 adr, u32 val) { MMU_IPCSync(PROCNUM, val); }
+template<int PROCNUM> static void FASTCALL iowrite_IPCFIFOCNT(u32 adr, u32 val) { IPC_FIFOcnt(PROCNUM, val); }
+template<int PROCNUM> static void FASTCALL iowrite_IPCFIFOSEND(u32 adr, u32 val) { IPC_FIFOsend(PROCNUM, val); }
+template<int PROCNUM> static void FASTCALL iowrite16_TMCNT(u32 adr, u32 val)
+{
+	if(adr & 2)
+		write_timer(PROCNUM, (adr>>2)&3, val);
+	else
+		MMU.timerReload[PROCNUM][(adr>>2)&3] = val;
+}
+template<int PROCNUM> static void FASTCALL iowrite32_TMCNT(u32 adr, u32 val)
+{
+	int timerIndex = (adr>>2)&0x3;
+	MMU.timerReload[PROCNUM][timerIndex] = (u16)val;
+	T1WriteWord(MMU.MMU_MEM[PROCNUM][0x40], adr & 0xFFF, val);
+	write_timer(PROCNUM, timerIndex, val>>16);
+}
+//the 16bit DIVCNT and SQRTCNT writes start the unit, the 32bit ones don't
+static void FASTCALL iowrite16_DIVCNT(u32 adr, u32 val) { MMU_new.div.write16(val); execdiv(); }
+static void FASTCALL iowrite32_DIVCNT(u32 adr, u32 val) { MMU_new.div.write16((u16)val); }
+static void FASTCALL iowrite16_SQRTCNT(u32 adr, u32 val) { MMU_new.sqrt.write16(val); execsqrt(); }
+static void FASTCALL iowrite32_SQRTCNT(u32 adr, u32 val) { MMU_new.sqrt.write16((u16)val); }
+static void FASTCALL iowrite32_DIVPARAM(u32 adr, u32 val)
+{
+	T1WriteLong(MMU.MMU_MEM[ARMCPU_ARM9][0x40], adr & 0xFFF, val);
+	execdiv();
+}
+static void FASTCALL iowrite32_SQRTPARAM(u32 adr, u32 val)
+{
+	T1WriteLong(MMU.MMU_MEM[ARMCPU_ARM9][0x40], adr & 0xFFF, val);
+	execsqrt();
+}
+template<int PROCNUM> static void FASTCALL iowrite08_IF(u32 adr, u32 val)
+{
+	REG_IF_WriteByte<PROCNUM>(adr&3,val);
+	T1WriteByte(MMU.MMU_MEM[PROCNUM][0x40], adr & 0xFFF, val);
+}
+//fog table: only write bottom 7 bits
+static void FASTCALL iowrite08_FOG_TABLE(u32 adr, u32 val) { T1WriteByte(MMU.MMU_MEM[ARMCPU_ARM9][0x40], adr & 0xFFF, val & 0x7F); }
+static void FASTCALL iowrite16_FOG_TABLE(u32 adr, u32 val) { T1WriteWord(MMU.MMU_MEM[ARMCPU_ARM9][0x40], adr & 0xFFF, val & 0x7F7F); }
+static void FASTCALL iowrite32_FOG_TABLE(u32 adr, u32 val) { T1WriteLong(MMU.MMU_MEM[ARMCPU_ARM9][0x40], adr & 0xFFF, val & 0x7F7F7F7F); }
+static void FASTCALL iowrite16_TOON_TABLE(u32 adr, u32 val)
+{
+	T1WriteWord(MMU.MMU_MEM[ARMCPU_ARM9][0x40], adr & 0xFFF, val);
+	gfx3d_UpdateToonTable((adr & 0x3F) >> 1, (u16)val);
+}
+static void FASTCALL iowrite32_TOON_TABLE(u32 adr, u32 val)
+{
+	T1WriteLong(MMU.MMU_MEM[ARMCPU_ARM9][0x40], adr & 0xFFF, val);
+	gfx3d_UpdateToonTable((adr & 0x3F) >> 1, val);
+}
+static void FASTCALL iowrite32_EDGE_COLOR(u32 adr, u32 val) { T1WriteLong(MMU.MMU_MEM[ARMCPU_ARM9][0x40], adr & 0xFFF, val); }
+static void FASTCALL iowrite08_CLEAR_COLOR(u32 adr, u32 val)
+{
+	T1WriteByte((u8*)&gfx3d.state.clearColor, adr-eng_3D_CLEAR_COLOR, val);
+	T1WriteByte(MMU.MMU_MEM[ARMCPU_ARM9][0x40], adr & 0xFFF, val);
+}
+static void FASTCALL iowrite16_CLEAR_COLOR(u32 adr, u32 val)
+{
+	T1WriteWord((u8*)&gfx3d.state.clearColor, adr-eng_3D_CLEAR_COLOR, val);
+	T1WriteWord(MMU.MMU_MEM[ARMCPU_ARM9][0x40], adr & 0xFFF, val);
+}
+static void FASTCALL iowrite32_CLEAR_COLOR(u32 adr, u32 val)
+{
+	T1WriteLong((u8*)&gfx3d.state.clearColor, 0, val);
+	T1WriteLong(MMU.MMU_MEM[ARMCPU_ARM9][0x40], adr & 0xFFF, val);
+}
+//each byte maps one bank (or WRAMCNT). VRAMCNTI is the last one, so a 32bit write to VRAMCNTH only maps two
+template<int SIZE> static void FASTCALL iowrite_VRAMCNT(u32 adr, u32 val)
+{
+	for(u32 i = 0; i < SIZE/8 && adr+i <= REG_VRAMCNTI; i++)
+		MMU_VRAMmapControl(adr-REG_VRAMCNTA+i, (val >> (i*8)) & 0xFF);
+	switch(SIZE)
+	{
+		case 8: T1WriteByte(MMU.MMU_MEM[ARMCPU_ARM9][0x40], adr & 0xFFF, val); break;
+		case 16: T1WriteWord(MMU.MMU_MEM[ARMCPU_ARM9][0x40], adr & 0xFFF, val); break;
+		case 32: T1WriteLong(MMU.MMU_MEM[ARMCPU_ARM9][0x40], adr & 0xFFF, val); break;
+	}
+}
+
+static void MMU_IOreg08(int proc, u32 adr, MMU_IOReadHandler read, MMU_IOWriteHandler write)
+{
+	if(read) MMU_IOread08[proc][adr & (MMU_IO_TABLE_SIZE-1)] = read;
+	if(write) MMU_IOwrite08[proc][adr & (MMU_IO_TABLE_SIZE-1)] = write;
+}
+
+static void MMU_IOreg16(int proc, u32 adr, MMU_IOReadHandler read, MMU_IOWriteHandler write)
+{
+	if(read) MMU_IOread16[proc][(adr & (MMU_IO_TABLE_SIZE-1))>>1] = read;
+	if(write) MMU_IOwrite16[proc][(adr & (MMU_IO_TABLE_SIZE-1))>>1] = write;
+}
+
+static void MMU_IOreg32(int proc, u32 adr, MMU_IOReadHandler read, MMU_IOWriteHandler write)
+{
+	if(read) MMU_IOread32[proc][(adr & (MMU_IO_TABLE_SIZE-1))>>2] = read;
+	if(write) MMU_IOwrite32[proc][(adr & (MMU_IO_TABLE_SIZE-1))>>2] = write;
+}
+
+template<int PROCNUM> static void MMU_IOInitCommon()
+{
+	MMU_IOreg16(PROCNUM, REG_IME, ioread_IME<PROCNUM>, iowrite_IME<PROCNUM>);
+	MMU_IOreg32(PROCNUM, REG_IME, ioread_IME<PROCNUM>, iowrite_IME<PROCNUM>);
+	MMU_IOreg16(PROCNUM, REG_IE, ioread_IE<PROCNUM>, iowrite16_IE<PROCNUM>);
+	MMU_IOreg16(PROCNUM, REG_IE+2, ioread_IE<PROCNUM>, iowrite16_IE<PROCNUM>);
+	MMU_IOreg32(PROCNUM, REG_IE, ioread_IE<PROCNUM>, iowrite32_IE<PROCNUM>);
+	MMU_IOreg16(PROCNUM, REG_IF, ioread_IF<PROCNUM>, iowrite16_IF<PROCNUM>);
+	MMU_IOreg16(PROCNUM, REG_IF+2, ioread_IF<PROCNUM>, iowrite16_IF<PROCNUM>);
+	MMU_IOreg32(PROCNUM, REG_IF, ioread_IF<PROCNUM>, iowrite32_IF<PROCNUM>);
+	for(u32 i=0;i<4;i++)
+		MMU_IOreg08(PROCNUM, REG_IF+i, ioread08_IF<PROCNUM>, iowrite08_IF<PROCNUM>);
+
+	MMU_IOreg16(PROCNUM, REG_IPCSYNC, NULL, iowrite_IPCSYNC<PROCNUM>);
+	MMU_IOreg32(PROCNUM, REG_IPCSYNC, NULL, iowrite_IPCSYNC<PROCNUM>);
+	MMU_IOreg16(PROCNUM, REG_IPCFIFOCNT, NULL, iowrite_IPCFIFOCNT<PROCNUM>);
+	MMU_IOreg32(PROCNUM, REG_IPCFIFOCNT, NULL, iowrite_IPCFIFOCNT<PROCNUM>);
+	MMU_IOreg32(PROCNUM, REG_IPCFIFOSEND, NULL, iowrite_IPCFIFOSEND<PROCNUM>);
+
+	for(int i=0;i<4;i++)
+	{
+		MMU_IOreg16(PROCNUM, REG_TM0CNTL+i*4, ioread16_TMCNT<PROCNUM>, iowrite16_TMCNT<PROCNUM>);
+		MMU_IOreg16(PROCNUM, REG_TM0CNTH+i*4, NULL, iowrite16_TMCNT<PROCNUM>);
+		MMU_IOreg32(PROCNUM, REG_TM0CNTL+i*4, ioread32_TMCNT<PROCNUM>, iowrite32_TMCNT<PROCNUM>);
+	}
+
+	MMU_IOreg08(PROCNUM, REG_DISPx_VCOUNT, ioread08_VCOUNT, NULL);
+	MMU_IOreg08(PROCNUM, REG_DISPx_VCOUNT+1, ioread08_VCOUNT, NULL);
+}
+
+static void MMU_IOInit()
+{
+	memset(MMU_IOread08, 0, sizeof(MMU_IOread08));
+	memset(MMU_IOread16, 0, sizeof(MMU_IOread16));
+	memset(MMU_IOread32, 0, sizeof(MMU_IOread32));
+	memset(MMU_IOwrite08, 0, sizeof(MMU_IOwrite08));
+	memset(MMU_IOwrite16, 0, sizeof(MMU_IOwrite16));
+	memset(MMU_IOwrite32, 0, sizeof(MMU_IOwrite32));
+
+	MMU_IOInitCommon<ARMCPU_ARM9>();
+	MMU_IOInitCommon<ARMCPU_ARM7>();
+
+	MMU_IOreg16(ARMCPU_ARM9, REG_DISPx_VCOUNT, ioread_VCOUNT_ensata, NULL);
+	MMU_IOreg16(ARMCPU_ARM7, REG_DISPx_VCOUNT, ioread_VCOUNT, NULL);
+
+	//despite DIVCNT and SQRTCNT being 16bit regs, Dolphin Island Underwater Adventures reads them
+	//as 32bits amidst seemingly reasonable divs, so they're readable at both sizes
+	MMU_IOreg16(ARMCPU_ARM9, REG_DIVCNT, ioread_DIVCNT, iowrite16_DIVCNT);
+	MMU_IOreg32(ARMCPU_ARM9, REG_DIVCNT, ioread_DIVCNT, iowrite32_DIVCNT);
+	MMU_IOreg16(ARMCPU_ARM9, REG_SQRTCNT, ioread_SQRTCNT, iowrite16_SQRTCNT);
+	MMU_IOreg32(ARMCPU_ARM9, REG_SQRTCNT, ioread_SQRTCNT, iowrite32_SQRTCNT);
+	MMU_IOreg32(ARMCPU_ARM9, REG_DIVNUMER, NULL, iowrite32_DIVPARAM);
+	MMU_IOreg32(ARMCPU_ARM9, REG_DIVNUMER+4, NULL, iowrite32_DIVPARAM);
+	MMU_IOreg32(ARMCPU_ARM9, REG_DIVDENOM, NULL, iowrite32_DIVPARAM);
+	MMU_IOreg32(ARMCPU_ARM9, REG_DIVDENOM+4, NULL, iowrite32_DIVPARAM);
+	MMU_IOreg32(ARMCPU_ARM9, REG_SQRTPARAM, NULL, iowrite32_SQRTPARAM);
+	MMU_IOreg32(ARMCPU_ARM9, REG_SQRTPARAM+4, NULL, iowrite32_SQRTPARAM);
+
+	//the fog table is write only
+	for(u32 i=0;i<0x20;i++)
+		MMU_IOreg08(ARMCPU_ARM9, eng_3D_FOG_TABLE+i, ioread_WRITEONLY, iowrite08_FOG_TABLE);
+	for(u32 i=0;i<0x20;i+=2)
+		MMU_IOreg16(ARMCPU_ARM9, eng_3D_FOG_TABLE+i, ioread_WRITEONLY, iowrite16_FOG_TABLE);
+	for(u32 i=0;i<0x20;i+=4)
+		MMU_IOreg32(ARMCPU_ARM9, eng_3D_FOG_TABLE+i, ioread_WRITEONLY, iowrite32_FOG_TABLE);
+
+	for(u32 i=0;i<0x40;i+=2)
+		MMU_IOreg16(ARMCPU_ARM9, eng_3D_TOON_TABLE+i, NULL, iowrite16_TOON_TABLE);
+	for(u32 i=0;i<0x40;i+=4)
+		MMU_IOreg32(ARMCPU_ARM9, eng_3D_TOON_TABLE+i, NULL, iowrite32_TOON_TABLE);
+	for(u32 i=0;i<0x10;i+=4)
+		MMU_IOreg32(ARMCPU_ARM9, eng_3D_EDGE_COLOR+i, NULL, iowrite32_EDGE_COLOR);
+
+	for(u32 i=0;i<4;i++)
+		MMU_IOreg08(ARMCPU_ARM9, eng_3D_CLEAR_COLOR+i, NULL, iowrite08_CLEAR_COLOR);
+	for(u32 i=0;i<4;i+=2)
+		MMU_IOreg16(ARMCPU_ARM9, eng_3D_CLEAR_COLOR+i, NULL, iowrite16_CLEAR_COLOR);
+	MMU_IOreg32(ARMCPU_ARM9, eng_3D_CLEAR_COLOR, NULL, iowrite32_CLEAR_COLOR);
+
+	for(u32 adr=REG_VRAMCNTA;adr<=REG_VRAMCNTI;adr++)
+		MMU_IOreg08(ARMCPU_ARM9, adr, NULL, iowrite_VRAMCNT<8>);
+	for(u32 adr=REG_VRAMCNTA;adr<=REG_VRAMCNTI;adr+=2)
+		MMU_IOreg16(ARMCPU_ARM9, adr, NULL, iowrite_VRAMCNT<16>);
+	for(u32 adr=REG_VRAMCNTA;adr<=REG_VRAMCNTI;adr+=4)
+		MMU_IOreg32(ARMCPU_ARM9, adr, NULL, iowrite_VRAMCNT<32>);
+}
+
 //================================================================================================== ARM9 *
 //=========================================================================================================
 //=========================================================================================================
@@ -2202,7 +2645,7 @@ void FASTCALL _MMU_ARM9_write08(u32 adr, u8 val)
 	if(adr < 0x02000000)
 	{
 #ifdef HAVE_JIT
-		JIT_COMPILED_FUNC_KNOWNBANK(adr, ARM9_ITCM, 0x7FFF, 0) = 0;
+		JIT_INVALIDATE(JIT_COMPILED_FUNC_KNOWNBANK(adr, ARM9_ITCM, 0x7FFF, 0), 1);
 #endif
 		T1WriteByte(MMU.ARM9_ITCM, adr & 0x7FFF, val);
 		return;
@@ -2234,6 +2677,12 @@ void FASTCALL _MMU_ARM9_write08(u32 adr, u8 val)
 		if (nds.power1.gfx3d_render == 0)
 			if ((adr >= 0x04000320) && (adr<=0x040003FF)) return;
 
+		if(MMU_IO_IN_TABLE(adr))
+		{
+			MMU_IOWriteHandler handler = MMU_IOwrite08[ARMCPU_ARM9][adr & (MMU_IO_TABLE_SIZE-1)];
+			if(handler) { handler(adr,val); return; }
+		}
+
 		if(MMU_new.is_dma(adr)) { 
 			MMU_new.write_dma(ARMCPU_ARM9,8,adr,val); 
 			return;
@@ -2253,18 +2702,6 @@ void FASTCALL _MMU_ARM9_write08(u32 adr, u8 val)
 			case REG_DIVCNT+3: printf("ERROR 8bit DIVCNT+3 WRITE\n"); return;
 #endif
 
-			//fog table: only write bottom 7 bits
-			case eng_3D_FOG_TABLE+0x00: case eng_3D_FOG_TABLE+0x01: case eng_3D_FOG_TABLE+0x02: case eng_3D_FOG_TABLE+0x03: 
-			case eng_3D_FOG_TABLE+0x04: case eng_3D_FOG_TABLE+0x05: case eng_3D_FOG_TABLE+0x06: case eng_3D_FOG_TABLE+0x07: 
-			case eng_3D_FOG_TABLE+0x08: case eng_3D_FOG_TABLE+0x09: case eng_3D_FOG_TABLE+0x0A: case eng_3D_FOG_TABLE+0x0B: 
-			case eng_3D_FOG_TABLE+0x0C: case eng_3D_FOG_TABLE+0x0D: case eng_3D_FOG_TABLE+0x0E: case eng_3D_FOG_TABLE+0x0F: 
-			case eng_3D_FOG_TABLE+0x10: case eng_3D_FOG_TABLE+0x11: case eng_3D_FOG_TABLE+0x12: case eng_3D_FOG_TABLE+0x13: 
-			case eng_3D_FOG_TABLE+0x14: case eng_3D_FOG_TABLE+0x15: case eng_3D_FOG_TABLE+0x16: case eng_3D_FOG_TABLE+0x17: 
-			case eng_3D_FOG_TABLE+0x18: case eng_3D_FOG_TABLE+0x19: case eng_3D_FOG_TABLE+0x1A: case eng_3D_FOG_TABLE+0x1B: 
-			case eng_3D_FOG_TABLE+0x1C: case eng_3D_FOG_TABLE+0x1D: case eng_3D_FOG_TABLE+0x1E: case eng_3D_FOG_TABLE+0x1F: 
-				val &= 0x7F;
-				break;
-
 			//ensata putchar port
 			case 0x04FFF000:
 				if(nds.ensataEmulation)
@@ -2409,29 +2846,6 @@ void FASTCALL _MMU_ARM9_write08(u32 adr, u8 val)
 			case REG_DISPA_DISP3DCNT: writereg_DISP3DCNT(8,adr,val); return;
 			case REG_DISPA_DISP3DCNT+1: writereg_DISP3DCNT(8,adr,val); return;
 
-			case REG_IF: REG_IF_WriteByte<ARMCPU_ARM9>(0,val); break;
-			case REG_IF+1: REG_IF_WriteByte<ARMCPU_ARM9>(1,val); break;
-			case REG_IF+2: REG_IF_WriteByte<ARMCPU_ARM9>(2,val); break;
-			case REG_IF+3: REG_IF_WriteByte<ARMCPU_ARM9>(3,val); break;
-
-			case eng_3D_CLEAR_COLOR+0: case eng_3D_CLEAR_COLOR+1:
-			case eng_3D_CLEAR_COLOR+2: case eng_3D_CLEAR_COLOR+3:
-				T1WriteByte((u8*)&gfx3d.state.clearColor,adr-eng_3D_CLEAR_COLOR,val); 
-				break;
-
-			case REG_VRAMCNTA:
-			case REG_VRAMCNTB:
-			case REG_VRAMCNTC:
-			case REG_VRAMCNTD:
-			case REG_VRAMCNTE:
-			case REG_VRAMCNTF:
-			case REG_VRAMCNTG:
-			case REG_WRAMCNT:
-			case REG_VRAMCNTH:
-			case REG_VRAMCNTI:
-					MMU_VRAMmapControl(adr-REG_VRAMCNTA, val);
-				break;
-
 			case REG_DISPA_DISPMMEMFIFO:
 			{
 				DISP_FIFOsend(val);
@@ -2465,9 +2879,12 @@ void FASTCALL _MMU_ARM9_write08(u32 adr, u8 val)
 
 #ifdef HAVE_JIT
 	if (JIT_MAPPED(adr, ARMCPU_ARM9))
-		JIT_COMPILED_FUNC_PREMASKED(adr, ARMCPU_ARM9, 0) = 0;
+		JIT_INVALIDATE(JIT_COMPILED_FUNC_PREMASKED(adr, ARMCPU_ARM9, 0), 1);
 #endif
 
+	if ((adr & 0x0F000000) == 0x06000000)
+		MMU_VRAM_dirty(adr);
+
 	// Removed the &0xFF as they are implicit with the adr&0x0FFFFFFF [shash]
 	MMU.MMU_MEM[ARMCPU_ARM9][adr>>20][adr&MMU.MMU_MASK[ARMCPU_ARM9][adr>>20]]=val;
 }
@@ -2482,7 +2899,7 @@ void FASTCALL _MMU_ARM9_write16(u32 adr, u16 val)
 	if (adr < 0x02000000)
 	{
 #ifdef HAVE_JIT
-		JIT_COMPILED_FUNC_KNOWNBANK(adr, ARM9_ITCM, 0x7FFF, 0) = 0;
+		JIT_INVALIDATE(JIT_COMPILED_FUNC_KNOWNBANK(adr, ARM9_ITCM, 0x7FFF, 0), 1);
 #endif
 		T1WriteWord(MMU.ARM9_ITCM, adr & 0x7FFF, val);
 		return;
@@ -2509,22 +2926,17 @@ void FASTCALL _MMU_ARM9_write16(u32 adr, u16 val)
 		if (nds.power1.gfx3d_render == 0)
 			if ((adr >= 0x04000320) && (adr<=0x040003FF)) return;
 
+		if(MMU_IO_IN_TABLE(adr))
+		{
+			MMU_IOWriteHandler handler = MMU_IOwrite16[ARMCPU_ARM9][(adr & (MMU_IO_TABLE_SIZE-1))>>1];
+			if(handler) { handler(adr,val); return; }
+		}
+
 		if(MMU_new.is_dma(adr)) { 
 			MMU_new.write_dma(ARMCPU_ARM9,16,adr,val); 
 			return;
 		}
 
-		switch (adr >> 4)
-		{
-						//toon table
-			case 0x0400038:
-			case 0x0400039:
-			case 0x040003A:
-			case 0x040003B:
-				((u16 *)(MMU.MMU_MEM[ARMCPU_ARM9][0x40]))[(adr & 0xFFF)>>1] = val;
-				gfx3d_UpdateToonTable((adr & 0x3F) >> 1, val);
-			return;
-		}
 		// Address is an IO register
 		switch(adr)
 		{
@@ -2532,14 +2944,6 @@ void FASTCALL _MMU_ARM9_write16(u32 adr, u16 val)
 			MMU_new.gxstat.write(16,adr,val);
 			break;
 
-		//fog table: only write bottom 7 bits
-		case eng_3D_FOG_TABLE+0x00: case eng_3D_FOG_TABLE+0x02: case eng_3D_FOG_TABLE+0x04: case eng_3D_FOG_TABLE+0x06:
-		case eng_3D_FOG_TABLE+0x08: case eng_3D_FOG_TABLE+0x0A: case eng_3D_FOG_TABLE+0x0C: case eng_3D_FOG_TABLE+0x0E:
-		case eng_3D_FOG_TABLE+0x10: case eng_3D_FOG_TABLE+0x12: case eng_3D_FOG_TABLE+0x14: case eng_3D_FOG_TABLE+0x16:
-		case eng_3D_FOG_TABLE+0x18: case eng_3D_FOG_TABLE+0x1A: case eng_3D_FOG_TABLE+0x1C: case eng_3D_FOG_TABLE+0x1E:
-			val &= 0x7F7F;
-			break;
-
 		case REG_DISPA_BG2XL: MainScreen.gpu->setAffineStartWord(2,0,val,0); break;
 		case REG_DISPA_BG2XH: MainScreen.gpu->setAffineStartWord(2,0,val,1); break;
 		case REG_DISPA_BG2YL: MainScreen.gpu->setAffineStartWord(2,1,val,0); break;
@@ -2567,13 +2971,6 @@ void FASTCALL _MMU_ARM9_write16(u32 adr, u16 val)
 				return;
 			}
 			
-			case eng_3D_CLEAR_COLOR:
-			case eng_3D_CLEAR_COLOR+2:
-			{
-				T1WriteWord((u8*)&gfx3d.state.clearColor,adr-eng_3D_CLEAR_COLOR,val);
-				break;
-			}
-
 			// Clear background depth setup - Parameters:2
 			case eng_3D_CLEAR_DEPTH:
 			{
@@ -2595,10 +2992,6 @@ void FASTCALL _MMU_ARM9_write16(u32 adr, u16 val)
 				return;
 			}
 
-			case REG_DIVCNT:
-				MMU_new.div.write16(val);
-				execdiv();
-				return;
 #if 1
 			case REG_DIVNUMER:
 			case REG_DIVNUMER+2:
@@ -2611,11 +3004,6 @@ void FASTCALL _MMU_ARM9_write16(u32 adr, u16 val)
 				printf("DIV: 16 write DENOM %08X. PLEASE REPORT! \n", val);
 				break;
 #endif
-			case REG_SQRTCNT:
-				MMU_new.sqrt.write16(val);
-				execsqrt();
-				return;
-
 			case REG_DISPA_BLDCNT: 	 
 				GPU_setBLDCNT(MainScreen.gpu,val) ; 	 
 				break ; 	 
@@ -2803,53 +3191,6 @@ void FASTCALL _MMU_ARM9_write16(u32 adr, u16 val)
 				T1WriteWord(MMU.MMU_MEM[ARMCPU_ARM9][0x40], 0x100E, val);
 				return;
 
-			case REG_VRAMCNTA:
-			case REG_VRAMCNTC:
-			case REG_VRAMCNTE:
-			case REG_VRAMCNTG:
-			case REG_VRAMCNTH:
-				MMU_VRAMmapControl(adr-REG_VRAMCNTA, val & 0xFF);
-				MMU_VRAMmapControl(adr-REG_VRAMCNTA+1, val >> 8);
-				break;
-
-			case REG_IME:
-				NDS_Reschedule();
-				MMU.reg_IME[ARMCPU_ARM9] = val & 0x01;
-				T1WriteLong(MMU.MMU_MEM[ARMCPU_ARM9][0x40], 0x208, val);
-				return;
-			case REG_IE :
-				NDS_Reschedule();
-				MMU.reg_IE[ARMCPU_ARM9] = (MMU.reg_IE[ARMCPU_ARM9]&0xFFFF0000) | val;
-				return;
-			case REG_IE + 2 :
-				NDS_Reschedule();
-				MMU.reg_IE[ARMCPU_ARM9] = (MMU.reg_IE[ARMCPU_ARM9]&0xFFFF) | (((u32)val)<<16);
-				return;
-			case REG_IF: REG_IF_WriteWord<ARMCPU_ARM9>(0,val); return;
-			case REG_IF+2: REG_IF_WriteWord<ARMCPU_ARM9>(2,val); return;
-
-            case REG_IPCSYNC:
-				MMU_IPCSync(ARMCPU_ARM9, val);
-				return;
-			case REG_IPCFIFOCNT:
-				IPC_FIFOcnt(ARMCPU_ARM9, val);
-				return;
-
-            case REG_TM0CNTL :
-            case REG_TM1CNTL :
-            case REG_TM2CNTL :
-            case REG_TM3CNTL :
-				MMU.timerReload[ARMCPU_ARM9][(adr>>2)&3] = val;
-				return;
-			case REG_TM0CNTH :
-			case REG_TM1CNTH :
-			case REG_TM2CNTH :
-			case REG_TM3CNTH :
-			{
-				int timerIndex	= ((adr-2)>>2)&0x3;
-				write_timer(ARMCPU_ARM9, timerIndex, val);
-				return;
-			}
 
 			case REG_DISPA_DISPCNT :
 				{
@@ -2921,9 +3262,12 @@ void FASTCALL _MMU_ARM9_write16(u32 adr, u16 val)
 
 #ifdef HAVE_JIT
 	if (JIT_MAPPED(adr, ARMCPU_ARM9))
-		JIT_COMPILED_FUNC_PREMASKED(adr, ARMCPU_ARM9, 0) = 0;
+		JIT_INVALIDATE(JIT_COMPILED_FUNC_PREMASKED(adr, ARMCPU_ARM9, 0), 1);
 #endif
 
+	if ((adr & 0x0F000000) == 0x06000000)
+		MMU_VRAM_dirty(adr);
+
 	// Removed the &0xFF as they are implicit with the adr&0x0FFFFFFF [shash]
 	T1WriteWord(MMU.MMU_MEM[ARMCPU_ARM9][adr>>20], adr&MMU.MMU_MASK[ARMCPU_ARM9][adr>>20], val);
 } 
@@ -2938,8 +3282,7 @@ void FASTCALL _MMU_ARM9_write32(u32 adr, u32 val)
 	if(adr<0x02000000)
 	{
 #ifdef HAVE_JIT
-		JIT_COMPILED_FUNC_KNOWNBANK(adr, ARM9_ITCM, 0x7FFF, 0) = 0;
-		JIT_COMPILED_FUNC_KNOWNBANK(adr, ARM9_ITCM, 0x7FFF, 1) = 0;
+		JIT_INVALIDATE(JIT_COMPILED_FUNC_KNOWNBANK(adr, ARM9_ITCM, 0x7FFF, 0), 2);
 #endif
 		T1WriteLong(MMU.ARM9_ITCM, adr & 0x7FFF, val);
 		return ;
@@ -2974,6 +3317,12 @@ void FASTCALL _MMU_ARM9_write32(u32 adr, u32 val)
 		if (nds.power1.gfx3d_render == 0)
 			if ((adr >= 0x04000320) && (adr<=0x040003FF)) return;
 
+		if(MMU_IO_IN_TABLE(adr))
+		{
+			MMU_IOWriteHandler handler = MMU_IOwrite32[ARMCPU_ARM9][(adr & (MMU_IO_TABLE_SIZE-1))>>2];
+			if(handler) { handler(adr,val); return; }
+		}
+
 		// MightyMax: no need to do several ifs, when only one can happen
 		// switch/case instead
 		// both comparison >=,< per if can be replaced by one bit comparison since
@@ -2982,18 +3331,6 @@ void FASTCALL _MMU_ARM9_write32(u32 adr, u32 val)
 		// lookups by the compiler
 		switch (adr >> 4)
 		{
-			case 0x400033:		//edge color table
-				((u32 *)(MMU.MMU_MEM[ARMCPU_ARM9][0x40]))[(adr & 0xFFF) >> 2] = val;
-				return;
-
-			case 0x400038:
-			case 0x400039:
-			case 0x40003A:
-			case 0x40003B:		//toon table
-				((u32 *)(MMU.MMU_MEM[ARMCPU_ARM9][0x40]))[(adr & 0xFFF) >> 2] = val;
-				gfx3d_UpdateToonTable((adr & 0x3F) >> 1, val);
-				return;
-
 			case 0x400040:
 			case 0x400041:
 			case 0x400042:
@@ -3045,17 +3382,8 @@ void FASTCALL _MMU_ARM9_write32(u32 adr, u32 val)
 
 		switch(adr)
 		{
-			case REG_SQRTCNT: MMU_new.sqrt.write16((u16)val); return;
-			case REG_DIVCNT: MMU_new.div.write16((u16)val); return;
-
 			case REG_POWCNT1: writereg_POWCNT1(32,adr,val); break;
 
-			//fog table: only write bottom 7 bits
-			case eng_3D_FOG_TABLE+0x00: case eng_3D_FOG_TABLE+0x04: case eng_3D_FOG_TABLE+0x08: case eng_3D_FOG_TABLE+0x0C:
-			case eng_3D_FOG_TABLE+0x10: case eng_3D_FOG_TABLE+0x14: case eng_3D_FOG_TABLE+0x18: case eng_3D_FOG_TABLE+0x1C:
-				val &= 0x7F7F7F7F;
-				break;
-
 
 			//ensata handshaking port?
 			case 0x04FFF010:
@@ -3114,10 +3442,6 @@ void FASTCALL _MMU_ARM9_write32(u32 adr, u32 val)
 				return;
 			}
 
-			case eng_3D_CLEAR_COLOR:
-				T1WriteLong((u8*)&gfx3d.state.clearColor,0,val); 
-				break;
-				
 			// Clear background depth setup - Parameters:2
 			case eng_3D_CLEAR_DEPTH:
 			{
@@ -3221,86 +3545,6 @@ void FASTCALL _MMU_ARM9_write32(u32 adr, u32 val)
 				T1WriteLong(MMU.MMU_MEM[ARMCPU_ARM9][0x40], 0x1000, val);
 				return;
 
-			case REG_VRAMCNTA:
-			case REG_VRAMCNTE:
-				MMU_VRAMmapControl(adr-REG_VRAMCNTA, val & 0xFF);
-				MMU_VRAMmapControl(adr-REG_VRAMCNTA+1, (val >> 8) & 0xFF);
-				MMU_VRAMmapControl(adr-REG_VRAMCNTA+2, (val >> 16) & 0xFF);
-				MMU_VRAMmapControl(adr-REG_VRAMCNTA+3, (val >> 24) & 0xFF);
-				break;
-			case REG_VRAMCNTH:
-				MMU_VRAMmapControl(adr-REG_VRAMCNTA, val & 0xFF);
-				MMU_VRAMmapControl(adr-REG_VRAMCNTA+1, (val >> 8) & 0xFF);
-				break;
-
-			case REG_IME : 
-				NDS_Reschedule();
-				MMU.reg_IME[ARMCPU_ARM9] = val & 0x01;
-				T1WriteLong(MMU.MMU_MEM[ARMCPU_ARM9][0x40], 0x208, val);
-				return;
-				
-			case REG_IE :
-				NDS_Reschedule();
-				MMU.reg_IE[ARMCPU_ARM9] = val;
-				return;
-			
-			case REG_IF: REG_IF_WriteLong<ARMCPU_ARM9>(val); return;
-
-            case REG_TM0CNTL:
-            case REG_TM1CNTL:
-            case REG_TM2CNTL:
-            case REG_TM3CNTL:
-			{
-				int timerIndex = (adr>>2)&0x3;
-				MMU.timerReload[ARMCPU_ARM9][timerIndex] = (u16)val;
-				T1WriteWord(MMU.MMU_MEM[ARMCPU_ARM9][0x40], adr & 0xFFF, val);
-				write_timer(ARMCPU_ARM9, timerIndex, val>>16);
-				return;
-			}
-
-			case REG_DIVNUMER:
-				T1WriteLong(MMU.MMU_MEM[ARMCPU_ARM9][0x40], 0x290, val);
-				execdiv();
-				return;
-			case REG_DIVNUMER+4:
-				T1WriteLong(MMU.MMU_MEM[ARMCPU_ARM9][0x40], 0x294, val);
-				execdiv();
-				return;
-
-            case REG_DIVDENOM :
-				{
-					T1WriteLong(MMU.MMU_MEM[ARMCPU_ARM9][0x40], 0x298, val);
-					execdiv();
-					return;
-				}
-			case REG_DIVDENOM+4 :
-				{
-					T1WriteLong(MMU.MMU_MEM[ARMCPU_ARM9][0x40], 0x29C, val);
-					execdiv();
-					return;
-				}
-
-			case REG_SQRTPARAM :
-			{
-				T1WriteLong(MMU.MMU_MEM[ARMCPU_ARM9][0x40], 0x2B8, val);
-				execsqrt();
-				return;
-			}
-			case REG_SQRTPARAM+4 :
-				T1WriteLong(MMU.MMU_MEM[ARMCPU_ARM9][0x40], 0x2BC, val);
-				execsqrt();
-				return;
-			
-			case REG_IPCSYNC:
-				MMU_IPCSync(ARMCPU_ARM9, val);
-				return;
-			case REG_IPCFIFOCNT:
-				IPC_FIFOcnt(ARMCPU_ARM9, val);
-				return;
-			case REG_IPCFIFOSEND:
-				IPC_FIFOsend(ARMCPU_ARM9, val);
-				return;
-
            
 			case REG_GCROMCTRL :
 				MMU_writeToGCControl<ARMCPU_ARM9>(val);
@@ -3355,12 +3599,12 @@ void FASTCALL _MMU_ARM9_write32(u32 adr, u32 val)
 
 #ifdef HAVE_JIT
 	if (JIT_MAPPED(adr, ARMCPU_ARM9))
-	{
-		JIT_COMPILED_FUNC_PREMASKED(adr, ARMCPU_ARM9, 0) = 0;
-		JIT_COMPILED_FUNC_PREMASKED(adr, ARMCPU_ARM9, 1) = 0;
-	}
+		JIT_INVALIDATE(JIT_COMPILED_FUNC_PREMASKED(adr, ARMCPU_ARM9, 0), 2);
 #endif
 
+	if ((adr & 0x0F000000) == 0x06000000)
+		MMU_VRAM_dirty(adr);
+
 	// Removed the &0xFF as they are implicit with the adr&0x0FFFFFFF [shash]
 	T1WriteLong(MMU.MMU_MEM[ARMCPU_ARM9][adr>>20], adr&MMU.MMU_MASK[ARMCPU_ARM9][adr>>20], val);
 }
@@ -3385,15 +3629,16 @@ u8 FASTCALL _MMU_ARM9_read08(u32 adr)
 
 	if (adr >> 24 == 4)
 	{	//Address is an IO register
+		if(MMU_IO_IN_TABLE(adr))
+		{
+			MMU_IOReadHandler handler = MMU_IOread08[ARMCPU_ARM9][adr & (MMU_IO_TABLE_SIZE-1)];
+			if(handler) return (u8)handler(adr);
+		}
+
 		if(MMU_new.is_dma(adr)) return MMU_new.read_dma(ARMCPU_ARM9,8,adr);
 
 		switch(adr)
 		{
-			case REG_IF: return MMU.gen_IF<ARMCPU_ARM9>();
-			case REG_IF+1: return (MMU.gen_IF<ARMCPU_ARM9>()>>8);
-			case REG_IF+2: return (MMU.gen_IF<ARMCPU_ARM9>()>>16);
-			case REG_IF+3: return (MMU.gen_IF<ARMCPU_ARM9>()>>24);
-
 			case REG_WRAMCNT:
 				return MMU.WRAMCNT;
 
@@ -3401,8 +3646,6 @@ u8 FASTCALL _MMU_ARM9_read08(u32 adr)
 				break;
 			case REG_DISPA_DISPSTAT+1:
 				break;
-			case REG_DISPx_VCOUNT: return nds.VCount & 0xFF;
-			case REG_DISPx_VCOUNT+1: return (nds.VCount>>8) & 0xFF;
 
 			case REG_SQRTCNT: return (MMU_new.sqrt.read16() & 0xFF);
 			case REG_SQRTCNT+1: return ((MMU_new.sqrt.read16()>>8) & 0xFF);
@@ -3419,17 +3662,6 @@ u8 FASTCALL _MMU_ARM9_read08(u32 adr)
 			case REG_DIVCNT+2: printf("ERROR 8bit DIVCNT+2 READ\n"); return 0;
 			case REG_DIVCNT+3: printf("ERROR 8bit DIVCNT+3 READ\n"); return 0;
 
-			//fog table: write only
-			case eng_3D_FOG_TABLE+0x00: case eng_3D_FOG_TABLE+0x01: case eng_3D_FOG_TABLE+0x02: case eng_3D_FOG_TABLE+0x03: 
-			case eng_3D_FOG_TABLE+0x04: case eng_3D_FOG_TABLE+0x05: case eng_3D_FOG_TABLE+0x06: case eng_3D_FOG_TABLE+0x07: 
-			case eng_3D_FOG_TABLE+0x08: case eng_3D_FOG_TABLE+0x09: case eng_3D_FOG_TABLE+0x0A: case eng_3D_FOG_TABLE+0x0B: 
-			case eng_3D_FOG_TABLE+0x0C: case eng_3D_FOG_TABLE+0x0D: case eng_3D_FOG_TABLE+0x0E: case eng_3D_FOG_TABLE+0x0F: 
-			case eng_3D_FOG_TABLE+0x10: case eng_3D_FOG_TABLE+0x11: case eng_3D_FOG_TABLE+0x12: case eng_3D_FOG_TABLE+0x13: 
-			case eng_3D_FOG_TABLE+0x14: case eng_3D_FOG_TABLE+0x15: case eng_3D_FOG_TABLE+0x16: case eng_3D_FOG_TABLE+0x17: 
-			case eng_3D_FOG_TABLE+0x18: case eng_3D_FOG_TABLE+0x19: case eng_3D_FOG_TABLE+0x1A: case eng_3D_FOG_TABLE+0x1B: 
-			case eng_3D_FOG_TABLE+0x1C: case eng_3D_FOG_TABLE+0x1D: case eng_3D_FOG_TABLE+0x1E: case eng_3D_FOG_TABLE+0x1F: 
-				return 0;
-
 			case REG_POWCNT1: 
 			case REG_POWCNT1+1: 
 			case REG_POWCNT1+2: 
@@ -3477,6 +3709,12 @@ u16 FASTCALL _MMU_ARM9_read16(u32 adr)
 
 	if (adr >> 24 == 4)
 	{
+		if(MMU_IO_IN_TABLE(adr))
+		{
+			MMU_IOReadHandler handler = MMU_IOread16[ARMCPU_ARM9][(adr & (MMU_IO_TABLE_SIZE-1))>>1];
+			if(handler) return (u16)handler(adr);
+		}
+
 		if(MMU_new.is_dma(adr)) return MMU_new.read_dma(ARMCPU_ARM9,16,adr); 
 
 		// Address is an IO register
@@ -3485,25 +3723,14 @@ u16 FASTCALL _MMU_ARM9_read16(u32 adr)
 			case REG_DISPA_DISPSTAT:
 				break;
 
-			case REG_SQRTCNT: return MMU_new.sqrt.read16();
 			//sqrtcnt isnt big enough for this to exist. but it'd probably return 0 so its ok
 			case REG_SQRTCNT+2: printf("ERROR 16bit SQRTCNT+2 READ\n"); return 0;
 
-			case REG_DIVCNT: return MMU_new.div.read16();
 			//divcnt isnt big enough for this to exist. but it'd probably return 0 so its ok
 			case REG_DIVCNT+2: printf("ERROR 16bit DIVCNT+2 READ\n"); return 0;
 
 			case eng_3D_GXSTAT: return MMU_new.gxstat.read(16,adr);
 
-			case REG_DISPA_VCOUNT:
-				if(nds.ensataEmulation && nds.ensataHandshake == ENSATA_HANDSHAKE_query)
-				{
-					nds.ensataHandshake = ENSATA_HANDSHAKE_ack;
-					return 270;
-				} 
-				else 
-					return nds.VCount;
-
 			// ============================================= 3D
 			case eng_3D_RAM_COUNT:
 				return 0;
@@ -3514,27 +3741,10 @@ u16 FASTCALL _MMU_ARM9_read16(u32 adr)
 				//almost worthless for now
 				//return (gfx3d_GetNumVertex());
 			// ============================================= 3D end
-			case REG_IME :
-				return (u16)MMU.reg_IME[ARMCPU_ARM9];
-
 			//WRAMCNT is readable but VRAMCNT is not, so just return WRAM's value
 			case REG_VRAMCNTG:
 				return MMU.WRAMCNT << 8;
 				
-			case REG_IE :
-				return (u16)MMU.reg_IE[ARMCPU_ARM9];
-			case REG_IE + 2 :
-				return (u16)(MMU.reg_IE[ARMCPU_ARM9]>>16);
-				
-			case REG_IF: return MMU.gen_IF<ARMCPU_ARM9>();
-			case REG_IF+2: return MMU.gen_IF<ARMCPU_ARM9>()>>16;
-
-			case REG_TM0CNTL :
-			case REG_TM1CNTL :
-			case REG_TM2CNTL :
-			case REG_TM3CNTL :
-				return read_timer(ARMCPU_ARM9,(adr&0xF)>>2);
-
 			case REG_AUXSPICNT:
 				return MMU.AUX_SPI_CNT;
 
@@ -3548,13 +3758,6 @@ u16 FASTCALL _MMU_ARM9_read16(u32 adr)
 			case REG_KEYINPUT:
 				LagFrameFlag=0;
 				break;
-
-			//fog table: write only
-			case eng_3D_FOG_TABLE+0x00: case eng_3D_FOG_TABLE+0x02: case eng_3D_FOG_TABLE+0x04: case eng_3D_FOG_TABLE+0x06:
-			case eng_3D_FOG_TABLE+0x08: case eng_3D_FOG_TABLE+0x0A: case eng_3D_FOG_TABLE+0x0C: case eng_3D_FOG_TABLE+0x0E:
-			case eng_3D_FOG_TABLE+0x10: case eng_3D_FOG_TABLE+0x12: case eng_3D_FOG_TABLE+0x14: case eng_3D_FOG_TABLE+0x16:
-			case eng_3D_FOG_TABLE+0x18: case eng_3D_FOG_TABLE+0x1A: case eng_3D_FOG_TABLE+0x1C: case eng_3D_FOG_TABLE+0x1E:
-				return 0;
 		}
 
 		return  T1ReadWord_guaranteedAligned(MMU.MMU_MEM[ARMCPU_ARM9][adr>>20], adr & MMU.MMU_MASK[ARMCPU_ARM9][adr>>20]);
@@ -3589,6 +3792,12 @@ u32 FASTCALL _MMU_ARM9_read32(u32 adr)
 	// Address is an IO register
 	if((adr >> 24) == 4)
 	{
+		if(MMU_IO_IN_TABLE(adr))
+		{
+			MMU_IOReadHandler handler = MMU_IOread32[ARMCPU_ARM9][(adr & (MMU_IO_TABLE_SIZE-1))>>2];
+			if(handler) return handler(adr);
+		}
+
 		if(MMU_new.is_dma(adr)) return MMU_new.read_dma(ARMCPU_ARM9,32,adr); 
 
 		switch(adr)
@@ -3610,17 +3819,6 @@ u32 FASTCALL _MMU_ARM9_read32(u32 adr)
 			case REG_VRAMCNTE:
 				return MMU.WRAMCNT << 24;
 
-			//despite these being 16bit regs,
-			//Dolphin Island Underwater Adventures uses this amidst seemingly reasonable divs so we're going to emulate it.
-			//well, it's pretty reasonable to read them as 32bits though, isnt it?
-			case REG_DIVCNT: return MMU_new.div.read16();
-			case REG_SQRTCNT: return MMU_new.sqrt.read16(); //I guess we'll do this also
-
-			//fog table: write only
-			case eng_3D_FOG_TABLE+0x00: case eng_3D_FOG_TABLE+0x04: case eng_3D_FOG_TABLE+0x08: case eng_3D_FOG_TABLE+0x0C:
-			case eng_3D_FOG_TABLE+0x10: case eng_3D_FOG_TABLE+0x14: case eng_3D_FOG_TABLE+0x18: case eng_3D_FOG_TABLE+0x1C:
-				return 0;
-
 			case eng_3D_CLIPMTX_RESULT:
 			case eng_3D_CLIPMTX_RESULT+4:
 			case eng_3D_CLIPMTX_RESULT+8:
@@ -3673,23 +3871,8 @@ u32 FASTCALL _MMU_ARM9_read32(u32 adr)
 			//	======================================== 3D end
 
 			
-			case REG_IME :
-				return MMU.reg_IME[ARMCPU_ARM9];
-			case REG_IE :
-				return MMU.reg_IE[ARMCPU_ARM9];
-			
-			case REG_IF: return MMU.gen_IF<ARMCPU_ARM9>();
-
 			case REG_IPCFIFORECV :
 				return IPC_FIFOrecv(ARMCPU_ARM9);
-			case REG_TM0CNTL :
-			case REG_TM1CNTL :
-			case REG_TM2CNTL :
-			case REG_TM3CNTL :
-				{
-					u32 val = T1ReadWord(MMU.MMU_MEM[ARMCPU_ARM9][0x40], (adr + 2) & 0xFFF);
-					return MMU.timer[ARMCPU_ARM9][(adr&0xF)>>2] | (val<<16);
-				}	
      
 			case REG_GCDATAIN: return MMU_readFromGC<ARMCPU_ARM9>();
       case REG_POWCNT1: return readreg_POWCNT1(32,adr);
@@ -3746,15 +3929,16 @@ void FASTCALL _MMU_ARM7_write08(u32 adr, u8 val)
 
 	if (adr >> 24 == 4)
 	{
+		if(MMU_IO_IN_TABLE(adr))
+		{
+			MMU_IOWriteHandler handler = MMU_IOwrite08[ARMCPU_ARM7][adr & (MMU_IO_TABLE_SIZE-1)];
+			if(handler) { handler(adr,val); return; }
+		}
+
 		if(MMU_new.is_dma(adr)) { MMU_new.write_dma(ARMCPU_ARM7,8,adr,val); return; }
 
 		switch(adr)
 		{
-			case REG_IF: REG_IF_WriteByte<ARMCPU_ARM7>(0,val); break;
-			case REG_IF+1: REG_IF_WriteByte<ARMCPU_ARM7>(1,val); break;
-			case REG_IF+2: REG_IF_WriteByte<ARMCPU_ARM7>(2,val); break;
-			case REG_IF+3: REG_IF_WriteByte<ARMCPU_ARM7>(3,val); break;
-
 			case REG_POSTFLG:
 				//The NDS7 register can be written to only from code executed in BIOS.
 				if (NDS_ARM7.instruct_adr > 0x3FFF) return;
@@ -3805,8 +3989,11 @@ void FASTCALL _MMU_ARM7_write08(u32 adr, u8 val)
 
 #ifdef HAVE_JIT
 	if (JIT_MAPPED(adr, ARMCPU_ARM7))
-		JIT_COMPILED_FUNC_PREMASKED(adr, ARMCPU_ARM7, 0) = 0;
+		JIT_INVALIDATE(JIT_COMPILED_FUNC_PREMASKED(adr, ARMCPU_ARM7, 0), 1);
 #endif
+
+	if ((adr & 0x0F000000) == 0x06000000)
+		MMU_VRAM_dirty(adr);
 	
 	// Removed the &0xFF as they are implicit with the adr&0x0FFFFFFF [shash]
 	MMU.MMU_MEM[ARMCPU_ARM7][adr>>20][adr&MMU.MMU_MASK[ARMCPU_ARM7][adr>>20]]=val;
@@ -3882,6 +4069,12 @@ void FASTCALL _MMU_ARM7_write16(u32 adr, u16 val)
 
 	if((adr >> 24) == 4)
 	{
+		if(MMU_IO_IN_TABLE(adr))
+		{
+			MMU_IOWriteHandler handler = MMU_IOwrite16[ARMCPU_ARM7][(adr & (MMU_IO_TABLE_SIZE-1))>>1];
+			if(handler) { handler(adr,val); return; }
+		}
+
 		if(MMU_new.is_dma(adr)) { MMU_new.write_dma(ARMCPU_ARM7,16,adr,val); return; }
 
 		//Address is an IO register
@@ -4189,47 +4382,6 @@ void FASTCALL _MMU_ARM7_write16(u32 adr, u16 val)
 
 				/* NOTICE: Perhaps we have to use gbatek-like reg names instead of libnds-like ones ...*/
 				
-			case REG_IME : 
-				NDS_Reschedule();
-				MMU.reg_IME[ARMCPU_ARM7] = val & 0x01;
-				T1WriteLong(MMU.MMU_MEM[ARMCPU_ARM7][0x40], 0x208, val);
-				return;
-			case REG_IE :
-				NDS_Reschedule();
-				MMU.reg_IE[ARMCPU_ARM7] = (MMU.reg_IE[ARMCPU_ARM7]&0xFFFF0000) | val;
-				return;
-			case REG_IE + 2 :
-				NDS_Reschedule();
-				//emu_halt();
-				MMU.reg_IE[ARMCPU_ARM7] = (MMU.reg_IE[ARMCPU_ARM7]&0xFFFF) | (((u32)val)<<16);
-				return;
-				
-			case REG_IF: REG_IF_WriteWord<ARMCPU_ARM7>(0,val); return;
-			case REG_IF+2: REG_IF_WriteWord<ARMCPU_ARM7>(2,val); return;
-				
-            case REG_IPCSYNC:
-				MMU_IPCSync(ARMCPU_ARM7, val);
-				return;
-			case REG_IPCFIFOCNT:
-				IPC_FIFOcnt(ARMCPU_ARM7, val);
-				return;
-
-            case REG_TM0CNTL :
-            case REG_TM1CNTL :
-            case REG_TM2CNTL :
-            case REG_TM3CNTL :
-				MMU.timerReload[ARMCPU_ARM7][(adr>>2)&3] = val;
-				return;
-			case REG_TM0CNTH :
-			case REG_TM1CNTH :
-			case REG_TM2CNTH :
-			case REG_TM3CNTH :
-			{
-				int timerIndex	= ((adr-2)>>2)&0x3;
-				write_timer(ARMCPU_ARM7, timerIndex, val);
-				return;
-			}
-			
 			case REG_GCROMCTRL :
 				MMU_writeToGCControl<ARMCPU_ARM7>( (T1ReadLong(MMU.MMU_MEM[ARMCPU_ARM7][0x40], 0x1A4) & 0xFFFF0000) | val);
 				return;
@@ -4248,9 +4400,12 @@ void FASTCALL _MMU_ARM7_write16(u32 adr, u16 val)
 
 #ifdef HAVE_JIT
 	if (JIT_MAPPED(adr, ARMCPU_ARM7))
-		JIT_COMPILED_FUNC_PREMASKED(adr, ARMCPU_ARM7, 0) = 0;
+		JIT_INVALIDATE(JIT_COMPILED_FUNC_PREMASKED(adr, ARMCPU_ARM7, 0), 1);
 #endif
 
+	if ((adr & 0x0F000000) == 0x06000000)
+		MMU_VRAM_dirty(adr);
+
 	// Removed the &0xFF as they are implicit with the adr&0x0FFFFFFF [shash]
 	T1WriteWord(MMU.MMU_MEM[ARMCPU_ARM7][adr>>20], adr&MMU.MMU_MASK[ARMCPU_ARM7][adr>>20], val);
 } 
@@ -4288,6 +4443,12 @@ void FASTCALL _MMU_ARM7_write32(u32 adr, u32 val)
 
 	if((adr>>24)==4)
 	{
+		if(MMU_IO_IN_TABLE(adr))
+		{
+			MMU_IOWriteHandler handler = MMU_IOwrite32[ARMCPU_ARM7][(adr & (MMU_IO_TABLE_SIZE-1))>>2];
+			if(handler) { handler(adr,val); return; }
+		}
+
 		if(MMU_new.is_dma(adr)) { MMU_new.write_dma(ARMCPU_ARM7,32,adr,val); return; }
 
 		switch(adr)
@@ -4296,42 +4457,6 @@ void FASTCALL _MMU_ARM7_write32(u32 adr, u32 val)
 				rtcWrite((u16)val);
 				break;
 
-			case REG_IME : 
-				NDS_Reschedule();
-				MMU.reg_IME[ARMCPU_ARM7] = val & 0x01;
-				T1WriteLong(MMU.MMU_MEM[ARMCPU_ARM7][0x40], 0x208, val);
-				return;
-				
-			case REG_IE :
-				NDS_Reschedule();
-				MMU.reg_IE[ARMCPU_ARM7] = val;
-				return;
-			
-			case REG_IF: REG_IF_WriteLong<ARMCPU_ARM7>(val); return;
-
-            case REG_TM0CNTL:
-            case REG_TM1CNTL:
-            case REG_TM2CNTL:
-            case REG_TM3CNTL:
-			{
-				int timerIndex = (adr>>2)&0x3;
-				MMU.timerReload[ARMCPU_ARM7][timerIndex] = (u16)val;
-				T1WriteWord(MMU.MMU_MEM[ARMCPU_ARM7][0x40], adr & 0xFFF, val);
-				write_timer(ARMCPU_ARM7, timerIndex, val>>16);
-				return;
-			}
-
-
-			case REG_IPCSYNC:
-				MMU_IPCSync(ARMCPU_ARM7, val);
-				return;
-			case REG_IPCFIFOCNT:
-				IPC_FIFOcnt(ARMCPU_ARM7, val);
-				return;
-			case REG_IPCFIFOSEND:
-				IPC_FIFOsend(ARMCPU_ARM7, val);
-				return;
-			
 			case REG_GCROMCTRL :
 				MMU_writeToGCControl<ARMCPU_ARM7>(val);
 				return;
@@ -4350,12 +4475,12 @@ void FASTCALL _MMU_ARM7_write32(u32 adr, u32 val)
 
 #ifdef HAVE_JIT
 	if (JIT_MAPPED(adr, ARMCPU_ARM7))
-	{
-		JIT_COMPILED_FUNC_PREMASKED(adr, ARMCPU_ARM7, 0) = 0;
-		JIT_COMPILED_FUNC_PREMASKED(adr, ARMCPU_ARM7, 1) = 0;
-	}
+		JIT_INVALIDATE(JIT_COMPILED_FUNC_PREMASKED(adr, ARMCPU_ARM7, 0), 2);
 #endif
 
+	if ((adr & 0x0F000000) == 0x06000000)
+		MMU_VRAM_dirty(adr);
+
 	// Removed the &0xFF as they are implicit with the adr&0x0FFFFFFF [shash]
 	T1WriteLong(MMU.MMU_MEM[ARMCPU_ARM7][adr>>20], adr&MMU.MMU_MASK[ARMCPU_ARM7][adr>>20], val);
 }
@@ -4404,20 +4529,18 @@ u8 FASTCALL _MMU_ARM7_read08(u32 adr)
 
 	if (adr >> 24 == 4)
 	{
+		if(MMU_IO_IN_TABLE(adr))
+		{
+			MMU_IOReadHandler handler = MMU_IOread08[ARMCPU_ARM7][adr & (MMU_IO_TABLE_SIZE-1)];
+			if(handler) return (u8)handler(adr);
+		}
+
 		if(MMU_new.is_dma(adr)) return MMU_new.read_dma(ARMCPU_ARM7,8,adr); 
 
 		// Address is an IO register
 
 		switch(adr)
 		{
-			case REG_IF: return MMU.gen_IF<ARMCPU_ARM7>();
-			case REG_IF+1: return (MMU.gen_IF<ARMCPU_ARM7>()>>8);
-			case REG_IF+2: return (MMU.gen_IF<ARMCPU_ARM7>()>>16);
-			case REG_IF+3: return (MMU.gen_IF<ARMCPU_ARM7>()>>24);
-
-			case REG_DISPx_VCOUNT: return nds.VCount&0xFF;
-			case REG_DISPx_VCOUNT+1: return (nds.VCount>>8)&0xFF;
-
 			case REG_WRAMSTAT: return MMU.WRAMCNT;
 		}
 
@@ -4465,6 +4588,12 @@ u16 FASTCALL _MMU_ARM7_read16(u32 adr)
 	if(adr>>24==4)
 	{	//Address is an IO register
 
+		if(MMU_IO_IN_TABLE(adr))
+		{
+			MMU_IOReadHandler handler = MMU_IOread16[ARMCPU_ARM7][(adr & (MMU_IO_TABLE_SIZE-1))>>1];
+			if(handler) return (u16)handler(adr);
+		}
+
 		if(MMU_new.is_dma(adr)) return MMU_new.read_dma(ARMCPU_ARM7,16,adr); 
 
 		switch(adr)
@@ -4477,23 +4606,7 @@ u16 FASTCALL _MMU_ARM7_read16(u32 adr)
 				return ret;
 			}
 
-			case REG_DISPx_VCOUNT: return nds.VCount;
 			case REG_RTC: return rtcRead();
-			case REG_IME: return (u16)MMU.reg_IME[ARMCPU_ARM7];
-				
-			case REG_IE:
-				return (u16)MMU.reg_IE[ARMCPU_ARM7];
-			case REG_IE + 2:
-				return (u16)(MMU.reg_IE[ARMCPU_ARM7]>>16);
-				
-			case REG_IF: return MMU.gen_IF<ARMCPU_ARM7>();
-			case REG_IF+2: return MMU.gen_IF<ARMCPU_ARM7>()>>16;
-
-			case REG_TM0CNTL :
-			case REG_TM1CNTL :
-			case REG_TM2CNTL :
-			case REG_TM3CNTL :
-				return read_timer(ARMCPU_ARM7,(adr&0xF)>>2);
 
 			case REG_VRAMSTAT:
 				//make sure WRAMSTAT is stashed and then fallthrough to return the value from memory. i know, gross.
@@ -4565,6 +4678,12 @@ u32 FASTCALL _MMU_ARM7_read32(u32 adr)
 	if((adr >> 24) == 4)
 	{	//Address is an IO register
 		
+		if(MMU_IO_IN_TABLE(adr))
+		{
+			MMU_IOReadHandler handler = MMU_IOread32[ARMCPU_ARM7][(adr & (MMU_IO_TABLE_SIZE-1))>>2];
+			if(handler) return handler(adr);
+		}
+
 		if(MMU_new.is_dma(adr)) return MMU_new.read_dma(ARMCPU_ARM7,32,adr); 
 		
 		switch(adr)
@@ -4572,21 +4691,8 @@ u32 FASTCALL _MMU_ARM7_read32(u32 adr)
 			case REG_RTC: return (u32)rtcRead();
 			case REG_DISPx_VCOUNT: return nds.VCount;
 
-			case REG_IME : 
-				return MMU.reg_IME[ARMCPU_ARM7];
-			case REG_IE :
-				return MMU.reg_IE[ARMCPU_ARM7];
-			case REG_IF: return MMU.gen_IF<ARMCPU_ARM7>();
 			case REG_IPCFIFORECV :
 				return IPC_FIFOrecv(ARMCPU_ARM7);
-			case REG_TM0CNTL :
-			case REG_TM1CNTL :
-			case REG_TM2CNTL :
-			case REG_TM3CNTL :
-			{
-				u32 val = T1ReadWord(MMU.MMU_MEM[ARMCPU_ARM7][0x40], (adr + 2) & 0xFFF);
-				return MMU.timer[ARMCPU_ARM7][(adr&0xF)>>2] | (val<<16);
-			}	
 			case REG_GCROMCTRL:
 			{
 				//INFO("arm7 romctrl read\n");
@@ -4682,6 +4788,69 @@ void FASTCALL MMU_DumpMemBlock(u8 proc, u32 address, u32 size, u8 *buffer)
 	}
 }
 
+//times the register traffic games generate the most, through the same entry points the cpu cores use:
+//vcount polling, the ipc sync handshake, a div and a sqrt round trip, and interrupt acknowledges
+void MMU_IOBenchmark(int iterations)
+{
+	static const char *names[] = { "vcount poll", "ipc sync", "div", "sqrt", "irq ack", "fog/toon" };
+	static const int accesses[] = { 2, 2, 5, 3, 3, 4 };
+	const u32 ipcsync9 = T1ReadWord(MMU.MMU_MEM[ARMCPU_ARM9][0x40], 0x180);
+	u32 fogToon[0x60>>2];
+	for(u32 i = 0; i < 0x60; i += 4)
+		fogToon[i>>2] = T1ReadLong(MMU.MMU_MEM[ARMCPU_ARM9][0x40], 0x360 + i);
+	u32 sink = 0;
+
+	for(int test = 0; test < 6; test++)
+	{
+		u64 start = Task_GetTimeMicros();
+		for(int i = 0; i < iterations; i++)
+		{
+			switch(test)
+			{
+				case 0:
+					sink += _MMU_ARM9_read16(REG_DISPx_VCOUNT);
+					sink += _MMU_ARM7_read16(REG_DISPx_VCOUNT);
+					break;
+				case 1:
+					_MMU_ARM9_write16(REG_IPCSYNC, (i & 0xF) << 8);
+					sink += _MMU_ARM7_read16(REG_IPCSYNC);
+					break;
+				case 2:
+					_MMU_ARM9_write16(REG_DIVCNT, 0);
+					_MMU_ARM9_write32(REG_DIVNUMER, i);
+					_MMU_ARM9_write32(REG_DIVDENOM, (i & 0xFF) + 1);
+					sink += _MMU_ARM9_read16(REG_DIVCNT);
+					sink += _MMU_ARM9_read32(REG_DIVRESULT);
+					break;
+				case 3:
+					_MMU_ARM9_write32(REG_SQRTPARAM, i);
+					sink += _MMU_ARM9_read16(REG_SQRTCNT);
+					sink += _MMU_ARM9_read32(REG_SQRTRESULT);
+					break;
+				case 4:
+					sink += _MMU_ARM9_read32(REG_IE);
+					sink += _MMU_ARM9_read32(REG_IF);
+					_MMU_ARM9_write32(REG_IF, 0);
+					break;
+				case 5:
+					_MMU_ARM9_write08(eng_3D_FOG_TABLE + (i & 0x1F), i);
+					_MMU_ARM9_write32(eng_3D_FOG_TABLE + (i & 0x1C), i);
+					_MMU_ARM9_write16(eng_3D_TOON_TABLE + (i & 0x3E), i);
+					_MMU_ARM9_write32(eng_3D_TOON_TABLE + (i & 0x3C), i);
+					break;
+			}
+		}
+		u64 elapsed = std::max<u64>(1, Task_GetTimeMicros() - start);
+
+		printf("MMU io benchmark: %-12s %.2f ns/access\n", names[test], elapsed * 1000.0 / ((double)iterations * accesses[test]));
+	}
+
+	_MMU_ARM9_write16(REG_IPCSYNC, ipcsync9);
+	for(u32 i = 0; i < 0x60; i += 4)
+		_MMU_ARM9_write32(eng_3D_FOG_TABLE + i, fogToon[i>>2]);
+	printf("MMU io benchmark: checksum %08X\n", sink);
+}
+
 
 //these templates needed to be instantiated manually
 template u32 MMU_struct::gen_IF<ARMCPU_ARM9>();
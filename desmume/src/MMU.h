@@ -572,6 +572,24 @@ extern VramConfiguration vramConfiguration;
 
 #define VRAM_ARM9_PAGES 512
 extern u8 vram_arm9_map[VRAM_ARM9_PAGES];
+
+//dirty tracking for caches of data derived from vram (the texture cache).
+//anything writing to a bank flags it dirty, and the flag is folded into the bank's generation
+//the next time somebody asks for it. so a bank's generation only changes if the bank was written since it was last looked at.
+//the extra entry stands for the blank memory, which never changes.
+extern u8 vram_bank_dirty[VRAM_BANKS+1];
+extern const u8 vram_lcdc_page_bank[64];
+
+//flags the bank containing an address returned by MMU_LCDmap (in the LCDC_HACKY_LOCATION range) dirty
+FORCEINLINE void MMU_VRAM_dirty(u32 lcdc_addr)
+{
+	vram_bank_dirty[vram_lcdc_page_bank[(lcdc_addr>>14)&63]] = 1;
+}
+
+//returns the generation of the bank containing the given pointer into ARM9_LCD (or blank_memory)
+u32 MMU_VRAM_generation(const u8* ptr);
+//flags every bank dirty, for when vram is replaced wholesale (savestates)
+void MMU_VRAM_dirty_all();
 FORCEINLINE void* MMU_gpu_map(u32 vram_addr)
 {
 	//this is supposed to map a single gpu vram address to emulator host memory
@@ -629,6 +647,25 @@ extern u32 _MMU_MAIN_MEM_MASK16;
 extern u32 _MMU_MAIN_MEM_MASK32;
 void SetupMMU(bool debugConsole, bool dsi);
 
+//write tracking for incremental savestates. while MMU_dirty_tracking is set, every write to main memory
+//sets the bit of its 4KB page in MMU_dirty_pages, and whoever takes the snapshots clears the bits it has used.
+#define MMU_DIRTY_PAGE_SHIFT 12
+#define MMU_DIRTY_PAGES (sizeof(MMU.MAIN_MEM) >> MMU_DIRTY_PAGE_SHIFT)
+extern bool MMU_dirty_tracking;
+extern u32 MMU_dirty_pages[MMU_DIRTY_PAGES/32];
+
+FORCEINLINE void MMU_MAIN_MEM_dirty(u32 addr)
+{
+	if(!MMU_dirty_tracking) return;
+	const u32 page = (addr & _MMU_MAIN_MEM_MASK) >> MMU_DIRTY_PAGE_SHIFT;
+	MMU_dirty_pages[page>>5] |= 1 << (page&31);
+}
+
+//the same for a run of bytes, which can cover several pages
+void MMU_MAIN_MEM_dirty_range(u32 addr, u32 bytes);
+//flags every page, for when main memory is replaced wholesale (reset, savestates)
+void MMU_MAIN_MEM_dirty_all();
+
 FORCEINLINE void CheckMemoryDebugEvent(EDEBUG_EVENT event, const MMU_ACCESS_TYPE type, const u32 procnum, const u32 addr, const u32 size, const u32 val)
 {
 	//TODO - ugh work out a better prefetch event system
@@ -803,9 +840,10 @@ FORCEINLINE void _MMU_write08(const int PROCNUM, const MMU_ACCESS_TYPE AT, const
 
 	if ( (addr & 0x0F000000) == 0x02000000) {
 #ifdef HAVE_JIT
-		JIT_COMPILED_FUNC_KNOWNBANK(addr, MAIN_MEM, _MMU_MAIN_MEM_MASK, 0) = 0;
+		JIT_INVALIDATE(JIT_COMPILED_FUNC_KNOWNBANK(addr, MAIN_MEM, _MMU_MAIN_MEM_MASK, 0), 1);
 #endif
 		T1WriteByte( MMU.MAIN_MEM, addr & _MMU_MAIN_MEM_MASK, val);
+		MMU_MAIN_MEM_dirty(addr);
 #ifdef HAVE_LUA
 		CallRegisteredLuaMemHook(addr, 1, val, LUAMEMHOOK_WRITE);
 #endif
@@ -842,9 +880,10 @@ FORCEINLINE void _MMU_write16(const int PROCNUM, const MMU_ACCESS_TYPE AT, const
 
 	if ( (addr & 0x0F000000) == 0x02000000) {
 #ifdef HAVE_JIT
-		JIT_COMPILED_FUNC_KNOWNBANK(addr, MAIN_MEM, _MMU_MAIN_MEM_MASK16, 0) = 0;
+		JIT_INVALIDATE(JIT_COMPILED_FUNC_KNOWNBANK(addr, MAIN_MEM, _MMU_MAIN_MEM_MASK16, 0), 1);
 #endif
 		T1WriteWord( MMU.MAIN_MEM, addr & _MMU_MAIN_MEM_MASK16, val);
+		MMU_MAIN_MEM_dirty(addr);
 #ifdef HAVE_LUA
 		CallRegisteredLuaMemHook(addr, 2, val, LUAMEMHOOK_WRITE);
 #endif
@@ -881,10 +920,10 @@ FORCEINLINE void _MMU_write32(const int PROCNUM, const MMU_ACCESS_TYPE AT, const
 
 	if ( (addr & 0x0F000000) == 0x02000000) {
 #ifdef HAVE_JIT
-		JIT_COMPILED_FUNC_KNOWNBANK(addr, MAIN_MEM, _MMU_MAIN_MEM_MASK32, 0) = 0;
-		JIT_COMPILED_FUNC_KNOWNBANK(addr, MAIN_MEM, _MMU_MAIN_MEM_MASK32, 1) = 0;
+		JIT_INVALIDATE(JIT_COMPILED_FUNC_KNOWNBANK(addr, MAIN_MEM, _MMU_MAIN_MEM_MASK32, 0), 2);
 #endif
 		T1WriteLong( MMU.MAIN_MEM, addr & _MMU_MAIN_MEM_MASK32, val);
+		MMU_MAIN_MEM_dirty(addr);
 #ifdef HAVE_LUA
 		CallRegisteredLuaMemHook(addr, 4, val, LUAMEMHOOK_WRITE);
 #endif
@@ -952,4 +991,7 @@ FORCEINLINE void _MMU_write32(u32 addr, u32 val) { _MMU_write32(PROCNUM, AT, add
 
 void FASTCALL MMU_DumpMemBlock(u8 proc, u32 address, u32 size, u8 *buffer);
 
+//times the hot io registers through the MMU read/write functions and prints ns per access
+void MMU_IOBenchmark(int iterations);
+
 #endif
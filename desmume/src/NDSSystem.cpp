@@ -41,9 +41,18 @@
 #include "firmware.h"
 #include "version.h"
 #include "slot1.h"
+#include "saves.h"
+#include "utils/task.h"
 
 #include "path.h"
 
+#ifndef _WINDOWS
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 //int xxctr=0;
 //#define LOG_ARM9
 //#define LOG_ARM7
@@ -156,6 +165,9 @@ int NDS_Init( void)
 }
 
 void NDS_DeInit(void) {
+	//a slot save may still be on its way to the disk
+	savestate_flush();
+
 	if(MMU.CART_ROM != MMU.UNUSED_RAM)
 		NDS_FreeROM();
 
@@ -320,6 +332,62 @@ RomBanner::RomBanner(bool defaultInit)
 	memset(end0xFF,0,sizeof(end0xFF));
 }
 
+bool GameInfo::mapFile(const char* filename, int size)
+{
+#ifdef _WINDOWS
+	return false;
+#else
+	int fd = open(filename, O_RDONLY);
+	if(fd == -1) return false;
+
+	//the mapping stays backed by the file for as long as the rom is loaded. if the file is
+	//truncated while it's mapped, touching the pages past its new end raises SIGBUS, and if
+	//it's rewritten in place the rom changes under the game. CommonSettings.rom_mmap turns
+	//this off for setups where that can happen. the size is checked here because the file
+	//could already have changed since it was read
+	struct stat sb;
+	if(fstat(fd, &sb) == -1 || sb.st_size != size)
+	{
+		close(fd);
+		return false;
+	}
+
+	release();
+	setSize(size);
+
+	//reserve the whole masked range as anonymous memory and lay the file over the start of it,
+	//so the padding that fillGap() writes never touches the file. both mappings are private:
+	//pages only read are shared with the page cache (and any other process running the same
+	//rom), while the secure area decrypt, fillGap() and dldi patching copy just the pages they write
+	long page = sysconf(_SC_PAGESIZE);
+	size_t len = ((size_t)allocatedSize + page - 1) & ~(size_t)(page - 1);
+	void* base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if(base != MAP_FAILED && mmap(base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+	{
+		munmap(base, len);
+		base = MAP_FAILED;
+	}
+	close(fd);
+	if(base == MAP_FAILED) return false;
+
+	romdata = (char*)base;
+	mappedSize = (u32)len;
+	return true;
+#endif
+}
+
+void GameInfo::release()
+{
+#ifndef _WINDOWS
+	if(mappedSize)
+		munmap(romdata, mappedSize);
+	else
+#endif
+		delete[] romdata;
+	romdata = NULL;
+	mappedSize = 0;
+}
+
 bool GameInfo::hasRomBanner()
 {
 	if(header.IconOff + sizeof(RomBanner) > romsize)
@@ -533,8 +601,17 @@ static int rom_init_path(const char *filename, const char *physicalName, const c
 	if(MMU.CART_ROM != MMU.UNUSED_RAM)
 		NDS_FreeROM();
 
-	gameInfo.resize(size);
-	ret = reader->Read(file, gameInfo.romdata, size);
+	//plain .nds files are mapped rather than read, so the pages of a rom that are only read are
+	//shared with the page cache and with other processes running it, instead of each process
+	//holding a private copy. (NDS_LoadROM still reads the whole file once for gameInfo.crc.)
+	//compressed roms and the offset ds.gba image still go through the reader
+	if(CommonSettings.rom_mmap && reader == &STDROMReader && type == ROM_NDS && gameInfo.mapFile(filename, size))
+		ret = size;
+	else
+	{
+		gameInfo.resize(size);
+		ret = reader->Read(file, gameInfo.romdata, size);
+	}
 	gameInfo.fillGap();
 	reader->DeInit(file);
 
@@ -573,6 +650,7 @@ int NDS_LoadROM(const char *filename, const char *physicalName, const char *logi
 	NDS_SetROM((u8*)gameInfo.romdata, gameInfo.mask);
 
 	gameInfo.populate();
+	//this reads every page of a mapped rom too, movies and the game database want the crc of the whole rom
 	gameInfo.crc = crc32(0,(u8*)gameInfo.romdata,gameInfo.romsize);
 	INFO("\nROM game code: %c%c%c%c\n", gameInfo.header.gameCode[0], gameInfo.header.gameCode[1], gameInfo.header.gameCode[2], gameInfo.header.gameCode[3]);
 	INFO("ROM crc: %08X\n", gameInfo.crc);
@@ -633,10 +711,11 @@ int NDS_LoadROM(const char *filename, const char *physicalName, const char *logi
 
 void NDS_FreeROM(void)
 {
+	savestate_flush();
 	FCEUI_StopMovie();
 	if ((u8*)MMU.CART_ROM == (u8*)gameInfo.romdata)
-		gameInfo.romdata = NULL;
-	if (MMU.CART_ROM != MMU.UNUSED_RAM)
+		gameInfo.release();
+	else if (MMU.CART_ROM != MMU.UNUSED_RAM)
 		delete [] MMU.CART_ROM;
 	MMU_unsetRom();
 }
@@ -1305,6 +1384,111 @@ struct TSequenceItem_sqrtunit : public TSequenceItem
 
 };
 
+//the events the sequencer can have pending. when several are due at once, execHardware runs
+//them in this order (which is the order the items were always checked in)
+enum ESequenceEvent
+{
+	ESE_DISPCNT, ESE_WIFI, ESE_DIVIDER, ESE_SQRTUNIT, ESE_GXFIFO,
+	ESE_DMA_0_0, ESE_DMA_0_1, ESE_DMA_0_2, ESE_DMA_0_3,
+	ESE_DMA_1_0, ESE_DMA_1_1, ESE_DMA_1_2, ESE_DMA_1_3,
+	ESE_TIMER_0_0, ESE_TIMER_0_1, ESE_TIMER_0_2, ESE_TIMER_0_3,
+	ESE_TIMER_1_0, ESE_TIMER_1_1, ESE_TIMER_1_2, ESE_TIMER_1_3,
+	ESE_COUNT
+};
+
+//binary min-heap of the enabled events keyed on the time they are due, so that finding the next
+//event doesn't have to poll every item. pos[] lets an event be moved or removed where it sits.
+struct TSequenceQueue
+{
+	u64 when[ESE_COUNT];
+	u8 heap[ESE_COUNT];
+	s8 pos[ESE_COUNT]; //-1 when the event isn't queued
+	int size;
+
+	TSequenceQueue() { clear(); }
+
+	void clear()
+	{
+		size = 0;
+		for(int i=0;i<ESE_COUNT;i++) pos[i] = -1;
+	}
+
+	FORCEINLINE u64 next() { return size ? when[heap[0]] : kNever; }
+
+	//queues the event, or moves it if it was already queued
+	void schedule(int id, u64 time)
+	{
+		int i = pos[id];
+		if(i < 0)
+		{
+			i = size++;
+			heap[i] = id;
+			pos[id] = i;
+			when[id] = time;
+			siftUp(i);
+		}
+		else
+		{
+			u64 old = when[id];
+			when[id] = time;
+			if(time < old) siftUp(i);
+			else siftDown(i);
+		}
+	}
+
+	void cancel(int id)
+	{
+		int i = pos[id];
+		if(i < 0) return;
+		pos[id] = -1;
+		if(i == --size) return;
+		int moved = heap[size];
+		place(i, moved);
+		siftUp(i);
+		if(pos[moved] == i) siftDown(i);
+	}
+
+	//removes and returns the first event, which must be due by now
+	int popDue(u64 now)
+	{
+		if(!size || when[heap[0]] > now) return -1;
+		int id = heap[0];
+		cancel(id);
+		return id;
+	}
+
+private:
+	void place(int i, int id) { heap[i] = id; pos[id] = i; }
+
+	void siftUp(int i)
+	{
+		int id = heap[i];
+		while(i > 0)
+		{
+			int parent = (i-1)>>1;
+			if(when[heap[parent]] <= when[id]) break;
+			place(i, heap[parent]);
+			i = parent;
+		}
+		place(i, id);
+	}
+
+	void siftDown(int i)
+	{
+		int id = heap[i];
+		for(;;)
+		{
+			int child = i*2+1;
+			if(child >= size) break;
+			if(child+1 < size && when[heap[child+1]] < when[heap[child]]) child++;
+			if(when[id] <= when[heap[child]]) break;
+			place(i, heap[child]);
+			i = child;
+		}
+		place(i, id);
+	}
+};
+
 struct Sequencer
 {
 	bool nds_vblankEnded;
@@ -1322,12 +1506,19 @@ struct Sequencer
 	TSequenceItem_Timer<0,2> timer_0_2; TSequenceItem_Timer<0,3> timer_0_3;
 	TSequenceItem_Timer<1,0> timer_1_0; TSequenceItem_Timer<1,1> timer_1_1;
 	TSequenceItem_Timer<1,2> timer_1_2; TSequenceItem_Timer<1,3> timer_1_3;
+	TSequenceQueue queue;
 
 	void init();
 
 	void execHardware();
 	u64 findNext();
 
+	//brings the event's place in the queue up to date with its item
+	void schedule(int id);
+	void scheduleAll();
+	void exec(int id);
+	void execDispcnt();
+
 	void save(EMUFILE* os)
 	{
 		write64le(nds_timer,os);
@@ -1375,12 +1566,13 @@ void NDS_RescheduleGXFIFO(u32 cost)
 		sequencer.gxfifo.enabled = true;
 	}
 	MMU.gfx3dCycles += cost;
+	sequencer.schedule(ESE_GXFIFO);
 	NDS_Reschedule();
 }
 
 void NDS_RescheduleTimers()
 {
-#define check(X,Y) sequencer.timer_##X##_##Y .schedule();
+#define check(X,Y) sequencer.timer_##X##_##Y .schedule(); sequencer.schedule(ESE_TIMER_##X##_##Y);
 	check(0,0); check(0,1); check(0,2); check(0,3);
 	check(1,0); check(1,1); check(1,2); check(1,3);
 #undef check
@@ -1388,11 +1580,38 @@ void NDS_RescheduleTimers()
 	NDS_Reschedule();
 }
 
-void NDS_RescheduleDMA()
+void NDS_RescheduleDMA(int procnum, int chan)
 {
-	//TBD
+	sequencer.schedule(ESE_DMA_0_0 + procnum*4 + chan);
 	NDS_Reschedule();
+}
 
+void NDS_RescheduleDivider()
+{
+	sequencer.schedule(ESE_DIVIDER);
+	NDS_Reschedule();
+}
+
+void NDS_RescheduleSqrt()
+{
+	sequencer.schedule(ESE_SQRTUNIT);
+	NDS_Reschedule();
+}
+
+//the wifi timers run lazily, so anything that changes them has to move their next event
+void NDS_RescheduleWifi()
+{
+#ifdef EXPERIMENTAL_WIFI_COMM
+	sequencer.wifi.timestamp = WIFI_usNextEvent();
+	sequencer.schedule(ESE_WIFI);
+	NDS_Reschedule();
+#endif
+}
+
+void NDS_RescheduleAll()
+{
+	sequencer.scheduleAll();
+	NDS_Reschedule();
 }
 
 static void initSchedule()
@@ -1407,18 +1626,9 @@ static void initSchedule()
 }
 
 
-// 2196372 ~= (ARM7_CLOCK << 16) / 1000000
-// This value makes more sense to me, because:
-// ARM7_CLOCK   = 33.51 mhz
-//				= 33513982 cycles per second
-// 				= 33.513982 cycles per microsecond
-const u64 kWifiCycles = 67;//34*2;
-//(this isn't very precise. I don't think it needs to be)
-
 void Sequencer::init()
 {
 	NDS_RescheduleTimers();
-	NDS_RescheduleDMA();
 
 	reschedule = false;
 	nds_timer = 0;
@@ -1443,10 +1653,12 @@ void Sequencer::init()
 
 	#ifdef EXPERIMENTAL_WIFI_COMM
 	wifi.enabled = true;
-	wifi.timestamp = kWifiCycles;
+	wifi.timestamp = WIFI_usNextEvent();
 	#else
 	wifi.enabled = false;
 	#endif
+
+	scheduleAll();
 }
 
 //this isnt helping much right now. work on it later
@@ -1694,6 +1906,10 @@ void NDS_Reschedule()
 {
 	IF_DEVELOPER(if(!sequencer.reschedule) DEBUG_statistics.sequencerExecutionCounters[0]++;);
 	sequencer.reschedule = true;
+#ifdef HAVE_JIT
+	//and don't let the jit link any further blocks before it does
+	NDS_ARM9.jit_link_budget = NDS_ARM7.jit_link_budget = 0;
+#endif
 }
 
 FORCEINLINE u32 _fast_min32(u32 a, u32 b, u32 c, u32 d)
@@ -1726,94 +1942,140 @@ FORCEINLINE u64 _fast_min(u64 a, u64 b)
 
 
 
-u64 Sequencer::findNext()
+void Sequencer::schedule(int id)
 {
+	u64 next = kNever;
+	switch(id)
+	{
 	//this one is always enabled so dont bother to check it
-	u64 next = dispcnt.next();
-
-	if(divider.isEnabled()) next = _fast_min(next,divider.next());
-	if(sqrtunit.isEnabled()) next = _fast_min(next,sqrtunit.next());
-	if(gxfifo.enabled) next = _fast_min(next,gxfifo.next());
-
+	case ESE_DISPCNT: next = dispcnt.next(); break;
 #ifdef EXPERIMENTAL_WIFI_COMM
-	next = _fast_min(next,wifi.next());
+	case ESE_WIFI: next = wifi.next(); break;
 #endif
-
-#define test(X,Y) if(dma_##X##_##Y .isEnabled()) next = _fast_min(next,dma_##X##_##Y .next());
+	case ESE_DIVIDER: if(divider.isEnabled()) next = divider.next(); break;
+	case ESE_SQRTUNIT: if(sqrtunit.isEnabled()) next = sqrtunit.next(); break;
+	case ESE_GXFIFO: next = gxfifo.next(); break;
+#define test(X,Y) case ESE_DMA_##X##_##Y: if(dma_##X##_##Y .controller && dma_##X##_##Y .isEnabled()) next = dma_##X##_##Y .next(); break;
 	test(0,0); test(0,1); test(0,2); test(0,3);
 	test(1,0); test(1,1); test(1,2); test(1,3);
 #undef test
-#define test(X,Y) if(timer_##X##_##Y .enabled) next = _fast_min(next,timer_##X##_##Y .next());
+#define test(X,Y) case ESE_TIMER_##X##_##Y: if(timer_##X##_##Y .enabled) next = timer_##X##_##Y .next(); break;
 	test(0,0); test(0,1); test(0,2); test(0,3);
 	test(1,0); test(1,1); test(1,2); test(1,3);
 #undef test
+	}
 
-	return next;
+	if(next == kNever) queue.cancel(id);
+	else queue.schedule(id, next);
 }
 
-void Sequencer::execHardware()
+void Sequencer::scheduleAll()
 {
-	if(dispcnt.isTriggered())
-	{
+	queue.clear();
+	for(int i=0;i<ESE_COUNT;i++)
+		schedule(i);
+}
 
-		IF_DEVELOPER(DEBUG_statistics.sequencerExecutionCounters[1]++);
+u64 Sequencer::findNext()
+{
+	return queue.next();
+}
 
-		switch(dispcnt.param)
-		{
-		case ESI_DISPCNT_HStart:
-			execHardware_hstart();
-			//(used to be 3168)
-			//hstart is actually 8 dots before the visible drawing begins
-			//we're going to run 1 here and then run 7 in the next case
-			dispcnt.timestamp += 1*6*2;
-			dispcnt.param = ESI_DISPCNT_HStartIRQ;
-			break;
-		case ESI_DISPCNT_HStartIRQ:
-			execHardware_hstart_irq();
-			dispcnt.timestamp += 7*6*2;
-			dispcnt.param = ESI_DISPCNT_HDraw;
-			break;
-			
-		case ESI_DISPCNT_HDraw:
-			execHardware_hdraw();
-			//duration of non-blanking period is ~1606 clocks (gbatek agrees) [but says its different on arm7]
-			//im gonna call this 267 dots = 267*6=1602
-			//so, this event lasts 267 dots minus the 8 dot preroll
-			dispcnt.timestamp += (267-8)*6*2;
-			dispcnt.param = ESI_DISPCNT_HBlank;
-			break;
-
-		case ESI_DISPCNT_HBlank:
-			execHardware_hblank();
-			//(once this was 1092 or 1092/12=91 dots.)
-			//there are surely 355 dots per scanline, less 267 for non-blanking period. the rest is hblank and then after that is hstart
-			dispcnt.timestamp += (355-267)*6*2;
-			dispcnt.param = ESI_DISPCNT_HStart;
-			break;
-		}
-	}
+void Sequencer::execDispcnt()
+{
+	IF_DEVELOPER(DEBUG_statistics.sequencerExecutionCounters[1]++);
 
-#ifdef EXPERIMENTAL_WIFI_COMM
-	if(wifi.isTriggered())
+	switch(dispcnt.param)
 	{
-		WIFI_usTrigger();
-		wifi.timestamp += kWifiCycles;
-	}
-#endif
-	
-	if(divider.isTriggered()) divider.exec();
-	if(sqrtunit.isTriggered()) sqrtunit.exec();
-	if(gxfifo.isTriggered()) gxfifo.exec();
+	case ESI_DISPCNT_HStart:
+		execHardware_hstart();
+		//(used to be 3168)
+		//hstart is actually 8 dots before the visible drawing begins
+		//we're going to run 1 here and then run 7 in the next case
+		dispcnt.timestamp += 1*6*2;
+		dispcnt.param = ESI_DISPCNT_HStartIRQ;
+		break;
+	case ESI_DISPCNT_HStartIRQ:
+		execHardware_hstart_irq();
+		dispcnt.timestamp += 7*6*2;
+		dispcnt.param = ESI_DISPCNT_HDraw;
+		break;
+		
+	case ESI_DISPCNT_HDraw:
+		execHardware_hdraw();
+		//duration of non-blanking period is ~1606 clocks (gbatek agrees) [but says its different on arm7]
+		//im gonna call this 267 dots = 267*6=1602
+		//so, this event lasts 267 dots minus the 8 dot preroll
+		dispcnt.timestamp += (267-8)*6*2;
+		dispcnt.param = ESI_DISPCNT_HBlank;
+		break;
 
+	case ESI_DISPCNT_HBlank:
+		execHardware_hblank();
+		//(once this was 1092 or 1092/12=91 dots.)
+		//there are surely 355 dots per scanline, less 267 for non-blanking period. the rest is hblank and then after that is hstart
+		dispcnt.timestamp += (355-267)*6*2;
+		dispcnt.param = ESI_DISPCNT_HStart;
+		break;
+	}
+}
 
-#define test(X,Y) if(dma_##X##_##Y .isTriggered()) dma_##X##_##Y .exec();
+void Sequencer::exec(int id)
+{
+	switch(id)
+	{
+	case ESE_DISPCNT: if(dispcnt.isTriggered()) execDispcnt(); break;
+#ifdef EXPERIMENTAL_WIFI_COMM
+	case ESE_WIFI:
+		if(wifi.isTriggered())
+		{
+			WIFI_usSync();
+			wifi.timestamp = WIFI_usNextEvent();
+		}
+		break;
+#endif
+	case ESE_DIVIDER: if(divider.isTriggered()) divider.exec(); break;
+	case ESE_SQRTUNIT: if(sqrtunit.isTriggered()) sqrtunit.exec(); break;
+	case ESE_GXFIFO: if(gxfifo.isTriggered()) gxfifo.exec(); break;
+#define test(X,Y) case ESE_DMA_##X##_##Y: if(dma_##X##_##Y .isTriggered()) dma_##X##_##Y .exec(); break;
 	test(0,0); test(0,1); test(0,2); test(0,3);
 	test(1,0); test(1,1); test(1,2); test(1,3);
 #undef test
-#define test(X,Y) if(timer_##X##_##Y .enabled) if(timer_##X##_##Y .isTriggered()) timer_##X##_##Y .exec();
+#define test(X,Y) case ESE_TIMER_##X##_##Y: if(timer_##X##_##Y .isTriggered()) timer_##X##_##Y .exec(); break;
 	test(0,0); test(0,1); test(0,2); test(0,3);
 	test(1,0); test(1,1); test(1,2); test(1,3);
 #undef test
+	}
+}
+
+void Sequencer::execHardware()
+{
+	//each item gets one chance per pass, in event order, to run if it is due by the time its turn
+	//comes. so an event that comes due while a later one runs (a dma kicking the gxfifo, or an
+	//item rescheduling itself for right now) waits for the next pass, the same as when every item
+	//was polled in turn
+	u32 due = 0, deferred = 0;
+	int turn = 0;
+	for(;;)
+	{
+		for(int id; (id = queue.popDue(nds_timer)) >= 0; )
+		{
+			if(id < turn) deferred |= 1<<id;
+			else due |= 1<<id;
+		}
+		if(!due) break;
+
+		int id = 0;
+		while(!(due & (1<<id))) id++;
+		due &= ~(1<<id);
+		turn = id+1;
+
+		exec(id);
+		schedule(id);
+	}
+
+	for(int id=0;deferred;id++,deferred>>=1)
+		if(deferred & 1) schedule(id);
 }
 
 void execHardware_interrupts();
@@ -1948,6 +2210,15 @@ static FORCEINLINE s32 minarmtime(s32 arm9, s32 arm7)
 }
 
 #ifdef HAVE_JIT
+//compiled blocks may run straight into each other while this cpu stays behind `until`,
+//since the loop below would keep picking it until then anyway
+template<int PROCNUM>
+static FORCEINLINE void armJitLinkBudget(const u64 nds_timer_base, const s32 now, const s32 until)
+{
+	ARMPROC.jit_link_budget = until - now;
+	ARMPROC.jit_link_deadline = nds_timer_base + until;
+}
+
 template<bool doarm9, bool doarm7, bool jit>
 #else
 template<bool doarm9, bool doarm7>
@@ -1965,6 +2236,7 @@ static /*donotinline*/ std::pair<s32,s32> armInnerLoop(
 				arm9log();
 				debug();
 #ifdef HAVE_JIT
+				if(jit) armJitLinkBudget<ARMCPU_ARM9>(nds_timer_base, arm9, doarm7 ? min(arm7,s32next) : s32next);
 				arm9 += armcpu_exec<ARMCPU_ARM9,jit>();
 #else
 				arm9 += armcpu_exec<ARMCPU_ARM9>();
@@ -1987,6 +2259,7 @@ static /*donotinline*/ std::pair<s32,s32> armInnerLoop(
 			{
 				arm7log();
 #ifdef HAVE_JIT
+				if(jit) armJitLinkBudget<ARMCPU_ARM7>(nds_timer_base, arm7, doarm9 ? min(arm9,s32next) : s32next);
 				arm7 += (armcpu_exec<ARMCPU_ARM7,jit>()<<1);
 #else
 				arm7 += (armcpu_exec<ARMCPU_ARM7>()<<1);
@@ -2170,6 +2443,7 @@ void NDS_exec(s32 nb)
 	DEBUG_Notify.NextFrame();
 	if (cheats)
 		cheats->process();
+	savestate_poll();
 }
 
 template<int PROCNUM> static void execHardware_interrupts_core()
@@ -3117,6 +3391,35 @@ bool ValidateSlot2Access(u32 procnum, u32 demandSRAMSpeed, u32 demand1stROMSpeed
 	return true;
 }
 
+void NDS_SequencerBenchmark(int frames)
+{
+	s64 iterations = 0;
+	u64 start = Task_GetTimeMicros();
+	for(int i = 0; i < frames; i++)
+	{
+		NDS_exec<false>();
+		iterations += nds.cpuloopIterationCount;
+	}
+	u64 elapsed = std::max<u64>(1, Task_GetTimeMicros() - start);
+
+	printf("sequencer benchmark: %d frames, %.1f loop iterations/frame, %.0f iterations/sec, %.2f us/frame\n",
+		frames, iterations / (double)frames, iterations * 1000000.0 / elapsed, elapsed / (double)frames);
+
+	//the cost of the queue on its own: moving one event and asking for the next, as the
+	//reschedule hooks and the cpu loop do
+	const int passes = 1000000;
+	u64 sink = 0;
+	start = Task_GetTimeMicros();
+	for(int i = 0; i < passes; i++)
+	{
+		sequencer.schedule(i % ESE_COUNT);
+		sink += sequencer.findNext();
+	}
+	elapsed = std::max<u64>(1, Task_GetTimeMicros() - start);
+
+	printf("sequencer benchmark: %.2f ns/reschedule, checksum %08X\n", elapsed * 1000.0 / passes, (u32)sink);
+}
+
 //these templates needed to be instantiated manually
 template void NDS_exec<FALSE>(s32 nb);
 template void NDS_exec<TRUE>(s32 nb);
@@ -145,8 +145,15 @@ void emu_halt();
 extern u64 nds_timer;
 void NDS_Reschedule();
 void NDS_RescheduleGXFIFO(u32 cost);
-void NDS_RescheduleDMA();
+void NDS_RescheduleDMA(int procnum, int chan);
 void NDS_RescheduleTimers();
+void NDS_RescheduleDivider();
+void NDS_RescheduleSqrt();
+void NDS_RescheduleWifi();
+void NDS_RescheduleAll();
+
+//runs the given number of frames and prints how many times the cpu loop went around the sequencer
+void NDS_SequencerBenchmark(int frames);
 
 enum ENSATA_HANDSHAKE
 {
@@ -317,6 +324,7 @@ struct GameInfo
 					crc(0),
 					romsize(0),
 					allocatedSize(0),
+					mappedSize(0),
 					mask(0)
 	{
 		memset(&header, 0, sizeof(header));
@@ -337,9 +345,7 @@ struct GameInfo
 		memset(romdata+romsize,0xFF,allocatedSize-romsize);
 	}
 
-	void resize(int size) {
-		if(romdata != NULL) delete[] romdata;
-
+	void setSize(int size) {
 		//calculate the necessary mask for the requested size
 		mask = size-1; 
 		mask |= (mask >>1);
@@ -351,10 +357,19 @@ struct GameInfo
 		//now, we actually need to over-allocate, because bytes from anywhere protected by that mask
 		//could be read from the rom
 		allocatedSize = mask+4;
+		romsize = size;
+	}
 
+	void resize(int size) {
+		release();
+		setSize(size);
 		romdata = new char[allocatedSize];
-		romsize = size;
 	}
+
+	//maps an uncompressed rom file instead of reading it. returns false if the file can't be mapped,
+	//in which case the caller should fall back to resize() and a read
+	bool mapFile(const char* filename, int size);
+	void release();
 	u32 crc;
 	NDS_header header;
 	char ROMserial[20];
@@ -364,6 +379,7 @@ struct GameInfo
 	char* romdata;
 	u32 romsize;
 	u32 allocatedSize;
+	u32 mappedSize; //nonzero when romdata is a file mapping rather than a new[] allocation
 	u32 mask;
 	const RomBanner& getRomBanner();
 	bool hasRomBanner();
@@ -497,7 +513,11 @@ extern struct TCommonSettings {
 		, GFX3D_LineHack(true)
 		, GFX3D_Zelda_Shadow_Depth_Hack(0)
 		, GFX3D_Renderer_Multisample(false)
+		, GFX3D_FixedPointRasterizer(false)
+		, GFX3D_TexCacheSizeMB(16)
 		, jit_max_block_size(100)
+		, jit_link_blocks(true)
+		, jit_superblocks(false)
 		, UseExtBIOS(false)
 		, SWIFromBIOS(false)
 		, PatchSWI3(false)
@@ -518,15 +538,19 @@ extern struct TCommonSettings {
 		, StylusPressure(50)
 		, ConsoleType(NDS_CONSOLE_TYPE_FAT)
 		, StylusJitter(false)
+		, rom_mmap(true)
+		, savestateCodec(SavestateZlib)
 	{
 		strcpy(ARM9BIOS, "biosnds9.bin");
 		strcpy(ARM7BIOS, "biosnds7.bin");
 		strcpy(Firmware, "firmware.bin");
+		jit_cache_dir[0] = 0;
 		NDS_FillDefaultFirmwareConfigData(&InternalFirmConf);
 
 		/* WIFI mode: adhoc = 0, infrastructure = 1 */
 		wifi.mode = 1;
 		wifi.infraBridgeAdapter = 0;
+		wifi.adhocTransport = 0;
 
 		for(int i=0;i<16;i++)
 			spu_muteChannels[i] = false;
@@ -549,6 +573,8 @@ extern struct TCommonSettings {
 	bool GFX3D_LineHack;
 	int  GFX3D_Zelda_Shadow_Depth_Hack;
 	bool GFX3D_Renderer_Multisample;
+	bool GFX3D_FixedPointRasterizer; //softrast: integer edges, interpolants and depth instead of floats
+	int  GFX3D_TexCacheSizeMB; //decoded textures are trimmed down to this at the end of each frame
 
 	bool UseExtBIOS;
 	char ARM9BIOS[256];
@@ -580,10 +606,14 @@ extern struct TCommonSettings {
 
 	bool use_jit;
 	u32	jit_max_block_size;
+	bool jit_link_blocks;
+	bool jit_superblocks; //recompile hot blocks as superblocks that follow their likely branches
+	char jit_cache_dir[256]; //compiled blocks are kept here between runs, empty to disable
 	
 	struct _Wifi {
 		int mode;
 		int infraBridgeAdapter;
+		int adhocTransport; //0 = UDP broadcast, 1 = shared memory hub for the instances on this computer
 	} wifi;
 
 	enum MicMode
@@ -597,6 +627,20 @@ extern struct TCommonSettings {
 
 	SPUInterpolationMode spuInterpolationMode;
 
+	//map uncompressed .nds files instead of reading them into memory. a mapped rom file that is
+	//truncated or replaced while it's running crashes the emulator (SIGBUS), so turn this off if
+	//that can happen
+	bool rom_mmap;
+
+	//how compressed savestates are written. all of them can be loaded, when the build has the codec.
+	//the block codecs are opt-in because older versions reject their savestates
+	enum SavestateCodec
+	{
+		SavestateZlib = 0, //one zlib stream, which older versions can load too
+		SavestateZlibBlocks = 1, //zlib blocks, compressed in parallel
+		SavestateLZ4Blocks = 2, //lz4 blocks, much faster but bigger (needs liblz4)
+	} savestateCodec;
+
 	//this is a temporary hack until we straighten out the flushing logic and/or gxfifo
 	//int gfx3d_flushMode;
 
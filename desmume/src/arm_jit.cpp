@@ -28,6 +28,9 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stddef.h>
+#ifdef __APPLE__
+#include <mach-o/dyld.h>
+#endif
 #define HAVE_STATIC_CODE_BUFFER
 #endif
 #include "instructions.h"
@@ -39,11 +42,19 @@
 #include "arm_jit.h"
 #include "bios.h"
 
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+#include <zlib.h>
+
 #define LOG_JIT_LEVEL 0
 #define PROFILER_JIT_LEVEL 0
 
-#if (PROFILER_JIT_LEVEL > 0)
-#include <algorithm>
+// inline loads and stores for the common memory regions. the debugger, gdb stub and lua memory
+// hooks all sit in the MMU access functions, so those builds keep every access there.
+#if !defined(GDB_STUB) && !defined(HAVE_LUA) && !defined(DEVELOPER)
+#define JIT_FASTMEM
 #endif
 
 using namespace AsmJit;
@@ -186,14 +197,702 @@ DS_ALIGN(4096) uintptr_t compiled_funcs[1<<26] = {0};
 
 static u8 recompile_counts[(1<<26)/16];
 
+JitStats arm_jit_stats[2];
+
 #ifdef HAVE_STATIC_CODE_BUFFER
 // On x86_64, allocate jitted code from a static buffer to ensure that it's within 2GB of .text
 // Allows call instructions to use pcrel offsets, as opposed to slower indirect calls.
 // Reduces memory needed for function pointers.
 // FIXME win64 needs this too, x86_32 doesn't
 
+// The buffer is split into generations that are filled one after the other. When the newest
+// one runs out, the oldest is emptied and reused, so only the code compiled longest ago has
+// to be recompiled rather than the whole cache.
+#define JIT_GENERATIONS 4
+
 DS_ALIGN(4096) static u8 scratchpad[1<<25];
 static u8 *scratchptr;
+static u32 scratch_gen;
+static u32 scratch_size;
+
+#define GENERATION_SIZE (sizeof(scratchpad) / JIT_GENERATIONS)
+#endif
+
+//-----------------------------------------------------------------------------
+//   Code map
+//-----------------------------------------------------------------------------
+// every compiled block, and every address that was handed over to the interpreter, is recorded
+// against the pages of guest code it was built from. a store into one of those lines drops
+// exactly the blocks that overlap it and gives their code back. a superblock covers several
+// ranges of guest code; the extra ones are recorded as parts (no entry, no code) that are
+// chained to the block in a ring, and dropping any of them drops the whole ring.
+struct JitBlock
+{
+	uintptr_t *entry;	// compiled_funcs slot the block is dispatched from, NULL for a part
+	uintptr_t func;		// what was stored there
+	u32 first, last;	// slots of the guest code it covers
+	u8 *code;			// NULL for an interpreter fallback or a part
+	u32 size;
+	u32 next_part;		// next record of the same block, itself if there's only one
+	u32 profile;		// jit_profile slot the block counts its entries in, JIT_NO_PROFILE if none
+	u8 gen;
+	u8 proc;
+	bool live;
+};
+
+// with CommonSettings.jit_superblocks, ordinary blocks count how often they're entered and,
+// when they end in a conditional branch with a static target, how often it was taken. the
+// counters live in a small table hashed by address; a block that finds its slot taken by
+// another one simply isn't profiled.
+#define JIT_PROFILE_SIZE 4096
+#define JIT_NO_PROFILE 0xFFFFFFFF
+#define JIT_HOT_ENTRIES 512
+
+struct JitProfile
+{
+	u32 adr;
+	bool thumb;
+	bool live;
+	s32 credits;		// entries left before the block is rebuilt as a superblock
+	u32 branch;			// address of the conditional branch ending the block, 0 if none
+	u32 taken;			// how often that branch went to its target
+	u32 block;			// jit_blocks id of the owner
+};
+
+static JitProfile jit_profile[2][JIT_PROFILE_SIZE];
+
+static u32 jit_profile_slot(u32 adr)
+{
+	return ((adr >> 1) ^ (adr >> 13)) & (JIT_PROFILE_SIZE - 1);
+}
+
+static JitProfile* jit_profile_find(int proc, u32 adr, bool thumb)
+{
+	JitProfile &p = jit_profile[proc][jit_profile_slot(adr)];
+	return (p.live && p.adr == adr && p.thumb == thumb) ? &p : NULL;
+}
+
+static JitProfile* jit_profile_claim(int proc, u32 adr, bool thumb)
+{
+	JitProfile &p = jit_profile[proc][jit_profile_slot(adr)];
+	if(p.live && (p.adr != adr || p.thumb != thumb))
+		return NULL;
+	p.adr = adr;
+	p.thumb = thumb;
+	p.live = true;
+	p.credits = JIT_HOT_ENTRIES;
+	p.branch = 0;
+	p.taken = 0;
+	p.block = JIT_NO_PROFILE;
+	return &p;
+}
+
+u32 jit_code_map[JIT_PAGE_COUNT];
+static std::vector<u32> jit_page_blocks[JIT_PAGE_COUNT];
+static std::vector<JitBlock> jit_blocks;
+static std::vector<u32> jit_free_blocks;
+#ifndef HAVE_STATIC_CODE_BUFFER
+// blocks are dropped from inside the store helpers, so the block doing the store may be the one
+// being dropped and still has to return through its code. it's only given back to the memory
+// manager once we're outside of any compiled code again.
+static std::vector<u8*> jit_pending_free;
+
+static void jit_free_pending()
+{
+	for(u32 i = 0; i < jit_pending_free.size(); i++)
+		MemoryManager::getGlobal()->free(jit_pending_free[i]);
+	jit_pending_free.clear();
+}
+#endif
+
+static u32 jit_line_mask(const JitBlock &b, u32 page)
+{
+	u32 lo = std::max(b.first, page << JIT_PAGE_SHIFT);
+	u32 hi = std::min(b.last, ((page + 1) << JIT_PAGE_SHIFT) - 1);
+	lo = (lo >> JIT_LINE_SHIFT) & 31;
+	hi = (hi >> JIT_LINE_SHIFT) & 31;
+	return (u32)((2ULL << hi) - (1ULL << lo));
+}
+
+static u32 jit_register_block(int proc, uintptr_t *entry, uintptr_t func, u32 first, u32 last, u8 *code, u32 size)
+{
+	u32 id;
+	if(jit_free_blocks.empty())
+	{
+		id = jit_blocks.size();
+		jit_blocks.push_back(JitBlock());
+	}
+	else
+	{
+		id = jit_free_blocks.back();
+		jit_free_blocks.pop_back();
+	}
+
+	JitBlock &b = jit_blocks[id];
+	b.entry = entry;
+	b.func = func;
+	b.first = first;
+	b.last = last;
+	b.code = code;
+	b.size = size;
+#ifdef HAVE_STATIC_CODE_BUFFER
+	b.gen = scratch_gen;
+#else
+	b.gen = 0;
+#endif
+	b.next_part = id;
+	b.profile = JIT_NO_PROFILE;
+	b.proc = proc;
+	b.live = true;
+
+	for(u32 page = first >> JIT_PAGE_SHIFT; page <= last >> JIT_PAGE_SHIFT; page++)
+	{
+		jit_page_blocks[page].push_back(id);
+		jit_code_map[page] |= jit_line_mask(b, page);
+	}
+	return id;
+}
+
+static void jit_register_part(u32 head, u32 first, u32 last)
+{
+	u32 id = jit_register_block(jit_blocks[head].proc, NULL, 0, first, last, NULL, 0);
+	jit_blocks[id].gen = jit_blocks[head].gen;
+	jit_blocks[id].next_part = jit_blocks[head].next_part;
+	jit_blocks[head].next_part = id;
+}
+
+static void jit_drop_part(u32 id)
+{
+	JitBlock &b = jit_blocks[id];
+	if(b.entry && *b.entry == b.func)
+		*b.entry = 0;
+	if(b.profile != JIT_NO_PROFILE)
+	{
+		JitProfile &p = jit_profile[b.proc][b.profile];
+		if(p.live && p.block == id)
+			p.live = false;
+	}
+
+	for(u32 page = b.first >> JIT_PAGE_SHIFT; page <= b.last >> JIT_PAGE_SHIFT; page++)
+	{
+		std::vector<u32> &list = jit_page_blocks[page];
+		u32 mask = 0;
+		for(u32 k = 0; k < list.size(); )
+		{
+			if(list[k] == id)
+			{
+				list[k] = list.back();
+				list.pop_back();
+				continue;
+			}
+			mask |= jit_line_mask(jit_blocks[list[k]], page);
+			k++;
+		}
+		jit_code_map[page] = mask;
+	}
+
+	if(b.code)
+	{
+#ifdef HAVE_STATIC_CODE_BUFFER
+		// only the newest block can go back to the buffer right away, which covers code that keeps
+		// rewriting what it just ran; anything else is reclaimed when its generation is reused
+		if(b.gen == scratch_gen && b.code + b.size == scratchptr)
+			scratchptr = b.code;
+#else
+		jit_pending_free.push_back(b.code);
+#endif
+	}
+
+	b.live = false;
+	jit_free_blocks.push_back(id);
+}
+
+static void jit_drop_block(u32 id)
+{
+	u32 k = id;
+	do
+	{
+		u32 next = jit_blocks[k].next_part;
+		jit_drop_part(k);
+		k = next;
+	} while(k != id);
+}
+
+void arm_jit_invalidate(u32 slot, u32 count)
+{
+	u32 last = slot + count - 1;
+	std::vector<u32> &list = jit_page_blocks[slot >> JIT_PAGE_SHIFT];
+	// dropping a block swaps the tail of the list into its place, so walk it backwards.
+	// dropping a superblock can take more than one entry out of the list.
+	for(u32 k = list.size(); k-- > 0; )
+	{
+		if(k >= list.size())
+			continue;
+		u32 id = list[k];
+		if(jit_blocks[id].first <= last && slot <= jit_blocks[id].last)
+		{
+			arm_jit_stats[jit_blocks[id].proc].invalidated++;
+			jit_drop_block(id);
+		}
+	}
+}
+
+void arm_jit_invalidate_range(u32 slot, u32 count)
+{
+	u32 end = slot + count;
+	while(slot < end)
+	{
+		u32 page_end = std::min(end, ((slot >> JIT_PAGE_SHIFT) + 1) << JIT_PAGE_SHIFT);
+		u32 first = (slot >> JIT_LINE_SHIFT) & 31;
+		u32 last = ((page_end - 1) >> JIT_LINE_SHIFT) & 31;
+		u32 lines = ((2u << last) - 1) & ~((1u << first) - 1);
+		if(jit_code_map[slot >> JIT_PAGE_SHIFT] & lines)
+			arm_jit_invalidate(slot, page_end - slot);
+		slot = page_end;
+	}
+}
+
+static void jit_clear_blocks()
+{
+	for(u32 id = 0; id < jit_blocks.size(); id++)
+		if(jit_blocks[id].live)
+			jit_drop_block(id);
+	jit_blocks.clear();
+	jit_free_blocks.clear();
+	memset(recompile_counts, 0, sizeof(recompile_counts));
+	memset(jit_profile, 0, sizeof(jit_profile));
+#ifdef HAVE_STATIC_CODE_BUFFER
+	scratchptr = scratchpad;
+	scratch_gen = 0;
+#else
+	jit_free_pending();
+#endif
+}
+
+#ifdef HAVE_STATIC_CODE_BUFFER
+static void jit_evict_generation(u32 gen)
+{
+	scratch_gen = gen;
+	scratchptr = scratchpad + gen * GENERATION_SIZE;
+	for(u32 id = 0; id < jit_blocks.size(); id++)
+		if(jit_blocks[id].live && jit_blocks[id].gen == gen)
+		{
+			arm_jit_stats[jit_blocks[id].proc].evicted++;
+			jit_drop_block(id);
+		}
+	// addresses that were given up on get another chance once the code around them has turned over
+	memset(recompile_counts, 0, sizeof(recompile_counts));
+}
+
+// returns where code of the given size can go; the caller advances scratchptr by what it used
+static u8* jit_alloc_code(uintptr_t size)
+{
+	if(size > (uintptr_t)(scratchpad + (scratch_gen + 1) * GENERATION_SIZE - scratchptr))
+		jit_evict_generation((scratch_gen + 1) % JIT_GENERATIONS);
+	return scratchptr;
+}
+
+//-----------------------------------------------------------------------------
+//   Translation cache
+//-----------------------------------------------------------------------------
+// compiled blocks can be kept on disk per rom (CommonSettings.jit_cache_dir) so the next run
+// doesn't have to compile its hot set again. a block is stored with the relocations needed to
+// move it: the code only refers to itself, to functions (rel32 calls) and to statics, all of
+// which live in the same image as the scratchpad. while the cache is open the addresses of
+// statics are loaded from a pool after the block (emit_ptr) rather than from immediates, so
+// the relocations for them are exactly the pool entries. when a block is loaded elsewhere,
+// pointers into the image move with the image and calls are rebased on top of that.
+// a block is looked up by its start address and used only if the guest code there still
+// hashes the same. the index is read when the rom starts; block code is read on its first hit.
+// since blocks call into every part of the image, a cache is only good for the executable that
+// wrote it, and the fingerprint in its header is a crc of the whole executable file.
+
+#define JIT_CACHE_VERSION 2
+
+enum
+{
+	JIT_RELOC_IMAGE64,	// absolute address of a static
+	JIT_RELOC_CODE32,	// absolute address inside the block
+	JIT_RELOC_CODE64,
+	JIT_RELOC_CALL32,	// pc-relative call to a function
+};
+
+struct JitCacheReloc
+{
+	u32 offset;
+	u32 type;
+};
+
+struct JitCacheHeader
+{
+	char magic[8];
+	u32 version;
+	u32 fingerprint;	// crc of the executable that wrote it
+	u32 rom_crc;
+	u32 rom_size;
+	u32 settings;		// jit settings that change the generated code
+	u32 count;
+};
+
+struct JitCacheEntry
+{
+	u32 adr;
+	u8 proc;
+	u8 thumb;
+	u8 count;			// instructions in the block
+	u8 pad;
+	u32 guest_crc;
+	u32 code_size;
+	u32 reloc_count;
+	u64 image_base;		// scratchpad when the block was compiled
+	u64 code_adr;		// and where the block was
+	u64 data_offset;	// of code and relocations in the file
+};
+
+struct JitCacheRecord
+{
+	JitCacheEntry e;
+	std::vector<u8> data;	// code followed by relocations, empty until read from the file
+};
+
+static std::string jit_cache_path;
+static JitCacheHeader jit_cache_header;	// what the cache is for, taken when the rom starts
+static FILE *jit_cache_fp = NULL;
+static bool jit_cache_dirty = false;
+static std::map<u64, JitCacheRecord> jit_cache;
+static JitCacheRecord jit_cache_capture;
+static bool jit_cache_captured = false;
+
+// the statics the block being compiled loads the address of, see emit_ptr
+struct JitPtrConst
+{
+	Label label;
+	uintptr_t ptr;
+};
+static std::vector<JitPtrConst> jit_ptr_pool;
+
+static u64 jit_cache_key(int proc, bool thumb, u32 adr)
+{
+	return ((u64)proc << 33) | ((u64)thumb << 32) | adr;
+}
+
+static bool jit_in_image(u64 adr)
+{
+	return adr - ((uintptr_t)scratchpad - 0x80000000ULL) < 0x100000000ULL;
+}
+
+// crc of the running executable, false if it can't be read
+static bool jit_cache_fingerprint(u32 *fingerprint)
+{
+	static bool done = false, ok = false;
+	static u32 crc = 0;
+	if(done)
+	{
+		*fingerprint = crc;
+		return ok;
+	}
+	done = true;
+
+	std::string path;
+#if defined(_WINDOWS)
+	char *pgm = NULL;
+	if(_get_pgmptr(&pgm) == 0 && pgm)
+		path = pgm;
+#elif defined(__APPLE__)
+	char buf[4096];
+	uint32_t len = sizeof(buf);
+	if(_NSGetExecutablePath(buf, &len) == 0)
+		path = buf;
+#else
+	char buf[4096];
+	ssize_t len = readlink("/proc/self/exe", buf, sizeof(buf) - 1);
+	if(len > 0)
+		path.assign(buf, len);
+#endif
+	FILE *fp = path.empty() ? NULL : fopen(path.c_str(), "rb");
+	if(!fp)
+	{
+		printf("JIT: can't read the executable, not using the cache\n");
+		return false;
+	}
+	std::vector<u8> data(1 << 20);
+	size_t n;
+	crc = crc32(0, NULL, 0);
+	while((n = fread(&data[0], 1, data.size(), fp)) > 0)
+		crc = crc32(crc, &data[0], n);
+	ok = !ferror(fp);
+	fclose(fp);
+	*fingerprint = crc;
+	return ok;
+}
+
+static u32 jit_cache_settings()
+{
+	return CommonSettings.jit_max_block_size | (CommonSettings.jit_link_blocks << 8)
+		| (CommonSettings.rigorous_timing << 9) | (CommonSettings.advanced_timing << 10)
+		| ((_MMU_MAIN_MEM_MASK >> 22) << 11);	// the inline main memory accesses bake in its size
+}
+
+template<int PROCNUM>
+static u32 jit_guest_crc(u32 adr, bool thumb, u32 count)
+{
+	u32 crc = 0;
+	for(u32 i = 0; i < count; i++)
+	{
+		u32 opcode;
+		if(thumb)
+			opcode = _MMU_read16<PROCNUM, MMU_AT_CODE>(adr + i*2);
+		else
+			opcode = _MMU_read32<PROCNUM, MMU_AT_CODE>(adr + i*4);
+		crc = crc32(crc, (const Bytef*)&opcode, thumb ? 2 : 4);
+	}
+	return crc;
+}
+
+// called from the code generator with the block as it was placed in the scratchpad
+static void jit_cache_capture_code(Assembler *assembler, u8 *code, u32 size)
+{
+	jit_cache_captured = false;
+	// trampolines would hold absolute addresses of their own
+	if(size != assembler->getOffset())
+		return;
+
+	std::vector<JitCacheReloc> relocs;
+	for(size_t i = 0; i < assembler->_relocData.getLength(); i++)
+	{
+		const Assembler::RelocData &r = assembler->_relocData[i];
+		JitCacheReloc reloc = { (u32)r.offset, 0 };
+		switch(r.type)
+		{
+			case kRelocRelToAbs: reloc.type = (r.size == 8) ? JIT_RELOC_CODE64 : JIT_RELOC_CODE32; break;
+			case kRelocAbsToRel:
+			case kRelocTrampoline: reloc.type = JIT_RELOC_CALL32; break;
+			case kRelocAbsToAbs:
+				if(r.size != 8 || !jit_in_image((uintptr_t)r.address))
+					return;
+				reloc.type = JIT_RELOC_IMAGE64;
+				break;
+			default: return;
+		}
+		relocs.push_back(reloc);
+	}
+	// and the addresses of statics, which are all in the pool
+	for(size_t i = 0; i < jit_ptr_pool.size(); i++)
+	{
+		if(!jit_in_image(jit_ptr_pool[i].ptr))
+			return;
+		sysint_t offset = assembler->_labels[jit_ptr_pool[i].label.getId() & kOperandIdValueMask].offset;
+		if(offset < 0 || (u32)offset + 8 > size)
+			return;
+		JitCacheReloc reloc = { (u32)offset, JIT_RELOC_IMAGE64 };
+		relocs.push_back(reloc);
+	}
+
+	JitCacheEntry &e = jit_cache_capture.e;
+	memset(&e, 0, sizeof(e));
+	e.code_size = size;
+	e.reloc_count = relocs.size();
+	e.image_base = (uintptr_t)scratchpad;
+	e.code_adr = (uintptr_t)code;
+	jit_cache_capture.data.assign(code, code + size);
+	if(!relocs.empty())
+		jit_cache_capture.data.insert(jit_cache_capture.data.end(), (u8*)&relocs[0], (u8*)(&relocs[0] + relocs.size()));
+	jit_cache_captured = true;
+}
+
+template<int PROCNUM>
+static void jit_cache_store(u32 adr, bool thumb, u32 count)
+{
+	if(!jit_cache_captured)
+		return;
+	jit_cache_captured = false;
+	if(jit_cache_settings() != jit_cache_header.settings)
+		return;
+
+	JitCacheRecord &rec = jit_cache[jit_cache_key(PROCNUM, thumb, adr)];
+	rec.data.swap(jit_cache_capture.data);
+	rec.e = jit_cache_capture.e;
+	rec.e.adr = adr;
+	rec.e.proc = PROCNUM;
+	rec.e.thumb = thumb;
+	rec.e.count = count;
+	rec.e.guest_crc = jit_guest_crc<PROCNUM>(adr, thumb, count);
+	jit_cache_dirty = true;
+}
+
+static bool jit_cache_read(JitCacheRecord &rec)
+{
+	u32 len = rec.e.code_size + rec.e.reloc_count * sizeof(JitCacheReloc);
+	rec.data.resize(len);
+	if(!jit_cache_fp || fseek(jit_cache_fp, (long)rec.e.data_offset, SEEK_SET) != 0
+		|| fread(&rec.data[0], 1, len, jit_cache_fp) != len)
+	{
+		rec.data.clear();
+		return false;
+	}
+	return true;
+}
+
+// puts a cached copy of the block at adr in place, returns its length in instructions or 0 on a miss
+template<int PROCNUM>
+static u32 jit_cache_install(u32 adr, bool thumb)
+{
+	std::map<u64, JitCacheRecord>::iterator it = jit_cache.find(jit_cache_key(PROCNUM, thumb, adr));
+	if(it == jit_cache.end())
+		return 0;
+	JitCacheRecord &rec = it->second;
+	if(rec.e.guest_crc != jit_guest_crc<PROCNUM>(adr, thumb, rec.e.count))
+		return 0;
+	if(rec.data.empty() && !jit_cache_read(rec))
+	{
+		jit_cache.erase(it);
+		return 0;
+	}
+
+	u32 size = rec.e.code_size;
+	u8 *code = jit_alloc_code(size);
+	memcpy(code, &rec.data[0], size);
+	s64 image_delta = (s64)((uintptr_t)scratchpad - rec.e.image_base);
+	s64 code_delta = (s64)((uintptr_t)code - rec.e.code_adr);
+	const JitCacheReloc *relocs = (const JitCacheReloc*)&rec.data[size];
+	for(u32 i = 0; i < rec.e.reloc_count; i++)
+	{
+		u8 *p = code + relocs[i].offset;
+		switch(relocs[i].type)
+		{
+			case JIT_RELOC_IMAGE64: { u64 v; memcpy(&v, p, 8); v += image_delta; memcpy(p, &v, 8); break; }
+			case JIT_RELOC_CODE64: { u64 v; memcpy(&v, p, 8); v += code_delta; memcpy(p, &v, 8); break; }
+			case JIT_RELOC_CODE32: { u32 v; memcpy(&v, p, 4); v += (u32)code_delta; memcpy(p, &v, 4); break; }
+			case JIT_RELOC_CALL32:
+			{
+				s32 v; memcpy(&v, p, 4);
+				s64 rel = v + image_delta - code_delta;
+				if(rel != (s32)rel)
+					return 0;
+				v = (s32)rel;
+				memcpy(p, &v, 4);
+				break;
+			}
+		}
+	}
+	scratchptr += size;
+
+	uintptr_t *entry = &JIT_COMPILED_FUNC(adr, PROCNUM);
+	u32 first = entry - JIT_SLOT_BASE;
+	u32 last = &JIT_COMPILED_FUNC(adr + rec.e.count * (thumb ? 2 : 4) - 2, PROCNUM) - JIT_SLOT_BASE;
+	if(last < first)
+		last = first;
+	*entry = (uintptr_t)code;
+	jit_register_block(PROCNUM, entry, (uintptr_t)code, first, last, code, size);
+	arm_jit_stats[PROCNUM].cached++;
+	return rec.e.count;
+}
+
+static void jit_cache_close()
+{
+	if(jit_cache_fp)
+		fclose(jit_cache_fp);
+	jit_cache_fp = NULL;
+	jit_cache.clear();
+	jit_cache_path.clear();
+	jit_cache_dirty = false;
+	jit_cache_captured = false;
+}
+
+static void jit_cache_open(bool enable)
+{
+	jit_cache_close();
+	// profiled blocks count into whatever jit_profile slot they got in this run, so they aren't kept
+	if(!enable || !CommonSettings.jit_cache_dir[0] || !gameInfo.romsize || CommonSettings.jit_superblocks)
+		return;
+
+	char name[32];
+	sprintf(name, "/%08X.jitcache", gameInfo.crc);
+	jit_cache_path = std::string(CommonSettings.jit_cache_dir) + name;
+
+	JitCacheHeader &want = jit_cache_header;
+	memset(&want, 0, sizeof(want));
+	memcpy(want.magic, "DSMEJITC", 8);
+	want.version = JIT_CACHE_VERSION;
+	if(!jit_cache_fingerprint(&want.fingerprint))
+	{
+		jit_cache_path.clear();
+		return;
+	}
+	want.rom_crc = gameInfo.crc;
+	want.rom_size = gameInfo.romsize;
+	want.settings = jit_cache_settings();
+
+	jit_cache_fp = fopen(jit_cache_path.c_str(), "rb");
+	if(!jit_cache_fp)
+		return;
+
+	JitCacheHeader hdr;
+	if(fread(&hdr, sizeof(hdr), 1, jit_cache_fp) != 1 || memcmp(&hdr, &want, offsetof(JitCacheHeader, count)))
+	{
+		printf("JIT: ignoring stale cache %s\n", jit_cache_path.c_str());
+		fclose(jit_cache_fp);
+		jit_cache_fp = NULL;
+		return;
+	}
+	for(u32 i = 0; i < hdr.count; i++)
+	{
+		JitCacheRecord rec;
+		if(fread(&rec.e, sizeof(rec.e), 1, jit_cache_fp) != 1)
+			break;
+		jit_cache[jit_cache_key(rec.e.proc, rec.e.thumb != 0, rec.e.adr)] = rec;
+	}
+	printf("JIT: %u cached blocks in %s\n", (u32)jit_cache.size(), jit_cache_path.c_str());
+}
+
+static void jit_cache_save()
+{
+	if(!jit_cache_dirty || jit_cache_path.empty())
+		return;
+
+	// blocks that weren't used this run are still only in the old file
+	for(std::map<u64, JitCacheRecord>::iterator it = jit_cache.begin(); it != jit_cache.end(); )
+	{
+		if(it->second.data.empty() && !jit_cache_read(it->second))
+			jit_cache.erase(it++);
+		else
+			++it;
+	}
+	if(jit_cache_fp)
+		fclose(jit_cache_fp);
+	jit_cache_fp = NULL;
+
+	std::string tmp = jit_cache_path + ".tmp";
+	FILE *fp = fopen(tmp.c_str(), "wb");
+	if(!fp)
+	{
+		printf("JIT: can't write cache %s\n", tmp.c_str());
+		return;
+	}
+	JitCacheHeader hdr = jit_cache_header;
+	hdr.count = jit_cache.size();
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+
+	u64 offset = sizeof(hdr) + hdr.count * sizeof(JitCacheEntry);
+	std::map<u64, JitCacheRecord>::iterator it;
+	for(it = jit_cache.begin(); it != jit_cache.end(); ++it)
+	{
+		it->second.e.data_offset = offset;
+		offset += it->second.data.size();
+		fwrite(&it->second.e, sizeof(JitCacheEntry), 1, fp);
+	}
+	for(it = jit_cache.begin(); it != jit_cache.end(); ++it)
+		fwrite(&it->second.data[0], 1, it->second.data.size(), fp);
+	bool ok = !ferror(fp);
+	ok &= fclose(fp) == 0;
+	if(!ok || rename(tmp.c_str(), jit_cache_path.c_str()) != 0)
+	{
+		printf("JIT: can't write cache %s\n", jit_cache_path.c_str());
+		remove(tmp.c_str());
+		return;
+	}
+	jit_cache_dirty = false;
+}
 
 struct ASMJIT_API StaticCodeGenerator : public Context
 {
@@ -217,17 +916,12 @@ struct ASMJIT_API StaticCodeGenerator : public Context
 			*dest = NULL;
 			return kErrorNoFunction;
 		}
-		if(size > (uintptr_t)(scratchpad+sizeof(scratchpad)-scratchptr))
-		{
-			fprintf(stderr, "Out of memory for asmjit. Clearing code cache.\n");
-			arm_jit_reset(1);
-			// If arm_jit_reset didn't involve recompiling op_cmp, we could keep the current function.
-			*dest = NULL;
-			return kErrorOk;
-		}
-		void *p = scratchptr;
+		u8 *p = jit_alloc_code(size);
 		size = assembler->relocCode(p);
 		scratchptr += size;
+		scratch_size = size;
+		if(!jit_cache_path.empty())
+			jit_cache_capture_code(assembler, p, size);
 		*dest = p;
 		return kErrorOk;
 	}
@@ -242,6 +936,45 @@ static X86Compiler c;
 static void emit_branch(int cond, Label to);
 static void _armlog(u8 proc, u32 addr, u32 opcode);
 
+// loads the address of a static. while blocks are being cached it is read from the block's
+// pool, so the cache knows exactly where the block holds absolute pointers
+static void emit_ptr(const GpVar& dst, const volatile void *ptr)
+{
+#ifdef HAVE_STATIC_CODE_BUFFER
+	if(jit_cache_path.empty())
+#endif
+	{
+		c.mov(dst, (uintptr_t)ptr);
+		return;
+	}
+#ifdef HAVE_STATIC_CODE_BUFFER
+	size_t i = 0;
+	while(i < jit_ptr_pool.size() && jit_ptr_pool[i].ptr != (uintptr_t)ptr)
+		i++;
+	if(i == jit_ptr_pool.size())
+	{
+		JitPtrConst k = { c.newLabel(), (uintptr_t)ptr };
+		jit_ptr_pool.push_back(k);
+	}
+	c.mov(dst, sysint_ptr(jit_ptr_pool[i].label));
+#endif
+}
+
+// puts the pool after the end of the block
+static void emit_ptr_pool()
+{
+#ifdef HAVE_STATIC_CODE_BUFFER
+	if(jit_ptr_pool.empty())
+		return;
+	c.align(sizeof(uintptr_t));
+	for(size_t i = 0; i < jit_ptr_pool.size(); i++)
+	{
+		c.bind(jit_ptr_pool[i].label);
+		c.dintptr((intptr_t)jit_ptr_pool[i].ptr);
+	}
+#endif
+}
+
 static FileLogger logger(stderr);
 
 static int PROCNUM;
@@ -263,9 +996,6 @@ static u32 bb_constant_cycles;
 #define flags_ptr			cpu_ptr_byte(CPSR.val, 3)
 #define reg_ptr(x)			dword_ptr(bb_cpu, offsetof(armcpu_t, R) + 4*(x))
 #define reg_pos_ptr(x)		dword_ptr(bb_cpu, offsetof(armcpu_t, R) + 4*REG_POS(i,(x)))
-#define reg_pos_ptrL(x)		word_ptr( bb_cpu, offsetof(armcpu_t, R) + 4*REG_POS(i,(x)))
-#define reg_pos_ptrH(x)		word_ptr( bb_cpu, offsetof(armcpu_t, R) + 4*REG_POS(i,(x)) + 2)
-#define reg_pos_ptrB(x)		byte_ptr( bb_cpu, offsetof(armcpu_t, R) + 4*REG_POS(i,(x)))
 #define reg_pos_thumb(x)	dword_ptr(bb_cpu, offsetof(armcpu_t, R) + 4*((i>>(x))&0x7))
 #define reg_pos_thumbB(x)	byte_ptr(bb_cpu, offsetof(armcpu_t, R) + 4*((i>>(x))&0x7))
 #define cp15_ptr(x)			dword_ptr(bb_cp15, offsetof(armcp15_t, x))
@@ -277,6 +1007,126 @@ static u32 bb_constant_cycles;
 #define r64 r32
 #endif
 
+//-----------------------------------------------------------------------------
+//   Guest register cache
+//-----------------------------------------------------------------------------
+// a block keeps the guest registers it touches, and the flags byte of the CPSR (slot 16),
+// in host variables rather than going through cpu->R for every access: the first read
+// loads a register, writes only mark it dirty, and dirty registers are stored back when
+// the block exits and before anything that looks at cpu->R or the CPSR on its own.
+#define REG_FLAGS			16
+#define REG_ALL				0x1FFFF
+#define REG_BIT(x)			(1 << (x))
+
+enum { REG_MEM = 0, REG_CLEAN, REG_DIRTY };
+
+static GpVar bb_reg[17];
+static u8 bb_reg_state[17];
+
+static void reg_load(u32 n)
+{
+	if(n == REG_FLAGS)
+		c.movzx(bb_reg[n], flags_ptr);
+	else
+		c.mov(bb_reg[n], reg_ptr(n));
+}
+
+static void reg_store(u32 n)
+{
+	if(n == REG_FLAGS)
+		c.mov(flags_ptr, bb_reg[n].r8Lo());
+	else
+		c.mov(reg_ptr(n), bb_reg[n]);
+}
+
+static GpVar reg_read(u32 n)
+{
+	if(bb_reg_state[n] == REG_MEM)
+	{
+		bb_reg[n] = c.newGpVar(kX86VarTypeGpd);
+		reg_load(n);
+		bb_reg_state[n] = REG_CLEAN;
+	}
+	return bb_reg[n];
+}
+
+static GpVar reg_write(u32 n)
+{
+	if(bb_reg_state[n] == REG_MEM)
+		bb_reg[n] = c.newGpVar(kX86VarTypeGpd);
+	bb_reg_state[n] = REG_DIRTY;
+	return bb_reg[n];
+}
+
+static GpVar reg_rw(u32 n)
+{
+	reg_read(n);
+	bb_reg_state[n] = REG_DIRTY;
+	return bb_reg[n];
+}
+
+// store the dirty registers in mask; with drop, the next access reloads them, which is
+// what callees that switch register banks or read and write cpu->R themselves need
+static void reg_flush(u32 mask, bool drop)
+{
+	for(u32 n = 0; n < 17; n++)
+	{
+		if(!(mask & REG_BIT(n)) || bb_reg_state[n] == REG_MEM)
+			continue;
+		if(bb_reg_state[n] == REG_DIRTY)
+			reg_store(n);
+		bb_reg_state[n] = drop ? REG_MEM : REG_CLEAN;
+	}
+}
+
+// the registers in mask were overwritten in cpu->R, whatever was cached for them is stale
+static void reg_invalidate(u32 mask)
+{
+	for(u32 n = 0; n < 17; n++)
+		if(mask & REG_BIT(n))
+			bb_reg_state[n] = REG_MEM;
+}
+
+// a conditional instruction changed the cache in the code it skips: bring that path back
+// to what the skipping path has, so both agree on where each register lives at the label
+static void reg_merge(const GpVar *before_reg, const u8 *before_state)
+{
+	for(u32 n = 0; n < 17; n++)
+	{
+		u8 state = bb_reg_state[n];
+		if(before_state[n] == REG_MEM)
+		{
+			if(state == REG_DIRTY)
+				reg_store(n);
+			bb_reg_state[n] = REG_MEM;
+			continue;
+		}
+		if(state == REG_MEM)
+		{
+			bb_reg[n] = before_reg[n];
+			reg_load(n);
+		}
+		else if(bb_reg[n].getId() != before_reg[n].getId())
+		{
+			c.mov(before_reg[n], bb_reg[n]);
+			bb_reg[n] = before_reg[n];
+		}
+		bb_reg_state[n] = (before_state[n] == REG_DIRTY || state == REG_DIRTY) ? REG_DIRTY : REG_CLEAN;
+	}
+}
+
+#define reg_pos_r(x)		reg_read(REG_POS(i,(x)))
+#define reg_pos_w(x)		reg_write(REG_POS(i,(x)))
+#define reg_pos_rw(x)		reg_rw(REG_POS(i,(x)))
+#define reg_thumb_r(x)		reg_read(_REG_NUM(i,(x)))
+#define reg_thumb_w(x)		reg_write(_REG_NUM(i,(x)))
+#define reg_thumb_rw(x)		reg_rw(_REG_NUM(i,(x)))
+#define flags_r				reg_read(REG_FLAGS)
+#define flags_w				reg_write(REG_FLAGS)
+#define flags_rw			reg_rw(REG_FLAGS)
+#define reg_pos_halfL(dst, x)	c.movsx(dst, reg_pos_r(x).r16())
+#define reg_pos_halfH(dst, x)	{ GpVar half = c.newGpVar(kX86VarTypeGpd); c.mov(half, reg_pos_r(x)); c.shr(half, 16); c.movsx(dst, half.r16()); }
+
 // sequencer.reschedule = true;
 #define changeCPSR { \
 			X86CompilerFuncCall* ctxCPSR = c.call((void*)NDS_Reschedule); \
@@ -332,11 +1182,11 @@ static GpVar bb_profiler_entry;
 	c.lea(x, ptr(y.r64(), x.r64(), kScale2Times)); \
 	c.seto(y.r8Lo()); \
 	c.lea(x, ptr(y.r64(), x.r64(), kScale2Times)); \
-	c.movzx(y, flags_ptr); \
+	c.mov(y, flags_r); \
 	c.shl(x, 4); \
 	c.and_(y, 0xF); \
 	c.or_(x, y); \
-	c.mov(flags_ptr, x.r8Lo()); \
+	c.mov(flags_w, x); \
 	c.unuse(x); \
 	c.unuse(y); \
 	JIT_COMMENT("end SET_NZCV"); \
@@ -350,25 +1200,25 @@ static GpVar bb_profiler_entry;
 	c.setz(y.r8Lo()); \
 	c.lea(x, ptr(y.r64(), x.r64(), kScale2Times)); \
 	if (cf_change) { c.lea(x, ptr(rcf.r64(), x.r64(), kScale2Times)); c.unuse(rcf); } \
-	c.movzx(y, flags_ptr); \
+	c.mov(y, flags_r); \
 	c.shl(x, 6 - cf_change); \
 	c.and_(y, cf_change?0x1F:0x3F); \
 	c.or_(x, y); \
-	c.mov(flags_ptr, x.r8Lo()); \
+	c.mov(flags_w, x); \
 	JIT_COMMENT("end SET_NZC"); \
 }
 
 #define SET_NZC_SHIFTS_ZERO(cf) { \
 	JIT_COMMENT("SET_NZC_SHIFTS_ZERO"); \
-	c.and_(flags_ptr, 0x1F); \
+	c.and_(flags_rw, 0x1F); \
 	if(cf) \
 	{ \
 		c.shl(rcf, 5); \
 		c.or_(rcf, (1<<6)); \
-		c.or_(flags_ptr, rcf.r8Lo()); \
+		c.or_(flags_rw, rcf); \
 	} \
 	else \
-		c.or_(flags_ptr, (1<<6)); \
+		c.or_(flags_rw, (1<<6)); \
 	JIT_COMMENT("end SET_NZC_SHIFTS_ZERO"); \
 }
 
@@ -379,11 +1229,11 @@ static GpVar bb_profiler_entry;
 	c.sets(x.r8Lo()); \
 	c.setz(y.r8Lo()); \
 	c.lea(x, ptr(y.r64(), x.r64(), kScale2Times)); \
-	c.movzx(y, flags_ptr); \
+	c.mov(y.r32(), flags_r); \
 	c.and_(y, clear_cv?0x0F:0x3F); \
 	c.shl(x, 6); \
 	c.or_(x, y); \
-	c.mov(flags_ptr, x.r8Lo()); \
+	c.mov(flags_w, x.r32()); \
 	JIT_COMMENT("end SET_NZ"); \
 }
 
@@ -392,7 +1242,7 @@ static GpVar bb_profiler_entry;
 	GpVar x = c.newGpVar(kX86VarTypeGpz); \
 	c.seto(x.r8Lo()); \
 	c.shl(x, 3); \
-	c.or_(flags_ptr, x.r8Lo()); \
+	c.or_(flags_rw, x.r32()); \
 	JIT_COMMENT("end SET_Q"); \
 }
 
@@ -403,6 +1253,7 @@ static GpVar bb_profiler_entry;
 	c.mov(SPSR, cpu_ptr(SPSR.val)); \
 	c.mov(tmp, SPSR); \
 	c.and_(tmp, 0x1F); \
+	reg_flush(REG_ALL, true); \
 	X86CompilerFuncCall* ctx = c.call((void*)armcpu_switchMode); \
 	ctx->setPrototype(ASMJIT_CALL_CONV, FuncBuilder2<Void, void*, u8>()); \
 	ctx->setArgument(0, bb_cpu); \
@@ -411,7 +1262,7 @@ static GpVar bb_profiler_entry;
 	c.and_(SPSR, (1<<5)); \
 	c.shr(SPSR, 5); \
 	c.lea(tmp, ptr_abs((void*)0xFFFFFFFC, SPSR.r64(), kScale2Times)); \
-	c.and_(tmp, reg_ptr(15)); \
+	c.and_(tmp, reg_read(15)); \
 	c.mov(cpu_ptr(next_instruction), tmp); \
 	c.unuse(tmp); \
 	JIT_COMMENT("end S_DST_R15"); \
@@ -423,7 +1274,7 @@ static GpVar bb_profiler_entry;
 	bool rhs_is_imm = false; \
 	u32 imm = ((i>>7)&0x1F); \
     GpVar rhs = c.newGpVar(kX86VarTypeGpd); \
-	c.mov(rhs, reg_pos_ptr(0)); \
+	c.mov(rhs, reg_pos_r(0)); \
 	if(imm) c.shl(rhs, imm); \
 	u32 rhs_first = cpu->R[REG_POS(i,0)] << imm;
 
@@ -434,7 +1285,7 @@ static GpVar bb_profiler_entry;
 	GpVar rcf; \
 	GpVar rhs = c.newGpVar(kX86VarTypeGpd); \
 	u32 imm = ((i>>7)&0x1F); \
-	c.mov(rhs, reg_pos_ptr(0)); \
+	c.mov(rhs, reg_pos_r(0)); \
 	if (imm)  \
 	{ \
 		cf_change = 1; \
@@ -450,7 +1301,7 @@ static GpVar bb_profiler_entry;
 	GpVar rhs = c.newGpVar(kX86VarTypeGpd); \
 	if(imm) \
 	{ \
-		c.mov(rhs, reg_pos_ptr(0)); \
+		c.mov(rhs, reg_pos_r(0)); \
 		c.shr(rhs, imm); \
 	} \
 	else \
@@ -464,7 +1315,7 @@ static GpVar bb_profiler_entry;
 	GpVar rcf = c.newGpVar(kX86VarTypeGpd); \
 	GpVar rhs = c.newGpVar(kX86VarTypeGpd); \
 	u32 imm = ((i>>7)&0x1F); \
-	c.mov(rhs, reg_pos_ptr(0)); \
+	c.mov(rhs, reg_pos_r(0)); \
 	if (!imm) \
 	{ \
 		c.test(rhs, (1 << 31)); \
@@ -482,7 +1333,7 @@ static GpVar bb_profiler_entry;
 	bool rhs_is_imm = false; \
 	u32 imm = ((i>>7)&0x1F); \
 	GpVar rhs = c.newGpVar(kX86VarTypeGpd); \
-	c.mov(rhs, reg_pos_ptr(0)); \
+	c.mov(rhs, reg_pos_r(0)); \
 	if(!imm) imm = 31; \
 	c.sar(rhs, imm); \
 	u32 rhs_first = (s32)cpu->R[REG_POS(i,0)] >> imm;
@@ -494,7 +1345,7 @@ static GpVar bb_profiler_entry;
 	GpVar rcf = c.newGpVar(kX86VarTypeGpd); \
 	GpVar rhs = c.newGpVar(kX86VarTypeGpd); \
 	u32 imm = ((i>>7)&0x1F); \
-	c.mov(rhs, reg_pos_ptr(0)); \
+	c.mov(rhs, reg_pos_r(0)); \
 	if (!imm) imm = 31; \
 	c.sar(rhs, imm); \
 	imm==31?c.sets(rcf.r8Lo()):c.setc(rcf.r8Lo());
@@ -504,10 +1355,10 @@ static GpVar bb_profiler_entry;
 	bool rhs_is_imm = false; \
 	u32 imm = ((i>>7)&0x1F); \
 	GpVar rhs = c.newGpVar(kX86VarTypeGpd); \
-	c.mov(rhs, reg_pos_ptr(0)); \
+	c.mov(rhs, reg_pos_r(0)); \
 	if (!imm) \
 	{ \
-		c.bt(flags_ptr, 5); \
+		c.bt(flags_r, 5); \
 		c.rcr(rhs, 1); \
 	} \
 	else \
@@ -521,10 +1372,10 @@ static GpVar bb_profiler_entry;
 	GpVar rcf = c.newGpVar(kX86VarTypeGpd); \
 	GpVar rhs = c.newGpVar(kX86VarTypeGpd); \
 	u32 imm = ((i>>7)&0x1F); \
-	c.mov(rhs, reg_pos_ptr(0)); \
+	c.mov(rhs, reg_pos_r(0)); \
 	if (!imm) \
 	{ \
-		c.bt(flags_ptr, 5); \
+		c.bt(flags_r, 5); \
 		c.rcr(rhs, 1); \
 	} \
 	else \
@@ -534,7 +1385,8 @@ static GpVar bb_profiler_entry;
 #define REG_OFF \
 	JIT_COMMENT("REG_OFF"); \
 	bool rhs_is_imm = false; \
-	Mem rhs = reg_pos_ptr(0); \
+	GpVar rhs = c.newGpVar(kX86VarTypeGpd); \
+	c.mov(rhs, reg_pos_r(0)); \
 	u32 rhs_first = cpu->R[REG_POS(i,0)];
 
 #define IMM_VAL \
@@ -578,8 +1430,8 @@ static GpVar bb_profiler_entry;
 	GpVar tmp = c.newGpVar(kX86VarTypeGpz); \
 	if(sign) c.mov(tmp, 31); \
 	else c.mov(tmp, 0); \
-	c.movzx(imm, reg_pos_ptrB(8)); \
-	c.mov(rhs, reg_pos_ptr(0)); \
+	c.movzx(imm, reg_pos_r(8).r8Lo()); \
+	c.mov(rhs, reg_pos_r(0)); \
 	c.cmp(imm, 31); \
 	if(sign) c.cmovg(imm, tmp); \
 	else c.cmovg(rhs, tmp); \
@@ -596,8 +1448,9 @@ static GpVar bb_profiler_entry;
 	Label __zero = c.newLabel(); \
 	Label __lt32 = c.newLabel(); \
 	Label __done = c.newLabel(); \
-	c.mov(imm, reg_pos_ptr(8)); \
-	c.mov(rhs, reg_pos_ptr(0)); \
+	GpVar flags = flags_r; \
+	c.mov(imm.r32(), reg_pos_r(8)); \
+	c.mov(rhs, reg_pos_r(0)); \
 	c.and_(imm, 0xFF); \
 	c.jz(__zero); \
 	c.cmp(imm, 32); \
@@ -619,7 +1472,7 @@ static GpVar bb_profiler_entry;
 	c.jmp(__done); \
 	/* imm == 0 */ \
 	c.bind(__zero); \
-	c.test(flags_ptr, (1 << 5)); \
+	c.test(flags, (1 << 5)); \
 	c.setnz(rcf.r8Lo()); \
 	c.jmp(__done); \
 	/* imm < 32 */ \
@@ -641,8 +1494,8 @@ static GpVar bb_profiler_entry;
 	bool rhs_is_imm = false; \
 	GpVar rhs = c.newGpVar(kX86VarTypeGpd); \
 	GpVar imm = c.newGpVar(kX86VarTypeGpz); \
-	c.mov(rhs, reg_pos_ptr(0)); \
-	c.mov(imm, reg_pos_ptrB(8)); \
+	c.mov(rhs, reg_pos_r(0)); \
+	c.movzx(imm, reg_pos_r(8).r8Lo()); \
 	c.ror(rhs, imm.r8Lo());
 
 #define S_ROR_REG \
@@ -655,8 +1508,9 @@ static GpVar bb_profiler_entry;
 	Label __zero = c.newLabel(); \
 	Label __zero_1F = c.newLabel(); \
 	Label __done = c.newLabel(); \
-	c.mov(imm, reg_pos_ptr(8)); \
-	c.mov(rhs, reg_pos_ptr(0)); \
+	GpVar flags = flags_r; \
+	c.mov(imm.r32(), reg_pos_r(8)); \
+	c.mov(rhs, reg_pos_r(0)); \
 	c.and_(imm, 0xFF); \
 	c.jz(__zero);\
 	c.and_(imm, 0x1F); \
@@ -672,7 +1526,7 @@ static GpVar bb_profiler_entry;
 	c.jmp(__done); \
 	/* imm == 0 */ \
 	c.bind(__zero); \
-	c.test(flags_ptr, (1 << 5)); \
+	c.test(flags, (1 << 5)); \
 	c.setnz(rcf.r8Lo()); \
 	/* done */ \
 	c.bind(__done);
@@ -701,17 +1555,17 @@ static void emit_MMU_aluMemCycles(int alu_cycles, GpVar mem_cycles, int populati
     arg; \
 	GpVar lhs = c.newGpVar(kX86VarTypeGpd); \
 	if(REG_POS(i,12) == REG_POS(i,16)) \
-		c.x86inst(reg_pos_ptr(12), rhs); \
+		c.x86inst(reg_pos_rw(12), rhs); \
 	else if(symmetric && !rhs_is_imm) \
 	{ \
-		c.x86inst(*(GpVar*)&rhs, reg_pos_ptr(16)); \
-		c.mov(reg_pos_ptr(12), rhs); \
+		c.x86inst(*(GpVar*)&rhs, reg_pos_r(16)); \
+		c.mov(reg_pos_w(12), rhs); \
 	} \
 	else \
 	{ \
-		c.mov(lhs, reg_pos_ptr(16)); \
+		c.mov(lhs, reg_pos_r(16)); \
 		c.x86inst(lhs, rhs); \
-		c.mov(reg_pos_ptr(12), lhs); \
+		c.mov(reg_pos_w(12), lhs); \
 	} \
 	if(flags) \
 	{ \
@@ -728,7 +1582,7 @@ static void emit_MMU_aluMemCycles(int alu_cycles, GpVar mem_cycles, int populati
 		if(REG_POS(i,12)==15) \
 		{ \
 			GpVar tmp = c.newGpVar(kX86VarTypeGpd); \
-			c.mov(tmp, reg_ptr(15)); \
+			c.mov(tmp, reg_read(15)); \
 			c.mov(cpu_ptr(next_instruction), tmp); \
 			c.add(bb_total_cycles, 2); \
 		} \
@@ -739,8 +1593,8 @@ static void emit_MMU_aluMemCycles(int alu_cycles, GpVar mem_cycles, int populati
     arg; \
 	GpVar lhs = c.newGpVar(kX86VarTypeGpd); \
 	c.mov(lhs, rhs); \
-	c.x86inst(lhs, reg_pos_ptr(16)); \
-	c.mov(reg_pos_ptr(12), lhs); \
+	c.x86inst(lhs, reg_pos_r(16)); \
+	c.mov(reg_pos_w(12), lhs); \
 	if(flags) \
 	{ \
 		if(REG_POS(i,12)==15) \
@@ -765,18 +1619,18 @@ static void emit_MMU_aluMemCycles(int alu_cycles, GpVar mem_cycles, int populati
 #define OP_ARITHMETIC_S(arg, x86inst, symmetric) \
     arg; \
 	if(REG_POS(i,12) == REG_POS(i,16)) \
-		c.x86inst(reg_pos_ptr(12), rhs); \
+		c.x86inst(reg_pos_rw(12), rhs); \
 	else if(symmetric && !rhs_is_imm) \
 	{ \
-		c.x86inst(*(GpVar*)&rhs, reg_pos_ptr(16)); \
-		c.mov(reg_pos_ptr(12), rhs); \
+		c.x86inst(*(GpVar*)&rhs, reg_pos_r(16)); \
+		c.mov(reg_pos_w(12), rhs); \
 	} \
 	else \
 	{ \
 		GpVar lhs = c.newGpVar(kX86VarTypeGpd); \
-		c.mov(lhs, reg_pos_ptr(16)); \
+		c.mov(lhs, reg_pos_r(16)); \
 		c.x86inst(lhs, rhs); \
-		c.mov(reg_pos_ptr(12), lhs); \
+		c.mov(reg_pos_w(12), lhs); \
 	} \
 	if(REG_POS(i,12)==15) \
 	{ \
@@ -788,7 +1642,7 @@ static void emit_MMU_aluMemCycles(int alu_cycles, GpVar mem_cycles, int populati
 	return 1;
 
 #define GET_CARRY(invert) { \
-	c.bt(flags_ptr, 5); \
+	c.bt(flags_r, 5); \
 	if (invert) c.cmc(); }
 
 static int OP_AND_LSL_IMM(const u32 i) { OP_ARITHMETIC(LSL_IMM, and_, 1, 0); }
@@ -997,7 +1851,7 @@ static int OP_BIC_S_IMM_VAL(const u32 i) { OP_ARITHMETIC_S(S_IMM_VAL; rhs = ~rhs
 //-----------------------------------------------------------------------------
 #define OP_TST_(arg) \
 	arg; \
-	c.test(reg_pos_ptr(16), rhs); \
+	c.test(reg_pos_r(16), rhs); \
 	SET_NZC; \
 	return 1;
 
@@ -1017,12 +1871,12 @@ static int OP_TST_IMM_VAL(const u32 i) { OP_TST_(S_IMM_VAL); }
 #define OP_TEQ_(arg) \
 	arg; \
 	if (!rhs_is_imm) \
-		c.xor_(*(GpVar*)&rhs, reg_pos_ptr(16)); \
+		c.xor_(*(GpVar*)&rhs, reg_pos_r(16)); \
 	else \
 	{ \
 		GpVar x = c.newGpVar(kX86VarTypeGpd); \
 		c.mov(x, rhs); \
-		c.xor_(x, reg_pos_ptr(16)); \
+		c.xor_(x, reg_pos_r(16)); \
 	} \
 	SET_NZC; \
 	return 1;
@@ -1042,7 +1896,7 @@ static int OP_TEQ_IMM_VAL(const u32 i) { OP_TEQ_(S_IMM_VAL); }
 //-----------------------------------------------------------------------------
 #define OP_CMP(arg) \
 	arg; \
-	c.cmp(reg_pos_ptr(16), rhs); \
+	c.cmp(reg_pos_r(16), rhs); \
 	SET_NZCV(1); \
 	return 1;
 
@@ -1065,11 +1919,11 @@ static int OP_CMP_IMM_VAL(const u32 i) { OP_CMP(IMM_VAL); }
 	u32 rhs_imm = *(u32*)&rhs; \
 	int sign = rhs_is_imm && (rhs_imm != -rhs_imm); \
 	if(sign) \
-		c.cmp(reg_pos_ptr(16), -rhs_imm); \
+		c.cmp(reg_pos_r(16), -rhs_imm); \
 	else \
 	{ \
 		GpVar lhs = c.newGpVar(kX86VarTypeGpd); \
-		c.mov(lhs, reg_pos_ptr(16)); \
+		c.mov(lhs, reg_pos_r(16)); \
 		c.add(lhs, rhs); \
 	} \
 	SET_NZCV(sign); \
@@ -1091,7 +1945,7 @@ static int OP_CMN_IMM_VAL(const u32 i) { OP_CMN(IMM_VAL); }
 //-----------------------------------------------------------------------------
 #define OP_MOV(arg) \
     arg; \
-	c.mov(reg_pos_ptr(12), rhs); \
+	c.mov(reg_pos_w(12), rhs); \
 	if(REG_POS(i,12)==15) \
 	{ \
 		c.mov(cpu_ptr(next_instruction), rhs); \
@@ -1111,7 +1965,7 @@ static int OP_MOV_IMM_VAL(const u32 i) { OP_MOV(IMM_VAL); }
 
 #define OP_MOV_S(arg) \
     arg; \
-	c.mov(reg_pos_ptr(12), rhs); \
+	c.mov(reg_pos_w(12), rhs); \
 	if(REG_POS(i,12)==15) \
 	{ \
 		S_DST_R15; \
@@ -1121,7 +1975,7 @@ static int OP_MOV_IMM_VAL(const u32 i) { OP_MOV(IMM_VAL); }
 	if(!rhs_is_imm) \
 		c.cmp(*(GpVar*)&rhs, 0); \
 	else \
-		c.cmp(reg_pos_ptr(12), 0); \
+		c.cmp(reg_pos_r(12), 0); \
 	SET_NZC; \
     return 1;
 
@@ -1194,35 +2048,35 @@ static void MUL_Mxx_END(GpVar x, bool sign, int cycles)
 		hi = c.newGpVar(kX86VarTypeGpd); \
 		c.xor_(hi, hi); \
 	} \
-	c.mov(lhs, reg_pos_ptr(0)); \
-	c.mov(rhs, reg_pos_ptr(8)); \
+	c.mov(lhs, reg_pos_r(0)); \
+	c.mov(rhs, reg_pos_r(8)); \
 	op; \
 	if(width && accum) \
 	{ \
 		if(flags) \
 		{ \
-			c.add(lhs, reg_pos_ptr(12)); \
-			c.adc(hi, reg_pos_ptr(16)); \
-			c.mov(reg_pos_ptr(12), lhs); \
-			c.mov(reg_pos_ptr(16), hi); \
+			c.add(lhs, reg_pos_r(12)); \
+			c.adc(hi, reg_pos_r(16)); \
+			c.mov(reg_pos_w(12), lhs); \
+			c.mov(reg_pos_w(16), hi); \
 			c.cmp(hi, lhs); SET_NZ(0); \
 		} \
 		else \
 		{ \
-			c.add(reg_pos_ptr(12), lhs); \
-			c.adc(reg_pos_ptr(16), hi); \
+			c.add(reg_pos_rw(12), lhs); \
+			c.adc(reg_pos_rw(16), hi); \
 		} \
 	} \
 	else if(width) \
 	{ \
-		c.mov(reg_pos_ptr(12), lhs); \
-		c.mov(reg_pos_ptr(16), hi); \
+		c.mov(reg_pos_w(12), lhs); \
+		c.mov(reg_pos_w(16), hi); \
 		if(flags) { c.cmp(hi, lhs); SET_NZ(0); } \
 	} \
 	else \
 	{ \
-		if(accum) c.add(lhs, reg_pos_ptr(12)); \
-		c.mov(reg_pos_ptr(16), lhs); \
+		if(accum) c.add(lhs, reg_pos_r(12)); \
+		c.mov(reg_pos_w(16), lhs); \
 		if(flags) { c.cmp(lhs, 0); SET_NZ(0); }\
 	} \
 	MUL_Mxx_END(rhs, sign, 1+width+accum); \
@@ -1246,8 +2100,8 @@ static int OP_SMLAL_S(const u32 i) { OP_MUL_(c.imul(hi,lhs,rhs), 1, 1, 1, 1); }
 	GpVar lhs = c.newGpVar(kX86VarTypeGpd); \
 	GpVar rhs = c.newGpVar(kX86VarTypeGpd); \
 	GpVar hi; \
-	c.movsx(lhs, reg_pos_ptr##x(0)); \
-	c.movsx(rhs, reg_pos_ptr##y(8)); \
+	reg_pos_half##x(lhs, 0); \
+	reg_pos_half##y(rhs, 8); \
 	if (width) \
 	{ \
 		hi = c.newGpVar(kX86VarTypeGpd); \
@@ -1257,29 +2111,29 @@ static int OP_SMLAL_S(const u32 i) { OP_MUL_(c.imul(hi,lhs,rhs), 1, 1, 1, 1); }
 	{ \
 		if(flags) \
 		{ \
-			c.add(lhs, reg_pos_ptr(12)); \
-			c.adc(hi, reg_pos_ptr(16)); \
-			c.mov(reg_pos_ptr(12), lhs); \
-			c.mov(reg_pos_ptr(16), hi); \
+			c.add(lhs, reg_pos_r(12)); \
+			c.adc(hi, reg_pos_r(16)); \
+			c.mov(reg_pos_w(12), lhs); \
+			c.mov(reg_pos_w(16), hi); \
 			SET_Q; \
 		} \
 		else \
 		{ \
-			c.add(reg_pos_ptr(12), lhs); \
-			c.adc(reg_pos_ptr(16), hi); \
+			c.add(reg_pos_rw(12), lhs); \
+			c.adc(reg_pos_rw(16), hi); \
 		} \
 	} \
 	else \
 	if(width) \
 	{ \
-		c.mov(reg_pos_ptr(12), lhs); \
-		c.mov(reg_pos_ptr(16), hi); \
+		c.mov(reg_pos_w(12), lhs); \
+		c.mov(reg_pos_w(16), hi); \
 		if(flags) { SET_Q; }\
 	} \
 	else \
 	{ \
-		if (accum) c.add(lhs, reg_pos_ptr(12));  \
-		c.mov(reg_pos_ptr(16), lhs); \
+		if (accum) c.add(lhs, reg_pos_r(12));  \
+		c.mov(reg_pos_w(16), lhs); \
 		if(flags) { SET_Q; }\
 	} \
 	return 1;
@@ -1316,12 +2170,12 @@ static int OP_SMLAL_T_T(const u32 i) { OP_MULxy_(c.imul(hi,lhs,rhs), H, H, 1, 1,
 #define OP_SMxxW_(x, accum, flags) \
 	GpVar lhs = c.newGpVar(kX86VarTypeGpz); \
 	GpVar rhs = c.newGpVar(kX86VarTypeGpz); \
-	c.movsx(lhs, reg_pos_ptr##x(8)); \
-	c.movsxd(rhs, reg_pos_ptr(0)); \
+	reg_pos_half##x(lhs, 8); \
+	c.movsxd(rhs, reg_pos_r(0)); \
 	c.imul(lhs, rhs);  \
 	c.sar(lhs, 16); \
-	if (accum) c.add(lhs, reg_pos_ptr(12)); \
-	c.mov(reg_pos_ptr(16), lhs.r32()); \
+	if (accum) c.add(lhs, reg_pos_r(12)); \
+	c.mov(reg_pos_w(16), lhs.r32()); \
 	if (flags) { SET_Q; } \
 	return 1;
 #else
@@ -1330,13 +2184,13 @@ static int OP_SMLAL_T_T(const u32 i) { OP_MULxy_(c.imul(hi,lhs,rhs), H, H, 1, 1,
 	GpVar lhs = c.newGpVar(kX86VarTypeGpd); \
 	GpVar hi = c.newGpVar(kX86VarTypeGpd); \
 	c.xor_(hi, hi); \
-	c.movsx(lhs, reg_pos_ptr##x(8)); \
-	c.mov(rhs, reg_pos_ptr(0)); \
+	reg_pos_half##x(lhs, 8); \
+	c.mov(rhs, reg_pos_r(0)); \
 	c.imul(hi, lhs, rhs); \
 	c.mov(lhs.r16(), hi.r16()); \
 	c.ror(lhs, 16); \
-	if (accum) c.add(lhs, reg_pos_ptr(12)); \
-	c.mov(reg_pos_ptr(16), lhs); \
+	if (accum) c.add(lhs, reg_pos_r(12)); \
+	c.mov(reg_pos_w(16), lhs); \
 	if (flags) { SET_Q; } \
 	return 1;
 #endif
@@ -1352,8 +2206,9 @@ static int OP_SMLAW_T(const u32 i) { OP_SMxxW_(H, 1, 1); }
 static int OP_MRS_CPSR(const u32 i)
 {
 	GpVar x = c.newGpVar(kX86VarTypeGpd);
+	reg_flush(REG_BIT(REG_FLAGS), false);
 	c.mov(x, cpu_ptr(CPSR));
-	c.mov(reg_pos_ptr(12), x);
+	c.mov(reg_pos_w(12), x);
 	return 1;
 }
 
@@ -1361,7 +2216,7 @@ static int OP_MRS_SPSR(const u32 i)
 {
 	GpVar x = c.newGpVar(kX86VarTypeGpd);
 	c.mov(x, cpu_ptr(SPSR));
-	c.mov(reg_pos_ptr(12), x);
+	c.mov(reg_pos_w(12), x);
 	return 1;
 }
 
@@ -1370,6 +2225,7 @@ static int OP_MRS_SPSR(const u32 i)
 	GpVar operand = c.newGpVar(kX86VarTypeGpd); \
 	args; \
 	c.mov(operand, rhs); \
+	reg_flush(REG_ALL, true); \
 	switch (((i>>16) & 0xF)) \
 	{ \
 		case 0x1:		/* bit 16 */ \
@@ -1565,13 +2421,244 @@ static const OpLDR LDRB_tab[2][5]  = { T(OP_LDRB) };
 static const OpLDR LDRSB_tab[2][5]  = { T(OP_LDRSB) };
 #undef T
 
+typedef u32 (FASTCALL* OpSTR)(u32, u32);
+
+// the same region guess also decides whether an access is done inline, straight on the host
+// arrays behind a check that the address still lands there: loads and stores to main memory and
+// the arm9's DTCM, and only loads from the arm7's work ram (shared wram only for the WRAMCNT it
+// was compiled under), since classify_adr never picks those regions for a store.
+// stores to main memory also check the code map, and take the slow path when they would
+// have to invalidate compiled code. everything else (ITCM, arm7 wram stores, I/O, VRAM, ...)
+// calls the helpers.
+#define FASTMEM_LDR		32, false
+#define FASTMEM_LDRH	16, false
+#define FASTMEM_LDRSH	16, true
+#define FASTMEM_LDRB	8, false
+#define FASTMEM_LDRSB	8, true
+#define FASTMEM_STR		32
+#define FASTMEM_STRH	16
+#define FASTMEM_STRB	8
+
+template<int P, int SIZE, MMU_ACCESS_DIRECTION DIR>
+static u32 fastmem_cycles(u32 adr)
+{
+	return MMU_aluMemCycles<P>(DIR == MMU_AD_READ ? 3 : 2, _MMU_accesstime<P,MMU_AT_DATA,SIZE,DIR,false>(adr, true));
+}
+
+template<int P, MMU_ACCESS_DIRECTION DIR>
+static u32 fastmem_cycles(int size, u32 adr)
+{
+	if(size == 32) return fastmem_cycles<P,32,DIR>(adr);
+	if(size == 16) return fastmem_cycles<P,16,DIR>(adr);
+	return fastmem_cycles<P,8,DIR>(adr);
+}
+
+// emits the region check for an access of the given memtype, jumping to slow when it fails,
+// and leaves the host address in host. returns false if the access has no inline path.
+static bool emit_fastmem(u32 memtype, int size, bool store, GpVar adr, GpVar host, Label slow)
+{
+#ifdef JIT_FASTMEM
+	u32 align = ~(u32)(size/8 - 1);
+	u8 *base = NULL;
+	u32 mask = 0;
+	u32 region = 0;
+
+	if(USE_TIMING())
+		return false;
+	switch(memtype)
+	{
+		case MEMTYPE_MAIN:
+			base = MMU.MAIN_MEM;
+			mask = _MMU_MAIN_MEM_MASK;
+			break;
+		case MEMTYPE_DTCM:
+			base = MMU.ARM9_DTCM;
+			mask = 0x3FFF;
+			region = MMU.DTCMRegion;
+			break;
+		case MEMTYPE_ERAM:
+			base = MMU.ARM7_ERAM;
+			mask = 0xFFFF;
+			break;
+		case MEMTYPE_SWIRAM:
+			region = MMU.WRAMCNT;
+			base = region == 0 ? MMU.ARM7_ERAM : region == 2 ? MMU.SWIRAM + 0x4000 : MMU.SWIRAM;
+			mask = region == 0 ? 0xFFFF : region == 3 ? 0x7FFF : 0x3FFF;
+			break;
+		default:
+			return false;
+	}
+
+	JIT_COMMENT("fastmem: %s", memtype == MEMTYPE_MAIN ? "main" : memtype == MEMTYPE_DTCM ? "dtcm" : "wram");
+	GpVar t = c.newGpVar(kX86VarTypeGpz);
+	emit_ptr(host, &CommonSettings.advanced_timing);
+	c.cmp(byte_ptr(host), 0);
+	c.jne(slow);
+	c.mov(t.r32(), adr);
+	switch(memtype)
+	{
+		case MEMTYPE_MAIN:
+			c.and_(t.r32(), 0x0F000000);
+			c.cmp(t.r32(), 0x02000000);
+			c.jne(slow);
+			if(PROCNUM == ARMCPU_ARM9)
+			{
+				// DTCM is mapped over main memory
+				c.mov(t.r32(), adr);
+				c.and_(t.r32(), ~0x3FFF);
+				emit_ptr(host, &MMU.DTCMRegion);
+				c.cmp(t.r32(), dword_ptr(host));
+				c.je(slow);
+			}
+			if(store)
+			{
+				// same test as JIT_INVALIDATE, on the line index of the code map
+#ifdef MAPPED_JIT_FUNCS
+				u32 slot_mask = _MMU_MAIN_MEM_MASK;
+#else
+				u32 slot_mask = 0x07FFFFFE;
+#endif
+				u32 line_base = (u32)(&JIT_COMPILED_FUNC_KNOWNBANK(0, MAIN_MEM, slot_mask, 0) - JIT_SLOT_BASE) >> JIT_LINE_SHIFT;
+				GpVar w = c.newGpVar(kX86VarTypeGpz);
+				c.mov(t.r32(), adr);
+				c.and_(t.r32(), slot_mask & align);
+				c.shr(t.r32(), 1 + JIT_LINE_SHIFT);
+				if(line_base)
+					c.add(t.r32(), line_base);
+				c.mov(w, t);
+				c.shr(w, 5);
+				emit_ptr(host, jit_code_map);
+				c.mov(w.r32(), dword_ptr(host, w, 2));
+				c.bt(w.r32(), t.r32());
+				c.jc(slow);
+				c.unuse(w);
+
+				// flag the page for incremental savestates, as MMU_MAIN_MEM_dirty does
+				Label clean = c.newLabel();
+				emit_ptr(host, &MMU_dirty_tracking);
+				c.cmp(byte_ptr(host), 0);
+				c.je(clean);
+				c.mov(t.r32(), adr);
+				c.and_(t.r32(), _MMU_MAIN_MEM_MASK);
+				c.shr(t.r32(), MMU_DIRTY_PAGE_SHIFT);
+				emit_ptr(host, MMU_dirty_pages);
+				c.bts(dword_ptr(host), t.r32());
+				c.bind(clean);
+			}
+			break;
+		case MEMTYPE_DTCM:
+			c.and_(t.r32(), ~0x3FFF);
+			c.cmp(t.r32(), region);
+			c.jne(slow);
+			emit_ptr(host, &MMU.DTCMRegion);
+			c.cmp(dword_ptr(host), region);
+			c.jne(slow);
+			break;
+		case MEMTYPE_ERAM:
+			c.and_(t.r32(), 0xFF800000);
+			c.cmp(t.r32(), 0x03800000);
+			c.jne(slow);
+			break;
+		case MEMTYPE_SWIRAM:
+			c.and_(t.r32(), 0xFF800000);
+			c.cmp(t.r32(), 0x03000000);
+			c.jne(slow);
+			emit_ptr(host, &MMU.WRAMCNT);
+			c.cmp(byte_ptr(host), region);
+			c.jne(slow);
+			break;
+	}
+	c.mov(t.r32(), adr);
+	c.and_(t.r32(), mask & align);
+	emit_ptr(host, base);
+	c.add(host, t);
+	c.unuse(t);
+	return true;
+#else
+	return false;
+#endif
+}
+
+static void emit_load(const OpLDR *tab, int size, bool sign, u32 adr_first, GpVar adr, GpVar dst)
+{
+	u32 memtype = classify_adr(adr_first, 0);
+	Label slow = c.newLabel();
+	Label done = c.newLabel();
+	GpVar host = c.newGpVar(kX86VarTypeGpz);
+	bool fast = emit_fastmem(memtype, size, false, adr, host, slow);
+	if(fast)
+	{
+		GpVar data = c.newGpVar(kX86VarTypeGpd);
+		if(size == 32)
+		{
+			// misaligned words are rotated, like OP_LDR does
+			GpVar rot = c.newGpVar(kX86VarTypeGpd);
+			c.mov(data, dword_ptr(host));
+			c.mov(rot, adr);
+			c.and_(rot, 3);
+			c.shl(rot, 3);
+			c.ror(data, rot.r8Lo());
+			c.unuse(rot);
+		}
+		else if(size == 16)
+		{
+			if(sign) c.movsx(data, word_ptr(host));
+			else c.movzx(data, word_ptr(host));
+		}
+		else
+		{
+			if(sign) c.movsx(data, byte_ptr(host));
+			else c.movzx(data, byte_ptr(host));
+		}
+		c.mov(dword_ptr(dst), data);
+		c.unuse(data);
+		c.mov(bb_cycles, PROCNUM ? fastmem_cycles<1,MMU_AD_READ>(size, adr_first) : fastmem_cycles<0,MMU_AD_READ>(size, adr_first));
+		c.jmp(done);
+		c.bind(slow);
+	}
+	c.unuse(host);
+	X86CompilerFuncCall *ctx = c.call((void*)tab[memtype]);
+	ctx->setPrototype(ASMJIT_CALL_CONV, FuncBuilder2<u32, u32, u32*>());
+	ctx->setArgument(0, adr);
+	ctx->setArgument(1, dst);
+	ctx->setReturn(bb_cycles);
+	if(fast)
+		c.bind(done);
+}
+
+static void emit_store(const OpSTR *tab, int size, u32 adr_first, GpVar adr, GpVar data)
+{
+	u32 memtype = classify_adr(adr_first, 1);
+	Label slow = c.newLabel();
+	Label done = c.newLabel();
+	GpVar host = c.newGpVar(kX86VarTypeGpz);
+	bool fast = emit_fastmem(memtype, size, true, adr, host, slow);
+	if(fast)
+	{
+		if(size == 32) c.mov(dword_ptr(host), data);
+		else if(size == 16) c.mov(word_ptr(host), data.r16());
+		else c.mov(byte_ptr(host), data.r8Lo());
+		c.mov(bb_cycles, PROCNUM ? fastmem_cycles<1,MMU_AD_WRITE>(size, adr_first) : fastmem_cycles<0,MMU_AD_WRITE>(size, adr_first));
+		c.jmp(done);
+		c.bind(slow);
+	}
+	c.unuse(host);
+	X86CompilerFuncCall *ctx = c.call((void*)tab[memtype]);
+	ctx->setPrototype(ASMJIT_CALL_CONV, FuncBuilder2<u32, u32, u32>());
+	ctx->setArgument(0, adr);
+	ctx->setArgument(1, data);
+	ctx->setReturn(bb_cycles);
+	if(fast)
+		c.bind(done);
+}
+
 static u32 add(u32 lhs, u32 rhs) { return lhs + rhs; }
 static u32 sub(u32 lhs, u32 rhs) { return lhs - rhs; }
 
 #define OP_LDR_(mem_op, arg, sign_op, writeback) \
 	GpVar adr = c.newGpVar(kX86VarTypeGpd); \
 	GpVar dst = c.newGpVar(kX86VarTypeGpz); \
-	c.mov(adr, reg_pos_ptr(16)); \
+	c.mov(adr, reg_pos_r(16)); \
 	c.lea(dst, reg_pos_ptr(12)); \
 	arg; \
 	if(!rhs_is_imm || *(u32*)&rhs) \
@@ -1581,30 +2668,27 @@ static u32 sub(u32 lhs, u32 rhs) { return lhs - rhs; }
 		else if(writeback < 0) \
 		{ \
 			c.sign_op(adr, rhs); \
-			c.mov(reg_pos_ptr(16), adr); \
+			c.mov(reg_pos_w(16), adr); \
 		} \
 		else if(writeback > 0) \
 		{ \
 			GpVar tmp_reg = c.newGpVar(kX86VarTypeGpd); \
 			c.mov(tmp_reg, adr); \
 			c.sign_op(tmp_reg, rhs); \
-			c.mov(reg_pos_ptr(16), tmp_reg); \
+			c.mov(reg_pos_w(16), tmp_reg); \
 		} \
 	} \
 	u32 adr_first = sign_op(cpu->R[REG_POS(i,16)], rhs_first); \
-	X86CompilerFuncCall *ctx = c.call((void*)mem_op##_tab[PROCNUM][classify_adr(adr_first,0)]); \
-	ctx->setPrototype(ASMJIT_CALL_CONV, FuncBuilder2<u32, u32, u32*>()); \
-	ctx->setArgument(0, adr); \
-	ctx->setArgument(1, dst); \
-	ctx->setReturn(bb_cycles); \
+	emit_load(mem_op##_tab[PROCNUM], FASTMEM_##mem_op, adr_first, adr, dst); \
+	reg_invalidate(REG_BIT(REG_POS(i,12))); \
 	if(REG_POS(i,12)==15) \
 	{ \
 		GpVar tmp = c.newGpVar(kX86VarTypeGpd); \
-		c.mov(tmp, reg_ptr(15)); \
+		c.mov(tmp, reg_read(15)); \
 		if (PROCNUM == 0) \
 		{ \
 			GpVar thumb = c.newGpVar(kX86VarTypeGpz); \
-			c.movzx(thumb, reg_pos_ptrB(16)); \
+			c.movzx(thumb, reg_pos_r(16).r8Lo()); \
 			c.and_(thumb, 1); \
 			c.shl(thumb, 5); \
 			c.or_(cpu_ptr(CPSR), thumb.r64()); \
@@ -1753,7 +2837,6 @@ static u32 FASTCALL OP_STRB(u32 adr, u32 data)
 	return MMU_aluMemAccessCycles<PROCNUM,8,MMU_AD_WRITE>(2,adr);
 }
 
-typedef u32 (FASTCALL* OpSTR)(u32, u32);
 #define T(op) op<0,0>, op<0,1>, op<0,2>, op<1,0>, op<1,1>, NULL
 static const OpSTR STR_tab[2][3]   = { T(OP_STR) };
 static const OpSTR STRH_tab[2][3]  = { T(OP_STRH) };
@@ -1763,8 +2846,8 @@ static const OpSTR STRB_tab[2][3]  = { T(OP_STRB) };
 #define OP_STR_(mem_op, arg, sign_op, writeback) \
 	GpVar adr = c.newGpVar(kX86VarTypeGpd); \
 	GpVar data = c.newGpVar(kX86VarTypeGpd); \
-	c.mov(adr, reg_pos_ptr(16)); \
-	c.mov(data, reg_pos_ptr(12)); \
+	c.mov(adr, reg_pos_r(16)); \
+	c.mov(data, reg_pos_r(12)); \
 	arg; \
 	if(!rhs_is_imm || *(u32*)&rhs) \
 	{ \
@@ -1773,22 +2856,18 @@ static const OpSTR STRB_tab[2][3]  = { T(OP_STRB) };
 		else if(writeback < 0) \
 		{ \
 			c.sign_op(adr, rhs); \
-			c.mov(reg_pos_ptr(16), adr); \
+			c.mov(reg_pos_w(16), adr); \
 		} \
 		else if(writeback > 0) \
 		{ \
 			GpVar tmp_reg = c.newGpVar(kX86VarTypeGpd); \
 			c.mov(tmp_reg, adr); \
 			c.sign_op(tmp_reg, rhs); \
-			c.mov(reg_pos_ptr(16), tmp_reg); \
+			c.mov(reg_pos_w(16), tmp_reg); \
 		} \
 	} \
 	u32 adr_first = sign_op(cpu->R[REG_POS(i,16)], rhs_first); \
-	X86CompilerFuncCall *ctx = c.call((void*)mem_op##_tab[PROCNUM][classify_adr(adr_first,1)]); \
-	ctx->setPrototype(ASMJIT_CALL_CONV, FuncBuilder2<u32, u32, u32>()); \
-	ctx->setArgument(0, adr); \
-	ctx->setArgument(1, data); \
-	ctx->setReturn(bb_cycles); \
+	emit_store(mem_op##_tab[PROCNUM], FASTMEM_##mem_op, adr_first, adr, data); \
 	return 1;
 
 static int OP_STR_P_IMM_OFF(const u32 i) { OP_STR_(STR, IMM_OFF_12, add, 0); }
@@ -1909,26 +2988,30 @@ static int OP_LDRD_STRD_POST_INDEX(const u32 i)
 	GpVar Rd = c.newGpVar(kX86VarTypeGpd);
 	GpVar addr = c.newGpVar(kX86VarTypeGpd);
 
-	c.mov(Rd, reg_pos_ptr(16));
-	c.mov(addr, reg_pos_ptr(16));
+	c.mov(Rd, reg_pos_r(16));
+	c.mov(addr, reg_pos_r(16));
 
 	// I bit - immediate or register
 	if (BIT22(i))
 	{
 		IMM_OFF;
-		BIT23(i)?c.add(reg_pos_ptr(16), rhs):c.sub(reg_pos_ptr(16), rhs);
+		BIT23(i)?c.add(reg_pos_rw(16), rhs):c.sub(reg_pos_rw(16), rhs);
 	}
 	else
 	{
 		GpVar idx = c.newGpVar(kX86VarTypeGpd);
-		c.mov(idx, reg_pos_ptr(0));
-		BIT23(i)?c.add(reg_pos_ptr(16), idx):c.sub(reg_pos_ptr(16), idx);
+		c.mov(idx, reg_pos_r(0));
+		BIT23(i)?c.add(reg_pos_rw(16), idx):c.sub(reg_pos_rw(16), idx);
 	}
 
+	if (BIT5(i))
+		reg_flush(REG_BIT(Rd_num) | REG_BIT(Rd_num+1), false);
 	X86CompilerFuncCall *ctx = c.call((void*)(BIT5(i) ? op_strd_tab[PROCNUM][Rd_num] : op_ldrd_tab[PROCNUM][Rd_num]));
 	ctx->setPrototype(ASMJIT_CALL_CONV, FuncBuilder1<u32, u32>());
 	ctx->setArgument(0, addr);
 	ctx->setReturn(bb_cycles);
+	if (!BIT5(i))
+		reg_invalidate(REG_BIT(Rd_num) | REG_BIT(Rd_num+1));
 	emit_MMU_aluMemCycles(3, bb_cycles, 0);
 	return 1;
 }
@@ -1950,8 +3033,8 @@ static int OP_LDRD_STRD_OFFSET_PRE_INDEX(const u32 i)
 	GpVar Rd = c.newGpVar(kX86VarTypeGpd);
 	GpVar addr = c.newGpVar(kX86VarTypeGpd);
 
-	c.mov(Rd, reg_pos_ptr(16));
-	c.mov(addr, reg_pos_ptr(16));
+	c.mov(Rd, reg_pos_r(16));
+	c.mov(addr, reg_pos_r(16));
 
 	// I bit - immediate or register
 	if (BIT22(i))
@@ -1960,26 +3043,28 @@ static int OP_LDRD_STRD_OFFSET_PRE_INDEX(const u32 i)
 		BIT23(i)?c.add(addr, rhs):c.sub(addr, rhs);
 	}
 	else
-		BIT23(i)?c.add(addr, reg_pos_ptr(0)):c.sub(addr, reg_pos_ptr(0));
+		BIT23(i)?c.add(addr, reg_pos_r(0)):c.sub(addr, reg_pos_r(0));
 
 	if (BIT5(i))		// Store
 	{
+		reg_flush(REG_BIT(Rd_num) | REG_BIT(Rd_num+1), false);
 		X86CompilerFuncCall *ctx = c.call((void*)op_strd_tab[PROCNUM][Rd_num]);
 		ctx->setPrototype(ASMJIT_CALL_CONV, FuncBuilder1<u32, u32>());
 		ctx->setArgument(0, addr);
 		ctx->setReturn(bb_cycles);
 		if (BIT21(i)) // W bit - writeback
-			c.mov(reg_pos_ptr(16), addr);
+			c.mov(reg_pos_w(16), addr);
 		emit_MMU_aluMemCycles(3, bb_cycles, 0);
 	}
 	else				// Load
 	{
 		if (BIT21(i)) // W bit - writeback
-			c.mov(reg_pos_ptr(16), addr);
+			c.mov(reg_pos_w(16), addr);
 		X86CompilerFuncCall *ctx = c.call((void*)op_ldrd_tab[PROCNUM][Rd_num]);
 		ctx->setPrototype(ASMJIT_CALL_CONV, FuncBuilder1<u32, u32>());
 		ctx->setArgument(0, addr);
 		ctx->setReturn(bb_cycles);
+		reg_invalidate(REG_BIT(Rd_num) | REG_BIT(Rd_num+1));
 		emit_MMU_aluMemCycles(3, bb_cycles, 0);
 	}
 	return 1;
@@ -2013,18 +3098,19 @@ static int op_swp_(const u32 i, int b)
 	GpVar addr = c.newGpVar(kX86VarTypeGpd);
 	GpVar Rd = c.newGpVar(kX86VarTypeGpz);
 	GpVar Rs = c.newGpVar(kX86VarTypeGpd);
-	c.mov(addr, reg_pos_ptr(16));
+	c.mov(addr, reg_pos_r(16));
 	c.lea(Rd, reg_pos_ptr(12));
 	if(b)
-		c.movzx(Rs, reg_pos_ptrB(0));
+		c.movzx(Rs, reg_pos_r(0).r8Lo());
 	else
-		c.mov(Rs, reg_pos_ptr(0));
+		c.mov(Rs, reg_pos_r(0));
 	X86CompilerFuncCall *ctx = c.call((void*)op_swp_tab[b][PROCNUM]);
 	ctx->setPrototype(ASMJIT_CALL_CONV, FuncBuilder3<u32, u32, u32*, u32>());
 	ctx->setArgument(0, addr);
 	ctx->setArgument(1, Rd);
 	ctx->setArgument(2, Rs);
 	ctx->setReturn(bb_cycles);
+	reg_invalidate(REG_BIT(REG_POS(i,12)));
 	emit_MMU_aluMemCycles(4, bb_cycles, 0);
 	return 1;
 }
@@ -2117,10 +3203,7 @@ static FORCEINLINE FASTCALL u32 OP_LDM_STM_main(u32 adr, u64 regs, int n, u8 *pt
 #define OP(j) { \
 	/* no need to zero functions in DTCM, since we can't execute from it */ \
 	if(null_compiled && store) \
-	{ \
-		*func = 0; \
-		*(func+1) = 0; \
-	} \
+		JIT_INVALIDATE(*func, 2); \
 	int Rd = ((uintptr_t)regs >> (j*4)) & 0xF; \
 	if(store) *(u32*)ptr = cpu->R[Rd]; \
 	else cpu->R[Rd] = *(u32*)ptr; \
@@ -2170,6 +3253,12 @@ static u32 FASTCALL OP_LDM_STM(u32 adr, u64 regs, int n)
 	{
 		ptr = MMU.MAIN_MEM + (adr & _MMU_MAIN_MEM_MASK32);
 		cycles = n * ((PROCNUM==ARMCPU_ARM9) ? 4 : 2);
+		if(store)
+		{
+			// the run is shorter than a page, so its ends cover every page it writes
+			MMU_MAIN_MEM_dirty(adr);
+			MMU_MAIN_MEM_dirty(adr + (n-1)*4*dir);
+		}
 	}
 	else if(PROCNUM==ARMCPU_ARM7 && !store && (adr & 0xFF800000) == 0x03800000)
 	{
@@ -2200,6 +3289,8 @@ static void call_ldm_stm(GpVar adr, u32 bitmask, bool store, int dir)
 {
 	if(bitmask)
 	{
+		if(store)
+			reg_flush(bitmask, false);
 		GpVar n = c.newGpVar(kX86VarTypeGpd);
 		c.mov(n, popcount(bitmask));
 #ifdef ASMJIT_X64
@@ -2224,13 +3315,15 @@ static void call_ldm_stm(GpVar adr, u32 bitmask, bool store, int dir)
 		ctx->setArgument(3, n);
 #endif
 		ctx->setReturn(bb_cycles);
+		if(!store)
+			reg_invalidate(bitmask);
 	}
 	else
 		bb_constant_cycles++;
 }
 
-static int op_bx(Mem srcreg, bool blx, bool test_thumb);
-static int op_bx_thumb(Mem srcreg, bool blx, bool test_thumb);
+static int op_bx(GpVar srcreg, bool blx, bool test_thumb);
+static int op_bx_thumb(GpVar srcreg, bool blx, bool test_thumb);
 
 static int op_ldm_stm(u32 i, bool store, int dir, bool before, bool writeback)
 {
@@ -2238,7 +3331,7 @@ static int op_ldm_stm(u32 i, bool store, int dir, bool before, bool writeback)
 	u32 pop = popcount(bitmask);
 
 	GpVar adr = c.newGpVar(kX86VarTypeGpd);
-	c.mov(adr, reg_pos_ptr(16));
+	c.mov(adr, reg_pos_r(16));
 	if(before)
 		c.add(adr, 4*dir);
 
@@ -2246,7 +3339,7 @@ static int op_ldm_stm(u32 i, bool store, int dir, bool before, bool writeback)
 
 	if(BIT15(i) && !store)
 	{
-		op_bx(reg_ptr(15), 0, PROCNUM == ARMCPU_ARM9);
+		op_bx(reg_read(15), 0, PROCNUM == ARMCPU_ARM9);
 	}
 
 	if(writeback)
@@ -2255,7 +3348,7 @@ static int op_ldm_stm(u32 i, bool store, int dir, bool before, bool writeback)
 		if(store || !(i & (1 << REG_POS(i,16))))
 		{
 			JIT_COMMENT("--- writeback");
-			c.add(reg_pos_ptr(16), 4*dir*pop);
+			c.add(reg_pos_rw(16), 4*dir*pop);
 		}
 		else 
 		{
@@ -2264,7 +3357,7 @@ static int op_ldm_stm(u32 i, bool store, int dir, bool before, bool writeback)
 			{
 				JIT_COMMENT("--- writeback");
 				c.add(adr, 4*dir*(pop-before));
-				c.mov(reg_pos_ptr(16), adr);
+				c.mov(reg_pos_w(16), adr);
 			}
 		}
 	}
@@ -2303,7 +3396,7 @@ static int op_ldm_stm2(u32 i, bool store, int dir, bool before, bool writeback)
 	GpVar adr = c.newGpVar(kX86VarTypeGpd);
 	GpVar oldmode = c.newGpVar(kX86VarTypeGpd);
 
-	c.mov(adr, reg_pos_ptr(16));
+	c.mov(adr, reg_pos_r(16));
 	if(before)
 		c.add(adr, 4*dir);
 
@@ -2311,6 +3404,7 @@ static int op_ldm_stm2(u32 i, bool store, int dir, bool before, bool writeback)
 	{  
 		//if((cpu->CPSR.bits.mode==USR)||(cpu->CPSR.bits.mode==SYS)) { printf("ERROR1\n"); return 1; }
 		//oldmode = armcpu_switchMode(cpu, SYS);
+		reg_flush(REG_ALL, true);
 		c.mov(oldmode, SYS);
 		X86CompilerFuncCall *ctx = c.call((void*)armcpu_switchMode);
 		ctx->setPrototype(ASMJIT_CALL_CONV, FuncBuilder2<u32, u8*, u8>());
@@ -2338,14 +3432,14 @@ static int op_ldm_stm2(u32 i, bool store, int dir, bool before, bool writeback)
 	if(writeback)
 	{
 		if(store || !(i & (1 << REG_POS(i,16))))
-			c.add(reg_pos_ptr(16), 4*dir*pop);
+			c.add(reg_pos_rw(16), 4*dir*pop);
 		else 
 		{
 			u32 bitlist = (~((2 << REG_POS(i,16))-1)) & 0xFFFF;
 			if(i & bitlist)
 			{
 				c.add(adr, 4*dir*(pop-before));
-				c.mov(reg_pos_ptr(16), adr);
+				c.mov(reg_pos_w(16), adr);
 			}
 		}
 	}
@@ -2388,7 +3482,7 @@ static int op_b(u32 i, bool bl)
 		c.or_(cpu_ptr_byte(CPSR, 0), 1<<5);
 	}
 	if(bl || CONDITION(i)==0xF)
-		c.mov(reg_ptr(14), bb_next_instruction);
+		c.mov(reg_write(14), bb_next_instruction);
 
 	c.mov(cpu_ptr(instruct_adr), dst);
 	return 1;
@@ -2397,7 +3491,7 @@ static int op_b(u32 i, bool bl)
 static int OP_B(const u32 i) { return op_b(i, 0); }
 static int OP_BL(const u32 i) { return op_b(i, 1); }
 
-static int op_bx(Mem srcreg, bool blx, bool test_thumb)
+static int op_bx(GpVar srcreg, bool blx, bool test_thumb)
 {
 	GpVar dst = c.newGpVar(kX86VarTypeGpd);
 	c.mov(dst, srcreg);
@@ -2418,14 +3512,14 @@ static int op_bx(Mem srcreg, bool blx, bool test_thumb)
 		c.and_(dst, 0xFFFFFFFC);
 
 	if(blx)
-		c.mov(reg_ptr(14), bb_next_instruction);
+		c.mov(reg_write(14), bb_next_instruction);
 	c.mov(cpu_ptr(instruct_adr), dst);
 	return 1;
 }
 
 //TODO: exeption when Rm=PC
-static int OP_BX(const u32 i) { return op_bx(reg_pos_ptr(0), 0, 1); }
-static int OP_BLX_REG(const u32 i) { return op_bx(reg_pos_ptr(0), 1, 1); }
+static int OP_BX(const u32 i) { return op_bx(reg_pos_r(0), 0, 1); }
+static int OP_BLX_REG(const u32 i) { return op_bx(reg_pos_r(0), 1, 1); }
 
 //-----------------------------------------------------------------------------
 //   CLZ
@@ -2434,9 +3528,9 @@ static int OP_CLZ(const u32 i)
 {
 	GpVar res = c.newGpVar(kX86VarTypeGpd);
 	c.mov(res, 0x3F);
-	c.bsr(res, reg_pos_ptr(0));
+	c.bsr(res, reg_pos_r(0));
 	c.xor_(res, 0x1F);
-	c.mov(reg_pos_ptr(12), res);
+	c.mov(reg_pos_w(12), res);
 	
 	return 1;
 }
@@ -2474,8 +3568,8 @@ static int OP_MCR(const u32 i)
 
 	GpVar bb_cp15 = c.newGpVar(kX86VarTypeGpz);
 	GpVar data = c.newGpVar(kX86VarTypeGpd);
-	c.mov(data, reg_pos_ptr(12));
-	c.mov(bb_cp15, (uintptr_t)&cp15);
+	c.mov(data, reg_pos_r(12));
+	emit_ptr(bb_cp15, &cp15);
 
 	bool bUnknown = false;
 	switch(CRn)
@@ -2487,7 +3581,7 @@ static int OP_MCR(const u32 i)
 				// On the NDS bit0,2,7,12..19 are R/W, Bit3..6 are always set, all other bits are always zero.
 				//MMU.ARM9_RW_MODE = BIT7(val);
 				GpVar bb_mmu = c.newGpVar(kX86VarTypeGpz);
-				c.mov(bb_mmu, (uintptr_t)&MMU);
+				emit_ptr(bb_mmu, &MMU);
 				Mem rwmode = mmu_ptr_byte(ARM9_RW_MODE);
 				Mem ldtbit = cpu_ptr_byte(LDTBit, 0);
 				c.test(data, (1<<7));
@@ -2653,7 +3747,7 @@ static int OP_MCR(const u32 i)
 									//MMU.DTCMRegion = DTCMRegion = val & 0x0FFFF000;
 									c.and_(data, 0x0FFFF000);
 									GpVar bb_mmu = c.newGpVar(kX86VarTypeGpz);
-									c.mov(bb_mmu, (uintptr_t)&MMU);
+									emit_ptr(bb_mmu, &MMU);
 									c.mov(mmu_ptr(DTCMRegion), data);
 									c.mov(cp15_ptr(DTCMRegion), data);
 								}
@@ -2663,7 +3757,7 @@ static int OP_MCR(const u32 i)
 									//ITCMRegion = val;
 									//ITCM base is not writeable!
 									GpVar bb_mmu = c.newGpVar(kX86VarTypeGpz);
-									c.mov(bb_mmu, (uintptr_t)&MMU);
+									emit_ptr(bb_mmu, &MMU);
 									c.mov(mmu_ptr(ITCMRegion), 0);
 									c.mov(cp15_ptr(ITCMRegion), data);
 								}
@@ -2715,7 +3809,7 @@ static int OP_MRC(const u32 i)
 	GpVar bb_cp15 = c.newGpVar(kX86VarTypeGpz);
 	GpVar data = c.newGpVar(kX86VarTypeGpd);
 
-	c.mov(bb_cp15, (uintptr_t)&cp15);
+	emit_ptr(bb_cp15, &cp15);
 	
 	bool bUnknown = false;
 	switch(CRn)
@@ -2926,17 +4020,19 @@ static int OP_MRC(const u32 i)
 		//CPSR.bits.C = BIT29(data);
 		//CPSR.bits.V = BIT28(data);
 		c.and_(data, 0xF0000000);
+		reg_flush(REG_BIT(REG_FLAGS), true);
 		c.and_(cpu_ptr(CPSR), 0x0FFFFFFF);
 		c.or_(cpu_ptr(CPSR), data);
 	}
 	else
-		c.mov(reg_pos_ptr(12), data);
+		c.mov(reg_pos_w(12), data);
 
 	return 1;
 }
 
 u32 op_swi(u8 swinum)
 {
+	reg_flush(REG_ALL, true);
 	if(cpu->swi_tab)
 	{
 #if defined(_M_X64) || defined(__x86_64__)
@@ -2964,7 +4060,7 @@ u32 op_swi(u8 swinum)
 	ctx->setArgument(1, mode);
 	c.unuse(mode);
 	JIT_COMMENT("store next instruction address to R14");
-	c.mov(reg_ptr(14), bb_next_instruction);
+	c.mov(reg_write(14), bb_next_instruction);
 	JIT_COMMENT("save old CPSR as new SPSR");
 	c.mov(cpu_ptr(SPSR.val), oldCPSR);
 	JIT_COMMENT("CPSR: clear T, set I");
@@ -2995,13 +4091,13 @@ static int OP_BKPT(const u32 i) { printf("JIT: unimplemented OP_BKPT\n"); return
 	u8 cf_change = 1; \
 	const u32 rhs = ((i>>6) & 0x1F); \
 	if (_REG_NUM(i, 0) == _REG_NUM(i, 3)) \
-		c.x86inst(reg_pos_thumb(0), rhs); \
+		c.x86inst(reg_thumb_rw(0), rhs); \
 	else \
 	{ \
 		GpVar lhs = c.newGpVar(kX86VarTypeGpd); \
-		c.mov(lhs, reg_pos_thumb(3)); \
+		c.mov(lhs, reg_thumb_r(3)); \
 		c.x86inst(lhs, rhs); \
-		c.mov(reg_pos_thumb(0), lhs); \
+		c.mov(reg_thumb_w(0), lhs); \
 		c.unuse(lhs); \
 	} \
 	c.setc(rcf.r8Lo()); \
@@ -3017,31 +4113,33 @@ static int OP_BKPT(const u32 i) { printf("JIT: unimplemented OP_BKPT\n"); return
 	Label __zero = c.newLabel(); \
 	Label __done = c.newLabel(); \
 	\
-	c.mov(imm, reg_pos_thumb(3)); \
+	reg_thumb_rw(0); \
+	flags_rw; \
+	c.mov(imm, reg_thumb_r(3)); \
 	c.and_(imm, 0xFF); \
 	c.jz(__zero); \
 	c.cmp(imm, 32); \
 	c.jl(__ls32); \
 	c.je(__eq32); \
 	/* imm > 32 */ \
-	c.mov(reg_pos_thumb(0), 0); \
+	c.mov(reg_thumb_w(0), 0); \
 	SET_NZC_SHIFTS_ZERO(0); \
 	c.jmp(__done); \
 	/* imm == 32 */ \
 	c.bind(__eq32); \
-	c.test(reg_pos_thumb(0), (1 << bit)); \
+	c.test(reg_thumb_r(0), (1 << bit)); \
 	c.setnz(rcf.r8Lo()); \
-	c.mov(reg_pos_thumb(0), 0); \
+	c.mov(reg_thumb_w(0), 0); \
 	SET_NZC_SHIFTS_ZERO(1); \
 	c.jmp(__done); \
 	/* imm == 0 */ \
 	c.bind(__zero); \
-	c.cmp(reg_pos_thumb(0), 0); \
+	c.cmp(reg_thumb_r(0), 0); \
 	SET_NZ(0); \
 	c.jmp(__done); \
 	/* imm < 32 */ \
 	c.bind(__ls32); \
-	c.x86inst(reg_pos_thumb(0), imm); \
+	c.x86inst(reg_thumb_rw(0), imm); \
 	c.setc(rcf.r8Lo()); \
 	SET_NZC; \
 	c.bind(__done); \
@@ -3049,9 +4147,9 @@ static int OP_BKPT(const u32 i) { printf("JIT: unimplemented OP_BKPT\n"); return
 
 #define OP_LOGIC(x86inst, _conv) \
 	GpVar rhs = c.newGpVar(kX86VarTypeGpd); \
-	c.mov(rhs, reg_pos_thumb(3)); \
+	c.mov(rhs, reg_thumb_r(3)); \
 	if (_conv==1) c.not_(rhs); \
-	c.x86inst(reg_pos_thumb(0), rhs); \
+	c.x86inst(reg_thumb_rw(0), rhs); \
 	SET_NZ(0); \
 	return 1;
 
@@ -3061,12 +4159,12 @@ static int OP_BKPT(const u32 i) { printf("JIT: unimplemented OP_BKPT\n"); return
 static int OP_LSL_0(const u32 i) 
 {
 	if (_REG_NUM(i, 0) == _REG_NUM(i, 3))
-		c.cmp(reg_pos_thumb(0), 0);
+		c.cmp(reg_thumb_r(0), 0);
 	else
 	{
 		GpVar rhs = c.newGpVar(kX86VarTypeGpd);
-		c.mov(rhs, reg_pos_thumb(3));
-		c.mov(reg_pos_thumb(0), rhs);
+		c.mov(rhs, reg_thumb_r(3));
+		c.mov(reg_thumb_w(0), rhs);
 		c.cmp(rhs, 0);
 	}
 	SET_NZ(0);
@@ -3077,10 +4175,10 @@ static int OP_LSL_REG(const u32 i) { OP_SHIFTS_REG(shl, 0); }
 static int OP_LSR_0(const u32 i) 
 {
 	GpVar rcf = c.newGpVar(kX86VarTypeGpd);
-	c.test(reg_pos_thumb(3), (1 << 31));
+	c.test(reg_thumb_r(3), (1 << 31));
 	c.setnz(rcf.r8Lo());
 	SET_NZC_SHIFTS_ZERO(1);
-	c.mov(reg_pos_thumb(0), 0);
+	c.mov(reg_thumb_w(0), 0);
 	return 1;
 }
 static int OP_LSR(const u32 i) { OP_SHIFTS_IMM(shr); }
@@ -3091,12 +4189,12 @@ static int OP_ASR_0(const u32 i)
 	GpVar rcf = c.newGpVar(kX86VarTypeGpd);
 	GpVar rhs = c.newGpVar(kX86VarTypeGpd);
 	if (_REG_NUM(i, 0) == _REG_NUM(i, 3))
-		c.sar(reg_pos_thumb(0), 31);
+		c.sar(reg_thumb_rw(0), 31);
 	else
 	{
-		c.mov(rhs, reg_pos_thumb(3));
+		c.mov(rhs, reg_thumb_r(3));
 		c.sar(rhs, 31);
-		c.mov(reg_pos_thumb(0), rhs);
+		c.mov(reg_thumb_w(0), rhs);
 	}
 	c.sets(rcf.r8Lo());
 	SET_NZC;
@@ -3112,11 +4210,13 @@ static int OP_ASR_REG(const u32 i)
 	Label __setFlags = c.newLabel();
 	GpVar imm = c.newGpVar(kX86VarTypeGpz);
 	GpVar rcf = c.newGpVar(kX86VarTypeGpd);
-	c.mov(imm, reg_pos_thumb(3));
+	reg_thumb_rw(0);
+	flags_rw;
+	c.mov(imm, reg_thumb_r(3));
 	c.and_(imm, 0xFF);
 	c.jnz(__gr0);
 	/* imm == 0 */
-	c.cmp(reg_pos_thumb(0), 0);
+	c.cmp(reg_thumb_r(0), 0);
 	SET_NZ(0);
 	c.jmp(__done);
 	/* imm > 0 */
@@ -3124,12 +4224,12 @@ static int OP_ASR_REG(const u32 i)
 	c.cmp(imm, 32);
 	c.jl(__lt32);
 	/* imm > 31 */
-	c.sar(reg_pos_thumb(0), 31);
+	c.sar(reg_thumb_rw(0), 31);
 	c.sets(rcf.r8Lo());
 	c.jmp(__setFlags);
 	/* imm < 32 */
 	c.bind(__lt32);
-	c.sar(reg_pos_thumb(0), imm);
+	c.sar(reg_thumb_rw(0), imm);
 	c.setc(rcf.r8Lo());
 	c.bind(__setFlags);
 	SET_NZC;
@@ -3149,24 +4249,26 @@ static int OP_ROR_REG(const u32 i)
 	Label __zero_1F = c.newLabel();
 	Label __done = c.newLabel();
 
-	c.mov(imm, reg_pos_thumb(3));
+	reg_thumb_rw(0);
+	flags_rw;
+	c.mov(imm, reg_thumb_r(3));
 	c.and_(imm, 0xFF);
 	c.jz(__zero);
 	c.and_(imm, 0x1F);
 	c.jz(__zero_1F);
-	c.ror(reg_pos_thumb(0), imm);
+	c.ror(reg_thumb_rw(0), imm);
 	c.setc(rcf.r8Lo());
 	SET_NZC;
 	c.jmp(__done);
 	/* imm & 0x1F == 0 */
 	c.bind(__zero_1F);
-	c.cmp(reg_pos_thumb(0), 0);
+	c.cmp(reg_thumb_r(0), 0);
 	c.sets(rcf.r8Lo());
 	SET_NZC;
 	c.jmp(__done);
 	/* imm == 0 */
 	c.bind(__zero);
-	c.cmp(reg_pos_thumb(0), 0);
+	c.cmp(reg_thumb_r(0), 0);
 	SET_NZ(0);
 	c.bind(__done);
 
@@ -3187,13 +4289,13 @@ static int OP_BIC(const u32 i) { OP_LOGIC(and_, 1); }
 static int OP_NEG(const u32 i)
 {
 	if (_REG_NUM(i, 0) == _REG_NUM(i, 3))
-		c.neg(reg_pos_thumb(0));
+		c.neg(reg_thumb_rw(0));
 	else
 	{
 		GpVar tmp = c.newGpVar(kX86VarTypeGpd);
-		c.mov(tmp, reg_pos_thumb(3));
+		c.mov(tmp, reg_thumb_r(3));
 		c.neg(tmp);
-		c.mov(reg_pos_thumb(0), tmp);
+		c.mov(reg_thumb_w(0), tmp);
 	}
 	SET_NZCV(1);
 	return 1;
@@ -3209,29 +4311,29 @@ static int OP_ADD_IMM3(const u32 i)
 	if (imm3 == 0)	// mov 2
 	{
 		GpVar tmp = c.newGpVar(kX86VarTypeGpd);
-		c.mov(tmp, reg_pos_thumb(3));
-		c.mov(reg_pos_thumb(0), tmp);
+		c.mov(tmp, reg_thumb_r(3));
+		c.mov(reg_thumb_w(0), tmp);
 		c.cmp(tmp, 0);
 		SET_NZ(1);
 		return 1;
 	}
 	if (_REG_NUM(i, 0) == _REG_NUM(i, 3))
 	{
-		c.add(reg_pos_thumb(0), imm3);
+		c.add(reg_thumb_rw(0), imm3);
 	}
 	else
 	{
 		GpVar tmp = c.newGpVar(kX86VarTypeGpd);
-		c.mov(tmp, reg_pos_thumb(3));
+		c.mov(tmp, reg_thumb_r(3));
 		c.add(tmp, imm3);
-		c.mov(reg_pos_thumb(0), tmp);
+		c.mov(reg_thumb_w(0), tmp);
 	}
 	SET_NZCV(0);
 	return 1;
 }
 static int OP_ADD_IMM8(const u32 i) 
 {
-	c.add(reg_pos_thumb(8), (i & 0xFF));
+	c.add(reg_thumb_rw(8), (i & 0xFF));
 	SET_NZCV(0);
 
 	return 1; 
@@ -3242,22 +4344,22 @@ static int OP_ADD_REG(const u32 i)
 	if (_REG_NUM(i, 0) == _REG_NUM(i, 3))
 	{
 		GpVar tmp = c.newGpVar(kX86VarTypeGpd);
-		c.mov(tmp, reg_pos_thumb(6));
-		c.add(reg_pos_thumb(0), tmp);
+		c.mov(tmp, reg_thumb_r(6));
+		c.add(reg_thumb_rw(0), tmp);
 	}
 	else
 		if (_REG_NUM(i, 0) == _REG_NUM(i, 6))
 		{
 			GpVar tmp = c.newGpVar(kX86VarTypeGpd);
-			c.mov(tmp, reg_pos_thumb(3));
-			c.add(reg_pos_thumb(0), tmp);
+			c.mov(tmp, reg_thumb_r(3));
+			c.add(reg_thumb_rw(0), tmp);
 		}
 		else
 			{
 				GpVar tmp = c.newGpVar(kX86VarTypeGpd);
-				c.mov(tmp, reg_pos_thumb(3));
-				c.add(tmp, reg_pos_thumb(6));
-				c.mov(reg_pos_thumb(0), tmp);
+				c.mov(tmp, reg_thumb_r(3));
+				c.add(tmp, reg_thumb_r(6));
+				c.mov(reg_thumb_w(0), tmp);
 			}
 	SET_NZCV(0);
 	return 1; 
@@ -3267,9 +4369,9 @@ static int OP_ADD_SPE(const u32 i)
 	u32 Rd = _REG_NUM(i, 0) | ((i>>4)&8);
 	//cpu->R[Rd] += cpu->R[REG_POS(i, 3)];
 	GpVar tmp = c.newGpVar(kX86VarTypeGpd);
-	c.mov(tmp, reg_ptr(Rd));
-	c.add(tmp, reg_pos_ptr(3));
-	c.mov(reg_ptr(Rd), tmp);
+	c.mov(tmp, reg_read(Rd));
+	c.add(tmp, reg_pos_r(3));
+	c.mov(reg_write(Rd), tmp);
 	
 	if(Rd==15)
 		c.mov(cpu_ptr(next_instruction), tmp);
@@ -3280,7 +4382,7 @@ static int OP_ADD_SPE(const u32 i)
 static int OP_ADD_2PC(const u32 i)
 {
 	u32 imm = ((i&0xFF)<<2);
-	c.mov(reg_pos_thumb(8), (bb_r15 & 0xFFFFFFFC) + imm);
+	c.mov(reg_thumb_w(8), (bb_r15 & 0xFFFFFFFC) + imm);
 	return 1;
 }
 
@@ -3289,9 +4391,9 @@ static int OP_ADD_2SP(const u32 i)
 	u32 imm = ((i&0xFF)<<2);
 	//cpu->R[REG_NUM(i, 8)] = cpu->R[13] + ((i&0xFF)<<2);
 	GpVar tmp = c.newGpVar(kX86VarTypeGpd);
-	c.mov(tmp, reg_ptr(13));
+	c.mov(tmp, reg_read(13));
 	if (imm) c.add(tmp, imm);
-	c.mov(reg_pos_thumb(8), tmp);
+	c.mov(reg_thumb_w(8), tmp);
 	
 	return 1;
 }
@@ -3306,14 +4408,14 @@ static int OP_SUB_IMM3(const u32 i)
 	// cpu->R[REG_NUM(i, 0)] = cpu->R[REG_NUM(i, 3)] - imm3;
 	if (_REG_NUM(i, 0) == _REG_NUM(i, 3))
 	{
-		c.sub(reg_pos_thumb(0), imm3);
+		c.sub(reg_thumb_rw(0), imm3);
 	}
 	else
 	{
 		GpVar tmp = c.newGpVar(kX86VarTypeGpd);
-		c.mov(tmp, reg_pos_thumb(3));
+		c.mov(tmp, reg_thumb_r(3));
 		c.sub(tmp, imm3);
-		c.mov(reg_pos_thumb(0), tmp);
+		c.mov(reg_thumb_w(0), tmp);
 	}
 	SET_NZCV(1);
 	return 1;
@@ -3321,7 +4423,7 @@ static int OP_SUB_IMM3(const u32 i)
 static int OP_SUB_IMM8(const u32 i)
 {
 	//cpu->R[REG_NUM(i, 8)] -= imm8;
-	c.sub(reg_pos_thumb(8), (i & 0xFF));
+	c.sub(reg_thumb_rw(8), (i & 0xFF));
 	SET_NZCV(1);
 	return 1; 
 }
@@ -3331,15 +4433,15 @@ static int OP_SUB_REG(const u32 i)
 	if (_REG_NUM(i, 0) == _REG_NUM(i, 3))
 	{
 		GpVar tmp = c.newGpVar(kX86VarTypeGpd);
-		c.mov(tmp, reg_pos_thumb(6));
-		c.sub(reg_pos_thumb(0), tmp);
+		c.mov(tmp, reg_thumb_r(6));
+		c.sub(reg_thumb_rw(0), tmp);
 	}
 	else
 	{
 		GpVar tmp = c.newGpVar(kX86VarTypeGpd);
-		c.mov(tmp, reg_pos_thumb(3));
-		c.sub(tmp, reg_pos_thumb(6));
-		c.mov(reg_pos_thumb(0), tmp);
+		c.mov(tmp, reg_thumb_r(3));
+		c.sub(tmp, reg_thumb_r(6));
+		c.mov(reg_thumb_w(0), tmp);
 	}
 	SET_NZCV(1);
 	return 1; 
@@ -3351,9 +4453,9 @@ static int OP_SUB_REG(const u32 i)
 static int OP_ADC_REG(const u32 i)
 {
 	GpVar tmp = c.newGpVar(kX86VarTypeGpd);
-	c.mov(tmp, reg_pos_thumb(3));
+	c.mov(tmp, reg_thumb_r(3));
 	GET_CARRY(0);
-	c.adc(reg_pos_thumb(0), tmp);
+	c.adc(reg_thumb_rw(0), tmp);
 	SET_NZCV(0);
 	return 1;
 }
@@ -3364,9 +4466,9 @@ static int OP_ADC_REG(const u32 i)
 static int OP_SBC_REG(const u32 i)
 {
 	GpVar tmp = c.newGpVar(kX86VarTypeGpd);
-	c.mov(tmp, reg_pos_thumb(3));
+	c.mov(tmp, reg_thumb_r(3));
 	GET_CARRY(1);
-	c.sbb(reg_pos_thumb(0), tmp);
+	c.sbb(reg_thumb_rw(0), tmp);
 	SET_NZCV(1);
 	return 1;
 }
@@ -3376,8 +4478,8 @@ static int OP_SBC_REG(const u32 i)
 //-----------------------------------------------------------------------------
 static int OP_MOV_IMM8(const u32 i)
 {
-	c.mov(reg_pos_thumb(8), (i & 0xFF));
-	c.cmp(reg_pos_thumb(8), 0);
+	c.mov(reg_thumb_w(8), (i & 0xFF));
+	c.cmp(reg_thumb_r(8), 0);
 	SET_NZ(0);
 	return 1;
 }
@@ -3387,8 +4489,8 @@ static int OP_MOV_SPE(const u32 i)
 	u32 Rd = _REG_NUM(i, 0) | ((i>>4)&8);
 	//cpu->R[Rd] = cpu->R[REG_POS(i, 3)];
 	GpVar tmp = c.newGpVar(kX86VarTypeGpd);
-	c.mov(tmp, reg_pos_ptr(3));
-	c.mov(reg_ptr(Rd), tmp);
+	c.mov(tmp, reg_pos_r(3));
+	c.mov(reg_write(Rd), tmp);
 	if(Rd == 15)
 	{
 		c.mov(cpu_ptr(next_instruction), tmp);
@@ -3401,10 +4503,10 @@ static int OP_MOV_SPE(const u32 i)
 static int OP_MVN(const u32 i)
 {
 	GpVar tmp = c.newGpVar(kX86VarTypeGpd);
-	c.mov(tmp, reg_pos_thumb(3));
+	c.mov(tmp, reg_thumb_r(3));
 	c.not_(tmp);
 	c.cmp(tmp, 0);
-	c.mov(reg_pos_thumb(0), tmp);
+	c.mov(reg_thumb_w(0), tmp);
 	SET_NZ(0);
 	return 1;
 }
@@ -3415,10 +4517,10 @@ static int OP_MVN(const u32 i)
 static int OP_MUL_REG(const u32 i) 
 {
 	GpVar lhs = c.newGpVar(kX86VarTypeGpd);
-	c.mov(lhs, reg_pos_thumb(0));
-	c.imul(lhs, reg_pos_thumb(3));
+	c.mov(lhs, reg_thumb_r(0));
+	c.imul(lhs, reg_thumb_r(3));
 	c.cmp(lhs, 0);
-	c.mov(reg_pos_thumb(0), lhs);
+	c.mov(reg_thumb_w(0), lhs);
 	SET_NZ(0);
 	if (PROCNUM == ARMCPU_ARM7)
 		c.mov(bb_cycles, 4);
@@ -3432,7 +4534,7 @@ static int OP_MUL_REG(const u32 i)
 //-----------------------------------------------------------------------------
 static int OP_CMP_IMM8(const u32 i) 
 {
-	c.cmp(reg_pos_thumb(8), (i & 0xFF));
+	c.cmp(reg_thumb_r(8), (i & 0xFF));
 	SET_NZCV(1);
 	return 1; 
 }
@@ -3440,8 +4542,8 @@ static int OP_CMP_IMM8(const u32 i)
 static int OP_CMP(const u32 i) 
 {
 	GpVar tmp = c.newGpVar(kX86VarTypeGpd);
-	c.mov(tmp, reg_pos_thumb(3));
-	c.cmp(reg_pos_thumb(0), tmp);
+	c.mov(tmp, reg_thumb_r(3));
+	c.cmp(reg_thumb_r(0), tmp);
 	SET_NZCV(1);
 	return 1; 
 }
@@ -3450,8 +4552,8 @@ static int OP_CMP_SPE(const u32 i)
 {
 	u32 Rn = (i&7) | ((i>>4)&8);
 	GpVar tmp = c.newGpVar(kX86VarTypeGpd);
-	c.mov(tmp, reg_pos_ptr(3));
-	c.cmp(reg_ptr(Rn), tmp);
+	c.mov(tmp, reg_pos_r(3));
+	c.cmp(reg_read(Rn), tmp);
 	SET_NZCV(1);
 	return 1; 
 }
@@ -3459,8 +4561,8 @@ static int OP_CMP_SPE(const u32 i)
 static int OP_CMN(const u32 i) 
 {
 	GpVar tmp = c.newGpVar(kX86VarTypeGpd);
-	c.mov(tmp, reg_pos_thumb(0));
-	c.add(tmp, reg_pos_thumb(3));
+	c.mov(tmp, reg_thumb_r(0));
+	c.add(tmp, reg_thumb_r(3));
 	SET_NZCV(0);
 	return 1; 
 }
@@ -3471,8 +4573,8 @@ static int OP_CMN(const u32 i)
 static int OP_TST(const u32 i)
 {
 	GpVar tmp = c.newGpVar(kX86VarTypeGpd);
-	c.mov(tmp, reg_pos_thumb(3));
-	c.test(reg_pos_thumb(0), tmp);
+	c.mov(tmp, reg_thumb_r(3));
+	c.test(reg_thumb_r(0), tmp);
 	SET_NZ(0);
 	return 1;
 }
@@ -3485,7 +4587,7 @@ static int OP_TST(const u32 i)
 	GpVar data = c.newGpVar(kX86VarTypeGpd); \
 	u32 adr_first = cpu->R[_REG_NUM(i, 3)]; \
 	 \
-	c.mov(addr, reg_pos_thumb(3)); \
+	c.mov(addr, reg_thumb_r(3)); \
 	if ((offset) != -1) \
 	{ \
 		if ((offset) != 0) \
@@ -3496,15 +4598,11 @@ static int OP_TST(const u32 i)
 	} \
 	else \
 	{ \
-		c.add(addr, reg_pos_thumb(6)); \
+		c.add(addr, reg_thumb_r(6)); \
 		adr_first += cpu->R[_REG_NUM(i, 6)]; \
 	} \
-	c.mov(data, reg_pos_thumb(0)); \
-	X86CompilerFuncCall *ctx = c.call((void*)mem_op##_tab[PROCNUM][classify_adr(adr_first,1)]); \
-	ctx->setPrototype(ASMJIT_CALL_CONV, FuncBuilder2<Void, u32, u32>()); \
-	ctx->setArgument(0, addr); \
-	ctx->setArgument(1, data); \
-	ctx->setReturn(bb_cycles); \
+	c.mov(data, reg_thumb_r(0)); \
+	emit_store(mem_op##_tab[PROCNUM], FASTMEM_##mem_op, adr_first, addr, data); \
 	return 1;
 
 #define LDR_THUMB(mem_op, offset) \
@@ -3512,7 +4610,7 @@ static int OP_TST(const u32 i)
 	GpVar data = c.newGpVar(kX86VarTypeGpz); \
 	u32 adr_first = cpu->R[_REG_NUM(i, 3)]; \
 	 \
-	c.mov(addr, reg_pos_thumb(3)); \
+	c.mov(addr, reg_thumb_r(3)); \
 	if ((offset) != -1) \
 	{ \
 		if ((offset) != 0) \
@@ -3523,15 +4621,12 @@ static int OP_TST(const u32 i)
 	} \
 	else \
 	{ \
-		c.add(addr, reg_pos_thumb(6)); \
+		c.add(addr, reg_thumb_r(6)); \
 		adr_first += cpu->R[_REG_NUM(i, 6)]; \
 	} \
 	c.lea(data, reg_pos_thumb(0)); \
-	X86CompilerFuncCall *ctx = c.call((void*)mem_op##_tab[PROCNUM][classify_adr(adr_first,0)]); \
-	ctx->setPrototype(ASMJIT_CALL_CONV, FuncBuilder2<Void, u32, u32*>()); \
-	ctx->setArgument(0, addr); \
-	ctx->setArgument(1, data); \
-	ctx->setReturn(bb_cycles); \
+	emit_load(mem_op##_tab[PROCNUM], FASTMEM_##mem_op, adr_first, addr, data); \
+	reg_invalidate(REG_BIT(_REG_NUM(i, 0))); \
 	return 1;
 
 static int OP_STRB_IMM_OFF(const u32 i) { STR_THUMB(STRB, ((i>>6)&0x1F)); }
@@ -3557,15 +4652,11 @@ static int OP_STR_SPREL(const u32 i)
 	u32 adr_first = cpu->R[13] + imm;
 
 	GpVar addr = c.newGpVar(kX86VarTypeGpd);
-	c.mov(addr, reg_ptr(13));
+	c.mov(addr, reg_read(13));
 	if (imm) c.add(addr, imm);
 	GpVar data = c.newGpVar(kX86VarTypeGpd);
-	c.mov(data, reg_pos_thumb(8));
-	X86CompilerFuncCall *ctx = c.call((void*)STR_tab[PROCNUM][classify_adr(adr_first,1)]);
-	ctx->setPrototype(ASMJIT_CALL_CONV, FuncBuilder2<Void, u32, u32>());
-	ctx->setArgument(0, addr);
-	ctx->setArgument(1, data);
-	ctx->setReturn(bb_cycles);
+	c.mov(data, reg_thumb_r(8));
+	emit_store(STR_tab[PROCNUM], FASTMEM_STR, adr_first, addr, data);
 	return 1;
 }
 
@@ -3575,15 +4666,12 @@ static int OP_LDR_SPREL(const u32 i)
 	u32 adr_first = cpu->R[13] + imm;
 	
 	GpVar addr = c.newGpVar(kX86VarTypeGpd);
-	c.mov(addr, reg_ptr(13));
+	c.mov(addr, reg_read(13));
 	if (imm) c.add(addr, imm);
 	GpVar data = c.newGpVar(kX86VarTypeGpz);
 	c.lea(data, reg_pos_thumb(8));
-	X86CompilerFuncCall *ctx = c.call((void*)LDR_tab[PROCNUM][classify_adr(adr_first,0)]);
-	ctx->setPrototype(ASMJIT_CALL_CONV, FuncBuilder2<Void, u32, u32*>());
-	ctx->setArgument(0, addr);
-	ctx->setArgument(1, data);
-	ctx->setReturn(bb_cycles);
+	emit_load(LDR_tab[PROCNUM], FASTMEM_LDR, adr_first, addr, data);
+	reg_invalidate(REG_BIT(_REG_NUM(i, 8)));
 	return 1;
 }
 
@@ -3595,11 +4683,8 @@ static int OP_LDR_PCREL(const u32 i)
 	GpVar data = c.newGpVar(kX86VarTypeGpz);
 	c.mov(addr, adr_first);
 	c.lea(data, reg_pos_thumb(8));
-	X86CompilerFuncCall *ctx = c.call((void*)LDR_tab[PROCNUM][classify_adr(adr_first,0)]);
-	ctx->setPrototype(ASMJIT_CALL_CONV, FuncBuilder2<Void, u32, u32*>());
-	ctx->setArgument(0, addr);
-	ctx->setArgument(1, data);
-	ctx->setReturn(bb_cycles);
+	emit_load(LDR_tab[PROCNUM], FASTMEM_LDR, adr_first, addr, data);
+	reg_invalidate(REG_BIT(_REG_NUM(i, 8)));
 	return 1;
 }
 
@@ -3615,7 +4700,7 @@ static int op_ldm_stm_thumb(u32 i, bool store)
 	//	printf("WARNING - %sIA with Rb in Rlist (THUMB)\n", store?"STM":"LDM");
 
 	GpVar adr = c.newGpVar(kX86VarTypeGpd);
-	c.mov(adr, reg_pos_thumb(8));
+	c.mov(adr, reg_thumb_r(8));
 
 	call_ldm_stm(adr, bitmask, store, 1);
 
@@ -3623,11 +4708,11 @@ static int op_ldm_stm_thumb(u32 i, bool store)
 	// ARM_REF:	If the base register <Rn> is specified in <registers>, the final value of <Rn> is the loaded value
 	//			(not the written-back value).
 	if (store)
-		c.add(reg_pos_thumb(8), 4*pop);
+		c.add(reg_thumb_rw(8), 4*pop);
 	else
 	{
 		if (!BIT_N(i, _REG_NUM(i, 8)))
-			c.add(reg_pos_thumb(8), 4*pop);
+			c.add(reg_thumb_rw(8), 4*pop);
 	}
 
 	emit_MMU_aluMemCycles(store ? 2 : 3, bb_cycles, pop);
@@ -3640,8 +4725,8 @@ static int OP_STMIA_THUMB(const u32 i) { return op_ldm_stm_thumb(i, 1); }
 //-----------------------------------------------------------------------------
 //   Adjust SP
 //-----------------------------------------------------------------------------
-static int OP_ADJUST_P_SP(const u32 i) { c.add(reg_ptr(13), ((i&0x7F)<<2)); return 1; }
-static int OP_ADJUST_M_SP(const u32 i) { c.sub(reg_ptr(13), ((i&0x7F)<<2)); return 1; }
+static int OP_ADJUST_P_SP(const u32 i) { c.add(reg_rw(13), ((i&0x7F)<<2)); return 1; }
+static int OP_ADJUST_M_SP(const u32 i) { c.sub(reg_rw(13), ((i&0x7F)<<2)); return 1; }
 
 //-----------------------------------------------------------------------------
 //   PUSH / POP
@@ -3654,15 +4739,15 @@ static int op_push_pop(u32 i, bool store, bool pc_lr)
 	int dir = store ? -1 : 1;
 
 	GpVar adr = c.newGpVar(kX86VarTypeGpd);
-	c.mov(adr, reg_ptr(13));
+	c.mov(adr, reg_read(13));
 	if(store)
 		c.sub(adr, 4);
 
 	call_ldm_stm(adr, bitmask, store, dir);
 
 	if(pc_lr && !store)
-		op_bx_thumb(reg_ptr(15), 0, PROCNUM == ARMCPU_ARM9);
-	c.add(reg_ptr(13), 4*dir*pop);
+		op_bx_thumb(reg_read(15), 0, PROCNUM == ARMCPU_ARM9);
+	c.add(reg_rw(13), 4*dir*pop);
 
 	emit_MMU_aluMemCycles(store ? (pc_lr?4:3) : (pc_lr?5:2), bb_cycles, pop);
 	return 1;
@@ -3702,11 +4787,11 @@ static int OP_B_UNCOND(const u32 i)
 static int OP_BLX(const u32 i)
 {
 	GpVar dst = c.newGpVar(kX86VarTypeGpd);
-	c.mov(dst, reg_ptr(14));
+	c.mov(dst, reg_read(14));
 	c.add(dst, (i&0x7FF) << 1);
 	c.and_(dst, 0xFFFFFFFC);
 	c.mov(cpu_ptr(instruct_adr), dst);
-	c.mov(reg_ptr(14), bb_next_instruction | 1);
+	c.mov(reg_write(14), bb_next_instruction | 1);
 	// reset T bit
 	c.and_(cpu_ptr_byte(CPSR, 0), ~(1<<5));
 	return 1;
@@ -3715,21 +4800,21 @@ static int OP_BLX(const u32 i)
 static int OP_BL_10(const u32 i)
 {
 	u32 dst = bb_r15 + (SIGNEXTEND_11(i)<<12);
-	c.mov(reg_ptr(14), dst);
+	c.mov(reg_write(14), dst);
 	return 1;
 }
 
 static int OP_BL_11(const u32 i) 
 {
 	GpVar dst = c.newGpVar(kX86VarTypeGpd);
-	c.mov(dst, reg_ptr(14));
+	c.mov(dst, reg_read(14));
 	c.add(dst, (i&0x7FF) << 1);
 	c.mov(cpu_ptr(instruct_adr), dst);
-	c.mov(reg_ptr(14), bb_next_instruction | 1);
+	c.mov(reg_write(14), bb_next_instruction | 1);
 	return 1;
 }
 
-static int op_bx_thumb(Mem srcreg, bool blx, bool test_thumb)
+static int op_bx_thumb(GpVar srcreg, bool blx, bool test_thumb)
 {
 	GpVar dst = c.newGpVar(kX86VarTypeGpd);
 	GpVar thumb = c.newGpVar(kX86VarTypeGpd);
@@ -3737,7 +4822,7 @@ static int op_bx_thumb(Mem srcreg, bool blx, bool test_thumb)
 	c.mov(thumb, dst);								// * cpu->CPSR.bits.T = BIT0(Rm);
 	c.and_(thumb, 1);								// *
 	if (blx)
-		c.mov(reg_ptr(14), bb_next_instruction | 1);
+		c.mov(reg_write(14), bb_next_instruction | 1);
 	if(test_thumb)
 	{
 		GpVar mask = c.newGpVar(kX86VarTypeGpd);
@@ -3758,8 +4843,8 @@ static int op_bx_thumb(Mem srcreg, bool blx, bool test_thumb)
 	return 1;
 }
 
-static int OP_BX_THUMB(const u32 i) { if (REG_POS(i, 3) == 15) c.mov(reg_ptr(15), bb_r15); return op_bx_thumb(reg_pos_ptr(3), 0, 0); }
-static int OP_BLX_THUMB(const u32 i) { return op_bx_thumb(reg_pos_ptr(3), 1, 1); }
+static int OP_BX_THUMB(const u32 i) { if (REG_POS(i, 3) == 15) c.mov(reg_write(15), bb_r15); return op_bx_thumb(reg_pos_r(3), 0, 0); }
+static int OP_BLX_THUMB(const u32 i) { return op_bx_thumb(reg_pos_r(3), 1, 1); }
 
 static int OP_SWI_THUMB(const u32 i) { return op_swi(i & 0x1F); }
 
@@ -3917,6 +5002,51 @@ static bool instr_does_prefetch(u32 opcode)
 			   && ((x & BRANCH_ALWAYS) || (x & BRANCH_LDM));
 }
 
+// the addresses a block ending in this instruction is statically known to continue at.
+// these are only candidates for block linking, the exit code still checks instruct_adr.
+static int instr_successors(u32 opcode, u32 *succ)
+{
+	int count = 0;
+	bool fallthrough;
+
+	if(bb_thumb)
+	{
+		if((opcode & 0xF000) == 0xD000 && ((opcode>>8) & 0xF) < 0xE)
+		{
+			// B<cond>
+			succ[count++] = bb_r15 + ((s32)(s8)opcode << 1);
+			fallthrough = true;
+		}
+		else if((opcode & 0xF800) == 0xE000)
+		{
+			// B
+			succ[count++] = bb_r15 + ((s32)(opcode << 21) >> 20);
+			fallthrough = false;
+		}
+		else
+			fallthrough = !instr_is_branch(opcode) || !(instr_attributes(opcode) & (BRANCH_ALWAYS|BRANCH_POS0));
+	}
+	else
+	{
+		if((opcode & 0x0E000000) == 0x0A000000)
+		{
+			// B, BL, BLX imm
+			u32 target = bb_r15 + ((s32)(opcode << 8) >> 6);
+			if(CONDITION(opcode) == 0xF)
+				target += (opcode >> 23) & 2;
+			succ[count++] = target;
+			fallthrough = instr_is_conditional(opcode);
+		}
+		else
+			fallthrough = !instr_is_branch(opcode) || instr_is_conditional(opcode)
+			              || !(instr_attributes(opcode) & (BRANCH_ALWAYS|BRANCH_POS12|BRANCH_LDM));
+	}
+
+	if(fallthrough)
+		succ[count++] = bb_next_instruction;
+	return count;
+}
+
 static const char *disassemble(u32 opcode)
 {
 	if(bb_thumb)
@@ -3958,7 +5088,7 @@ static void sync_r15(u32 opcode, bool is_last, bool force)
 		if(instr_uses_r15(opcode))
 		{
 			JIT_COMMENT("sync_r15: R15 %08Xh (USES R15)", bb_r15);
-			c.mov(reg_ptr(15), bb_r15);
+			c.mov(reg_write(15), bb_r15);
 		}
 		if(instr_attributes(opcode) & JIT_BYPASS)
 		{
@@ -3974,13 +5104,13 @@ static void emit_branch(int cond, Label to)
 	static const u8 cond_bit[] = {0x40, 0x40, 0x20, 0x20, 0x80, 0x80, 0x10, 0x10};
 	if(cond < 8)
 	{
-		c.test(flags_ptr, cond_bit[cond]);
+		c.test(flags_r, cond_bit[cond]);
 		(cond & 1)?c.jnz(to):c.jz(to);
 	}
 	else
 	{
 		GpVar x = c.newGpVar(kX86VarTypeGpz);
-		c.movzx(x, flags_ptr);
+		c.mov(x.r32(), flags_r);
 		c.and_(x, 0xF0);
 #if defined(_M_X64) || defined(__x86_64__)
 		c.add(x, offsetof(armcpu_t,cond_table) + cond);
@@ -4001,6 +5131,7 @@ static void emit_armop_call(u32 opcode)
 		return;
 
 	JIT_COMMENT("call interpreter");
+	reg_flush(REG_ALL, true);
 	GpVar arg = c.newGpVar(kX86VarTypeGpd);
 	c.mov(arg, opcode);
 	OpFunc f = bb_thumb ? thumb_instructions_set[PROCNUM][opcode>>6]
@@ -4033,8 +5164,167 @@ static void _armlog(u8 proc, u32 addr, u32 opcode)
 #endif
 }
 
+// block linking: when the block ends up at one of its static successors, hand that one's
+// compiled code to armcpu_exec so it runs next without going back through armInnerLoop.
+// each block charges its cycles to jit_link_budget on the way out, so the chain stops exactly
+// where armInnerLoop would have switched to the other cpu or the sequencer. the successors are
+// taken from their compiled_funcs entries, which the memory write paths clear, so an
+// invalidated block is unlinked for free and its recompiled code is picked up without patching.
+template<int PROCNUM>
+static void emit_block_link(u32 opcode)
+{
+	u32 succ[2];
+	int count = instr_successors(opcode, succ);
+	if(count == 0)
+		return;
+
+	JIT_COMMENT("block linking");
+	Label unlinked = c.newLabel();
+
+	GpVar x = c.newGpVar(kX86VarTypeGpz);
+	c.mov(x, bb_total_cycles);
+	if(PROCNUM == ARMCPU_ARM7)
+		c.shl(x, 1);
+	c.sub(cpu_ptr(jit_link_budget), x.r32());
+	c.jle(unlinked);
+	c.cmp(cpu_ptr(waitIRQ), 0);
+	c.jne(unlinked);
+	emit_ptr(x, &nds.freezeBus);
+	c.cmp(dword_ptr(x), 0);
+	c.jne(unlinked);
+	emit_ptr(x, &execute);
+	c.cmp(byte_ptr(x), 0);
+	c.je(unlinked);
+
+	GpVar adr = c.newGpVar(kX86VarTypeGpd);
+	c.mov(adr, cpu_ptr(instruct_adr));
+	for(int i = 0; i < count; i++)
+	{
+		if(!JIT_MAPPED(succ[i] & 0x0FFFFFFF, PROCNUM))
+			continue;
+		Label next = c.newLabel();
+		c.cmp(adr, succ[i]);
+		c.jne(next);
+		emit_ptr(x, &JIT_COMPILED_FUNC(succ[i], PROCNUM));
+		c.mov(x, sysint_ptr(x));
+		c.mov(sysint_ptr(bb_cpu, offsetof(armcpu_t, jit_link_next)), x);
+		c.jmp(unlinked);
+		c.bind(next);
+	}
+	c.unuse(adr);
+	c.unuse(x);
+	c.bind(unlinked);
+}
+
+// superblocks: once a profiled block has been entered JIT_HOT_ENTRIES times it clears its own
+// compiled_funcs entry, and the next dispatch rebuilds it as a superblock. that carries on
+// past B/BL to their target, and past a conditional branch to the side its profile says it
+// takes at least 3 times out of 4, checking instruct_adr there and leaving through a side exit
+// when the branch went the other way. the guest registers stay cached across the whole trace
+// and its constant cycles are added up once per exit.
+#define JIT_TRACE_MAX_BLOCKS 8
+#define JIT_TRACE_MIN_SAMPLES 32
+
+template<int PROCNUM>
+static void emit_profile_entry(JitProfile *prof, u32 adr)
+{
+	JIT_COMMENT("superblock profile: entries");
+	Label warm = c.newLabel();
+	GpVar x = c.newGpVar(kX86VarTypeGpz);
+	emit_ptr(x, &prof->credits);
+	c.sub(dword_ptr(x), 1);
+	c.jnz(warm);
+	emit_ptr(x, &JIT_COMPILED_FUNC(adr, PROCNUM));
+	c.mov(sysint_ptr(x), 0);
+	c.bind(warm);
+	c.unuse(x);
+}
+
+static bool instr_is_static_branch(u32 opcode)
+{
+	if(bb_thumb)
+		return ((opcode & 0xF000) == 0xD000 && ((opcode>>8) & 0xF) < 0xE) || (opcode & 0xF800) == 0xE000;
+	return (opcode & 0x0E000000) == 0x0A000000 && CONDITION(opcode) != 0xF;
+}
+
+// counts the block's final branch going to its target, instruct_adr must be final
+static void emit_profile_branch(JitProfile *prof, u32 opcode)
+{
+	u32 succ[2];
+	if(!instr_is_static_branch(opcode) || instr_successors(opcode, succ) != 2)
+		return;
+	prof->branch = bb_adr;
+
+	JIT_COMMENT("superblock profile: branch taken");
+	Label not_taken = c.newLabel();
+	c.cmp(cpu_ptr(instruct_adr), succ[0]);
+	c.jne(not_taken);
+	GpVar x = c.newGpVar(kX86VarTypeGpz);
+	emit_ptr(x, &prof->taken);
+	c.add(dword_ptr(x), 1);
+	c.unuse(x);
+	c.bind(not_taken);
+}
+
+// where a superblock goes on after the branch opcode that ends the basic block starting at
+// bb_start, 0 to end it there. *guard is set when the branch may go elsewhere.
 template<int PROCNUM>
-static u32 compile_basicblock()
+static u32 trace_successor(u32 opcode, u32 bb_start, bool *guard)
+{
+	u32 succ[2];
+	if(!instr_is_static_branch(opcode))
+		return 0;
+	int count = instr_successors(opcode, succ);
+	*guard = count == 2;
+	if(count == 1)
+		return succ[0];
+
+	JitProfile *prof = jit_profile_find(PROCNUM, bb_start, bb_thumb);
+	if(!prof || prof->branch != (u32)bb_adr)
+		return 0;
+	u32 entries = JIT_HOT_ENTRIES - std::max(prof->credits, 0);
+	if(entries < JIT_TRACE_MIN_SAMPLES)
+		return 0;
+	if(prof->taken * 4 >= entries * 3)
+		return succ[0];
+	if(prof->taken * 4 <= entries)
+		return succ[1];
+	return 0;
+}
+
+// leaves the superblock at a branch it follows when the branch went elsewhere, or when the
+// code before it has written over the superblock itself (which drops its compiled_funcs entry)
+template<int PROCNUM>
+static void emit_side_exit(u32 opcode, u32 head, bool guard, u32 expected)
+{
+	JIT_COMMENT("superblock: side exit unless %08X", expected);
+	Label stay = c.newLabel();
+	Label leave = c.newLabel();
+	if(guard)
+	{
+		c.cmp(cpu_ptr(instruct_adr), expected);
+		c.jne(leave);
+	}
+	GpVar x = c.newGpVar(kX86VarTypeGpz);
+	emit_ptr(x, &JIT_COMPILED_FUNC(head, PROCNUM));
+	c.cmp(sysint_ptr(x), 0);
+	c.unuse(x);
+	c.jne(stay);
+	c.bind(leave);
+	u8 state[17];
+	memcpy(state, bb_reg_state, sizeof(state));
+	reg_flush(REG_ALL, false);
+	if(bb_constant_cycles > 0)
+		c.add(bb_total_cycles, bb_constant_cycles);
+	if(CommonSettings.jit_link_blocks)
+		emit_block_link<PROCNUM>(opcode);
+	c.ret(bb_total_cycles);
+	memcpy(bb_reg_state, state, sizeof(state));
+	c.bind(stay);
+}
+
+template<int PROCNUM>
+static u32 compile_basicblock(bool superblock)
 {
 #if LOG_JIT
 	bool has_variable_cycles = FALSE;
@@ -4046,6 +5336,14 @@ static u32 compile_basicblock()
 	bb_thumb = cpu->CPSR.bits.T;
 	bb_opcodesize = bb_thumb ? 2 : 4;
 
+	// guest code the block was built from, one range per basic block of a superblock
+	u32 range_start[JIT_TRACE_MAX_BLOCKS], range_end[JIT_TRACE_MAX_BLOCKS];
+	u32 ranges = 0;
+	JitProfile *hot = superblock ? jit_profile_find(PROCNUM, start_adr, bb_thumb) : NULL;
+	JitProfile *prof = NULL;
+	if(CommonSettings.jit_superblocks && !superblock)
+		prof = jit_profile_claim(PROCNUM, start_adr, bb_thumb);
+
 	if (!JIT_MAPPED(start_adr & 0x0FFFFFFF, PROCNUM))
 	{
 		printf("JIT: use unmapped memory address %08X\n", start_adr);
@@ -4058,13 +5356,16 @@ static u32 compile_basicblock()
 #endif
 
 	c.clear();
+#ifdef HAVE_STATIC_CODE_BUFFER
+	jit_ptr_pool.clear();
+#endif
 	c.newFunc(ASMJIT_CALL_CONV, FuncBuilder0<int>());
 	c.getFunc()->setHint(kFuncHintNaked, true);
 	c.getFunc()->setHint(kX86FuncHintPushPop, true);
 	
 	JIT_COMMENT("CPU ptr");
 	bb_cpu = c.newGpVar(kX86VarTypeGpz);
-	c.mov(bb_cpu, (uintptr_t)&ARMPROC);
+	emit_ptr(bb_cpu, &ARMPROC);
 
 	JIT_COMMENT("reset bb_total_cycles");
 	bb_total_cycles = c.newGpVar(kX86VarTypeGpz);
@@ -4073,13 +5374,22 @@ static u32 compile_basicblock()
 #if (PROFILER_JIT_LEVEL > 0)
 	JIT_COMMENT("Profiler ptr");
 	bb_profiler = c.newGpVar(kX86VarTypeGpz);
-	c.mov(bb_profiler, (uintptr_t)&profiler_counter[PROCNUM]);
+	emit_ptr(bb_profiler, &profiler_counter[PROCNUM]);
 #endif
 
+	if(prof)
+		emit_profile_entry<PROCNUM>(prof, start_adr);
+
 	bb_constant_cycles = 0;
+	memset(bb_reg_state, REG_MEM, sizeof(bb_reg_state));
+	u32 next_adr = start_adr;
+	u32 bb_start = start_adr;
+	bool interpreting = true;
+	range_start[0] = start_adr;
 	for(u32 i=0, bEndBlock = 0; bEndBlock == 0; i++)
 	{
-		bb_adr = start_adr + (i * bb_opcodesize);
+		bb_adr = next_adr;
+		next_adr = bb_adr + bb_opcodesize;
 		if(bb_thumb)
 			opcode = _MMU_read16<PROCNUM, MMU_AT_CODE>(bb_adr);
 		else
@@ -4123,6 +5433,11 @@ static u32 compile_basicblock()
 			if(bEndBlock) sync_r15(opcode, 1, 1);
 			Label skip = c.newLabel();
 			emit_branch(CONDITION(opcode), skip);
+			GpVar before_reg[17];
+			u8 before_state[17];
+			for(u32 n = 0; n < 17; n++)
+				before_reg[n] = bb_reg[n];
+			memcpy(before_state, bb_reg_state, sizeof(bb_reg_state));
 			if(!bEndBlock) sync_r15(opcode, 0, 0);
 			emit_armop_call(opcode);
 			
@@ -4137,6 +5452,7 @@ static u32 compile_basicblock()
 					JIT_COMMENT("cycles (%d)", cycles);
 					c.lea(bb_total_cycles, ptr(bb_total_cycles.r64(), -1));
 				}
+			reg_merge(before_reg, before_state);
 			c.bind(skip);
 		}
 		else
@@ -4149,9 +5465,41 @@ static u32 compile_basicblock()
 				c.lea(bb_total_cycles, ptr(bb_total_cycles.r64(), bb_cycles.r64(), kScaleNone));
 			}
 		}
-		interpreted_cycles += op_decode[PROCNUM][bb_thumb]();
+		// the first run goes through the interpreter, up to where it leaves the superblock
+		if(interpreting)
+			interpreted_cycles += op_decode[PROCNUM][bb_thumb]();
+
+		bool guard = false;
+		u32 follow = 0;
+		if(superblock && bEndBlock && i < CommonSettings.jit_max_block_size - 1 && ranges + 1 < JIT_TRACE_MAX_BLOCKS)
+			follow = trace_successor<PROCNUM>(opcode, bb_start, &guard);
+		if(follow && !JIT_MAPPED(follow & 0x0FFFFFFF, PROCNUM))
+			follow = 0;
+		range_end[ranges] = bb_adr;
+		for(u32 r = 0; follow && r <= ranges; r++)
+			if(follow >= range_start[r] && follow <= range_end[r])
+				follow = 0;
+		if(follow)
+		{
+			if(!instr_does_prefetch(opcode))
+			{
+				GpVar x = c.newGpVar(kX86VarTypeGpd);
+				c.mov(x, cpu_ptr(next_instruction));
+				c.mov(cpu_ptr(instruct_adr), x);
+				c.unuse(x);
+			}
+			emit_side_exit<PROCNUM>(opcode, start_adr, guard, follow);
+			if(interpreting && cpu->instruct_adr != follow)
+				interpreting = false;
+			range_start[++ranges] = follow;
+			bb_start = next_adr = follow;
+			bEndBlock = 0;
+		}
 	}
-	
+	ranges++;
+
+	reg_flush(REG_ALL, false);
+
 	if(!instr_does_prefetch(opcode))
 	{
 		JIT_COMMENT("!instr_does_prefetch: copy next_instruction (%08X) to instruct_adr (%08X)", cpu->next_instruction, cpu->instruct_adr);
@@ -4162,6 +5510,8 @@ static u32 compile_basicblock()
 		//c.mov(cpu_ptr(instruct_adr), bb_adr);
 		//c.mov(cpu_ptr(instruct_adr), bb_next_instruction);
 	}
+	if(prof)
+		emit_profile_branch(prof, opcode);
 
 	JIT_COMMENT("total cycles (block)");
 
@@ -4172,22 +5522,32 @@ static u32 compile_basicblock()
 	JIT_COMMENT("*** profiler - cycles");
 	u32 padr = ((start_adr & 0x07FFFFFE) >> 1);
 	bb_profiler_entry = c.newGpVar(kX86VarTypeGpz);
-	c.mov(bb_profiler_entry, (uintptr_t)&profiler_entry[PROCNUM][padr]);
+	emit_ptr(bb_profiler_entry, &profiler_entry[PROCNUM][padr]);
 	c.add(dword_ptr(bb_profiler_entry, offsetof(PROFILER_ENTRY, cycles)), bb_total_cycles);
 	profiler_entry[PROCNUM][padr].addr = start_adr;
 #endif
 
+	if(CommonSettings.jit_link_blocks)
+		emit_block_link<PROCNUM>(opcode);
+
 	c.ret(bb_total_cycles);
 #if LOG_JIT
 	fprintf(stderr, "cycles %d%s\n", bb_constant_cycles, has_variable_cycles ? " + variable" : "");
 #endif
 	c.endFunc();
+	emit_ptr_pool();
 
 	ArmOpCompiled f = (ArmOpCompiled)c.make();
+	u8 *code = (u8*)f;
+	u32 code_size = 0;
+#ifdef HAVE_STATIC_CODE_BUFFER
+	code_size = scratch_size;
+#endif
 	if(c.getError())
 	{
 		fprintf(stderr, "JIT error at %s%c-%08X: %s\n", bb_thumb?"THUMB":"ARM", PROCNUM?'7':'9', start_adr, getErrorString(c.getError()));
 		f = op_decode[PROCNUM][bb_thumb];
+		code = NULL;
 	}
 #if LOG_JIT
 	uintptr_t baddr = (uintptr_t)f;
@@ -4195,27 +5555,83 @@ static u32 compile_basicblock()
 	fflush(stderr);
 #endif
 	
-	JIT_COMPILED_FUNC(start_adr, PROCNUM) = (uintptr_t)f;
+	// the block it replaces is still registered when tiering up, drop it first so its
+	// compiled_funcs entry and profile slot go with it
+	if(hot && hot->live && hot->block != JIT_NO_PROFILE)
+		jit_drop_block(hot->block);
+
+	uintptr_t *entry = &JIT_COMPILED_FUNC(start_adr, PROCNUM);
+	u32 id = 0;
+	for(u32 r = 0; r < ranges; r++)
+	{
+		u32 first = &JIT_COMPILED_FUNC(range_start[r], PROCNUM) - JIT_SLOT_BASE;
+		u32 last = &JIT_COMPILED_FUNC(range_end[r] + bb_opcodesize - 2, PROCNUM) - JIT_SLOT_BASE;
+		if(last < first)
+			last = first;
+		if(r == 0)
+			id = jit_register_block(PROCNUM, entry, (uintptr_t)f, first, last, code, code_size);
+		else
+			jit_register_part(id, first, last);
+	}
+	*entry = (uintptr_t)f;
+	if(prof)
+	{
+		prof->block = id;
+		jit_blocks[id].profile = prof - jit_profile[PROCNUM];
+	}
+	arm_jit_stats[PROCNUM].blocks++;
+	if(superblock)
+		arm_jit_stats[PROCNUM].superblocks++;
+#ifdef HAVE_STATIC_CODE_BUFFER
+	else if(code)
+		jit_cache_store<PROCNUM>(start_adr, bb_thumb, (bb_adr - start_adr) / bb_opcodesize + 1);
+#endif
 	return interpreted_cycles;
 }
 
 template<int PROCNUM> u32 arm_jit_compile()
 {
 	*PROCNUM_ptr = PROCNUM;
+#ifndef HAVE_STATIC_CODE_BUFFER
+	// we're called from the dispatcher, so none of the dropped code can still be running
+	jit_free_pending();
+#endif
 
-	// prevent endless recompilation of self-modifying code, which would be a memleak since we only free code all at once.
-	// also allows us to clear compiled_funcs[] while leaving it sparsely allocated, if the OS does memory overcommit.
+	// code that keeps rewriting itself costs more to recompile than to interpret, so after a few
+	// rounds its address is handed to the interpreter until its generation of the code buffer
+	// is reused (or until the code there is written to again).
 	u32 adr = cpu->instruct_adr;
 	u32 mask_adr = (adr & 0x07FFFFFE) >> 4;
 	if(((recompile_counts[mask_adr >> 1] >> 4*(mask_adr & 1)) & 0xF) > 8)
 	{
 		ArmOpCompiled f = op_decode[PROCNUM][cpu->CPSR.bits.T];
-		JIT_COMPILED_FUNC(adr, PROCNUM) = (uintptr_t)f;
+		uintptr_t *entry = &JIT_COMPILED_FUNC(adr, PROCNUM);
+		u32 slot = entry - JIT_SLOT_BASE;
+		*entry = (uintptr_t)f;
+		jit_register_block(PROCNUM, entry, (uintptr_t)f, slot, slot, NULL, 0);
 		return f();
 	}
 	recompile_counts[mask_adr >> 1] += 1 << 4*(mask_adr & 1);
 
-	return compile_basicblock<PROCNUM>();
+#ifdef HAVE_STATIC_CODE_BUFFER
+	bool thumb = cpu->CPSR.bits.T;
+	u32 count = jit_cache.empty() ? 0 : jit_cache_install<PROCNUM>(adr, thumb);
+	if(count)
+	{
+		// run it through the interpreter once, the same as compile_basicblock would have
+		u32 cycles = 0;
+		for(u32 i = 0; i < count; i++)
+			cycles += op_decode[PROCNUM][thumb]();
+		return cycles;
+	}
+#endif
+	if(CommonSettings.jit_superblocks)
+	{
+		JitProfile *prof = jit_profile_find(PROCNUM, adr, cpu->CPSR.bits.T);
+		if(prof && prof->credits <= 0)
+			return compile_basicblock<PROCNUM>(true);
+	}
+	return compile_basicblock<PROCNUM>(false);
 }
 
 template u32 arm_jit_compile<0>();
@@ -4230,41 +5646,24 @@ void arm_jit_reset(bool enable)
 #endif
 #endif
 #ifdef HAVE_STATIC_CODE_BUFFER
-	scratchptr = scratchpad;
+	jit_cache_save();
 #endif
+	jit_clear_blocks();
 	printf("CPU mode: %s\n", enable?"JIT":"Interpreter");
 
 	if (enable)
 	{
 		printf("JIT: max block size %d instruction(s)\n", CommonSettings.jit_max_block_size);
 #ifdef MAPPED_JIT_FUNCS
-
-		//these pointers are allocated by asmjit and need freeing
-		#define JITFREE(x)  for(int iii=0;iii<ARRAY_SIZE(x);iii++) if(x[iii]) AsmJit::MemoryManager::getGlobal()->free((void*)x[iii]);  memset(x,0,sizeof(x));
-			JITFREE(JIT.MAIN_MEM);
-			JITFREE(JIT.SWIRAM);
-			JITFREE(JIT.ARM9_ITCM);
-			JITFREE(JIT.ARM9_LCDC);
-			JITFREE(JIT.ARM9_BIOS);
-			JITFREE(JIT.ARM7_BIOS);
-			JITFREE(JIT.ARM7_ERAM);
-			JITFREE(JIT.ARM7_WIRAM);
-			JITFREE(JIT.ARM7_WRAM);
-		#undef JITFREE
-
-		memset(recompile_counts, 0, sizeof(recompile_counts));
 		init_jit_mem();
-#else
-		for(int i=0; i<sizeof(recompile_counts)/8; i++)
-			if(((u64*)recompile_counts)[i])
-			{
-				((u64*)recompile_counts)[i] = 0;
-				memset(compiled_funcs+128*i, 0, 128*sizeof(*compiled_funcs));
-			}
 #endif
 	}
+#ifdef HAVE_STATIC_CODE_BUFFER
+	jit_cache_open(enable);
+#endif
 
 	c.clear();
+	memset(arm_jit_stats, 0, sizeof(arm_jit_stats));
 
 #if (PROFILER_JIT_LEVEL > 0)
 	reconstruct(&profiler_counter[0]);
@@ -4295,6 +5694,10 @@ static int pcmp_entry(PROFILER_ENTRY *info1, PROFILER_ENTRY *info2)
 
 void arm_jit_close()
 {
+#ifdef HAVE_STATIC_CODE_BUFFER
+	jit_cache_save();
+	jit_cache_close();
+#endif
 #if (PROFILER_JIT_LEVEL > 0)
 	printf("Generating profile report...");
 
@@ -31,6 +31,18 @@ void arm_jit_close();
 void arm_jit_sync();
 template<int PROCNUM> u32 arm_jit_compile();
 
+struct JitStats
+{
+	u64 dispatches;	// blocks entered from the cpu loop
+	u64 links;		// blocks entered directly from the end of another block
+	u32 blocks;		// blocks compiled
+	u32 invalidated;	// blocks dropped because their guest code was written to
+	u32 evicted;	// blocks dropped to make room in the code buffer
+	u32 cached;		// blocks taken from the on-disk cache instead of being compiled
+	u32 superblocks;	// hot blocks recompiled as superblocks
+};
+extern JitStats arm_jit_stats[2];
+
 #if defined(_WINDOWS) || defined(DESMUME_COCOA)
 #define MAPPED_JIT_FUNCS
 #endif
@@ -65,5 +77,32 @@ extern uintptr_t compiled_funcs[];
 #define JIT_MAPPED(adr, PROCNUM) true
 #endif
 
+// the code map groups the compiled_funcs slots (one per halfword of guest code) into 4KB pages
+// of 2048 slots, and each page into 32 lines of 64 slots. jit_code_map keeps a bit per line that
+// holds compiled code, so a store only calls arm_jit_invalidate when it hits one of those lines.
+#define JIT_PAGE_SHIFT 11
+#define JIT_LINE_SHIFT 6
+#ifdef MAPPED_JIT_FUNCS
+#define JIT_SLOT_BASE ((uintptr_t*)&JIT)
+#define JIT_SLOT_COUNT (sizeof(JIT_struct)/sizeof(uintptr_t))
+#else
+#define JIT_SLOT_BASE compiled_funcs
+#define JIT_SLOT_COUNT (1<<26)
+#endif
+#define JIT_PAGE_COUNT ((JIT_SLOT_COUNT >> JIT_PAGE_SHIFT) + 1)
+
+extern u32 jit_code_map[];
+void arm_jit_invalidate(u32 slot, u32 count);
+
+#define JIT_INVALIDATE(func, count) { \
+	u32 slot_ = (u32)(&(func) - JIT_SLOT_BASE); \
+	if(jit_code_map[slot_ >> JIT_PAGE_SHIFT] & (1 << ((slot_ >> JIT_LINE_SHIFT) & 31))) \
+		arm_jit_invalidate(slot_, (count)); \
+}
+
+// the same for a run of slots that can cover several lines and pages (bulk dma copies)
+void arm_jit_invalidate_range(u32 slot, u32 count);
+#define JIT_INVALIDATE_RANGE(func, count) arm_jit_invalidate_range((u32)(&(func) - JIT_SLOT_BASE), (count))
+
 
 #endif
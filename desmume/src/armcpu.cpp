@@ -670,7 +670,21 @@ u32 armcpu_exec()
 	if (jit)
 	{
 		ArmOpCompiled f = (ArmOpCompiled)JIT_COMPILED_FUNC(ARMPROC.instruct_adr, PROCNUM);
-		return f ? f() : arm_jit_compile<PROCNUM>();
+		arm_jit_stats[PROCNUM].dispatches++;
+		if (!f) return arm_jit_compile<PROCNUM>();
+
+		// follow the blocks' links for as long as they hand us the next one
+		u32 cycles = 0;
+		for (;;)
+		{
+			ARMPROC.jit_link_next = 0;
+			cycles += f();
+			f = (ArmOpCompiled)ARMPROC.jit_link_next;
+			if (!f) return cycles;
+			// armInnerLoop would have set nds_timer to this cpu's clock before running it
+			nds_timer = ARMPROC.jit_link_deadline - ARMPROC.jit_link_budget;
+			arm_jit_stats[PROCNUM].links++;
+		}
 	}
 
 	return armcpu_exec<PROCNUM>();
@@ -269,6 +269,15 @@ struct armcpu_t
 	u8 cond_table[16*16];
 #endif
 
+#ifdef HAVE_JIT
+	// block linking: how many arm9 clocks compiled blocks may run into each other before the
+	// cpu loop has to look at the other cpu or the sequencer, the nds_timer value at which
+	// that budget runs out (both set up by armInnerLoop), and the block to run next, if any
+	s32 jit_link_budget;
+	u64 jit_link_deadline;
+	uintptr_t jit_link_next;
+#endif
+
 #ifdef GDB_STUB
   /** there is a pending irq for the cpu */
   int irq_flag;
@@ -51,6 +51,7 @@
 #include "ctrlssdl.h"
 #include "render3D.h"
 #include "rasterize.h"
+#include "texcache.h"
 #include "saves.h"
 #include "firmware.h"
 #include "GPU_osd.h"
@@ -138,6 +139,21 @@ public:
 #endif
 
   int firmware_language;
+
+  int softrast_bench;
+  int softrast_verify;
+  int softrast_stats;
+  int mmu_bench;
+  int sequencer_bench;
+  int rewind_bench;
+  int savestate_bench;
+  int savestate_roundtrip_bench;
+#ifdef EXPERIMENTAL_WIFI_COMM
+  int adhoc_bench;
+#endif
+#ifdef HAVE_JIT
+  int jit_stats;
+#endif
 };
 
 static void
@@ -156,6 +172,21 @@ init_config( class configured_features *config) {
 
   /* use the default language */
   config->firmware_language = -1;
+
+  config->softrast_bench = 0;
+  config->softrast_verify = 0;
+  config->softrast_stats = 0;
+  config->mmu_bench = 0;
+  config->sequencer_bench = 0;
+  config->rewind_bench = 0;
+  config->savestate_bench = 0;
+  config->savestate_roundtrip_bench = 0;
+#ifdef EXPERIMENTAL_WIFI_COMM
+  config->adhoc_bench = 0;
+#endif
+#ifdef HAVE_JIT
+  config->jit_stats = 0;
+#endif
 }
 
 
@@ -191,6 +222,20 @@ fill_config( class configured_features *config,
     "\t\t\t\t\t\t  4 = Italian\n"
     "\t\t\t\t\t\t  5 = Spanish\n",
     "LANG"},
+    { "softrast-bench", 0, 0, G_OPTION_ARG_INT, &config->softrast_bench, "Emulate one frame (after --load-slot), re-render its 3d frame NUM times on 1..N rasterizer cores, print the timings and exit", "NUM"},
+    { "softrast-verify", 0, 0, G_OPTION_ARG_NONE, &config->softrast_verify, "Emulate one frame (after --load-slot), check that the SIMD span shading renders its 3d frame identically to the scalar path and exit", NULL},
+    { "softrast-stats", 0, 0, G_OPTION_ARG_NONE, &config->softrast_stats, "Print how many fragments the software rasterizer's early depth rejection skipped and the texture cache counters, on exit", NULL},
+    { "mmu-bench", 0, 0, G_OPTION_ARG_INT, &config->mmu_bench, "Emulate one frame (after --load-slot), run NUM passes of vcount, ipc sync, div/sqrt, irq and fog/toon table register traffic through the MMU, print the timings and exit", "NUM"},
+    { "sequencer-bench", 0, 0, G_OPTION_ARG_INT, &config->sequencer_bench, "Emulate NUM frames (after --load-slot), print the cpu loop iterations per frame and the sequencer reschedule cost and exit", "NUM"},
+    { "rewind-bench", 0, 0, G_OPTION_ARG_INT, &config->rewind_bench, "Emulate NUM frames (after --load-slot) keeping a rewind state per frame, print the memory per state and the save and rewind timings and exit", "NUM"},
+    { "savestate-bench", 0, 0, G_OPTION_ARG_INT, &config->savestate_bench, "Emulate one frame (after --load-slot), save and load its state NUM times with each codec, print the timings and exit", "NUM"},
+    { "savestate-roundtrip-bench", 0, 0, G_OPTION_ARG_INT, &config->savestate_roundtrip_bench, "Emulate one frame (after --load-slot), save and reload its uncompressed state NUM times, print the round trips per second and the chunk tag lookup cost and exit", "NUM"},
+#ifdef EXPERIMENTAL_WIFI_COMM
+    { "adhoc-bench", 0, 0, G_OPTION_ARG_INT, &config->adhoc_bench, "Ping and stream NUM frames over the --adhoc-transport to a forked copy of this instance, print the round trip time and throughput and exit", "NUM"},
+#endif
+#ifdef HAVE_JIT
+    { "jit-stats", 0, 0, G_OPTION_ARG_NONE, &config->jit_stats, "Print how many ARM JIT blocks were entered from the cpu loop and how many through block links, on exit", NULL},
+#endif
     { NULL }
   };
 
@@ -710,6 +755,52 @@ int main(int argc, char ** argv) {
     loadstate_slot(my_config.load_slot);
   }
 
+  if(my_config.softrast_bench > 0) {
+    NDS_exec<false>();
+    SoftRastBenchmark(my_config.softrast_bench);
+    exit(0);
+  }
+
+  if(my_config.softrast_verify) {
+    NDS_exec<false>();
+    exit(SoftRastVerifySpanShading() == 0 ? 0 : 1);
+  }
+
+  if(my_config.mmu_bench > 0) {
+    NDS_exec<false>();
+    MMU_IOBenchmark(my_config.mmu_bench);
+    exit(0);
+  }
+
+  if(my_config.sequencer_bench > 0) {
+    NDS_SequencerBenchmark(my_config.sequencer_bench);
+    exit(0);
+  }
+
+  if(my_config.rewind_bench > 0) {
+    RewindBenchmark(my_config.rewind_bench);
+    exit(0);
+  }
+
+  if(my_config.savestate_bench > 0) {
+    NDS_exec<false>();
+    SavestateBenchmark(my_config.savestate_bench);
+    exit(0);
+  }
+
+  if(my_config.savestate_roundtrip_bench > 0) {
+    NDS_exec<false>();
+    SavestateRoundTripBenchmark(my_config.savestate_roundtrip_bench);
+    exit(0);
+  }
+
+#ifdef EXPERIMENTAL_WIFI_COMM
+  if(my_config.adhoc_bench > 0) {
+    Adhoc_Benchmark(my_config.adhoc_bench);
+    exit(0);
+  }
+#endif
+
 #ifdef HAVE_LIBAGG
   Desmume_InitOnce();
   Hud.reset();
@@ -790,6 +881,37 @@ int main(int argc, char ** argv) {
   uninit_joy();
 
   SDL_Quit();
+
+  if(my_config.softrast_stats) {
+    SoftRastEarlyZStats stats;
+    SoftRastGetEarlyZStats(stats);
+    printf("SoftRast early depth rejection: %llu of %llu span fragments rejected (%.1f%%), %llu polys rejected\n",
+           (unsigned long long)stats.rejectedFragments, (unsigned long long)stats.fragments,
+           stats.fragments ? 100.0 * stats.rejectedFragments / stats.fragments : 0.0,
+           (unsigned long long)stats.rejectedPolys);
+
+    TexCacheStats texStats;
+    TexCache_GetStats(texStats);
+    printf("Texture cache: %llu hits, %llu misses (%.1f%% hit rate), %llu KB decoded, %llu KB rehashed, %llu evictions, %u items in %u KB\n",
+           (unsigned long long)texStats.hits, (unsigned long long)texStats.misses,
+           (texStats.hits + texStats.misses) ? 100.0 * texStats.hits / (texStats.hits + texStats.misses) : 0.0,
+           (unsigned long long)(texStats.decodedBytes / 1024), (unsigned long long)(texStats.hashedBytes / 1024),
+           (unsigned long long)texStats.evictions,
+           texStats.items, texStats.size / 1024);
+  }
+
+#ifdef HAVE_JIT
+  if(my_config.jit_stats) {
+    for(int proc = 0; proc < 2; proc++) {
+      const JitStats &stats = arm_jit_stats[proc];
+      printf("ARM%c JIT: %llu dispatches, %llu linked block entries (%.1f%% of blocks run), %u blocks compiled\n",
+             proc ? '7' : '9', (unsigned long long)stats.dispatches, (unsigned long long)stats.links,
+             (stats.dispatches + stats.links) ? 100.0 * stats.links / (stats.dispatches + stats.links) : 0.0,
+             stats.blocks);
+    }
+  }
+#endif
+
   NDS_DeInit();
 
 #ifdef GDB_STUB
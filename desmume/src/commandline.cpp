@@ -47,11 +47,21 @@ CommandLine::CommandLine()
 , _num_cores(-1)
 , _rigorous_timing(0)
 , _advanced_timing(-1)
+, _softrast_fixed_point(-1)
+, _texcache_size(-1)
+, _savestate_codec(NULL)
+, _rom_mmap(-1)
 , _slot1(NULL)
 , _slot1_fat_dir(NULL)
 #ifdef HAVE_JIT
 , _cpu_mode(-1)
 , _jit_size(-1)
+, _jit_link(-1)
+, _jit_superblocks(-1)
+, _jit_cache(NULL)
+#endif
+#ifdef EXPERIMENTAL_WIFI_COMM
+, _adhoc_transport(NULL)
 #endif
 , _console_type(NULL)
 , depth_threshold(-1)
@@ -98,6 +108,10 @@ void CommandLine::loadCommonOptions()
 		{ "scanline-filter-d", 0, 0, G_OPTION_ARG_INT, &_scanline_filter_d, "Intensity of fadeout for scanlines filter (bottomright) (default 4)", "SCANLINE_FILTER_D"},
 		{ "rigorous-timing", 0, 0, G_OPTION_ARG_INT, &_rigorous_timing, "Use some rigorous timings instead of unrealistically generous (default 0)", "RIGOROUS_TIMING"},
 		{ "advanced-timing", 0, 0, G_OPTION_ARG_INT, &_advanced_timing, "Use advanced BUS-level timing (default 1)", "ADVANCED_TIMING"},
+		{ "softrast-fixed-point", 0, 0, G_OPTION_ARG_INT, &_softrast_fixed_point, "Use fixed point edges, interpolants and depth in the software rasterizer (default 0)", "SOFTRAST_FIXED_POINT"},
+		{ "texcache-size", 0, 0, G_OPTION_ARG_INT, &_texcache_size, "Budget for decoded textures in megabytes (default 16)", "TEXCACHE_SIZE"},
+		{ "savestate-codec", 0, 0, G_OPTION_ARG_STRING, &_savestate_codec, "Compress savestates with: {zlib,blocks,lz4} (default zlib, blocks and lz4 are faster but older versions can't load them)", "CODEC"},
+		{ "rom-mmap", 0, 0, G_OPTION_ARG_INT, &_rom_mmap, "Map uncompressed .nds roms instead of reading them into memory (default 1, use 0 if the rom file may change while running)", "ROM_MMAP"},
 		{ "slot1", 0, 0, G_OPTION_ARG_STRING, &_slot1, "Device to load in slot 1 (default retail)", "SLOT1"},
 		{ "slot1-fat-dir", 0, 0, G_OPTION_ARG_STRING, &_slot1_fat_dir, "Directory to scan for slot 1", "SLOT1_DIR"},
 		{ "depth-threshold", 0, 0, G_OPTION_ARG_INT, &depth_threshold, "Depth comparison threshold (default 0)", "DEPTHTHRESHOLD"},
@@ -105,6 +119,12 @@ void CommandLine::loadCommonOptions()
 #ifdef HAVE_JIT
 		{ "cpu-mode", 0, 0, G_OPTION_ARG_INT, &_cpu_mode, "ARM CPU emulation mode: 0 - interpreter, 1 - dynarec (default 1)", NULL},
 		{ "jit-size", 0, 0, G_OPTION_ARG_INT, &_jit_size, "ARM JIT block size: 1..100 (1 - accuracy, 100 - faster) (default 100)", NULL},
+		{ "jit-link", 0, 0, G_OPTION_ARG_INT, &_jit_link, "Let ARM JIT blocks jump directly into the next compiled block (default 1)", "JIT_LINK"},
+		{ "jit-superblocks", 0, 0, G_OPTION_ARG_INT, &_jit_superblocks, "Recompile hot ARM JIT blocks as superblocks along their usual branch directions (default 0)", "JIT_SUPERBLOCKS"},
+		{ "jit-cache", 0, 0, G_OPTION_ARG_FILENAME, &_jit_cache, "Keep compiled ARM JIT blocks in this directory between runs", "JIT_CACHE_DIR"},
+#endif
+#ifdef EXPERIMENTAL_WIFI_COMM
+		{ "adhoc-transport", 0, 0, G_OPTION_ARG_STRING, &_adhoc_transport, "Carry ad-hoc wifi frames over: {udp,hub} (default udp, hub only reaches instances on this computer)", "TRANSPORT"},
 #endif
 #ifndef _MSC_VER
 		{ "disable-sound", 0, 0, G_OPTION_ARG_NONE, &disable_sound, "Disables the sound emulation", NULL},
@@ -152,6 +172,16 @@ bool CommandLine::parse(int argc,char **argv)
 	if(_num_cores != -1) CommonSettings.num_cores = _num_cores;
 	if(_rigorous_timing) CommonSettings.rigorous_timing = true;
 	if(_advanced_timing != -1) CommonSettings.advanced_timing = _advanced_timing==1;
+	if(_softrast_fixed_point != -1) CommonSettings.GFX3D_FixedPointRasterizer = _softrast_fixed_point==1;
+	if(_texcache_size != -1) CommonSettings.GFX3D_TexCacheSizeMB = _texcache_size;
+	if(_rom_mmap != -1) CommonSettings.rom_mmap = _rom_mmap==1;
+	if(_savestate_codec)
+	{
+		std::string codec = strtoupper(_savestate_codec);
+		if(codec == "ZLIB") CommonSettings.savestateCodec = TCommonSettings::SavestateZlib;
+		else if(codec == "BLOCKS") CommonSettings.savestateCodec = TCommonSettings::SavestateZlibBlocks;
+		else if(codec == "LZ4") CommonSettings.savestateCodec = TCommonSettings::SavestateLZ4Blocks;
+	}
 #ifdef HAVE_JIT
 	if(_cpu_mode != -1) CommonSettings.use_jit = (_cpu_mode==1);
 	if(_jit_size != -1) 
@@ -161,6 +191,17 @@ bool CommandLine::parse(int argc,char **argv)
 		else
 			CommonSettings.jit_max_block_size = _jit_size;
 	}
+	if(_jit_link != -1) CommonSettings.jit_link_blocks = (_jit_link==1);
+	if(_jit_superblocks != -1) CommonSettings.jit_superblocks = (_jit_superblocks==1);
+	if(_jit_cache) strncpy(CommonSettings.jit_cache_dir, _jit_cache, sizeof(CommonSettings.jit_cache_dir)-1);
+#endif
+#ifdef EXPERIMENTAL_WIFI_COMM
+	if(_adhoc_transport)
+	{
+		std::string transport = strtoupper(_adhoc_transport);
+		if(transport == "UDP") CommonSettings.wifi.adhocTransport = 0;
+		else if(transport == "HUB") CommonSettings.wifi.adhocTransport = 1;
+	}
 #endif
 	if(depth_threshold != -1)
 		CommonSettings.GFX3D_Zelda_Shadow_Depth_Hack = depth_threshold;
@@ -90,9 +90,19 @@ private:
 	int _num_cores;
 	int _rigorous_timing;
 	int _advanced_timing;
+	int _softrast_fixed_point;
+	int _texcache_size;
+	char* _savestate_codec;
+	int _rom_mmap;
 #ifdef HAVE_JIT
 	int _cpu_mode;
 	int _jit_size;
+	int _jit_link;
+	int _jit_superblocks;
+	char* _jit_cache;
+#endif
+#ifdef EXPERIMENTAL_WIFI_COMM
+	char* _adhoc_transport;
 #endif
 	char* _slot1;
 	char *_slot1_fat_dir;
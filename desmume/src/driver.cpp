@@ -31,7 +31,7 @@ const int kViewportWidth = 256;
 const int kViewportHeight = 192;
 
 static SoftRasterizerEngine engine;
-static Fragment _screen[kViewportWidth*kViewportHeight];
+static FragmentAttributesBuffer _screen(kViewportWidth*kViewportHeight);
 static FragmentColor _screenColor[kViewportWidth*kViewportHeight];
 
 extern void _HACK_Viewer_ExecUnit(SoftRasterizerEngine* engine);
@@ -83,7 +83,7 @@ public:
 		engine.polylist = &viewer3d_state->polylist;
 		engine.vertlist = &viewer3d_state->vertlist;
 		engine.indexlist = &viewer3d_state->indexlist;
-		engine.screen = _screen;
+		engine.screen = &_screen;
 		engine.screenColor = _screenColor;
 		engine.width = kViewportWidth;
 		engine.height = kViewportHeight;
@@ -97,7 +97,7 @@ public:
 		engine.performViewportTransforms<true>(kViewportWidth,kViewportHeight);
 		engine.performBackfaceTests();
 		engine.performCoordAdjustment(false);
-		engine.setupTextures(false);
+		engine.setupTextures(false,false);
 
 		_HACK_Viewer_ExecUnit(&engine);
 		//------------
@@ -69,6 +69,12 @@ static u8 index_start_table[8];
 
 static bool softRastHasNewData = false;
 
+//the SSE2 span shading kernels can be switched off to compare them against the scalar path
+static bool softRastSpanShading = true;
+
+//likewise the early rejection of spans and polys against the depth tiles
+static bool softRastEarlyZ = true;
+
 ////optimized float floor useful in limited cases
 ////from http://www.stereopsis.com/FPU.html#convert
 ////(unfortunately, it relies on certain FPU register settings)
@@ -115,7 +121,7 @@ static FORCEINLINE int fastFloor(float f)
 //	verts[vert_index] = &rawvert;
 //}
 
-static Fragment _screen[256*192];
+static FragmentAttributesBuffer _screen(256*192);
 static FragmentColor _screenColor[256*192];
 
 static FORCEINLINE int iround(float f) {
@@ -186,29 +192,50 @@ static FORCEINLINE int Ceil28_4( fixed28_4 Value ) {
 	return ReturnValue;
 }
 
+//64bit floor divide for the fixed point rasterizer. the callers guarantee Denominator > 0,
+//and the C truncation is turned into a floor without branching
+static FORCEINLINE void FloorDivMod64(s64 Numerator, s64 Denominator, s64 &Floor, s64 &Mod)
+{
+	Floor = Numerator / Denominator;
+	Mod = Numerator % Denominator;
+	const s64 negative = (Mod < 0);
+	Floor -= negative;
+	Mod += Denominator & -negative;
+}
+
+static FORCEINLINE s64 FloorDiv64(s64 Numerator, s64 Denominator)
+{
+	s64 Floor, Mod;
+	FloorDivMod64(Numerator,Denominator,Floor,Mod);
+	return Floor;
+}
+
 struct edge_fx_fl {
 	edge_fx_fl() {}
 	edge_fx_fl(int Top, int Bottom, VERT** verts, bool& failure);
 	FORCEINLINE int Step();
+	FORCEINLINE void Skip(int lines);
 
 	VERT** verts;
 	long X, XStep, Numerator, Denominator;			// DDA info for x
 	long ErrorTerm;
 	int Y, Height;					// current y and vertical count
-	
+	int Lines, ExtraSteps;			// how far the interpolants have been stepped
+
+	//the interpolants are recomputed from their starting values instead of accumulated,
+	//so that skipping a run of scanlines lands on exactly what stepping over them would have
 	struct Interpolant {
-		float curr, step, stepExtra;
-		FORCEINLINE void doStep() { curr += step; }
-		FORCEINLINE void doStepExtra() { curr += stepExtra; }
+		float curr, start, step, stepExtra;
+		FORCEINLINE void doStep(float lines, float extraSteps) { curr = start + lines * step + extraSteps * stepExtra; }
 		FORCEINLINE void initialize(float value) {
-			curr = value;
+			curr = start = value;
 			step = 0;
 			stepExtra = 0;
 		}
 		FORCEINLINE void initialize(float top, float bottom, float dx, float dy, long XStep, float XPrestep, float YPrestep) {
 			dx = 0;
 			dy *= (bottom-top);
-			curr = top + YPrestep * dy + XPrestep * dx;
+			curr = start = top + YPrestep * dy + XPrestep * dx;
 			step = XStep * dx + dy;
 			stepExtra = dx;
 		}
@@ -221,12 +248,15 @@ struct edge_fx_fl {
 		};
 		Interpolant interpolants[NUM_INTERPOLANTS];
 	};
-	void FORCEINLINE doStepInterpolants() { for(int i=0;i<NUM_INTERPOLANTS;i++) interpolants[i].doStep(); }
-	void FORCEINLINE doStepExtraInterpolants() { for(int i=0;i<NUM_INTERPOLANTS;i++) interpolants[i].doStepExtra(); }
+	void FORCEINLINE doStepInterpolants() {
+		const float lines = (float)Lines, extraSteps = (float)ExtraSteps;
+		for(int i=0;i<NUM_INTERPOLANTS;i++) interpolants[i].doStep(lines,extraSteps);
+	}
 };
 
 FORCEINLINE edge_fx_fl::edge_fx_fl(int Top, int Bottom, VERT** verts, bool& failure) {
 	this->verts = verts;
+	Lines = ExtraSteps = 0;
 	Y = Ceil28_4((fixed28_4)verts[Top]->y);
 	int YEnd = Ceil28_4((fixed28_4)verts[Bottom]->y);
 	Height = YEnd - Y;
@@ -287,17 +317,167 @@ FORCEINLINE edge_fx_fl::edge_fx_fl(int Top, int Bottom, VERT** verts, bool& fail
 
 FORCEINLINE int edge_fx_fl::Step() {
 	X += XStep; Y++; Height--;
-	doStepInterpolants();
+	Lines++;
 
 	ErrorTerm += Numerator;
 	if(ErrorTerm >= Denominator) {
 		X++;
 		ErrorTerm -= Denominator;
-		doStepExtraInterpolants();
+		ExtraSteps++;
 	}
+	doStepInterpolants();
 	return Height;
 }	
 
+//the same as calling Step() that many times. the x DDA carries at most once per scanline, so the carries are counted with a division
+FORCEINLINE void edge_fx_fl::Skip(int lines) {
+	s64 carries, error;
+	FloorDivMod64((s64)ErrorTerm + (s64)lines * Numerator, Denominator, carries, error);
+	X += lines * XStep + (long)carries; Y += lines; Height -= lines;
+	ErrorTerm = (long)error;
+	Lines += lines;
+	ExtraSteps += (int)carries;
+	doStepInterpolants();
+}
+
+//the fixed point counterpart to edge_fx_fl.
+//the perspective-correct interpolants (1/w, and u, v and the colors, which were already divided by w)
+//are scaled by 2^shift, chosen per poly so that 1/w is a 28bit integer. z is scaled by 2^31.
+//everything is then stepped with exact integer DDAs, so the results don't depend on the compiler or FPU settings.
+static const int kFixedInvWBits = 28;
+static const int kFixedZBits = 31;
+
+struct edge_fx_fx {
+	edge_fx_fx() {}
+	edge_fx_fx(int Top, int Bottom, VERT** verts, int shift, bool& failure);
+	FORCEINLINE int Step();
+	FORCEINLINE void Skip(int lines);
+
+	VERT** verts;
+	long X, XStep, Numerator, Denominator;			// DDA info for x
+	long ErrorTerm;
+	int Y, Height;					// current y and vertical count
+
+	//value(i) = floor(from + (to-from) * (offset + i*unit) / den), stepped without any division or branching
+	struct Interpolant {
+		s64 curr, step, numerator, denominator, errorTerm;
+		FORCEINLINE void doStep() {
+			curr += step;
+			errorTerm += numerator;
+			const s64 carry = (errorTerm >= denominator);
+			curr += carry;
+			errorTerm -= denominator & -carry;
+		}
+		//the same as doStep() that many times
+		FORCEINLINE void doSteps(s64 count) {
+			s64 carries;
+			FloorDivMod64(errorTerm + count * numerator, denominator, carries, errorTerm);
+			curr += count * step + carries;
+		}
+		FORCEINLINE void initialize(s64 value) {
+			curr = value;
+			step = numerator = errorTerm = 0;
+			denominator = 1;
+		}
+		FORCEINLINE void initialize(s64 from, s64 to, s64 den, s64 offset, s64 unit) {
+			const s64 delta = to - from;
+			FloorDivMod64(delta*offset,den,curr,errorTerm);
+			curr += from;
+			FloorDivMod64(delta*unit,den,step,numerator);
+			denominator = den;
+		}
+	};
+
+	static const int NUM_INTERPOLANTS = 7;
+	union {
+		struct {
+			Interpolant invw,z,u,v,color[3];
+		};
+		Interpolant interpolants[NUM_INTERPOLANTS];
+	};
+	void FORCEINLINE doStepInterpolants() { for(int i=0;i<NUM_INTERPOLANTS;i++) interpolants[i].doStep(); }
+
+	//converts a vert's interpolants to fixed point, in the same order as the interpolants union
+	static FORCEINLINE void toFixed(const VERT* vert, int shift, s64* out, bool& failure)
+	{
+		const double scale = ldexp(1.0,shift);
+		const double values[NUM_INTERPOLANTS] = {
+			scale / vert->w,
+			ldexp((double)vert->z,kFixedZBits),
+			scale * vert->u, scale * vert->v,
+			scale * vert->fcolor[0], scale * vert->fcolor[1], scale * vert->fcolor[2] };
+		//keep enough headroom that the DDA setup products can't overflow
+		const double limit = ldexp(1.0,46);
+		for(int i=0;i<NUM_INTERPOLANTS;i++)
+		{
+			if(!(values[i] > -limit && values[i] < limit)) failure = true;
+			else out[i] = (s64)values[i];
+		}
+	}
+};
+
+FORCEINLINE edge_fx_fx::edge_fx_fx(int Top, int Bottom, VERT** verts, int shift, bool& failure) {
+	this->verts = verts;
+	Y = Ceil28_4((fixed28_4)verts[Top]->y);
+	int YEnd = Ceil28_4((fixed28_4)verts[Bottom]->y);
+	Height = YEnd - Y;
+	X = Ceil28_4((fixed28_4)verts[Top]->x);
+	int XEnd = Ceil28_4((fixed28_4)verts[Bottom]->x);
+	int Width = XEnd - X; // can be negative
+
+	s64 top[NUM_INTERPOLANTS], bottom[NUM_INTERPOLANTS];
+	toFixed(verts[Top],shift,top,failure);
+	toFixed(verts[Bottom],shift,bottom,failure);
+	if(failure)
+		return;
+
+	long dN = long(verts[Bottom]->y - verts[Top]->y);
+	long dM = long(verts[Bottom]->x - verts[Top]->x);
+	if((Height != 0 || Width != 0) && dN != 0)
+	{
+		long InitialNumerator = (long)(dM*16*Y - dM*verts[Top]->y + dN*verts[Top]->x - 1 + dN*16);
+		FloorDivMod(InitialNumerator,dN*16,X,ErrorTerm,failure);
+		FloorDivMod(dM*16,dN*16,XStep,Numerator,failure);
+		Denominator = dN*16;
+
+		//everything here is in 28.4: the prestep to the first scanline center, and 16 for each scanline after that
+		const s64 YPrestep = (s64)Y*16 - (s64)verts[Top]->y;
+		for(int i=0;i<NUM_INTERPOLANTS;i++)
+			interpolants[i].initialize(top[i],bottom[i],dN,YPrestep,16);
+	}
+	else
+	{
+		//horizontal edges (and single pixels) just carry the top vert's values
+		XStep = (Height != 0 || Width != 0) ? Width : 1;
+		Numerator = 0;
+		Denominator = 1;
+		ErrorTerm = 0;
+		for(int i=0;i<NUM_INTERPOLANTS;i++)
+			interpolants[i].initialize(top[i]);
+	}
+}
+
+FORCEINLINE int edge_fx_fx::Step() {
+	X += XStep; Y++; Height--;
+	doStepInterpolants();
+
+	ErrorTerm += Numerator;
+	if(ErrorTerm >= Denominator) {
+		X++;
+		ErrorTerm -= Denominator;
+	}
+	return Height;
+}
+
+FORCEINLINE void edge_fx_fx::Skip(int lines) {
+	s64 carries, error;
+	FloorDivMod64((s64)ErrorTerm + (s64)lines * Numerator, Denominator, carries, error);
+	X += lines * XStep + (long)carries; Y += lines; Height -= lines;
+	ErrorTerm = (long)error;
+	for(int i=0;i<NUM_INTERPOLANTS;i++)
+		interpolants[i].doSteps(lines);
+}
+
 
 
 static FORCEINLINE void alphaBlend(FragmentColor & dst, const FragmentColor & src)
@@ -333,6 +513,36 @@ static FORCEINLINE void alphaBlend(FragmentColor & dst, const FragmentColor & sr
 	}
 }
 
+#ifdef ENABLE_SSE2
+//SSE2 helpers for the span shading kernels. these all work on four s32 lanes
+//and must match the scalar code they stand in for exactly.
+static FORCEINLINE __m128i sse2_select(const __m128i mask, const __m128i a, const __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(mask,a), _mm_andnot_si128(mask,b));
+}
+
+//same as s32floor(), for four floats
+static FORCEINLINE __m128i sse2_s32floor(const __m128 f)
+{
+	return _mm_srai_epi32(_mm_cvtps_epi32(_mm_add_ps(_mm_set1_ps(-0.5f),_mm_add_ps(f,f))),1);
+}
+
+//same as max(0U,min(63U,u32floor(f))) -- note that negative values clamp to 63, since the compare is unsigned
+static FORCEINLINE __m128i sse2_u32floor_clamp63(const __m128 f)
+{
+	const __m128i val = _mm_cvttps_epi32(f);
+	const __m128i max = _mm_set1_epi32(63);
+	const __m128i out = _mm_or_si128(_mm_cmplt_epi32(val,_mm_setzero_si128()), _mm_cmpgt_epi32(val,max));
+	return sse2_select(out,max,val);
+}
+
+//same as GFX3D_5TO6(), for 16bit lanes
+static FORCEINLINE __m128i sse2_5to6_epi16(const __m128i x)
+{
+	return _mm_andnot_si128(_mm_cmpeq_epi16(x,_mm_setzero_si128()), _mm_add_epi16(_mm_add_epi16(x,x),_mm_set1_epi16(1)));
+}
+#endif
+
 // TODO: wire-frame
 struct PolyAttr
 {
@@ -385,15 +595,26 @@ class RasterizerUnit
 {
 public:
 
-	int SLI_MASK, SLI_VALUE;
+	//the band of scanlines this unit is currently drawing, when running banded
+	int bandTop, bandBottom;
 	bool _debug_thisPoly;
 
 	RasterizerUnit()
 		: _debug_thisPoly(false)
+		, earlyZ(false)
+		, earlyZFragments(0)
+		, earlyZRejectedFragments(0)
+		, earlyZRejectedPolys(0)
 	{
 	}
 
+	//whether the current poly's spans are tested against the depth tiles, and how that went (see SoftRastEarlyZStats)
+	bool earlyZ;
+	u64 earlyZFragments, earlyZRejectedFragments, earlyZRejectedPolys;
+
 	TexCacheItem* lastTexKey;
+	//the last texture this unit made sure was decoded
+	TexCacheItem* readyTexKey;
 	
 	VERT* verts[MAX_CLIPPED_VERTS];
 
@@ -468,6 +689,47 @@ public:
 				case 0xF: hflip(iu); vflip(iv); break;
 			}
 		}
+
+#ifdef ENABLE_SSE2
+		FORCEINLINE __m128i clamp4(__m128i val, const int sizemask) {
+			const __m128i m = _mm_set1_epi32(sizemask);
+			val = _mm_andnot_si128(_mm_cmplt_epi32(val,_mm_setzero_si128()), val);
+			return sse2_select(_mm_cmpgt_epi32(val,m), m, val);
+		}
+		FORCEINLINE __m128i repeat4(const __m128i val, const int sizemask) {
+			return _mm_and_si128(val,_mm_set1_epi32(sizemask));
+		}
+		FORCEINLINE __m128i flip4(__m128i val, const int size) {
+			const __m128i m = _mm_set1_epi32((size<<1)-1);
+			val = _mm_and_si128(val,m);
+			return sse2_select(_mm_cmpgt_epi32(val,_mm_set1_epi32(size-1)), _mm_sub_epi32(m,val), val);
+		}
+
+		//dowrap() for four texel coordinates at once
+		FORCEINLINE void dowrap4(__m128i& iu, __m128i& iv)
+		{
+			switch(wrap) {
+				case 0x0: case 0x4: case 0x8: case 0xC:
+					iu = clamp4(iu,wmask); iv = clamp4(iv,hmask); break;
+				case 0x1: case 0x9:
+					iu = repeat4(iu,wmask); iv = clamp4(iv,hmask); break;
+				case 0x2: case 0x6:
+					iu = clamp4(iu,wmask); iv = repeat4(iv,hmask); break;
+				case 0x3:
+					iu = repeat4(iu,wmask); iv = repeat4(iv,hmask); break;
+				case 0x5: case 0xD:
+					iu = flip4(iu,width); iv = clamp4(iv,hmask); break;
+				case 0x7:
+					iu = flip4(iu,width); iv = repeat4(iv,hmask); break;
+				case 0xA: case 0xE:
+					iu = clamp4(iu,wmask); iv = flip4(iv,height); break;
+				case 0xB:
+					iu = repeat4(iu,wmask); iv = flip4(iv,height); break;
+				case 0xF:
+					iu = flip4(iu,width); iv = flip4(iv,height); break;
+			}
+		}
+#endif
 	} sampler;
 
 	FORCEINLINE FragmentColor sample(float u, float v)
@@ -477,8 +739,15 @@ public:
 
 		//finally, we can use floor here. but, it is slower than we want.
 		//the best solution is probably to wait until the pipeline is full of fixed point
-		s32 iu = s32floor(u);
-		s32 iv = s32floor(v);
+		//(which it is, in the fixed point mode: see sampleTexel)
+		return sampleTexel(s32floor(u),s32floor(v));
+	}
+
+	FORCEINLINE FragmentColor sampleTexel(s32 iu, s32 iv)
+	{
+		static const FragmentColor white = MakeFragmentColor(63,63,63,31);
+		if(!sampler.enabled) return white;
+
 		sampler.dowrap(iu,iv);
 
 		FragmentColor color;
@@ -490,20 +759,26 @@ public:
 	{
 		u8 mode;
 		float invu, invv, w;
+		s32 iu, iv; //texel coords, in the fixed point mode
 		FragmentColor materialColor;
 	} shader;
 
+	template<bool FIXED>
+	FORCEINLINE FragmentColor shaderSample()
+	{
+		if(FIXED) return sampleTexel(shader.iu,shader.iv);
+		else return sample(shader.invu*shader.w,shader.invv*shader.w);
+	}
+
+	template<bool FIXED>
 	FORCEINLINE void shade(FragmentColor& dst)
 	{
 		FragmentColor texColor;
-		float u,v;
 
 		switch(shader.mode)
 		{
 		case 0: //modulate
-			u = shader.invu*shader.w;
-			v = shader.invv*shader.w;
-			texColor = sample(u,v);
+			texColor = shaderSample<FIXED>();
 			dst.r = modulate_table[texColor.r][shader.materialColor.r];
 			dst.g = modulate_table[texColor.g][shader.materialColor.g];
 			dst.b = modulate_table[texColor.b][shader.materialColor.b];
@@ -524,9 +799,7 @@ public:
 		case 1: //decal
 			if(sampler.enabled)
 			{
-				u = shader.invu*shader.w;
-				v = shader.invv*shader.w;
-				texColor = sample(u,v);
+				texColor = shaderSample<FIXED>();
 				dst.r = decal_table[texColor.a][texColor.r][shader.materialColor.r];
 				dst.g = decal_table[texColor.a][texColor.g][shader.materialColor.g];
 				dst.b = decal_table[texColor.a][texColor.b][shader.materialColor.b];
@@ -535,9 +808,7 @@ public:
 			break;
 		case 2: //toon/highlight shading
 			{
-				u = shader.invu*shader.w;
-				v = shader.invv*shader.w;
-				texColor = sample(u,v);
+				texColor = shaderSample<FIXED>();
 				FragmentColor toonColor = engine->toonTable[shader.materialColor.r>>1];
 			
 				if(gfx3d.renderState.shading == GFX3D_State::HIGHLIGHT)
@@ -573,30 +844,265 @@ public:
 		shader.mode = (polyattr>>4)&0x3;
 	}
 
-	FORCEINLINE void pixel(int adr,float r, float g, float b, float invu, float invv, float w, float z)
+#ifdef ENABLE_SSE2
+	//whether shade4() can be used for the current poly: only modulate and decal with texturing enabled
+	FORCEINLINE bool canShade4() const
 	{
-		Fragment &destFragment = engine->screen[adr];
-		FragmentColor &destFragmentColor = engine->screenColor[adr];
+		return softRastSpanShading && sampler.enabled && (shader.mode == 0 || shader.mode == 1);
+	}
 
-		u32 depth;
+	//the modulate and decal cases of shade(), plus the perspective correction and material color setup
+	//from pixel(), for four fragments at once. every step uses the same float operations as the scalar path
+	//(the 1/w divide included) so the output is bit-identical.
+	FORCEINLINE void shade4(const float *invw, const float *invu, const float *invv,
+		const float *r, const float *g, const float *b, float *w, FragmentColor *dst)
+	{
+		const __m128 vw = _mm_div_ps(_mm_set1_ps(1.0f), _mm_loadu_ps(invw));
+		_mm_storeu_ps(w, vw);
+
+		//sample
+		__m128i iu = sse2_s32floor(_mm_mul_ps(_mm_loadu_ps(invu), vw));
+		__m128i iv = sse2_s32floor(_mm_mul_ps(_mm_loadu_ps(invv), vw));
+		sampler.dowrap4(iu,iv);
+		const __m128i texIndex = _mm_add_epi32(_mm_sll_epi32(iv,_mm_cvtsi32_si128(sampler.wshift)), iu);
+		DS_ALIGN(16) s32 idx[4];
+		_mm_store_si128((__m128i*)idx, texIndex);
+		const u32 *tex = (u32*)lastTexKey->decoded;
+		const __m128i texColor = _mm_set_epi32(tex[idx[3]], tex[idx[2]], tex[idx[1]], tex[idx[0]]);
+
+		//perspective-correct the colors, and pack them up with the poly alpha as the material color
+		const __m128 half = _mm_set1_ps(0.5f);
+		const __m128i mr = sse2_u32floor_clamp63(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(r), vw), half));
+		const __m128i mg = sse2_u32floor_clamp63(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(g), vw), half));
+		const __m128i mb = sse2_u32floor_clamp63(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(b), vw), half));
+		const __m128i materialColor = _mm_or_si128(
+			_mm_or_si128(mr, _mm_slli_epi32(mg,8)),
+			_mm_or_si128(_mm_slli_epi32(mb,16), _mm_set1_epi32(polyAttr.alpha<<24)));
+
+		//work on 16bit channels, two fragments per register
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i one = _mm_set1_epi16(1);
+		const __m128i alphaLanes = _mm_set_epi16(-1,0,0,0,-1,0,0,0);
+		__m128i out[2];
+		for(int h=0;h<2;h++)
+		{
+			__m128i t = h ? _mm_unpackhi_epi8(texColor,zero) : _mm_unpacklo_epi8(texColor,zero);
+			__m128i m = h ? _mm_unpackhi_epi8(materialColor,zero) : _mm_unpacklo_epi8(materialColor,zero);
+			if(shader.mode == 0)
+			{
+				//modulate_table[i][j] is ((i+1)*(j+1)-1)>>6. the alphas are expanded to 6 bits first and shifted back after
+				t = sse2_select(alphaLanes, sse2_5to6_epi16(t), t);
+				m = sse2_select(alphaLanes, sse2_5to6_epi16(m), m);
+				__m128i res = _mm_srli_epi16(_mm_sub_epi16(_mm_mullo_epi16(_mm_add_epi16(t,one),_mm_add_epi16(m,one)),one),6);
+				out[h] = sse2_select(alphaLanes, _mm_srli_epi16(res,1), res);
+			}
+			else
+			{
+				//decal_table[a][i][j] is (i*a + j*(31-a))>>5, with the texel alpha as a. the material alpha is kept
+				const __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(t,0xFF),0xFF);
+				const __m128i res = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(t,a),
+					_mm_mullo_epi16(m,_mm_sub_epi16(_mm_set1_epi16(31),a))),5);
+				out[h] = sse2_select(alphaLanes, m, res);
+			}
+		}
+		_mm_storeu_si128((__m128i*)dst, _mm_packus_epi16(out[0],out[1]));
+	}
+#endif
+
+	//the inputs to pixel(). they differ in how the depth and the shader output are arrived at
+	struct FloatFragment
+	{
+		float r,g,b,invu,invv,w,z;
+	};
+	struct PreshadedFragment //already run through shade4()
+	{
+		float w,z;
+		FragmentColor color;
+	};
+	struct FixedFragment //see edge_fx_fx for the scaling
+	{
+		s64 invw,z,u,v,color[3];
+	};
+
+	//the scaling of the fixed point interpolants for the current poly
+	int fixedShift;
+
+	FORCEINLINE u32 fragmentDepth(float w, float z)
+	{
 		if(gfx3d.renderState.wbuffer)
 		{
 			//not sure about this
 			//this value was chosen to make the skybox, castle window decals, and water level render correctly in SM64
-			depth = u32floor(4096*w);
+			return u32floor(4096*w);
 		}
 		else
 		{
-			depth = u32floor(z*0x7FFF);
-			depth <<= 9;
+			u32 depth = u32floor(z*0x7FFF);
+			return depth << 9;
+		}
+	}
+	FORCEINLINE u32 fragmentDepth(const FloatFragment &frag) { return fragmentDepth(frag.w,frag.z); }
+	FORCEINLINE u32 fragmentDepth(const PreshadedFragment &frag) { return fragmentDepth(frag.w,frag.z); }
+	FORCEINLINE u32 fragmentDepth(const FixedFragment &frag)
+	{
+		if(gfx3d.renderState.wbuffer)
+		{
+			//4096*w, where w = 2^fixedShift / invw
+			const s64 depth = ((s64)4096 << fixedShift) / frag.invw;
+			return depth > 0xFFFFFFFF ? 0xFFFFFFFF : (u32)depth;
 		}
+		else
+			return (u32)((frag.z * 0x7FFF) >> kFixedZBits) << 9;
+	}
+
+	//conservative bounds on the depth of fragments whose 1/w and z lie within the given ranges (give or take the
+	//error from stepping them in float). fragmentDepth() is monotonic in both, but only while it stays in range;
+	//returns false when it doesn't, or when the bounds would be useless.
+	FORCEINLINE bool depthBounds(const float invwLo, const float invwHi, const float zLo, const float zHi, u32 &lo, u32 &hi)
+	{
+		if(gfx3d.renderState.wbuffer)
+		{
+			const double margin = 0.001 * max(fabs(invwLo),fabs(invwHi));
+			if(!(invwLo - margin > 0)) return false;
+			const double depthLo = 4096.0 / (invwHi + margin) - 1;
+			const double depthHi = 4096.0 / (invwLo - margin) + 1;
+			if(!(depthHi < 2147483648.0)) return false;
+			lo = depthLo > 0 ? (u32)depthLo : 0;
+			hi = (u32)depthHi;
+		}
+		else
+		{
+			const double margin = 0.001 * max(fabs(zLo),fabs(zHi)) + 0.000001;
+			if(!(zLo - margin >= 0)) return false;
+			const double depthHi = (zHi + margin) * 0x7FFF + 1;
+			if(!(depthHi < (1<<23))) return false;
+			lo = (u32)((zLo - margin) * 0x7FFF) << 9;
+			hi = (u32)depthHi << 9;
+		}
+		return true;
+	}
+
+	//the fixed point interpolants are stepped exactly, so their ends bound them exactly
+	FORCEINLINE bool depthBounds(const s64 invwLo, const s64 invwHi, const s64 zLo, const s64 zHi, u32 &lo, u32 &hi)
+	{
+		if(gfx3d.renderState.wbuffer)
+		{
+			if(invwLo <= 0) return false;
+			const FixedFragment fragLo = { invwHi }, fragHi = { invwLo };
+			lo = fragmentDepth(fragLo);
+			hi = fragmentDepth(fragHi);
+		}
+		else
+		{
+			if(zLo < 0 || ((zHi * 0x7FFF) >> kFixedZBits) >= (1<<23)) return false;
+			FixedFragment fragLo = { 0, zLo }, fragHi = { 0, zHi };
+			lo = fragmentDepth(fragLo);
+			hi = fragmentDepth(fragHi);
+		}
+		return true;
+	}
+
+	//true if no fragment with a depth within [lo,hi] could pass the depth test anywhere in the rows [y0,y1) and columns [x0,x1)
+	FORCEINLINE bool depthTilesReject(const int y0, const int y1, const int x0, const int x1, const u32 lo, const u32 hi)
+	{
+		const int size = SoftRasterizerEngine::DEPTH_TILE_SIZE;
+		for(int ty=y0/size;ty<=(y1-1)/size;ty++)
+		{
+			for(int tx=x0/size;tx<=(x1-1)/size;tx++)
+			{
+				if(engine->depthTiles[ty][tx].dirty)
+					engine->updateDepthTile(ty,tx);
+				const SoftRasterizerEngine::DepthTile &tile = engine->depthTiles[ty][tx];
+
+				//decals need an equal depth, and everything else a lesser one
+				if(polyAttr.decalMode)
+				{
+					if(hi >= tile.min && lo <= tile.max) return false;
+				}
+				else
+				{
+					if(lo < tile.max) return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	//tests a span against the depth tiles, from the interpolants at its ends
+	template<typename T>
+	FORCEINLINE bool earlyRejectSpan(const int y, const int x, const int width, const T invwA, const T invwB, const T zA, const T zB)
+	{
+		earlyZFragments += width;
+
+		u32 lo, hi;
+		if(!depthBounds(min(invwA,invwB),max(invwA,invwB),min(zA,zB),max(zA,zB),lo,hi)) return false;
+		if(!depthTilesReject(y,y+1,x,x+width,lo,hi)) return false;
+
+		earlyZRejectedFragments += width;
+		return true;
+	}
+
+	FORCEINLINE void fragmentShade(const FloatFragment &frag, FragmentColor &shaderOutput)
+	{
+		shader.w = frag.w;
+		shader.invu = frag.invu;
+		shader.invv = frag.invv;
+
+		//perspective-correct the colors
+		float r = (frag.r * frag.w) + 0.5f;
+		float g = (frag.g * frag.w) + 0.5f;
+		float b = (frag.b * frag.w) + 0.5f;
+
+
+		//this is a HACK: 
+		//we are being very sloppy with our interpolation precision right now
+		//and rather than fix it, i just want to clamp it
+		shader.materialColor.r = max(0U,min(63U,u32floor(r)));
+		shader.materialColor.g = max(0U,min(63U,u32floor(g)));
+		shader.materialColor.b = max(0U,min(63U,u32floor(b)));
+
+		shader.materialColor.a = polyAttr.alpha;
+
+		//pixel shader
+		shade<false>(shaderOutput);
+	}
+	FORCEINLINE void fragmentShade(const PreshadedFragment &frag, FragmentColor &shaderOutput)
+	{
+		shaderOutput = frag.color;
+	}
+	FORCEINLINE void fragmentShade(const FixedFragment &frag, FragmentColor &shaderOutput)
+	{
+		//perspective-correct everything by dividing out the interpolated 1/w.
+		//the colors are rounded, the texel coords floored
+		shader.iu = (s32)FloorDiv64(frag.u,frag.invw);
+		shader.iv = (s32)FloorDiv64(frag.v,frag.invw);
+		for(int i=0;i<3;i++)
+		{
+			const s64 c = FloorDiv64(2*frag.color[i] + frag.invw, 2*frag.invw);
+			(&shader.materialColor.r)[i] = (u8)max<s64>(0,min<s64>(63,c));
+		}
+
+		shader.materialColor.a = polyAttr.alpha;
+
+		shade<true>(shaderOutput);
+	}
+
+	template<typename FRAGMENT>
+	FORCEINLINE void pixel(int adr, const FRAGMENT &frag)
+	{
+		FragmentAttributesBuffer &dst = *engine->screen;
+		u32 &destDepth = dst.depth[adr];
+		u8 &destStencil = dst.stencil[adr];
+		FragmentColor &destFragmentColor = engine->screenColor[adr];
+
+		u32 depth = fragmentDepth(frag);
 
 		if(polyAttr.decalMode)
 		{
 			if ( CommonSettings.GFX3D_Zelda_Shadow_Depth_Hack > 0)
 			{
-				if(depth<destFragment.depth - CommonSettings.GFX3D_Zelda_Shadow_Depth_Hack
-					|| depth>destFragment.depth + CommonSettings.GFX3D_Zelda_Shadow_Depth_Hack) 
+				if(depth<destDepth - CommonSettings.GFX3D_Zelda_Shadow_Depth_Hack
+					|| depth>destDepth + CommonSettings.GFX3D_Zelda_Shadow_Depth_Hack) 
 				{
 					goto depth_fail;
 				}
@@ -604,7 +1110,7 @@ public:
 			}
 			else
 			{
-				if(depth != destFragment.depth)
+				if(depth != destDepth)
 				{
 					goto depth_fail;
 				}
@@ -613,7 +1119,7 @@ public:
 		}
 		else
 		{
-			if(depth>=destFragment.depth) 
+			if(depth>=destDepth) 
 			{
 				goto depth_fail;
 			}
@@ -628,7 +1134,7 @@ public:
 			}
 			else
 			{
-				if(destFragment.stencil==0)
+				if(destStencil==0)
 				{
 					goto rejected_fragment;
 				}	
@@ -636,33 +1142,14 @@ public:
 				//shadow polys have a special check here to keep from self-shadowing when user
 				//has tried to prevent it from happening
 				//if this isnt here, then the vehicle select in mariokart will look terrible
-				if(destFragment.polyid.opaque == polyAttr.polyid)
+				if(dst.opaquePolyID[adr] == polyAttr.polyid)
 					goto rejected_fragment;
 			}
 		}
 		
-		shader.w = w;
-		shader.invu = invu;
-		shader.invv = invv;
-
-		//perspective-correct the colors
-		r = (r * w) + 0.5f;
-		g = (g * w) + 0.5f;
-		b = (b * w) + 0.5f;
-
-
-		//this is a HACK: 
-		//we are being very sloppy with our interpolation precision right now
-		//and rather than fix it, i just want to clamp it
-		shader.materialColor.r = max(0U,min(63U,u32floor(r)));
-		shader.materialColor.g = max(0U,min(63U,u32floor(g)));
-		shader.materialColor.b = max(0U,min(63U,u32floor(b)));
-
-		shader.materialColor.a = polyAttr.alpha;
-
 		//pixel shader
 		FragmentColor shaderOutput;
-		shade(shaderOutput);
+		fragmentShade(frag,shaderOutput);
 
 		//we shouldnt do any of this if we generated a totally transparent pixel
 		if(shaderOutput.a != 0)
@@ -678,31 +1165,35 @@ public:
 			bool isOpaquePixel = shaderOutput.a == 31;
 			if(isOpaquePixel)
 			{
-				destFragment.polyid.opaque = polyAttr.polyid;
-				destFragment.isTranslucentPoly = polyAttr.translucent?1:0;
-				destFragment.fogged = polyAttr.fogged;
+				dst.opaquePolyID[adr] = polyAttr.polyid;
+				dst.isTranslucentPoly[adr] = polyAttr.translucent?1:0;
+				dst.isFogged[adr] = polyAttr.fogged;
 				destFragmentColor = shaderOutput;
 			}
 			else
 			{
 				//dont overwrite pixels on translucent polys with the same polyids
-				if(destFragment.polyid.translucent == polyAttr.polyid)
+				if(dst.translucentPolyID[adr] == polyAttr.polyid)
 					goto rejected_fragment;
 			
 				//originally we were using a test case of shadows-behind-trees in sm64ds
 				//but, it looks bad in that game. this is actually correct
 				//if this isnt correct, then complex shape cart shadows in mario kart don't work right
-				destFragment.polyid.translucent = polyAttr.polyid;
+				dst.translucentPolyID[adr] = polyAttr.polyid;
 
 				//alpha blending and write color
 				alphaBlend(destFragmentColor, shaderOutput);
 
-				destFragment.fogged &= polyAttr.fogged;
+				dst.isFogged[adr] &= polyAttr.fogged;
 			}
 
 			//depth writing
 			if(isOpaquePixel || polyAttr.translucentDepthWrite)
-				destFragment.depth = depth;
+			{
+				destDepth = depth;
+				if(RENDERER)
+					engine->depthTiles[(adr>>8)/SoftRasterizerEngine::DEPTH_TILE_SIZE][(adr&255)/SoftRasterizerEngine::DEPTH_TILE_SIZE].dirty = true;
+			}
 
 		}
 
@@ -715,13 +1206,13 @@ public:
 		goto done;
 		depth_fail:
 		if(shader.mode == 3 && polyAttr.polyid == 0)
-			destFragment.stencil++;
+			destStencil++;
 		rejected_fragment:
 		done:
 		;
 
-		if(shader.mode == 3 && polyAttr.polyid != 0 && destFragment.stencil)
-			destFragment.stencil--;
+		if(shader.mode == 3 && polyAttr.polyid != 0 && destStencil)
+			destStencil--;
 	}
 
 	//draws a single scanline
@@ -806,9 +1297,50 @@ public:
 			width = (RENDERER?256:engine->width)-x;
 		}
 
+		if(RENDERER && earlyZ && width > 0
+			&& earlyRejectSpan(pLeft->Y,x,width,pLeft->invw.curr,pRight->invw.curr,pLeft->z.curr,pRight->z.curr))
+			return;
+
+#ifdef ENABLE_SSE2
+		if(RENDERER && canShade4())
+		{
+			//step the interpolants four fragments at a time (in the same order as below, so they accumulate identically)
+			//and then shade all four at once
+			while(width >= 4)
+			{
+				DS_ALIGN(16) float sinvw[4], su[4], sv[4], sz[4], sr[4], sg[4], sb[4], sw[4];
+				DS_ALIGN(16) FragmentColor shaded[4];
+				for(int i=0;i<4;i++)
+				{
+					sinvw[i] = invw; su[i] = u; sv[i] = v; sz[i] = z;
+					sr[i] = color[0]; sg[i] = color[1]; sb[i] = color[2];
+					invw += dinvw_dx;
+					u += du_dx;
+					v += dv_dx;
+					z += dz_dx;
+					color[0] += dc_dx[0];
+					color[1] += dc_dx[1];
+					color[2] += dc_dx[2];
+				}
+
+				shade4(sinvw,su,sv,sr,sg,sb,sw,shaded);
+				for(int i=0;i<4;i++)
+				{
+					const PreshadedFragment frag = { sw[i], sz[i], shaded[i] };
+					pixel(adr+i,frag);
+				}
+
+				adr += 4;
+				x += 4;
+				width -= 4;
+			}
+		}
+#endif
+
 		while(width-- > 0)
 		{
-			pixel(adr,color[0],color[1],color[2],u,v,1.0f/invw,z);
+			const FloatFragment frag = { color[0], color[1], color[2], u, v, 1.0f/invw, z };
+			pixel(adr,frag);
 			adr++;
 			x++;
 
@@ -822,9 +1354,92 @@ public:
 		}
 	}
 
+	//draws a single scanline, in the fixed point mode
+	FORCEINLINE void drawscanline(edge_fx_fx *pLeft, edge_fx_fx *pRight, bool lineHack)
+	{
+		int XStart = pLeft->X;
+		int width = pRight->X - XStart;
+
+		// HACK: workaround for vertical/slant line poly
+		if (lineHack && width == 0)
+		{
+			int leftWidth = pLeft->XStep;
+			if (pLeft->ErrorTerm + pLeft->Numerator >= pLeft->Denominator)
+				leftWidth++;
+			int rightWidth = pRight->XStep;
+			if (pRight->ErrorTerm + pRight->Numerator >= pRight->Denominator)
+				rightWidth++;
+			width = max(1, max(abs(leftWidth), abs(rightWidth)));
+		}
+
+		if(width <= 0)
+			return;
+		const int spanWidth = width;
+
+		int adr = (pLeft->Y*engine->width)+XStart;
+
+		if(RENDERER && (pLeft->Y<0 || pLeft->Y>191)) {
+			printf("rasterizer rendering at y=%d! oops!\n",pLeft->Y);
+			return;
+		}
+		if(!RENDERER && (pLeft->Y<0 || pLeft->Y>=engine->height)) {
+			printf("rasterizer rendering at y=%d! oops!\n",pLeft->Y);
+			return;
+		}
+
+		int x = XStart;
+		int prestep = 0;
+
+		if(x<0)
+		{
+			if(RENDERER && !lineHack)
+			{
+				printf("rasterizer rendering at x=%d! oops!\n",x);
+				return;
+			}
+			prestep = -x;
+			adr += -x;
+			width -= -x;
+			x = 0;
+		}
+		if(x+width > (RENDERER?256:engine->width))
+		{
+			if(RENDERER && !lineHack)
+			{
+				printf("rasterizer rendering at x=%d! oops!\n",x+width-1);
+				return;
+			}
+			width = (RENDERER?256:engine->width)-x;
+		}
+
+		if(RENDERER && earlyZ && width > 0
+			&& earlyRejectSpan(pLeft->Y,x,width,pLeft->invw.curr,pRight->invw.curr,pLeft->z.curr,pRight->z.curr))
+			return;
+
+		//step from the left edge's values to the right edge's over the span
+		edge_fx_fx::Interpolant interpolants[edge_fx_fx::NUM_INTERPOLANTS];
+		for(int i=0;i<edge_fx_fx::NUM_INTERPOLANTS;i++)
+			interpolants[i].initialize(pLeft->interpolants[i].curr,pRight->interpolants[i].curr,spanWidth,prestep,1);
+		edge_fx_fx::Interpolant &invw = interpolants[0], &z = interpolants[1], &u = interpolants[2], &v = interpolants[3];
+		edge_fx_fx::Interpolant *color = &interpolants[4];
+
+		while(width-- > 0)
+		{
+			const FixedFragment frag = { invw.curr, z.curr, u.curr, v.curr, { color[0].curr, color[1].curr, color[2].curr } };
+			if(frag.invw > 0)
+				pixel(adr,frag);
+			adr++;
+			x++;
+
+			for(int i=0;i<edge_fx_fx::NUM_INTERPOLANTS;i++)
+				interpolants[i].doStep();
+		}
+	}
+
 	//runs several scanlines, until an edge is finished
-	template<bool SLI>
-	void runscanlines(edge_fx_fl *left, edge_fx_fl *right, bool horizontal, bool lineHack)
+	//(or until we step past the bottom of our band, in which case nothing else of this poly is ours to draw)
+	template<bool BANDED, typename EDGE>
+	void runscanlines(EDGE *left, EDGE *right, bool horizontal, bool lineHack)
 	{
 		//oh lord, hack city for edge drawing
 
@@ -835,12 +1450,23 @@ public:
 		//HACK: special handling for horizontal line poly
 		if (lineHack && left->Height == 0 && right->Height == 0 && left->Y<192 && left->Y>=0)
 		{
-			bool draw = (!SLI || (left->Y & SLI_MASK) == SLI_VALUE);
+			bool draw = (!BANDED || (left->Y >= bandTop && left->Y < bandBottom));
 			if(draw) drawscanline(left,right,lineHack);
 		}
 
+		//jump straight to the top of our band rather than stepping down to it
+		if(BANDED && Height > 0 && left->Y < bandTop)
+		{
+			const int skip = min(Height, bandTop - left->Y);
+			left->Skip(skip);
+			right->Skip(skip);
+			Height -= skip;
+			first = false;
+		}
+
 		while(Height--) {
-			bool draw = (!SLI || (left->Y & SLI_MASK) == SLI_VALUE);
+			if(BANDED && left->Y >= bandBottom) break;
+			bool draw = (!BANDED || left->Y >= bandTop);
 			if(draw) drawscanline(left,right,lineHack);
 			const int xl = left->X;
 			const int xr = right->X;
@@ -951,7 +1577,30 @@ public:
 	//verts must be clockwise.
 	//I didnt reference anything for this algorithm but it seems like I've seen it somewhere before.
 	//Maybe it is like crow's algorithm
-	template<bool SLI>
+	FORCEINLINE void setupEdge(edge_fx_fl &edge, int Top, int Bottom, bool& failure)
+	{
+		edge = edge_fx_fl(Top,Bottom,(VERT**)&verts,failure);
+	}
+	FORCEINLINE void setupEdge(edge_fx_fx &edge, int Top, int Bottom, bool& failure)
+	{
+		edge = edge_fx_fx(Top,Bottom,(VERT**)&verts,fixedShift,failure);
+	}
+
+	//picks the scaling for the fixed point interpolants of the current poly (see edge_fx_fx).
+	//returns false for polys whose w is too far out of range; those go through the float path
+	bool setupFixedPoint(int type)
+	{
+		float maxInvW = 0;
+		for(int j=0;j<type;j++)
+			maxInvW = max(maxInvW, 1/verts[j]->w);
+
+		int exponent;
+		frexp(maxInvW,&exponent);
+		fixedShift = kFixedInvWBits - exponent;
+		return maxInvW > 0 && fixedShift >= 0 && fixedShift <= 50;
+	}
+
+	template<bool BANDED, typename EDGE>
 	void shape_engine(int type, bool backwards, bool lineHack)
 	{
 		bool failure = false;
@@ -974,15 +1623,15 @@ public:
 		//for the counter we're decrementing.
 		int lv = type, rv = 0;
 
-		edge_fx_fl left, right;
+		EDGE left, right;
 		bool step_left = true, step_right = true;
 		for(;;) {
 			//generate new edges if necessary. we must avoid regenerating edges when they are incomplete
 			//so that they can be continued on down the shape
 			assert(rv != type);
 			int _lv = lv==type?0:lv; //make sure that we ask for vert 0 when the variable contains the starting value
-			if(step_left) left = edge_fx_fl(_lv,lv-1,(VERT**)&verts, failure);
-			if(step_right) right = edge_fx_fl(rv,rv+1,(VERT**)&verts, failure);
+			if(step_left) setupEdge(left,_lv,lv-1,failure);
+			if(step_right) setupEdge(right,rv,rv+1,failure);
 			step_left = step_right = false;
 
 			//handle a failure in the edge setup due to nutty polys
@@ -990,7 +1639,10 @@ public:
 				return;
 
 			bool horizontal = left.Y == right.Y;
-			runscanlines<SLI>(&left,&right,horizontal, lineHack);
+			runscanlines<BANDED>(&left,&right,horizontal, lineHack);
+
+			//the rest of the poly is below our band
+			if(BANDED && left.Y >= bandBottom) break;
 
 			//if we ran out of an edge, step to the next one
 			if(right.Height == 0) {
@@ -1010,63 +1662,182 @@ public:
 
 	SoftRasterizerEngine* engine;
 
-	template<bool SLI>
-	FORCEINLINE void mainLoop(SoftRasterizerEngine* const engine)
+	bool firstPoly;
+	bool fixedPoint;
+	u32 lastPolyAttr;
+	u32 lastTextureFormat, lastTexturePalette;
+
+	FORCEINLINE void beginPolys(SoftRasterizerEngine* const engine)
 	{
 		this->engine = engine;
 		lastTexKey = NULL;
+		readyTexKey = NULL;
+		firstPoly = true;
+		fixedPoint = CommonSettings.GFX3D_FixedPointRasterizer;
+		lastPolyAttr = 0;
+		lastTextureFormat = lastTexturePalette = 0;
+	}
 
-		u32 lastPolyAttr = 0;
-		u32 lastTextureFormat = 0, lastTexturePalette = 0;
+	template<bool BANDED>
+	FORCEINLINE void renderPoly(const int i)
+	{
+		if(!RENDERER) _debug_thisPoly = (i==engine->_debug_drawClippedUserPoly);
+		polynum = i;
 
-		//iterate over polys
-		bool first=true;
-		for(int i=0;i<engine->clippedPolyCounter;i++)
+		GFX3D_Clipper::TClippedPoly &clippedPoly = engine->clippedPolys[i];
+		POLY *poly = clippedPoly.poly;
+		int type = clippedPoly.type;
+
+		if(firstPoly || lastPolyAttr != poly->polyAttr)
 		{
-			if(!RENDERER) _debug_thisPoly = (i==engine->_debug_drawClippedUserPoly);
-			if(!engine->polyVisible[i]) continue;
-			polynum = i;
+			polyAttr.setup(poly->polyAttr);
+			lastPolyAttr = poly->polyAttr;
+		}
 
-			GFX3D_Clipper::TClippedPoly &clippedPoly = engine->clippedPolys[i];
-			POLY *poly = clippedPoly.poly;
-			int type = clippedPoly.type;
+		//this depends on the texture format too, so it can't be cached along with the rest of the attributes.
+		//(a stale value would also make the output depend on which polys a rasterizer unit drew before this one)
+		polyAttr.translucent = poly->isTranslucent();
 
-			if(first || lastPolyAttr != poly->polyAttr)
-			{
-				polyAttr.setup(poly->polyAttr);
-				polyAttr.translucent = poly->isTranslucent();
-				lastPolyAttr = poly->polyAttr;
-			}
 
+		if(firstPoly || lastTextureFormat != poly->texParam || lastTexturePalette != poly->texPalette)
+		{
+			sampler.setup(poly->texParam);
+			lastTextureFormat = poly->texParam;
+			lastTexturePalette = poly->texPalette;
+		}
+
+		firstPoly = false;
 
-			if(first || lastTextureFormat != poly->texParam || lastTexturePalette != poly->texPalette)
-			{
-				sampler.setup(poly->texParam);
-				lastTextureFormat = poly->texParam;
-				lastTexturePalette = poly->texPalette;
-			}
+		lastTexKey = engine->polyTexKeys[i];
 
-			first = false;
+		//hmm... shader gets setup every time because it depends on sampler which may have just changed
+		setupShader(poly->polyAttr);
+
+		for(int j=0;j<type;j++)
+			this->verts[j] = &clippedPoly.clipVerts[j];
+		for(int j=type;j<MAX_CLIPPED_VERTS;j++)
+			this->verts[j] = NULL;
+
+		polyAttr.backfacing = engine->polyBackfacing[i];
+
+		const bool lineHack = (poly->vtxFormat & 4) && CommonSettings.GFX3D_LineHack;
+
+		//fragments failing the depth test have no side effects, except on shadow polys' stencil.
+		//decals with the zelda depth hack compare within a range, which the tiles aren't set up for
+		earlyZ = RENDERER && softRastEarlyZ && shader.mode != 3
+			&& !(polyAttr.decalMode && CommonSettings.GFX3D_Zelda_Shadow_Depth_Hack > 0);
+		if(earlyZ && !lineHack && earlyRejectPoly<BANDED>(type))
+		{
+			earlyZRejectedPolys++;
+			return;
+		}
+
+		//the texture's decoding may have been left to the rasterizer units (see setupTextures)
+		if(lastTexKey != readyTexKey)
+		{
+			if(lastTexKey) TexCache_Decode(lastTexKey);
+			readyTexKey = lastTexKey;
+		}
+
+		if(fixedPoint && setupFixedPoint(type))
+			shape_engine<BANDED,edge_fx_fx>(type,!polyAttr.backfacing,lineHack);
+		else
+			shape_engine<BANDED,edge_fx_fl>(type,!polyAttr.backfacing,lineHack);
+	}
+
+	//tests the whole of the current poly (within our band) against the depth tiles, from its verts
+	template<bool BANDED>
+	bool earlyRejectPoly(const int type)
+	{
+		float invwLo = 1/verts[0]->w, invwHi = invwLo, zLo = verts[0]->z, zHi = zLo;
+		float xLo = verts[0]->x, xHi = xLo, yLo = verts[0]->y, yHi = yLo;
+		for(int j=1;j<type;j++)
+		{
+			const float invw = 1/verts[j]->w;
+			invwLo = min(invwLo,invw); invwHi = max(invwHi,invw);
+			zLo = min(zLo,verts[j]->z); zHi = max(zHi,verts[j]->z);
+			xLo = min(xLo,verts[j]->x); xHi = max(xHi,verts[j]->x);
+			yLo = min(yLo,verts[j]->y); yHi = max(yHi,verts[j]->y);
+		}
+
+		//the pixels a poly covers are the ones from the ceilings of its top left up to (but not including) the ceilings of its bottom right
+		const int x0 = max(0, Ceil28_4((fixed28_4)xLo)), x1 = min(256, Ceil28_4((fixed28_4)xHi));
+		const int y0 = max(BANDED ? bandTop : 0, Ceil28_4((fixed28_4)yLo)), y1 = min(BANDED ? bandBottom : 192, Ceil28_4((fixed28_4)yHi));
+		if(x0 >= x1 || y0 >= y1) return false;
+
+		u32 lo, hi;
+		if(!depthBounds(invwLo,invwHi,zLo,zHi,lo,hi)) return false;
+		return depthTilesReject(y0,y1,x0,x1,lo,hi);
+	}
 
-			lastTexKey = engine->polyTexKeys[i];
+	//draws every visible poly over the whole framebuffer
+	void mainLoop(SoftRasterizerEngine* const engine)
+	{
+		beginPolys(engine);
 
-			//hmm... shader gets setup every time because it depends on sampler which may have just changed
-			setupShader(poly->polyAttr);
+		//iterate over polys
+		for(int i=0;i<engine->clippedPolyCounter;i++)
+		{
+			if(!engine->polyVisible[i]) continue;
+			renderPoly<false>(i);
+		}
+	}
 
-			for(int j=0;j<type;j++)
-				this->verts[j] = &clippedPoly.clipVerts[j];
-			for(int j=type;j<MAX_CLIPPED_VERTS;j++)
-				this->verts[j] = NULL;
+	//keeps grabbing bands until there are none left, drawing only the polys binned into each one.
+	//the polys in a band are still drawn in order, so the output is the same as mainLoop's
+	void bandLoop(SoftRasterizerEngine* const engine)
+	{
+		for(;;)
+		{
+			const int band = Task_AtomicIncrement(&engine->nextBand) - 1;
+			if(band >= SoftRasterizerEngine::BAND_COUNT) break;
 
-			polyAttr.backfacing = engine->polyBackfacing[i];
+			bandTop = band * SoftRasterizerEngine::BAND_HEIGHT;
+			bandBottom = bandTop + SoftRasterizerEngine::BAND_HEIGHT;
+			beginPolys(engine);
 
-			shape_engine<SLI>(type,!polyAttr.backfacing, (poly->vtxFormat & 4) && CommonSettings.GFX3D_LineHack);
+			const std::vector<int> &polys = engine->bandPolys[band];
+			for(size_t j=0;j<polys.size();j++)
+				renderPoly<true>(polys[j]);
 		}
+
+		//out of bands, so decode whatever textures no poly drawn so far has needed
+		TexCache_DecodePending();
 	}
 
 
 }; //rasterizerUnit
 
+//the eight neighbours of a pixel, in the order the edges used to be drawn onto them
+enum {
+	EDGE_UPLEFT = 0x01, EDGE_UP = 0x02, EDGE_UPRIGHT = 0x04, EDGE_LEFT = 0x08,
+	EDGE_RIGHT = 0x10, EDGE_DOWNLEFT = 0x20, EDGE_DOWN = 0x40, EDGE_DOWNRIGHT = 0x80
+};
+
+//maps the set of neighbours a pixel makes an edge against to the set of neighbours it draws the edge onto
+static u8 edgeMarkDrawTable[256];
+
+static void generateEdgeMarkDrawTable()
+{
+	for(int i=0;i<256;i++)
+	{
+		const bool upleft = (i&EDGE_UPLEFT)!=0, up = (i&EDGE_UP)!=0, upright = (i&EDGE_UPRIGHT)!=0;
+		const bool left = (i&EDGE_LEFT)!=0, right = (i&EDGE_RIGHT)!=0;
+		const bool downleft = (i&EDGE_DOWNLEFT)!=0, down = (i&EDGE_DOWN)!=0, downright = (i&EDGE_DOWNRIGHT)!=0;
+
+		u8 draws = 0;
+		if(upleft && upright && downleft && !downright) draws |= EDGE_UPLEFT;
+		if(up && !down) draws |= EDGE_UP;
+		if(upleft && upright && !downleft && downright) draws |= EDGE_UPRIGHT;
+		if(left && !right) draws |= EDGE_LEFT;
+		if(right && !left) draws |= EDGE_RIGHT;
+		if(upleft && !upright && downleft && downright) draws |= EDGE_DOWNLEFT;
+		if(down && !up) draws |= EDGE_DOWN;
+		if(!upleft && upright && downleft && downright) draws |= EDGE_DOWNRIGHT;
+		edgeMarkDrawTable[i] = draws;
+	}
+}
+
 static SoftRasterizerEngine mainSoftRasterizer;
 
 #define _MAX_CORES 16
@@ -1074,12 +1845,21 @@ static Task rasterizerUnitTask[_MAX_CORES];
 static RasterizerUnit<true> rasterizerUnit[_MAX_CORES];
 static RasterizerUnit<false> _HACK_viewer_rasterizerUnit;
 static unsigned int rasterizerCores = 0;
+//how many of the rasterizer units are handed work each frame (less than rasterizerCores only while benchmarking)
+static unsigned int rasterizerActiveCores = 0;
 static bool rasterizerUnitTasksInited = false;
 
 static void* execRasterizerUnit(void* arg)
 {
 	intptr_t which = (intptr_t)arg;
-	rasterizerUnit[which].mainLoop<true>(&mainSoftRasterizer);
+	rasterizerUnit[which].bandLoop(&mainSoftRasterizer);
+	return 0;
+}
+
+static void* execFramebufferProcess(void* arg)
+{
+	intptr_t pass = (intptr_t)arg;
+	mainSoftRasterizer.framebufferProcessBands(pass);
 	return 0;
 }
 
@@ -1095,27 +1875,20 @@ static char SoftRastInit(void)
 	{
 		rasterizerUnitTasksInited = true;
 
-		_HACK_viewer_rasterizerUnit.SLI_MASK = 1;
-		_HACK_viewer_rasterizerUnit.SLI_VALUE = 0;
-
 		rasterizerCores = CommonSettings.num_cores;
 		if (rasterizerCores > _MAX_CORES) 
 			rasterizerCores = _MAX_CORES;
 		if(CommonSettings.num_cores <= 1)
 		{
 			rasterizerCores = 1;
-			rasterizerUnit[0].SLI_MASK = 0;
-			rasterizerUnit[0].SLI_VALUE = 0;
 		}
 		else
 		{
+			//bands are handed out on demand, so any number of cores will do (not just powers of two)
 			for (u8 i = 0; i < rasterizerCores; i++)
-			{
-				rasterizerUnit[i].SLI_MASK = (rasterizerCores - 1);
-				rasterizerUnit[i].SLI_VALUE = i;
 				rasterizerUnitTask[i].start(false);
-			}
 		}
+		rasterizerActiveCores = rasterizerCores;
 
 	}
 
@@ -1147,6 +1920,8 @@ static char SoftRastInit(void)
 				index_lookup_table[idx++] = b;
 			}
 		}
+
+		generateEdgeMarkDrawTable();
 	}
 
 	TexCache_Reset();
@@ -1197,6 +1972,55 @@ static void SoftRastConvertFramebuffer()
 	memcpy(gfx3d_convertedScreen,_screenColor,256*192*4);
 }
 
+FragmentAttributesBuffer::FragmentAttributesBuffer(const size_t count)
+	: count(count)
+{
+	depth = new u32[count];
+	opaquePolyID = new u8[count];
+	translucentPolyID = new u8[count];
+	stencil = new u8[count];
+	isTranslucentPoly = new u8[count];
+	isFogged = new u8[count];
+}
+
+FragmentAttributesBuffer::~FragmentAttributesBuffer()
+{
+	delete[] depth;
+	delete[] opaquePolyID;
+	delete[] translucentPolyID;
+	delete[] stencil;
+	delete[] isTranslucentPoly;
+	delete[] isFogged;
+}
+
+void FragmentAttributesBuffer::fill(const Fragment &fragment)
+{
+	for(size_t i=0;i<count;i++)
+		depth[i] = fragment.depth;
+	memset(opaquePolyID, fragment.polyid.opaque, count);
+	memset(translucentPolyID, fragment.polyid.translucent, count);
+	memset(stencil, fragment.stencil, count);
+	memset(isTranslucentPoly, fragment.isTranslucentPoly, count);
+	memset(isFogged, fragment.fogged, count);
+}
+
+void SoftRasterizerEngine::updateDepthTile(const int ty, const int tx)
+{
+	DepthTile &tile = depthTiles[ty][tx];
+	tile.min = 0xFFFFFFFF;
+	tile.max = 0;
+	for(int y=0;y<DEPTH_TILE_SIZE;y++)
+	{
+		const u32* depth = screen->depth + (ty*DEPTH_TILE_SIZE+y)*256 + tx*DEPTH_TILE_SIZE;
+		for(int x=0;x<DEPTH_TILE_SIZE;x++)
+		{
+			tile.min = min(tile.min,depth[x]);
+			tile.max = max(tile.max,depth[x]);
+		}
+	}
+	tile.dirty = false;
+}
+
 void SoftRasterizerEngine::initFramebuffer(const int width, const int height, const bool clearImage)
 {
 	const int todo = width*height;
@@ -1217,8 +2041,11 @@ void SoftRasterizerEngine::initFramebuffer(const int width, const int height, co
 	clearFragment.stencil = 0;
 	clearFragment.isTranslucentPoly = 0;
 	clearFragment.fogged = BIT15(gfx3d.renderState.clearColor);
-	for(int i=0;i<todo;i++)
-		screen[i] = clearFragment;
+	screen->fill(clearFragment);
+
+	for(int ty=0;ty<DEPTH_TILES_Y;ty++)
+		for(int tx=0;tx<DEPTH_TILES_X;tx++)
+			depthTiles[ty][tx].dirty = true;
 
 	if(clearImage)
 	{
@@ -1235,7 +2062,8 @@ void SoftRasterizerEngine::initFramebuffer(const int width, const int height, co
 		u16 yscroll = (scroll>>8)&0xFF;
 
 		FragmentColor *dstColor = screenColor;
-		Fragment *dst = screen;
+		u32 *dstDepth = screen->depth;
+		u8 *dstFogged = screen->isFogged;
 
 		for(int iy=0;iy<192;iy++) {
 			int y = ((iy + yscroll)&255)<<8;
@@ -1252,11 +2080,12 @@ void SoftRasterizerEngine::initFramebuffer(const int width, const int height, co
 				//this is tested quite well in the sonic chronicles main map mode
 				//where depth values are used for trees etc you can walk behind
 				u16 depth = clearDepth[adr];
-				dst->fogged = BIT15(depth);
-				dst->depth = DS_DEPTH15TO24(depth);
+				*dstFogged = BIT15(depth);
+				*dstDepth = DS_DEPTH15TO24(depth);
 
 				dstColor++;
-				dst++;
+				dstDepth++;
+				dstFogged++;
 			}
 		}
 	}
@@ -1342,24 +2171,21 @@ SoftRasterizerEngine::SoftRasterizerEngine()
 	: _debug_drawClippedUserPoly(-1)
 {
 	this->clippedPolys = clipper.clippedPolys = new GFX3D_Clipper::TClippedPoly[POLYLIST_SIZE*2];
+
+	//only the insides of the edge marking planes get written, so the padding is set up here once and for all.
+	//a pixel never makes an edge against the padding, since nothing is greater than 0xFF
+	memset(edgeMarkIds,0xFF,sizeof(edgeMarkIds));
+	memset(edgeMarkSources,0,sizeof(edgeMarkSources));
+	memset(edgeMarkDraws,0,sizeof(edgeMarkDraws));
 }
 
-void SoftRasterizerEngine::framebufferProcess()
+//picks up the edge mark and fog colors for this frame and returns the first pass that needs to run
+int SoftRasterizerEngine::setupFramebufferProcess()
 {
-	// this looks ok although it's still pretty much a hack,
-	// it needs to be redone with low-level accuracy at some point,
-	// but that should probably wait until the shape renderer is more accurate.
-	// a good test case for edge marking is Sonic Rush:
-	// - the edges are completely sharp/opaque on the very brief title screen intro,
-	// - the level-start intro gets a pseudo-antialiasing effect around the silhouette,
-	// - the character edges in-level are clearly transparent, and also show well through shield powerups.
 	if(gfx3d.renderState.enableEdgeMarking)
-	{ 
+	{
 		//TODO - need to test and find out whether these get grabbed at flush time, or at render time
 		//we can do this by rendering a 3d frame and then freezing the system, but only changing the edge mark colors
-		FragmentColor edgeMarkColors[8];
-		int edgeMarkDisabled[8];
-
 		for(int i=0;i<8;i++)
 		{
 			u16 col = T1ReadWord(MMU.MMU_MEM[ARMCPU_ARM9][0x40], 0x330+i*2);
@@ -1371,85 +2197,211 @@ void SoftRasterizerEngine::framebufferProcess()
 			// this seems to be the only thing that selectively disables edge marking
 			edgeMarkDisabled[i] = (col == 0x7FFF);
 		}
+	}
+
+	if(gfx3d.renderState.enableFog)
+	{
+		fogColor[0] = GFX3D_5TO6((gfx3d.renderState.fogColor)&0x1F);
+		fogColor[1] = GFX3D_5TO6((gfx3d.renderState.fogColor>>5)&0x1F);
+		fogColor[2] = GFX3D_5TO6((gfx3d.renderState.fogColor>>10)&0x1F);
+		fogColor[3] = (gfx3d.renderState.fogColor>>16)&0x1F;
+		fogAlphaOnly = gfx3d.renderState.enableFogAlphaOnly?true:false;
+	}
+
+	if(gfx3d.renderState.enableEdgeMarking) return FRAMEBUFFER_PASS_EDGEMARK_IDS;
+	if(gfx3d.renderState.enableFog) return FRAMEBUFFER_PASS_BLEND;
+	return FRAMEBUFFER_PASS_COUNT;
+}
+
+void SoftRasterizerEngine::framebufferProcessRows(const int pass, const int top, const int bottom)
+{
+	// this looks ok although it's still pretty much a hack,
+	// it needs to be redone with low-level accuracy at some point,
+	// but that should probably wait until the shape renderer is more accurate.
+	// a good test case for edge marking is Sonic Rush:
+	// - the edges are completely sharp/opaque on the very brief title screen intro,
+	// - the level-start intro gets a pseudo-antialiasing effect around the silhouette,
+	// - the character edges in-level are clearly transparent, and also show well through shield powerups.
+	const int P = EDGEMARK_PITCH;
 
-		for(int i=0,y=0;y<192;y++)
+	if(pass == FRAMEBUFFER_PASS_EDGEMARK_IDS)
+	{
+		for(int y=top;y<bottom;y++)
+		{
+			const u8* srcIds = screen->opaquePolyID + y*256;
+			const u8* srcTranslucent = screen->isTranslucentPoly + y*256;
+			u8* sources = edgeMarkSources + EDGEMARK_INDEX(0,y);
+			memcpy(edgeMarkIds + EDGEMARK_INDEX(0,y), srcIds, 256);
+			for(int x=0;x<256;x++)
+				sources[x] = (edgeMarkDisabled[srcIds[x]>>3] || srcTranslucent[x]) ? 0x00 : 0xFF;
+		}
+	}
+	else if(pass == FRAMEBUFFER_PASS_EDGEMARK_DRAWS)
+	{
+		// > is used instead of != to prevent double edges
+		// between overlapping polys of different IDs.
+		// also note that the edge generally goes on the outside, not the inside, (maybe needs to change later)
+		// and that polys with the same edge color can make edges against each other.
+		static const int offsets[8] = { -P-1, -P, -P+1, -1, 1, P-1, P, P+1 };
+		for(int y=top;y<bottom;y++)
 		{
-			for(int x=0;x<256;x++,i++)
+			const int row = EDGEMARK_INDEX(0,y);
+#ifdef ENABLE_SSE2
+			for(int x=0;x<256;x+=16)
 			{
-				Fragment destFragment = screen[i];
-				u8 self = destFragment.polyid.opaque;
-				if(edgeMarkDisabled[self>>3]) continue;
-				if(destFragment.isTranslucentPoly) continue;
-
-				// > is used instead of != to prevent double edges
-				// between overlapping polys of different IDs.
-				// also note that the edge generally goes on the outside, not the inside, (maybe needs to change later)
-				// and that polys with the same edge color can make edges against each other.
-
-				FragmentColor edgeColor = edgeMarkColors[self>>3];
-
-#define PIXOFFSET(dx,dy) ((dx)+(256*(dy)))
-#define ISEDGE(dx,dy) ((x+(dx)!=256) && (x+(dx)!=-1) && (y+(dy)!=192) && (y+(dy)!=-1) && self > screen[i+PIXOFFSET(dx,dy)].polyid.opaque)
-#define DRAWEDGE(dx,dy) alphaBlend(screenColor[i+PIXOFFSET(dx,dy)], edgeColor)
-
-				bool upleft    = ISEDGE(-1,-1);
-				bool up        = ISEDGE( 0,-1);
-				bool upright   = ISEDGE( 1,-1);
-				bool left      = ISEDGE(-1, 0);
-				bool right     = ISEDGE( 1, 0);
-				bool downleft  = ISEDGE(-1, 1);
-				bool down      = ISEDGE( 0, 1);
-				bool downright = ISEDGE( 1, 1);
-
-				if(upleft && upright && downleft && !downright)
-					DRAWEDGE(-1,-1);
-				if(up && !down)
-					DRAWEDGE(0,-1);
-				if(upleft && upright && !downleft && downright)
-					DRAWEDGE(1,-1);
-				if(left && !right)
-					DRAWEDGE(-1,0);
-				if(right && !left)
-					DRAWEDGE(1,0);
-				if(upleft && !upright && downleft && downright)
-					DRAWEDGE(-1,1);
-				if(down && !up)
-					DRAWEDGE(0,1);
-				if(!upleft && upright && downleft && downright)
-					DRAWEDGE(1,1);
-
-#undef PIXOFFSET
-#undef ISEDGE
-#undef DRAWEDGE
+				const int i = row+x;
+				const __m128i self = _mm_load_si128((__m128i*)(edgeMarkIds+i));
+				__m128i edges = _mm_setzero_si128();
+				for(int k=0;k<8;k++)
+				{
+					//self > neighbour exactly when the saturating difference is nonzero
+					const __m128i neighbour = _mm_loadu_si128((__m128i*)(edgeMarkIds+i+offsets[k]));
+					const __m128i notEdge = _mm_cmpeq_epi8(_mm_subs_epu8(self,neighbour),_mm_setzero_si128());
+					edges = _mm_or_si128(edges, _mm_andnot_si128(notEdge,_mm_set1_epi8((char)(1<<k))));
+				}
+				edges = _mm_and_si128(edges, _mm_load_si128((__m128i*)(edgeMarkSources+i)));
 
+				DS_ALIGN(16) u8 lanes[16];
+				_mm_store_si128((__m128i*)lanes,edges);
+				for(int j=0;j<16;j++)
+					edgeMarkDraws[i+j] = edgeMarkDrawTable[lanes[j]];
+			}
+#else
+			for(int x=0;x<256;x++)
+			{
+				const int i = row+x;
+				const u8 self = edgeMarkIds[i];
+				u8 edges = 0;
+				for(int k=0;k<8;k++)
+					if(self > edgeMarkIds[i+offsets[k]]) edges |= (1<<k);
+				edgeMarkDraws[i] = edgeMarkDrawTable[edges & edgeMarkSources[i]];
 			}
+#endif
 		}
 	}
-
-	if(gfx3d.renderState.enableFog)
+	else if(pass == FRAMEBUFFER_PASS_BLEND)
 	{
-		u32 r = GFX3D_5TO6((gfx3d.renderState.fogColor)&0x1F);
-		u32 g = GFX3D_5TO6((gfx3d.renderState.fogColor>>5)&0x1F);
-		u32 b = GFX3D_5TO6((gfx3d.renderState.fogColor>>10)&0x1F);
-		u32 a = (gfx3d.renderState.fogColor>>16)&0x1F;
-		for(int i=0;i<256*192;i++)
-		{
-			Fragment &destFragment = screen[i];
-			if(!destFragment.fogged) continue;
-			FragmentColor &destFragmentColor = screenColor[i];
-			u32 fogIndex = destFragment.depth>>9;
-			assert(fogIndex<32768);
-			u8 fog = fogTable[fogIndex];
-			if(fog==127) fog=128;
-			if(!gfx3d.renderState.enableFogAlphaOnly)
+		for(int y=top;y<bottom;y++)
+		{
+			FragmentColor* dst = screenColor + y*256;
+
+			if(gfx3d.renderState.enableEdgeMarking)
+			{
+				//every pixel collects the edges its neighbours draw onto it, in the same order
+				//that a scan over the neighbours would have drawn them
+				const int row = EDGEMARK_INDEX(0,y);
+				for(int x=0;x<256;x++)
+				{
+					const int i = row+x;
+#ifdef ENABLE_SSE2
+					//most of the frame has no edges at all; skip over it sixteen pixels at a time
+					if((x&15)==0)
+					{
+						__m128i any = _mm_or_si128(
+							_mm_or_si128(_mm_loadu_si128((__m128i*)(edgeMarkDraws+i-P-1)), _mm_loadu_si128((__m128i*)(edgeMarkDraws+i-P+1))),
+							_mm_or_si128(_mm_loadu_si128((__m128i*)(edgeMarkDraws+i+P-1)), _mm_loadu_si128((__m128i*)(edgeMarkDraws+i+P+1))));
+						any = _mm_or_si128(any, _mm_or_si128(_mm_load_si128((__m128i*)(edgeMarkDraws+i-P)), _mm_load_si128((__m128i*)(edgeMarkDraws+i+P))));
+						any = _mm_or_si128(any, _mm_or_si128(_mm_loadu_si128((__m128i*)(edgeMarkDraws+i-1)), _mm_loadu_si128((__m128i*)(edgeMarkDraws+i+1))));
+						if(_mm_movemask_epi8(_mm_cmpeq_epi8(any,_mm_setzero_si128())) == 0xFFFF)
+						{
+							x += 15;
+							continue;
+						}
+					}
+#endif
+#define DRAWEDGE(offset,dir) if(edgeMarkDraws[i+(offset)] & (dir)) alphaBlend(dst[x], edgeMarkColors[edgeMarkIds[i+(offset)]>>3])
+					DRAWEDGE(-P-1,EDGE_DOWNRIGHT);
+					DRAWEDGE(-P,  EDGE_DOWN);
+					DRAWEDGE(-P+1,EDGE_DOWNLEFT);
+					DRAWEDGE(-1,  EDGE_RIGHT);
+					DRAWEDGE( 1,  EDGE_LEFT);
+					DRAWEDGE( P-1,EDGE_UPRIGHT);
+					DRAWEDGE( P,  EDGE_UP);
+					DRAWEDGE( P+1,EDGE_UPLEFT);
+#undef DRAWEDGE
+				}
+			}
+
+			if(gfx3d.renderState.enableFog)
 			{
-				destFragmentColor.r = ((128-fog)*destFragmentColor.r + r*fog)>>7;
-				destFragmentColor.g = ((128-fog)*destFragmentColor.g + g*fog)>>7;
-				destFragmentColor.b = ((128-fog)*destFragmentColor.b + b*fog)>>7;
+				const u32* srcDepth = screen->depth + y*256;
+				const u8* srcFogged = screen->isFogged + y*256;
+#ifdef ENABLE_SSE2
+				//the lerp is done in 16bit lanes. the scalar version keeps bits 7-14 of a 32bit sum, which come out the same mod 2^16
+				const __m128i fog4 = _mm_setr_epi16(fogColor[0],fogColor[1],fogColor[2],fogColor[3],fogColor[0],fogColor[1],fogColor[2],fogColor[3]);
+				const __m128i lanes = fogAlphaOnly ? _mm_setr_epi16(0,0,0,-1,0,0,0,-1) : _mm_set1_epi16(-1);
+				for(int x=0;x<256;x+=4)
+				{
+					if(!(srcFogged[x] | srcFogged[x+1] | srcFogged[x+2] | srcFogged[x+3])) continue;
+
+					DS_ALIGN(16) u16 weights[8];
+					for(int j=0;j<4;j++)
+					{
+						u16 fog = 0;
+						if(srcFogged[x+j])
+						{
+							u32 fogIndex = srcDepth[x+j]>>9;
+							assert(fogIndex<32768);
+							fog = fogTable[fogIndex];
+							if(fog==127) fog=128;
+						}
+						weights[j*2] = weights[j*2+1] = fog;
+					}
+
+					const __m128i fogWeights = _mm_load_si128((__m128i*)weights);
+					const __m128i colors = _mm_loadu_si128((__m128i*)(dst+x));
+					__m128i out[2];
+					for(int h=0;h<2;h++)
+					{
+						//spread the two pixels' weights over their four channels, and zero them on the channels fog leaves alone
+						__m128i weight = h ? _mm_unpackhi_epi32(fogWeights,fogWeights) : _mm_unpacklo_epi32(fogWeights,fogWeights);
+						weight = _mm_and_si128(weight,lanes);
+						const __m128i c = h ? _mm_unpackhi_epi8(colors,_mm_setzero_si128()) : _mm_unpacklo_epi8(colors,_mm_setzero_si128());
+						const __m128i sum = _mm_add_epi16(_mm_mullo_epi16(_mm_sub_epi16(_mm_set1_epi16(128),weight),c), _mm_mullo_epi16(fog4,weight));
+						out[h] = _mm_and_si128(_mm_srli_epi16(sum,7),_mm_set1_epi16(0xFF));
+					}
+					_mm_storeu_si128((__m128i*)(dst+x), _mm_packus_epi16(out[0],out[1]));
+				}
+#else
+				for(int x=0;x<256;x++)
+				{
+					if(!srcFogged[x]) continue;
+					FragmentColor &destFragmentColor = dst[x];
+					u32 fogIndex = srcDepth[x]>>9;
+					assert(fogIndex<32768);
+					u8 fog = fogTable[fogIndex];
+					if(fog==127) fog=128;
+					if(!fogAlphaOnly)
+					{
+						destFragmentColor.r = ((128-fog)*destFragmentColor.r + fogColor[0]*fog)>>7;
+						destFragmentColor.g = ((128-fog)*destFragmentColor.g + fogColor[1]*fog)>>7;
+						destFragmentColor.b = ((128-fog)*destFragmentColor.b + fogColor[2]*fog)>>7;
+					}
+					destFragmentColor.a = ((128-fog)*destFragmentColor.a + fogColor[3]*fog)>>7;
+				}
+#endif
 			}
-			destFragmentColor.a = ((128-fog)*destFragmentColor.a + a*fog)>>7;
 		}
 	}
+}
+
+//runs a pass over whichever bands are left, so that several rasterizer units can share it
+void SoftRasterizerEngine::framebufferProcessBands(const int pass)
+{
+	for(;;)
+	{
+		const s32 band = Task_AtomicIncrement(&nextBand) - 1;
+		if(band >= BAND_COUNT) break;
+		framebufferProcessRows(pass, band*BAND_HEIGHT, (band+1)*BAND_HEIGHT);
+	}
+}
+
+void SoftRasterizerEngine::framebufferProcess()
+{
+	for(int pass = setupFramebufferProcess(); pass < FRAMEBUFFER_PASS_COUNT; pass++)
+	{
+		framebufferProcessRows(pass, 0, 192);
+	}
 
 	////debug alpha channel framebuffer contents
 	//for(int i=0;i<256*192;i++)
@@ -1555,7 +2507,37 @@ void SoftRasterizerEngine::performCoordAdjustment(const bool skipBackfacing)
 	}
 }
 
-void SoftRasterizerEngine::setupTextures(const bool skipBackfacing)
+void SoftRasterizerEngine::performBinning()
+{
+	for(int b=0;b<BAND_COUNT;b++)
+		bandPolys[b].clear();
+
+	for(int i=0;i<clippedPolyCounter;i++)
+	{
+		if(!polyVisible[i]) continue;
+
+		GFX3D_Clipper::TClippedPoly &clippedPoly = clippedPolys[i];
+		VERT* verts = &clippedPoly.clipVerts[0];
+
+		float ymin = verts[0].y, ymax = verts[0].y;
+		for(int j=1;j<clippedPoly.type;j++)
+		{
+			ymin = min(ymin,verts[j].y);
+			ymax = max(ymax,verts[j].y);
+		}
+
+		//scanlines are drawn starting from the ceiling of the top vert.
+		//the bottom is conservative, since the line hack can draw a scanline at the ceiling of the bottom vert
+		int top = max(0, Ceil28_4((fixed28_4)ymin));
+		int bottom = min(191, Ceil28_4((fixed28_4)ymax));
+		for(int b=top/BAND_HEIGHT;b<=bottom/BAND_HEIGHT;b++)
+			bandPolys[b].push_back(i);
+	}
+
+	nextBand = 0;
+}
+
+void SoftRasterizerEngine::setupTextures(const bool skipBackfacing, const bool deferDecoding)
 {
 	TexCacheItem* lastTexKey = NULL;
 	u32 lastTextureFormat = 0, lastTexturePalette = 0;
@@ -1574,7 +2556,12 @@ void SoftRasterizerEngine::setupTextures(const bool skipBackfacing)
 		//and then it won't be safe.
 		if(needInitTexture || lastTextureFormat != poly->texParam || lastTexturePalette != poly->texPalette)
 		{
-			lastTexKey = TexCache_SetTexture(TexFormat_15bpp,poly->texParam,poly->texPalette);
+			//the textures which aren't cached yet can be decoded by the rasterizer units as they need them,
+			//in parallel and while the bands which don't need them get going
+			if(deferDecoding)
+				lastTexKey = TexCache_SetTextureDeferred(TexFormat_15bpp,poly->texParam,poly->texPalette);
+			else
+				lastTexKey = TexCache_SetTexture(TexFormat_15bpp,poly->texParam,poly->texPalette);
 			lastTextureFormat = poly->texParam;
 			lastTexturePalette = poly->texPalette;
 			needInitTexture = false;
@@ -1624,7 +2611,7 @@ void SoftRasterizerEngine::performBackfaceTests()
 
 void _HACK_Viewer_ExecUnit(SoftRasterizerEngine* engine)
 {
-	_HACK_viewer_rasterizerUnit.mainLoop<false>(engine);
+	_HACK_viewer_rasterizerUnit.mainLoop(engine);
 }
 
 static void SoftRastRender()
@@ -1641,7 +2628,7 @@ static void SoftRastRender()
 	mainSoftRasterizer.polylist = gfx3d.polylist;
 	mainSoftRasterizer.vertlist = gfx3d.vertlist;
 	mainSoftRasterizer.indexlist = &gfx3d.indexlist;
-	mainSoftRasterizer.screen = _screen;
+	mainSoftRasterizer.screen = &_screen;
 	mainSoftRasterizer.screenColor = _screenColor;
 	mainSoftRasterizer.width = 256;
 	mainSoftRasterizer.height = 192;
@@ -1657,20 +2644,21 @@ static void SoftRastRender()
 	mainSoftRasterizer.performViewportTransforms<false>(256,192);
 	mainSoftRasterizer.performBackfaceTests();
 	mainSoftRasterizer.performCoordAdjustment(true);
-	mainSoftRasterizer.setupTextures(true);
+	mainSoftRasterizer.setupTextures(true, rasterizerActiveCores > 1);
 
 	softRastHasNewData = true;
 	
-	if (rasterizerCores > 1)
+	if (rasterizerActiveCores > 1)
 	{
-		for(unsigned int i = 0; i < rasterizerCores; i++)
+		mainSoftRasterizer.performBinning();
+		for(unsigned int i = 0; i < rasterizerActiveCores; i++)
 		{
 			rasterizerUnitTask[i].execute(&execRasterizerUnit, (void *)i);
 		}
 	}
 	else
 	{
-		rasterizerUnit[0].mainLoop<false>(&mainSoftRasterizer);
+		rasterizerUnit[0].mainLoop(&mainSoftRasterizer);
 	}
 }
 
@@ -1691,7 +2679,22 @@ static void SoftRastRenderFinish()
 	
 	TexCache_EvictFrame();
 	
-	mainSoftRasterizer.framebufferProcess();
+	if (rasterizerActiveCores > 1)
+	{
+		//each pass is spread over the rasterizer units, and they all have to be done with it before the next one starts
+		for(int pass = mainSoftRasterizer.setupFramebufferProcess(); pass < SoftRasterizerEngine::FRAMEBUFFER_PASS_COUNT; pass++)
+		{
+			mainSoftRasterizer.nextBand = 0;
+			for(unsigned int i = 0; i < rasterizerActiveCores; i++)
+				rasterizerUnitTask[i].execute(&execFramebufferProcess, (void *)(intptr_t)pass);
+			for(unsigned int i = 0; i < rasterizerActiveCores; i++)
+				rasterizerUnitTask[i].finish();
+		}
+	}
+	else
+	{
+		mainSoftRasterizer.framebufferProcess();
+	}
 	
 	//	printf("rendered %d of %d polys after backface culling\n",gfx3d.polylist->count-culled,gfx3d.polylist->count);
 	SoftRastConvertFramebuffer();
@@ -1699,6 +2702,150 @@ static void SoftRastRenderFinish()
 	softRastHasNewData = false;
 }
 
+void SoftRastBenchmark(int iterations)
+{
+	if(!rasterizerUnitTasksInited)
+		SoftRastInit();
+
+	//replays whatever frame gfx3d last flushed, first on one core and then on more and more of the rasterizer units
+	u64 baseline = 0;
+	for(unsigned int cores = 1; cores <= rasterizerCores; cores++)
+	{
+		rasterizerActiveCores = cores;
+
+		u64 start = Task_GetTimeMicros();
+		for(int i=0;i<iterations;i++)
+		{
+			SoftRastRender();
+			SoftRastRenderFinish();
+		}
+		u64 elapsed = max<u64>(1, Task_GetTimeMicros() - start);
+		if(cores == 1) baseline = elapsed;
+
+		printf("SoftRast benchmark: %d polys, cores=%d: %.3f ms/frame, speedup %.2fx\n",
+			gfx3d.polylist->count, cores, elapsed / (1000.0 * iterations), (double)baseline / elapsed);
+	}
+
+	//and the float and fixed point interpolation on one core.
+	//this times only the rasterizer units, since everything before them is the same for both
+	rasterizerActiveCores = 1;
+	const bool fixedPoint = CommonSettings.GFX3D_FixedPointRasterizer;
+	for(int mode = 0; mode < 2; mode++)
+	{
+		CommonSettings.GFX3D_FixedPointRasterizer = (mode == 1);
+		SoftRastRender();
+		SoftRastRenderFinish();
+
+		u64 start = Task_GetTimeMicros();
+		for(int i=0;i<iterations;i++)
+		{
+			mainSoftRasterizer.initFramebuffer(256,192,false);
+			rasterizerUnit[0].mainLoop(&mainSoftRasterizer);
+		}
+		u64 elapsed = max<u64>(1, Task_GetTimeMicros() - start);
+
+		printf("SoftRast benchmark: %s interpolation: %d clipped polys, %.0f polys/sec\n",
+			mode ? "fixed point" : "float", mainSoftRasterizer.clippedPolyCounter,
+			(double)mainSoftRasterizer.clippedPolyCounter * iterations * 1000000.0 / elapsed);
+	}
+	CommonSettings.GFX3D_FixedPointRasterizer = fixedPoint;
+
+	//and with and without the early depth rejection, on one core. this also checks that it doesn't change the output
+	static FragmentColor referenceColor[256*192];
+	const bool earlyZ = softRastEarlyZ;
+	for(int mode = 0; mode < 2; mode++)
+	{
+		softRastEarlyZ = (mode == 1);
+		SoftRastResetEarlyZStats();
+
+		u64 start = Task_GetTimeMicros();
+		for(int i=0;i<iterations;i++)
+		{
+			SoftRastRender();
+			SoftRastRenderFinish();
+		}
+		u64 elapsed = max<u64>(1, Task_GetTimeMicros() - start);
+
+		if(mode == 0)
+		{
+			memcpy(referenceColor,_screenColor,sizeof(referenceColor));
+			printf("SoftRast benchmark: early depth rejection off: %.3f ms/frame\n", elapsed / (1000.0 * iterations));
+		}
+		else
+		{
+			SoftRastEarlyZStats stats;
+			SoftRastGetEarlyZStats(stats);
+			int mismatches = 0;
+			for(int i=0;i<256*192;i++)
+				if(referenceColor[i].color != _screenColor[i].color) mismatches++;
+			printf("SoftRast benchmark: early depth rejection on: %.3f ms/frame, %.1f%% of %.0f span fragments and %.0f polys rejected per frame, %d pixels differ\n",
+				elapsed / (1000.0 * iterations),
+				stats.fragments ? 100.0 * stats.rejectedFragments / stats.fragments : 0.0,
+				(double)stats.fragments / iterations, (double)stats.rejectedPolys / iterations, mismatches);
+		}
+	}
+	softRastEarlyZ = earlyZ;
+
+	rasterizerActiveCores = rasterizerCores;
+}
+
+void SoftRastGetEarlyZStats(SoftRastEarlyZStats &stats)
+{
+	stats.fragments = stats.rejectedFragments = stats.rejectedPolys = 0;
+	for(int i=0;i<_MAX_CORES;i++)
+	{
+		stats.fragments += rasterizerUnit[i].earlyZFragments;
+		stats.rejectedFragments += rasterizerUnit[i].earlyZRejectedFragments;
+		stats.rejectedPolys += rasterizerUnit[i].earlyZRejectedPolys;
+	}
+}
+
+void SoftRastResetEarlyZStats()
+{
+	for(int i=0;i<_MAX_CORES;i++)
+		rasterizerUnit[i].earlyZFragments = rasterizerUnit[i].earlyZRejectedFragments = rasterizerUnit[i].earlyZRejectedPolys = 0;
+}
+
+int SoftRastVerifySpanShading()
+{
+	if(!rasterizerUnitTasksInited)
+		SoftRastInit();
+
+	//render the last flushed frame through the scalar path as the reference image,
+	//and then again with the span shading kernels
+	static FragmentColor referenceColor[256*192];
+	static Fragment reference[256*192];
+
+	const bool spanShading = softRastSpanShading;
+	softRastSpanShading = false;
+	SoftRastRender();
+	SoftRastRenderFinish();
+	memcpy(referenceColor,_screenColor,sizeof(referenceColor));
+	for(int i=0;i<256*192;i++)
+		reference[i] = _screen.get(i);
+
+	softRastSpanShading = true;
+	SoftRastRender();
+	SoftRastRenderFinish();
+	softRastSpanShading = spanShading;
+
+	int mismatches = 0;
+	for(int i=0;i<256*192;i++)
+	{
+		const Fragment fragment = _screen.get(i);
+		if(referenceColor[i].color != _screenColor[i].color
+			|| reference[i].depth != fragment.depth
+			|| reference[i].stencil != fragment.stencil
+			|| reference[i].polyid.opaque != fragment.polyid.opaque
+			|| reference[i].polyid.translucent != fragment.polyid.translucent)
+			mismatches++;
+	}
+
+	printf("SoftRast span shading: %d polys, %d of %d pixels differ from the scalar path\n",
+		gfx3d.polylist->count, mismatches, 256*192);
+	return mismatches;
+}
+
 GPU3DInterface gpu3DRasterize = {
 	"SoftRasterizer",
 	SoftRastInit,
@@ -18,11 +18,28 @@
 #ifndef _RASTERIZE_H_
 #define _RASTERIZE_H_
 
+#include <vector>
 #include "render3D.h"
 #include "gfx3d.h"
 
 extern GPU3DInterface gpu3DRasterize;
 
+//re-renders the last flushed 3d frame `iterations` times on 1..N rasterizer cores and prints the timings
+void SoftRastBenchmark(int iterations);
+
+//renders the last flushed 3d frame with and without the SIMD span shading, and returns how many pixels differ
+int SoftRastVerifySpanShading();
+
+//counters for the early depth rejection against the depth tiles, summed over the rasterizer units
+struct SoftRastEarlyZStats
+{
+	u64 fragments;         //fragments in the spans which were tested
+	u64 rejectedFragments; //fragments in the spans which were rejected before being interpolated
+	u64 rejectedPolys;     //polys rejected before edge setup (per band, when running banded). their fragments aren't counted above
+};
+void SoftRastGetEarlyZStats(SoftRastEarlyZStats &stats);
+void SoftRastResetEarlyZStats();
+
 union FragmentColor {
 	u32 color;
 	struct {
@@ -55,6 +72,48 @@ struct Fragment
 	};
 };
 
+//the per-pixel attributes of the framebuffer. each attribute is kept in a plane of its own, so that the passes
+//which only look at one or two of them (the depth test, edge marking, fog) stream contiguous data
+//instead of dragging whole Fragments through the cache.
+class FragmentAttributesBuffer
+{
+public:
+	FragmentAttributesBuffer(const size_t count);
+	~FragmentAttributesBuffer();
+
+	FORCEINLINE Fragment get(const size_t i) const
+	{
+		Fragment fragment;
+		fragment.depth = depth[i];
+		fragment.polyid.opaque = opaquePolyID[i];
+		fragment.polyid.translucent = translucentPolyID[i];
+		fragment.stencil = stencil[i];
+		fragment.isTranslucentPoly = isTranslucentPoly[i];
+		fragment.fogged = isFogged[i];
+		return fragment;
+	}
+
+	FORCEINLINE void set(const size_t i, const Fragment &fragment)
+	{
+		depth[i] = fragment.depth;
+		opaquePolyID[i] = fragment.polyid.opaque;
+		translucentPolyID[i] = fragment.polyid.translucent;
+		stencil[i] = fragment.stencil;
+		isTranslucentPoly[i] = fragment.isTranslucentPoly;
+		isFogged[i] = fragment.fogged;
+	}
+
+	void fill(const Fragment &fragment);
+
+	size_t count;
+	u32 *depth;
+	u8 *opaquePolyID;
+	u8 *translucentPolyID;
+	u8 *stencil;
+	u8 *isTranslucentPoly; //0 or 1
+	u8 *isFogged; //0 or 1
+};
+
 class TexCacheItem;
 
 class SoftRasterizerEngine
@@ -67,6 +126,9 @@ public:
 	
 	void initFramebuffer(const int width, const int height, const bool clearImage);
 	void framebufferProcess();
+	int setupFramebufferProcess();
+	void framebufferProcessRows(const int pass, const int top, const int bottom);
+	void framebufferProcessBands(const int pass);
 	void updateToonTable();
 	void updateFogTable();
 	void updateFloatColors();
@@ -74,7 +136,9 @@ public:
 	template<bool CUSTOM> void performViewportTransforms(int width, int height);
 	void performCoordAdjustment(const bool skipBackfacing);
 	void performBackfaceTests();
-	void setupTextures(const bool skipBackfacing);
+	void performBinning();
+	void updateDepthTile(const int ty, const int tx);
+	void setupTextures(const bool skipBackfacing, const bool deferDecoding);
 
 	FragmentColor toonTable[32];
 	u8 fogTable[32768];
@@ -84,8 +148,50 @@ public:
 	TexCacheItem* polyTexKeys[POLYLIST_SIZE];
 	bool polyVisible[POLYLIST_SIZE];
 	bool polyBackfacing[POLYLIST_SIZE];
-	Fragment *screen;
+	FragmentAttributesBuffer *screen;
 	FragmentColor *screenColor;
+
+	//the framebuffer is split into horizontal bands, and every visible poly is binned into each band it touches.
+	//rasterizer units grab whole bands off of nextBand and only set up the polys binned there.
+	static const int BAND_HEIGHT = 8;
+	static const int BAND_COUNT = 192/BAND_HEIGHT;
+	std::vector<int> bandPolys[BAND_COUNT];
+	volatile s32 nextBand;
+
+	//coarse depth buffer: the min and max depth of each 8x8 tile, for rejecting spans and polys before they get interpolated.
+	//tiles are marked dirty when a depth in them is written, and only recomputed when they are next looked at.
+	//the tiles are as tall as the bands, so a rasterizer unit only ever touches the tiles of its own band.
+	static const int DEPTH_TILE_SIZE = BAND_HEIGHT;
+	static const int DEPTH_TILES_X = 256/DEPTH_TILE_SIZE;
+	static const int DEPTH_TILES_Y = 192/DEPTH_TILE_SIZE;
+	struct DepthTile
+	{
+		u32 min, max;
+		bool dirty;
+	};
+	DepthTile depthTiles[DEPTH_TILES_Y][DEPTH_TILES_X];
+
+	//framebufferProcess() runs as a series of passes over row bands, which the rasterizer units can share.
+	//a pass must be finished over the whole frame before the next one starts, since edge marking looks at the neighbouring rows.
+	enum {
+		FRAMEBUFFER_PASS_EDGEMARK_IDS,   //copies the opaque poly ids out of the fragments
+		FRAMEBUFFER_PASS_EDGEMARK_DRAWS, //finds out which neighbours every pixel draws an edge onto
+		FRAMEBUFFER_PASS_BLEND,          //blends the edges and the fog into the colors
+		FRAMEBUFFER_PASS_COUNT
+	};
+	FragmentColor edgeMarkColors[8];
+	bool edgeMarkDisabled[8];
+	u32 fogColor[4];
+	bool fogAlphaOnly;
+
+	//edge marking planes. they are padded by a pixel on each side, so the neighbour compares need no bounds checks;
+	//pixel x,y lives at EDGEMARK_INDEX(x,y)
+	static const int EDGEMARK_PITCH = 256+32;
+	#define EDGEMARK_INDEX(x,y) (((y)+1)*SoftRasterizerEngine::EDGEMARK_PITCH + 16 + (x))
+	DS_ALIGN(16) u8 edgeMarkIds[(192+2)*EDGEMARK_PITCH];
+	DS_ALIGN(16) u8 edgeMarkSources[(192+2)*EDGEMARK_PITCH];
+	DS_ALIGN(16) u8 edgeMarkDraws[(192+2)*EDGEMARK_PITCH];
+
 	POLYLIST* polylist;
 	VERTLIST* vertlist;
 	INDEXLIST* indexlist;
@@ -23,8 +23,13 @@
 #ifdef HAVE_LIBZ
 #include <zlib.h>
 #endif
+#ifdef HAVE_LIBLZ4
+#include <lz4.h>
+#endif
 #include <stack>
+#include <algorithm>
 #include <set>
+#include <map>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -45,6 +50,7 @@
 #include "MMU_timing.h"
 
 #include "path.h"
+#include "utils/task.h"
 
 #ifdef _WINDOWS
 #include "windows/main.h"
@@ -340,6 +346,7 @@ SFORMAT SF_WIFI[]={
 	{ "W260", 2, 1, &wifiMac.retryLimit},
 
 	{ "W270", 4, 1, &wifiMac.crystalEnabled},
+	{ "W275", 8, 1, &wifiMac.usecTime},
 	{ "W280", 8, 1, &wifiMac.usec},
 	{ "W290", 4, 1, &wifiMac.usecEnable},
 	{ "W300", 8, 1, &wifiMac.ucmp},
@@ -520,6 +527,9 @@ static bool cp15_loadstate(EMUFILE* is, int size)
 
 
 /* Format time and convert to string */
+static bool savestate_queueWrite(const char *file_name, int slot);
+static void savestate_reportWrite(int num, bool ok);
+
 static char * format_time(time_t cal_time)
 {
   struct tm *time_struct;
@@ -563,7 +573,6 @@ void scan_savestates()
 
 void savestate_slot(int num)
 {
-   struct stat sbuf;
    char filename[MAX_PATH+1];
 
 	lastSaveState = num;		//Set last savestate used
@@ -573,26 +582,34 @@ void savestate_slot(int num)
    if (strlen(filename) + strlen(".dsx") + strlen("-2147483648") /* = biggest string for num */ >MAX_PATH) return ;
    sprintf(filename+strlen(filename), ".ds%d", num);
 
-   if (savestate_save(filename))
+   //"Saved to" and the slot's date are only shown once the write is done, see savestate_reportWrite
+   savestate_queueWrite(filename, num);
+}
+
+//tells the user how the slot save that just finished went
+static void savestate_reportWrite(int num, bool ok)
+{
+   if (!ok)
    {
-	   osd->setLineColor(255, 255, 255);
-	   osd->addLine("Saved to %i slot", num);
+	   if (osd)
+	   {
+		   osd->setLineColor(255, 0, 0);
+		   osd->addLine("Error saving %i slot", num);
+	   }
+	   return;
    }
-   else
+
+   if (osd)
    {
-	   osd->setLineColor(255, 0, 0);
-	   osd->addLine("Error saving %i slot", num);
-	   return;
+	   osd->setLineColor(255, 255, 255);
+	   osd->addLine("Saved to %i slot", num);
    }
 
    if (num >= 0 && num < NB_STATES)
    {
-	   if (stat(filename,&sbuf) != -1)
-	   {
-		   savestates[num].exists = TRUE;
-		   strncpy(savestates[num].date, format_time(sbuf.st_mtime),40);
-		   savestates[num].date[40-1] = '\0';
-	   }
+	   savestates[num].exists = TRUE;
+	   strncpy(savestates[num].date, format_time(time(NULL)),40);
+	   savestates[num].date[40-1] = '\0';
    }
 }
 
@@ -619,6 +636,62 @@ void loadstate_slot(int num)
 }
 
 
+//the entries of an SFORMAT table hashed by tag, built (and checked for duplicate tags) the first time the
+//table is saved or loaded. the slots hold entry numbers that are checked against the tag on every hit,
+//and a miss falls back to CheckS, so a table on the stack (SF_HEADER) that reuses the address of another
+//one still finds the right entries.
+struct SFORMAT_Index
+{
+	u32 entries;
+	u32 mask;
+	std::vector<s32> slots; //-1 for an empty slot
+};
+
+static std::map<const SFORMAT*, SFORMAT_Index> sformatIndices;
+
+static u32 SFORMAT_hash(const char *desc)
+{
+	u32 tag;
+	memcpy(&tag, desc, 4);
+	tag *= 2654435761u;
+	return tag ^ (tag >> 16);
+}
+
+static const SFORMAT_Index& SFORMAT_getIndex(const SFORMAT *sf)
+{
+	u32 entries = 0;
+	while(sf[entries].v) entries++;
+
+	SFORMAT_Index& index = sformatIndices[sf];
+	if(index.entries == entries && !index.slots.empty())
+		return index;
+
+	u32 size = 8;
+	while(size < entries*2) size <<= 1;
+	index.entries = entries;
+	index.mask = size - 1;
+	index.slots.assign(size, -1);
+
+	for(u32 i = 0; i < entries; i++)
+	{
+		for(u32 slot = SFORMAT_hash(sf[i].desc) & index.mask; ; slot = (slot + 1) & index.mask)
+		{
+			const s32 j = index.slots[slot];
+			if(j < 0)
+			{
+				index.slots[slot] = i;
+				break;
+			}
+			if(!memcmp(sf[j].desc, sf[i].desc, 4))
+			{
+				printf("ERROR! duplicated chunk name: %s\n", sf[i].desc);
+				break;
+			}
+		}
+	}
+	return index;
+}
+
 // note: guessSF is so we don't have to do a linear search through the SFORMAT array every time
 // in the (most common) case that we already know where the next entry is.
 static const SFORMAT *CheckS(const SFORMAT *guessSF, const SFORMAT *firstSF, u32 size, u32 count, char *desc)
@@ -657,10 +730,26 @@ static const SFORMAT *CheckS(const SFORMAT *guessSF, const SFORMAT *firstSF, u32
 }
 
 
+//finds the entry for a tag through the table's index, or returns 0 like CheckS
+static const SFORMAT *SFORMAT_find(const SFORMAT *sf, const SFORMAT_Index& index, u32 size, u32 count, char *desc)
+{
+	for(u32 slot = SFORMAT_hash(desc) & index.mask; index.slots[slot] >= 0; slot = (slot + 1) & index.mask)
+	{
+		const SFORMAT *entry = sf + index.slots[slot];
+		if(!memcmp(desc,entry->desc,4))
+		{
+			if(entry->size != size || entry->count != count)
+				return 0;
+			return entry;
+		}
+	}
+	return CheckS(NULL,sf,size,count,desc);
+}
+
 static bool ReadStateChunk(EMUFILE* is, const SFORMAT *sf, int size)
 {
 	const SFORMAT *tmp = NULL;
-	const SFORMAT *guessSF = NULL;
+	const SFORMAT_Index& index = SFORMAT_getIndex(sf);
 	int temp = is->ftell();
 
 	while(is->ftell()<temp+size)
@@ -675,7 +764,7 @@ static bool ReadStateChunk(EMUFILE* is, const SFORMAT *sf, int size)
 		if(!read32le(&sz,is)) return false;
 		if(!read32le(&count,is)) return false;
 
-		if((tmp=CheckS(guessSF,sf,sz,count,toa)))
+		if((tmp=SFORMAT_find(sf,index,sz,count,toa)))
 		{
 		#ifdef LOCAL_LE
 			// no need to ever loop one at a time if not flipping byte order
@@ -692,12 +781,10 @@ static bool ReadStateChunk(EMUFILE* is, const SFORMAT *sf, int size)
 				}
 			}
 		#endif
-			guessSF = tmp + 1;
 		}
 		else
 		{
 			is->fseek(sz*count,SEEK_CUR);
-			guessSF = NULL;
 		}
 	} // while(...)
 	return true;
@@ -705,25 +792,64 @@ static bool ReadStateChunk(EMUFILE* is, const SFORMAT *sf, int size)
 
 
 
-static int SubWrite(EMUFILE* os, const SFORMAT *sf)
+//incremental savestates. a buffer that already holds a capture only needs the main memory pages written
+//since then copied again; the rest of the state is small enough to serialize every time.
+static SavestateCapture* captureList; //plain pointer, so captures can be constructed before this file's statics
+static SavestateCapture* captureTarget; //the capture savestate_capture is writing, if any
+
+SavestateCapture::SavestateCapture()
+	: valid(false)
+	, dirty(MMU_DIRTY_PAGES/32)
+	, prev(NULL)
+	, next(captureList)
 {
-	uint32 acc=0;
+	pos[0] = pos[1] = 0;
+	if(next) next->prev = this;
+	captureList = this;
+}
 
-#ifdef DEBUG
-	std::set<std::string> keyset;
-#endif
+SavestateCapture::~SavestateCapture()
+{
+	if(prev) prev->next = next;
+	else captureList = next;
+	if(next) next->prev = prev;
+}
 
-	const SFORMAT* temp = sf;
-	while(temp->v) {
-		const SFORMAT* seek = sf;
-		while(seek->v && seek != temp) {
-			if(!strcmp(seek->desc,temp->desc)) {
-				printf("ERROR! duplicated chunk name: %s\n", temp->desc);
-			}
-			seek++;
-		}
-		temp++;
+//writes only the pages of a main memory block that were written since the target's last capture,
+//seeking over the ones it still holds. returns false when the block has to be written whole.
+static bool capture_write(EMUFILE* os, const SFORMAT* sf)
+{
+	if(!captureTarget) return false;
+
+	int half;
+	if(sf->v == MMU.MAIN_MEM) half = 0;
+	else if(sf->v == MMU.MAIN_MEM+0x400000) half = 1;
+	else return false;
+
+	const s32 pos = os->ftell();
+	const bool inPlace = captureTarget->valid && captureTarget->pos[half] == pos;
+	captureTarget->pos[half] = pos;
+	if(!inPlace) return false;
+
+	const u32 pageSize = 1 << MMU_DIRTY_PAGE_SHIFT;
+	const u32 first = (half*0x400000) >> MMU_DIRTY_PAGE_SHIFT;
+	const u32 last = first + (0x400000 >> MMU_DIRTY_PAGE_SHIFT);
+	for(u32 page = first; page < last; page++)
+	{
+		if(captureTarget->dirty[page>>5] & (1 << (page&31)))
+			os->fwrite(MMU.MAIN_MEM + (page << MMU_DIRTY_PAGE_SHIFT), pageSize);
+		else
+			os->fseek(pageSize, SEEK_CUR);
 	}
+	return true;
+}
+
+static int SubWrite(EMUFILE* os, const SFORMAT *sf)
+{
+	uint32 acc=0;
+
+	//the tags are checked for duplicates when the index is built
+	SFORMAT_getIndex(sf);
 
 	while(sf->v)
 	{
@@ -752,24 +878,16 @@ static int SubWrite(EMUFILE* os, const SFORMAT *sf)
 			write32le(sf->size,os);
 			write32le(sf->count,os);
 
-			#ifdef DEBUG
-			//make sure we dont dup any keys
-			if(keyset.find(sf->desc) != keyset.end())
-			{
-				printf("duplicate save key!\n");
-				assert(false);
-			}
-			keyset.insert(sf->desc);
-			#endif
-
 
 		#ifdef LOCAL_LE
 			// no need to ever loop one at a time if not flipping byte order
-			os->fwrite((char *)sf->v,size*count);
+			if(!capture_write(os,sf))
+				os->fwrite((char *)sf->v,size*count);
 		#else
 			if(size == 1) {
 				//special case: write a huge byte array
-				os->fwrite((char *)sf->v,count);
+				if(!capture_write(os,sf))
+					os->fwrite((char *)sf->v,count);
 			} else {
 				for(int i=0;i<count;i++) {
 					FlipByteOrder((u8*)sf->v + i*size, size);
@@ -841,87 +959,371 @@ static void savestate_WriteChunk(EMUFILE* os, int type, void (*saveproc)(EMUFILE
 
 static void writechunks(EMUFILE* os);
 
-bool savestate_save(EMUFILE* outstream, int compressionLevel)
+static void savestate_writeHeader(EMUFILE* outstream, u32 codec, u32 len, u32 comprlen)
 {
-#ifdef HAVE_JIT 
-	arm_jit_sync();
+	outstream->fseek(0,SEEK_SET);
+	outstream->fwrite(magic,16);
+	write32le(SAVESTATE_VERSION | (codec << 16),outstream); //the codec (zero for a single zlib stream) is kept in the top half
+	write32le(EMU_DESMUME_VERSION_NUMERIC(),outstream); //desmume version
+	write32le(len,outstream); //uncompressed length
+	write32le(comprlen,outstream); //compressed length (-1 if it is not compressed)
+}
+
+#ifdef HAVE_LIBZ
+
+//the block codecs cut the state into blocks of this size and compress them independently, on as many
+//tasks as there are cores. their data is the block size, the block count, the compressed size of each
+//block and then the blocks.
+#define SAVESTATE_BLOCK_SIZE (1024*1024)
+#define SAVESTATE_MAX_TASKS 8
+
+struct SavestateBlocks
+{
+	int codec;
+	int level;
+	bool compress;
+	const u8* in;
+	u8* out;
+	std::vector<u32> inPos, inSize, outPos, outCap, outSize;
+	volatile s32 next;
+	volatile s32 failed;
+};
+
+static bool savestate_codeBlock(SavestateBlocks& job, u32 i)
+{
+	const u8* in = job.in + job.inPos[i];
+	u8* out = job.out + job.outPos[i];
+	switch(job.codec)
+	{
+#ifdef HAVE_LIBLZ4
+		case TCommonSettings::SavestateLZ4Blocks:
+		{
+			int n = job.compress
+				? LZ4_compress_default((const char*)in, (char*)out, job.inSize[i], job.outCap[i])
+				: LZ4_decompress_safe((const char*)in, (char*)out, job.inSize[i], job.outCap[i]);
+			if(n <= 0 || (!job.compress && (u32)n != job.outCap[i])) return false;
+			job.outSize[i] = n;
+			return true;
+		}
 #endif
-	#ifndef HAVE_LIBZ
-	compressionLevel = Z_NO_COMPRESSION;
-	#endif
+		case TCommonSettings::SavestateZlibBlocks:
+		{
+			uLongf n = job.outCap[i];
+			int error = job.compress
+				? compress2(out, &n, in, job.inSize[i], job.level)
+				: uncompress(out, &n, in, job.inSize[i]);
+			if(error != Z_OK || (!job.compress && n != job.outCap[i])) return false;
+			job.outSize[i] = (u32)n;
+			return true;
+		}
+	}
+	return false;
+}
 
-	EMUFILE_MEMORY ms;
-	EMUFILE* os;
-	
-	if(compressionLevel != Z_NO_COMPRESSION)
+static void* savestate_blockWork(void* param)
+{
+	SavestateBlocks& job = *(SavestateBlocks*)param;
+	for(;;)
 	{
-		//generate the savestate in memory first
-		os = (EMUFILE*)&ms;
-		writechunks(os);
+		const s32 i = Task_AtomicIncrement(&job.next) - 1;
+		if(i >= (s32)job.inPos.size()) break;
+		if(!savestate_codeBlock(job, i))
+			job.failed = 1;
 	}
-	else
+	return NULL;
+}
+
+static Task savestateBlockTask[SAVESTATE_MAX_TASKS];
+static int savestateBlockTasks = -1;
+
+//hands the blocks out to the block tasks and the calling thread
+static bool savestate_runBlocks(SavestateBlocks& job)
+{
+	if(savestateBlockTasks < 0)
+	{
+		savestateBlockTasks = std::min(std::max(CommonSettings.num_cores, 1), SAVESTATE_MAX_TASKS) - 1;
+		for(int i = 0; i < savestateBlockTasks; i++)
+			savestateBlockTask[i].start(false);
+	}
+
+	job.next = 0;
+	job.failed = 0;
+	job.outSize.resize(job.inPos.size());
+	const int tasks = std::min(savestateBlockTasks, (int)job.inPos.size() - 1);
+	for(int i = 0; i < tasks; i++)
+		savestateBlockTask[i].execute(savestate_blockWork, &job);
+	savestate_blockWork(&job);
+	for(int i = 0; i < tasks; i++)
+		savestateBlockTask[i].finish();
+
+	return !job.failed;
+}
+
+static u32 savestate_blockBound(int codec, u32 size)
+{
+#ifdef HAVE_LIBLZ4
+	if(codec == TCommonSettings::SavestateLZ4Blocks)
+		return LZ4_compressBound(size);
+#endif
+	return compressBound(size);
+}
+
+static bool savestate_decompressBlocks(int codec, const u8* data, u32 comprlen, u8* buf, u32 len)
+{
+	if(comprlen < 8) return false;
+	const u32 blockSize = LE_TO_LOCAL_32(*(u32*)data);
+	const u32 count = LE_TO_LOCAL_32(*(u32*)(data+4));
+	if(blockSize == 0 || count != (len + blockSize - 1) / blockSize) return false;
+	if(count > (comprlen - 8) / 4) return false;
+
+	SavestateBlocks job;
+	job.codec = codec;
+	job.compress = false;
+	job.in = data;
+	job.out = buf;
+	u32 pos = 8 + count*4;
+	for(u32 i = 0; i < count; i++)
 	{
-		os = outstream;
-		os->fseek(32,SEEK_SET); //skip the header
-		writechunks(os);
+		const u32 size = LE_TO_LOCAL_32(*(u32*)(data + 8 + i*4));
+		if(size > comprlen - pos) return false;
+		job.inPos.push_back(pos);
+		job.inSize.push_back(size);
+		job.outPos.push_back(i*blockSize);
+		job.outCap.push_back(std::min(blockSize, len - i*blockSize));
+		pos += size;
 	}
 
-	//save the length of the file
-	u32 len = os->ftell();
+	return savestate_runBlocks(job);
+}
+
+#endif
+
+//writes the header and then the state's chunks, compressed with the codec from CommonSettings
+static bool savestate_writeCompressed(EMUFILE* outstream, const u8* raw, u32 len, int compressionLevel)
+{
+#ifndef HAVE_LIBZ
+	compressionLevel = Z_NO_COMPRESSION;
+#endif
+	if(compressionLevel == Z_NO_COMPRESSION)
+	{
+		savestate_writeHeader(outstream, 0, len + 32, 0xFFFFFFFF);
+		outstream->fwrite(raw, len);
+		return true;
+	}
 
-	u32 comprlen = 0xFFFFFFFF;
-	u8* cbuf;
+#ifdef HAVE_LIBZ
+	int codec = CommonSettings.savestateCodec;
+#ifndef HAVE_LIBLZ4
+	if(codec == TCommonSettings::SavestateLZ4Blocks)
+		codec = TCommonSettings::SavestateZlibBlocks;
+#endif
 
-	//compress the data
-	int error = Z_OK;
-	if(compressionLevel != Z_NO_COMPRESSION)
+	if(codec == TCommonSettings::SavestateZlib)
 	{
-		cbuf = ms.buf();
-		uLongf comprlen2;
 		//worst case compression.
 		//zlib says "0.1% larger than sourceLen plus 12 bytes"
-		comprlen = (len>>9)+12 + len;
-		cbuf = new u8[comprlen];
-		// Workaround to make it compile under linux 64bit
-		comprlen2 = comprlen;
-		error = compress2(cbuf,&comprlen2,ms.buf(),len,compressionLevel);
-		comprlen = (u32)comprlen2;
+		uLongf comprlen = (len>>9)+12 + len;
+		std::vector<u8> cbuf(comprlen);
+		int error = compress2(&cbuf[0],&comprlen,raw,len,compressionLevel);
+		savestate_writeHeader(outstream, codec, len, (u32)comprlen);
+		outstream->fwrite((char*)&cbuf[0],(u32)comprlen);
+		return error == Z_OK;
 	}
 
-	//dump the header
-	outstream->fseek(0,SEEK_SET);
-	outstream->fwrite(magic,16);
-	write32le(SAVESTATE_VERSION,outstream);
-	write32le(EMU_DESMUME_VERSION_NUMERIC(),outstream); //desmume version
-	write32le(len,outstream); //uncompressed length
-	write32le(comprlen,outstream); //compressed length (-1 if it is not compressed)
+	SavestateBlocks job;
+	job.codec = codec;
+	job.level = compressionLevel;
+	job.compress = true;
+	job.in = raw;
+	u32 cap = 0;
+	for(u32 pos = 0; pos < len; pos += SAVESTATE_BLOCK_SIZE)
+	{
+		const u32 size = std::min<u32>(SAVESTATE_BLOCK_SIZE, len - pos);
+		job.inPos.push_back(pos);
+		job.inSize.push_back(size);
+		job.outPos.push_back(cap);
+		job.outCap.push_back(savestate_blockBound(codec, size));
+		cap += job.outCap.back();
+	}
+	std::vector<u8> cbuf(std::max<u32>(cap, 1));
+	job.out = &cbuf[0];
+	bool ok = savestate_runBlocks(job);
+
+	const u32 count = job.inPos.size();
+	u32 comprlen = 8 + count*4;
+	for(u32 i = 0; i < count; i++)
+		comprlen += job.outSize[i];
+
+	savestate_writeHeader(outstream, codec, len, comprlen);
+	write32le(SAVESTATE_BLOCK_SIZE,outstream);
+	write32le(count,outstream);
+	for(u32 i = 0; i < count; i++)
+		write32le(job.outSize[i],outstream);
+	for(u32 i = 0; i < count; i++)
+		outstream->fwrite((char*)job.out + job.outPos[i], job.outSize[i]);
 
-	if(compressionLevel != Z_NO_COMPRESSION)
+	return ok;
+#endif
+}
+
+bool savestate_save(EMUFILE* outstream, int compressionLevel)
+{
+#ifdef HAVE_JIT 
+	arm_jit_sync();
+#endif
+	#ifndef HAVE_LIBZ
+	compressionLevel = Z_NO_COMPRESSION;
+	#endif
+
+	if(compressionLevel == Z_NO_COMPRESSION)
+	{
+		outstream->fseek(32,SEEK_SET); //skip the header
+		writechunks(outstream);
+
+		//save the length of the file
+		u32 len = outstream->ftell();
+		savestate_writeHeader(outstream, 0, len, 0xFFFFFFFF);
+		return true;
+	}
+
+	//the block tasks may be busy with a slot save
+	savestate_flush();
+
+	//generate the savestate in memory first
+	EMUFILE_MEMORY ms;
+	writechunks(&ms);
+	return savestate_writeCompressed(outstream, ms.buf(), ms.size(), compressionLevel);
+}
+
+bool savestate_capture(SavestateCapture& capture)
+{
+	//fold the pages written since the last capture into every live capture
+	for(SavestateCapture* c = captureList; c; c = c->next)
+		for(u32 w = 0; w < MMU_DIRTY_PAGES/32; w++)
+			c->dirty[w] |= MMU_dirty_pages[w];
+	memset(MMU_dirty_pages, 0, sizeof(MMU_dirty_pages));
+
+	//nothing was tracked before the first capture
+	if(!MMU_dirty_tracking)
 	{
-		outstream->fwrite((char*)cbuf,comprlen==(u32)-1?len:comprlen);
-		delete[] cbuf;
+		MMU_dirty_tracking = true;
+		for(SavestateCapture* c = captureList; c; c = c->next)
+			c->invalidate();
 	}
 
-	return error == Z_OK;
+	EMUFILE_MEMORY* ms = &capture.ms;
+	captureTarget = &capture;
+	bool ok = savestate_save(ms, Z_NO_COMPRESSION);
+	captureTarget = NULL;
+
+	capture.valid = ok;
+	std::fill(capture.dirty.begin(), capture.dirty.end(), 0);
+	if(!ok) return false;
+
+	//the buffer may have held a longer state
+	u32 len;
+	ms->fseek(24, SEEK_SET);
+	read32le(&len, ms);
+	ms->truncate(len);
+	return true;
+}
+
+static bool savestate_writeFile(const char *file_name, EMUFILE_MEMORY& ms)
+{
+	size_t elems_written;
+	FILE* file = fopen(file_name,"wb");
+	if(file)
+	{
+		elems_written = fwrite(ms.buf(),1,ms.size(),file);
+		fclose(file);
+		return (elems_written == ms.size());
+	} else return false;
 }
 
 bool savestate_save (const char *file_name)
 {
 	EMUFILE_MEMORY ms;
-	size_t elems_written;
 #ifdef HAVE_LIBZ
 	if(!savestate_save(&ms, Z_DEFAULT_COMPRESSION))
 #else
 	if(!savestate_save(&ms, 0))
 #endif
 		return false;
-	FILE* file = fopen(file_name,"wb");
-	if(file)
+	return savestate_writeFile(file_name, ms);
+}
+
+//a slot save in flight: the chunks as they were when it was asked for, compressed and written out on savestateWriteTask
+struct SavestateWrite
+{
+	EMUFILE_MEMORY raw;
+	std::string file_name;
+};
+
+static Task savestateWriteTask;
+static bool savestateWriteTaskStarted, savestateWritePending;
+static volatile bool savestateWriteDone;
+static int savestateWriteSlot = -1;	//slot of the write in flight, -1 when it isn't a slot save
+
+static void* savestate_writeTask(void* param)
+{
+	SavestateWrite* job = (SavestateWrite*)param;
+	EMUFILE_MEMORY ms;
+#ifdef HAVE_LIBZ
+	bool ok = savestate_writeCompressed(&ms, job->raw.buf(), job->raw.size(), Z_DEFAULT_COMPRESSION);
+#else
+	bool ok = savestate_writeCompressed(&ms, job->raw.buf(), job->raw.size(), 0);
+#endif
+	ok = ok && savestate_writeFile(job->file_name.c_str(), ms);
+	if(!ok)
+		printf("Error saving %s\n", job->file_name.c_str());
+	delete job;
+	savestateWriteDone = true;
+	return (void*)(intptr_t)ok;
+}
+
+bool savestate_save_async(const char *file_name)
+{
+	return savestate_queueWrite(file_name, -1);
+}
+
+static bool savestate_queueWrite(const char *file_name, int slot)
+{
+	savestate_flush();
+
+#ifdef HAVE_JIT 
+	arm_jit_sync();
+#endif
+	SavestateWrite* job = new SavestateWrite();
+	job->file_name = file_name;
+	writechunks(&job->raw);
+
+	if(!savestateWriteTaskStarted)
 	{
-		elems_written = fwrite(ms.buf(),1,ms.size(),file);
-		fclose(file);
-		return (elems_written == ms.size());
-	} else return false;
+		savestateWriteTask.start(false);
+		savestateWriteTaskStarted = true;
+	}
+	savestateWriteDone = false;
+	savestateWriteSlot = slot;
+	savestateWriteTask.execute(savestate_writeTask, job);
+	savestateWritePending = true;
+	return true;
+}
+
+bool savestate_flush()
+{
+	if(!savestateWritePending) return true;
+	savestateWritePending = false;
+	bool ok = savestateWriteTask.finish() != NULL;
+	if(savestateWriteSlot >= 0)
+		savestate_reportWrite(savestateWriteSlot, ok);
+	savestateWriteSlot = -1;
+	return ok;
+}
+
+void savestate_poll()
+{
+	if(savestateWritePending && savestateWriteDone)
+		savestate_flush();
 }
 
 extern SFORMAT SF_RTC[];
@@ -962,6 +1364,9 @@ static bool ReadStateChunks(EMUFILE* is, s32 totalsize)
 	};
 	memset(&header, 0, sizeof(header));
 
+	//states from before the wifi mac timers were run lazily don't have W275
+	wifiMac.usecTime = ~0ULL;
+
 	while(totalsize > 0)
 	{
 		uint32 size;
@@ -995,6 +1400,11 @@ static bool ReadStateChunks(EMUFILE* is, s32 totalsize)
 		if(!ret)
 			return false;
 	}
+
+	//so if it was missing, count the mac timers from where the emulation is now
+	if(wifiMac.usecTime == ~0ULL)
+		wifiMac.usecTime = nds_timer;
+
 	if (haveInfo)
 	{
 		char buf[14] = {0};
@@ -1016,6 +1426,11 @@ static bool ReadStateChunks(EMUFILE* is, s32 totalsize)
 
 static void loadstate()
 {
+	// The vram contents were replaced behind the back of the bank dirty tracking
+	MMU_VRAM_dirty_all();
+	// and so were the main memory pages
+	MMU_MAIN_MEM_dirty_all();
+
     // This should regenerate the vram banks
     for (int i = 0; i < 0xA; i++)
        _MMU_write08<ARMCPU_ARM9>(0x04000240+i, _MMU_read08<ARMCPU_ARM9>(0x04000240+i));
@@ -1041,6 +1456,9 @@ static void loadstate()
 
 	SetupMMU(nds.Is_DebugConsole(),nds.Is_DSI());
 
+	// The sequencer items and the state they wait on come from several chunks, so queue them up once everything is in
+	NDS_RescheduleAll();
+
 	execute = !driver->EMU_IsEmulationPaused();
 }
 
@@ -1058,6 +1476,8 @@ bool savestate_load(EMUFILE* is)
 	if(!read32le(&len,is)) return false;
 	if(!read32le(&comprlen,is)) return false;
 
+	const u32 codec = ssversion >> 16;
+	ssversion &= 0xFFFF;
 	if(ssversion != SAVESTATE_VERSION) return false;
 
 	std::vector<u8> buf(len);
@@ -1072,10 +1492,20 @@ bool savestate_load(EMUFILE* is)
 		if(is->fail()) return false;
 
 #ifdef HAVE_LIBZ
-		uLongf uncomprlen = len;
-		int error = uncompress((uint8*)&buf[0],&uncomprlen,(uint8*)&cbuf[0],comprlen);
-		if(error != Z_OK || uncomprlen != len)
-			return false;
+		if(codec != TCommonSettings::SavestateZlib)
+		{
+			//the block tasks may be busy with a slot save
+			savestate_flush();
+			if(!savestate_decompressBlocks(codec,(u8*)&cbuf[0],comprlen,&buf[0],len))
+				return false;
+		}
+		else
+		{
+			uLongf uncomprlen = len;
+			int error = uncompress((uint8*)&buf[0],&uncomprlen,(uint8*)&cbuf[0],comprlen);
+			if(error != Z_OK || uncomprlen != len)
+				return false;
+		}
 #endif
 	} else {
 		is->fread((char*)&buf[0],len-32);
@@ -1127,43 +1557,204 @@ bool savestate_load(EMUFILE* is)
 
 bool savestate_load(const char *file_name)
 {
+	//this could be the slot that is still being written
+	savestate_flush();
+
 	EMUFILE_FILE f(file_name,"rb");
 	if(f.fail()) return false;
 
 	return savestate_load(&f);
 }
 
-static std::stack<EMUFILE_MEMORY*> rewindFreeList;
-static std::vector<EMUFILE_MEMORY*> rewindbuffer;
+//the rewind history keeps the newest state whole and every older one as a delta that turns the
+//state after it back into it: the two xored together, with the runs of zeros left out. walking
+//back from the newest state only ever needs the next delta, so the oldest entries can be dropped
+//freely and no keyframes are needed. the deltas are worked out (and undone) on rewindTask while
+//the emulation goes on.
+struct RewindEntry
+{
+	std::vector<u32> data; //(skip words, literal words, literals...) records, then the xored tail bytes
+	u32 size; //size of the state this restores
+	bool whole; //the newer state had a different size, so this is xored against zeros instead
+};
+
+static std::vector<RewindEntry> rewindRing; //oldest at rewindHead
+static int rewindHead, rewindCount;
+static SavestateCapture rewindStates[2];
+static SavestateCapture *rewindLatest = &rewindStates[0], *rewindOlder = &rewindStates[1];
+static bool rewindHaveLatest;
+static std::vector<u32> rewindScratch;
+static Task rewindTask;
+static bool rewindTaskStarted, rewindTaskPending;
 
 int rewindstates = 16;
 int rewindinterval = 4;
 
-void rewindsave () {
+//stores in the entry the records that turn base (or zeros, if there is no base) into target
+static void rewind_encode(RewindEntry& entry, const u8* target, const u8* base, u32 size)
+{
+	const u32 words = size/4;
+	const u32* t = (const u32*)target;
+	const u32* b = (const u32*)base;
+
+	//worst case: a record for every other word
+	rewindScratch.resize(std::max<size_t>(rewindScratch.size(), words + words/2 + 4));
+	u32* out = &rewindScratch[0];
+	u32 n = 0;
+
+	#define DELTA(i) (t[i] ^ (b ? b[i] : 0))
+	u32 i = 0;
+	while(i < words)
+	{
+		u32 start = i;
+		while(i < words && !DELTA(i)) i++;
+		if(i == words) break;
+		out[n++] = i - start;
+
+		//a record costs two words, so gaps shorter than that stay inside the literal run
+		u32 count = n++;
+		start = i;
+		while(i < words)
+		{
+			if(!DELTA(i) && (i+2 >= words || (!DELTA(i+1) && !DELTA(i+2))))
+				break;
+			out[n++] = DELTA(i);
+			i++;
+		}
+		out[count] = i - start;
+	}
+	#undef DELTA
 
-	if(currFrameCounter % rewindinterval)
-		return;
+	u32 tail = 0;
+	for(u32 j = words*4; j < size; j++)
+		tail |= (u32)(target[j] ^ (base ? base[j] : 0)) << ((j&3)*8);
+	out[n++] = tail;
 
-	//printf("rewindsave"); printf("%d%s", currFrameCounter, "\n");
+	//give back the slot's memory when it held a much bigger delta before
+	if(entry.data.capacity() > 2*n)
+		std::vector<u32>(out, out+n).swap(entry.data);
+	else
+		entry.data.assign(out, out+n);
+	entry.size = size;
+}
 
-	
-	EMUFILE_MEMORY *ms;
-	if(!rewindFreeList.empty()) {
-		ms = rewindFreeList.top();
-		rewindFreeList.pop();
-	} else {
-		ms = new EMUFILE_MEMORY(1024*1024*12);
+//turns the state after the entry's into the one it restores
+static void rewind_decode(const RewindEntry& entry, EMUFILE_MEMORY* state)
+{
+	if(entry.whole)
+	{
+		state->truncate(0);
+		state->truncate(entry.size);
+	}
+
+	u8* buf = state->buf();
+	u32* w = (u32*)buf;
+	const u32* in = &entry.data[0];
+	const u32* end = in + entry.data.size() - 1;
+	u32 i = 0;
+	while(in < end)
+	{
+		i += *in++;
+		u32 count = *in++;
+		for(u32 j = 0; j < count; j++)
+			w[i++] ^= *in++;
 	}
 
-	if(!savestate_save(ms, Z_NO_COMPRESSION))
+	u32 tail = *in;
+	for(u32 j = (entry.size/4)*4; j < entry.size; j++)
+		buf[j] ^= (u8)(tail >> ((j&3)*8));
+}
+
+static void* rewind_encodeTask(void* param)
+{
+	RewindEntry& entry = *(RewindEntry*)param;
+	u32 size = rewindOlder->ms.size();
+	entry.whole = (u32)rewindLatest->ms.size() != size;
+	rewind_encode(entry, rewindOlder->ms.buf(), entry.whole ? NULL : rewindLatest->ms.buf(), size);
+	return NULL;
+}
+
+static void* rewind_decodeTask(void* param)
+{
+	rewind_decode(*(RewindEntry*)param, &rewindLatest->ms);
+	return NULL;
+}
+
+static void rewind_finish()
+{
+	if(!rewindTaskPending) return;
+	rewindTask.finish();
+	rewindTaskPending = false;
+}
+
+static void rewind_run(Task::TWork work, RewindEntry* entry)
+{
+	if(!rewindTaskStarted)
+	{
+		rewindTask.start(false);
+		rewindTaskStarted = true;
+	}
+	rewindTask.execute(work, entry);
+	rewindTaskPending = true;
+}
+
+static void rewind_push()
+{
+	rewind_finish();
+
+	const int capacity = std::max(rewindstates-1, 0);
+	if((int)rewindRing.size() != capacity)
+	{
+		rewindRing.clear();
+		rewindRing.resize(capacity);
+		rewindHead = rewindCount = 0;
+	}
+
+	if(!savestate_capture(*rewindOlder))
 		return;
+	std::swap(rewindLatest, rewindOlder);
 
-	rewindbuffer.push_back(ms);
-	
-	if((int)rewindbuffer.size() > rewindstates) {
-		delete *rewindbuffer.begin();
-		rewindbuffer.erase(rewindbuffer.begin());
+	if(rewindHaveLatest && capacity > 0)
+	{
+		//when the ring is full the new entry takes the oldest one's place
+		RewindEntry* entry = &rewindRing[(rewindHead + rewindCount) % capacity];
+		if(rewindCount == capacity)
+			rewindHead = (rewindHead + 1) % capacity;
+		else
+			rewindCount++;
+
+		rewind_run(rewind_encodeTask, entry);
 	}
+
+	rewindHaveLatest = true;
+}
+
+static void rewind_pop()
+{
+	rewind_finish();
+
+	rewindLatest->ms.fseek(32, SEEK_SET);
+	ReadStateChunks(&rewindLatest->ms, rewindLatest->ms.size()-32);
+	loadstate();
+
+	//the oldest state stays, the same as a one entry buffer used to
+	if(rewindCount > 0)
+	{
+		rewindCount--;
+		//the decode turns the buffer into an older state behind the capture's back
+		rewindLatest->invalidate();
+		rewind_run(rewind_decodeTask, &rewindRing[(rewindHead + rewindCount) % rewindRing.size()]);
+	}
+}
+
+void rewindsave () {
+
+	if(currFrameCounter % rewindinterval)
+		return;
+
+	//printf("rewindsave"); printf("%d%s", currFrameCounter, "\n");
+
+	rewind_push();
 }
 
 void dorewind()
@@ -1173,25 +1764,167 @@ void dorewind()
 
 	//printf("rewind\n");
 
-	int size = rewindbuffer.size();
-
-	if(size < 1) {
+	if(!rewindHaveLatest) {
 		printf("rewind buffer empty\n");
 		return;
 	}
 
-	printf("%d", size);
+	printf("%d", rewindCount+1);
 
-	EMUFILE_MEMORY* loadms = rewindbuffer[size-1];
-	loadms->fseek(32, SEEK_SET);
+	rewind_pop();
+}
 
-	ReadStateChunks(loadms,loadms->size()-32);
-	loadstate();
+void RewindBenchmark(int frames)
+{
+	const int savedStates = rewindstates;
+	rewindstates = std::max(frames, 1);
+
+	//fill the history one state per frame
+	u64 saveTime = 0;
+	for(int i = 0; i < frames; i++)
+	{
+		NDS_exec<false>();
+		u64 start = Task_GetTimeMicros();
+		rewind_push();
+		saveTime += Task_GetTimeMicros() - start;
+	}
+	rewind_finish();
+
+	size_t deltaBytes = 0;
+	for(int i = 0; i < rewindCount; i++)
+		deltaBytes += rewindRing[(rewindHead + i) % rewindRing.size()].data.size() * 4;
+	const size_t stateBytes = rewindLatest->ms.size();
+	const int states = rewindCount + 1;
+
+	printf("rewind benchmark: %d states of %u bytes, %.0f bytes/state (%.1f%% of a full state), %.2f ms/save\n",
+		states, (u32)stateBytes, (deltaBytes + stateBytes) / (double)states,
+		(deltaBytes + stateBytes) * 100.0 / ((double)stateBytes * states), saveTime / 1000.0 / std::max(frames, 1));
 
-	if(rewindbuffer.size()>1)
+	//each rewind loads a state and then waits on the decode of the one before it
+	u64 rewindTime = 0;
+	for(int i = 0; i < states; i++)
 	{
-		rewindFreeList.push(loadms);
-		rewindbuffer.pop_back();
+		u64 start = Task_GetTimeMicros();
+		rewind_pop();
+		rewind_finish();
+		rewindTime += Task_GetTimeMicros() - start;
+	}
+	printf("rewind benchmark: %.2f ms/rewind\n", rewindTime / 1000.0 / states);
+
+	rewindstates = savedStates;
+}
+
+void SavestateBenchmark(int iterations)
+{
+	static const TCommonSettings::SavestateCodec codecs[] = {
+		TCommonSettings::SavestateZlib,
+		TCommonSettings::SavestateZlibBlocks,
+#ifdef HAVE_LIBLZ4
+		TCommonSettings::SavestateLZ4Blocks,
+#endif
+	};
+	static const char* names[] = { "zlib", "zlib blocks", "lz4 blocks" };
+	const TCommonSettings::SavestateCodec savedCodec = CommonSettings.savestateCodec;
+	iterations = std::max(iterations, 1);
+
+	for(size_t c = 0; c < ARRAY_SIZE(codecs); c++)
+	{
+		CommonSettings.savestateCodec = codecs[c];
+		EMUFILE_MEMORY ms;
+
+		u64 start = Task_GetTimeMicros();
+		for(int i = 0; i < iterations; i++)
+		{
+			ms.truncate(0);
+			savestate_save(&ms, Z_DEFAULT_COMPRESSION);
+		}
+		const u64 saveTime = Task_GetTimeMicros() - start;
+
+		start = Task_GetTimeMicros();
+		for(int i = 0; i < iterations; i++)
+		{
+			ms.fseek(0, SEEK_SET);
+			savestate_load(&ms);
+		}
+		const u64 loadTime = Task_GetTimeMicros() - start;
+
+		printf("savestate benchmark: %-11s %u bytes, %.2f ms/save, %.2f ms/load\n", names[codecs[c]],
+			(u32)ms.size(), saveTime / 1000.0 / iterations, loadTime / 1000.0 / iterations);
+	}
+	CommonSettings.savestateCodec = savedCodec;
+
+	//what a slot save costs the emulation thread, against waiting for it to be written
+	char filename[MAX_PATH];
+	path.getpathnoext(path.STATES, filename);
+	strncat(filename, ".dsbench", MAX_PATH - strlen(filename) - 1);
+	u64 callTime = 0, writeTime = 0;
+	for(int i = 0; i < iterations; i++)
+	{
+		u64 start = Task_GetTimeMicros();
+		savestate_save_async(filename);
+		u64 mid = Task_GetTimeMicros();
+		savestate_flush();
+		callTime += mid - start;
+		writeTime += Task_GetTimeMicros() - mid;
+	}
+	remove(filename);
+	printf("savestate benchmark: async slot save holds the emulation for %.2f ms, then writes for %.2f ms\n",
+		callTime / 1000.0 / iterations, writeTime / 1000.0 / iterations);
+}
+
+void SavestateRoundTripBenchmark(int iterations)
+{
+	iterations = std::max(iterations, 1);
+	EMUFILE_MEMORY ms;
+
+	u64 saveTime = 0, loadTime = 0;
+	for(int i = 0; i < iterations; i++)
+	{
+		u64 start = Task_GetTimeMicros();
+		ms.truncate(0);
+		savestate_save(&ms, Z_NO_COMPRESSION);
+		u64 mid = Task_GetTimeMicros();
+
+		//loaded the way rewind does it, without the full reset savestate_load starts with
+		ms.fseek(32, SEEK_SET);
+		ReadStateChunks(&ms, ms.size()-32);
+		loadstate();
+		saveTime += mid - start;
+		loadTime += Task_GetTimeMicros() - mid;
+	}
+
+	printf("savestate round trips: %.1f/sec, %.3f ms/save, %.3f ms/load\n",
+		iterations * 1000000.0 / std::max<u64>(saveTime + loadTime, 1), saveTime / 1000.0 / iterations, loadTime / 1000.0 / iterations);
+
+	//the tag lookups on their own: every entry of the tables, through the index and with the linear scan
+	static const SFORMAT* tables[] = { SF_ARM9, SF_ARM7, SF_MEM, SF_NDS, SF_MMU, SF_GFX3D, SF_MOVIE, SF_WIFI, SF_RTC };
+	const int passes = 1000;
+	u64 time[2];
+	u32 lookups = 0;
+	uintptr_t sink = 0;
+	for(int linear = 0; linear < 2; linear++)
+	{
+		u64 start = Task_GetTimeMicros();
+		for(int pass = 0; pass < passes; pass++)
+		{
+			for(size_t t = 0; t < ARRAY_SIZE(tables); t++)
+			{
+				const SFORMAT_Index& index = SFORMAT_getIndex(tables[t]);
+				for(const SFORMAT* entry = tables[t]; entry->v; entry++)
+				{
+					char desc[4];
+					memcpy(desc, entry->desc, 4);
+					const SFORMAT* found = linear
+						? CheckS(NULL, tables[t], entry->size, entry->count, desc)
+						: SFORMAT_find(tables[t], index, entry->size, entry->count, desc);
+					sink += (uintptr_t)found;
+					if(!linear) lookups++;
+				}
+			}
+		}
+		time[linear] = Task_GetTimeMicros() - start;
 	}
 
+	printf("savestate tag lookups: %.1f ns hashed, %.1f ns linear (checksum %08X)\n",
+		time[0] * 1000.0 / lookups, time[1] * 1000.0 / lookups, (u32)sink);
 }
@@ -21,6 +21,7 @@
 #define _SRAM_H
 
 #include "types.h"
+#include "emufile.h"
 
 #define NB_STATES 10
 
@@ -65,8 +66,44 @@ void loadstate_slot(int num);
 
 bool savestate_load(class EMUFILE* is);
 bool savestate_save(class EMUFILE* outstream, int compressionLevel);
+//takes the state right away but compresses and writes it on another thread, so it doesn't hold up the emulation.
+//savestate_flush waits for the write in flight (if any) and returns whether it succeeded. it has to be called
+//before the process exits, NDS_FreeROM and NDS_DeInit do. savestate_poll, called once a frame, finishes
+//a write that is already done, which is when a slot save reports its result on the osd.
+bool savestate_save_async(const char *file_name);
+bool savestate_flush();
+void savestate_poll();
+//a buffer the caller keeps for savestate_capture, along with the main memory pages written since the last
+//capture into it. only those pages are copied again, so whatever else changes ms has to call invalidate(),
+//and the next capture then writes it whole.
+struct SavestateCapture
+{
+	SavestateCapture();
+	~SavestateCapture();
+
+	EMUFILE_MEMORY ms;
+	void invalidate() { valid = false; }
+
+	bool valid; //ms holds a capture, and dirty covers everything written since
+	s32 pos[2]; //where the data of WRAM and WRAX sat in ms
+	std::vector<u32> dirty;
+	SavestateCapture *prev, *next; //the live captures, which all get the pages written
+
+private:
+	SavestateCapture(const SavestateCapture&);
+	SavestateCapture& operator=(const SavestateCapture&);
+};
+
+//an uncompressed savestate into capture.ms
+bool savestate_capture(SavestateCapture& capture);
 
 void dorewind();
 void rewindsave();
+void RewindBenchmark(int frames);
+
+//times saving and loading with each codec and the part of an async slot save the emulation waits for
+void SavestateBenchmark(int iterations);
+//times uncompressed save/load round trips and the SFORMAT tag lookups
+void SavestateRoundTripBenchmark(int iterations);
 
 #endif
@@ -20,7 +20,7 @@
 #include <string.h>
 #include <algorithm>
 #include <assert.h>
-#include <map>
+#include <vector>
 
 #include "texcache.h"
 
@@ -29,6 +29,7 @@
 #include "debug.h"
 #include "gfx3d.h"
 #include "NDSSystem.h"
+#include "utils/task.h"
 
 using std::min;
 using std::max;
@@ -200,38 +201,529 @@ static void DebugDumpTexture(TexCacheItem* item)
 }
 #endif
 
+//everything needed to decode a texture, captured when it was looked up.
+//the decode may run later on a rasterizer thread (see TexCache_SetTextureDeferred) while the emulation goes on,
+//so this holds onto the bank memory the texture was found in instead of going through the texture slots again.
+//(those banks can't be written without being remapped first, and a remap finishes the pending decodes)
+struct TexCacheDecodeJob
+{
+	MemSpan ms;
+	u16 pal[256];
+	u8* texPalSlot[8]; //the 4x4 palette is too big to copy
+	u8* indexSlot; //texture slot 1, which holds the 4x4 index data
+	u32 paletteAddress;
+};
+
+#if defined(ENABLE_SSE2) && !defined(WORDS_BIGENDIAN)
+//for each byte of a 4x4 block row, the texels whose 2bit color index has bit 0 set, and those with bit 1 set
+static CACHE_ALIGN u32 texel4x4Bit0Masks[256][4];
+static CACHE_ALIGN u32 texel4x4Bit1Masks[256][4];
+
+static void generateTexel4x4Masks()
+{
+	for(int i=0;i<256;i++)
+		for(int t=0;t<4;t++)
+		{
+			texel4x4Bit0Masks[i][t] = ((i>>(t*2))&1) ? 0xFFFFFFFF : 0;
+			texel4x4Bit1Masks[i][t] = ((i>>(t*2))&2) ? 0xFFFFFFFF : 0;
+		}
+}
+
+//for each 4x4 block mode, the colors which are replaced by the average of the first two (mode 1),
+//by their 5:3 mixes (mode 3), or by transparency (modes 0 and 1)
+static CACHE_ALIGN const u32 texel4x4AvgMasks[4][4] = { {0,0,0,0}, {0,0,0xFFFFFFFF,0}, {0,0,0,0}, {0,0,0,0} };
+static CACHE_ALIGN const u32 texel4x4MixMasks[4][4] = { {0,0,0,0}, {0,0,0,0}, {0,0,0,0}, {0,0,0xFFFFFFFF,0xFFFFFFFF} };
+static CACHE_ALIGN const u32 texel4x4ClearMasks[4][4] = { {0,0,0,0xFFFFFFFF}, {0,0,0,0xFFFFFFFF}, {0,0,0,0}, {0,0,0,0} };
+
+static FORCEINLINE __m128i selectTexels(const __m128i mask, const __m128i a, const __m128i b)
+{
+	return _mm_or_si128(_mm_andnot_si128(mask,a),_mm_and_si128(mask,b));
+}
+#endif
+
+template<TexCache_TexFormat TEXFORMAT>
+static void DecodeTexture(TexCacheItem* item, const TexCacheDecodeJob &job)
+{
+	const u32 format = item->texformat;
+	const u32 sizeX = item->sizeX, sizeY = item->sizeY;
+	const u32 paletteAddress = job.paletteAddress;
+	const MemSpan &ms = job.ms;
+	const u16 *pal = job.pal;
+	u32 *dwdst = (u32*)item->decoded;
+	u8 *adr;
+
+	const u32 opaqueColor = TEXFORMAT==TexFormat_32bpp?255:31;
+	u32 palZeroTransparent = (1-((format>>29)&1))*opaqueColor;
+
+	//the paletted formats convert each palette entry (with each alpha it may come with) once,
+	//then just look every texel up in that
+	u32 lut[256];
+
+	switch (item->mode)
+	{
+	case TEXMODE_A3I5:
+		{
+			for(int i=0;i<256;i++)
+			{
+				u16 c = pal[i&31];
+				u8 alpha = i>>5;
+				if(TEXFORMAT == TexFormat_15bpp)
+					lut[i] = RGB15TO6665(c,material_3bit_to_5bit[alpha]);
+				else
+					lut[i] = RGB15TO32(c,material_3bit_to_8bit[alpha]);
+			}
+			for(int j=0;j<ms.numItems;j++) {
+				adr = ms.items[j].ptr;
+				for(u32 x = 0; x < ms.items[j].len; x++)
+					*dwdst++ = lut[*adr++];
+			}
+			break;
+		}
+
+	case TEXMODE_I2:
+		{
+			for(int i=0;i<4;i++)
+				lut[i] = CONVERT(pal[i],(i == 0) ? palZeroTransparent : opaqueColor);
+			for(int j=0;j<ms.numItems;j++) {
+				adr = ms.items[j].ptr;
+				for(u32 x = 0; x < ms.items[j].len; x++)
+				{
+					const u8 bits = *adr++;
+					*dwdst++ = lut[bits&0x3];
+					*dwdst++ = lut[(bits>>2)&0x3];
+					*dwdst++ = lut[(bits>>4)&0x3];
+					*dwdst++ = lut[bits>>6];
+				}
+			}
+			break;
+		}
+	case TEXMODE_I4:
+		{
+			for(int i=0;i<16;i++)
+				lut[i] = CONVERT(pal[i],(i == 0) ? palZeroTransparent : opaqueColor);
+			for(int j=0;j<ms.numItems;j++) {
+				adr = ms.items[j].ptr;
+				for(u32 x = 0; x < ms.items[j].len; x++)
+				{
+					const u8 bits = *adr++;
+					*dwdst++ = lut[bits&0xF];
+					*dwdst++ = lut[bits>>4];
+				}
+			}
+			break;
+		}
+	case TEXMODE_I8:
+		{
+			for(int i=0;i<256;i++)
+				lut[i] = CONVERT(pal[i],(i == 0) ? palZeroTransparent : opaqueColor);
+			for(int j=0;j<ms.numItems;j++) {
+				adr = ms.items[j].ptr;
+				for(u32 x = 0; x < ms.items[j].len; ++x)
+					*dwdst++ = lut[*adr++];
+			}
+		}
+		break;
+	case TEXMODE_4X4:
+		{
+			//RGB16TO32 is used here because the other conversion macros result in broken interpolation logic
+
+			if(ms.numItems != 1) {
+				PROGINFO("Your 4x4 texture has overrun its texture slot.\n");
+			}
+			//this check isnt necessary since the addressing is tied to the texture data which will also run out:
+			//if(msIndex.numItems != 1) PROGINFO("Your 4x4 texture index has overrun its slot.\n");
+
+#define PAL4X4(offset) ( *(u16*)( job.texPalSlot[((paletteAddress + (offset)*2)>>14)&0x7] + ((paletteAddress + (offset)*2)&0x3FFF) ) )
+
+			u16* slot1;
+			u32* map = (u32*)ms.items[0].ptr;
+			u32 limit = ms.items[0].len<<2;
+			u32 d = 0;
+			if ( (format & 0xc000) == 0x8000)
+				// texel are in slot 2
+				slot1=(u16*)&job.indexSlot[((format & 0x3FFF)<<2)+0x010000];
+			else 
+				slot1=(u16*)&job.indexSlot[(format & 0x3FFF)<<2];
+
+			u16 yTmpSize = (sizeY>>2);
+			u16 xTmpSize = (sizeX>>2);
+
+			//this is flagged whenever a 4x4 overruns its slot.
+			//i am guessing we just generate black in that case
+			bool dead = false;
+
+			for (int y = 0; y < yTmpSize; y ++)
+			{
+				u32 tmpPos[4]={(y<<2)*sizeX,((y<<2)+1)*sizeX,
+					((y<<2)+2)*sizeX,((y<<2)+3)*sizeX};
+				for (int x = 0; x < xTmpSize; x ++, d++)
+				{
+					if(d >= limit)
+						dead = true;
+
+					if(dead) {
+						for (int sy = 0; sy < 4; sy++)
+						{
+							u32 currentPos = (x<<2) + tmpPos[sy];
+							dwdst[currentPos] = dwdst[currentPos+1] = dwdst[currentPos+2] = dwdst[currentPos+3] = 0;
+						}
+						continue;
+					}
+
+#if defined(ENABLE_SSE2) && !defined(WORDS_BIGENDIAN)
+					u32 currBlock	= map[d];
+					u16 pal1		= slot1[d];
+					u16 pal1offset	= (pal1 & 0x3FFF)<<1;
+					u8  mode		= pal1>>14;
+
+					//fetch all four palette colors the block may use in one go, unless they straddle two slots
+					const u32 palAdr = paletteAddress + pal1offset*2;
+					__m128i cols;
+					if((palAdr & 0x3FFF) <= 0x3FF8)
+						cols = _mm_loadl_epi64((__m128i*)(job.texPalSlot[(palAdr>>14)&0x7] + (palAdr&0x3FFF)));
+					else
+						cols = _mm_set_epi16(0,0,0,0,PAL4X4(pal1offset+3),PAL4X4(pal1offset+2),PAL4X4(pal1offset+1),PAL4X4(pal1offset));
+					cols = _mm_unpacklo_epi16(cols,_mm_setzero_si128());
+
+					//RGB16TO32
+					cols = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(_mm_and_si128(cols,_mm_set1_epi32(0x001F)),3),
+						_mm_slli_epi32(_mm_and_si128(cols,_mm_set1_epi32(0x03E0)),6)),
+						_mm_or_si128(_mm_slli_epi32(_mm_and_si128(cols,_mm_set1_epi32(0x7C00)),9),_mm_set1_epi32(0xFF000000)));
+
+					//work out every mode's derived colors, then pick this block's.
+					//mode 1's average is exact with a rounding average, since the channels are all multiples of 8
+					const __m128i avg = _mm_avg_epu8(_mm_shuffle_epi32(cols,0x00),_mm_shuffle_epi32(cols,0x55));
+					//mode 3 mixes 5:3 and 3:5 into the third and fourth colors
+					const __m128i mixA = _mm_shuffle_epi32(cols,_MM_SHUFFLE(1,0,0,0));
+					const __m128i mixB = _mm_shuffle_epi32(cols,_MM_SHUFFLE(0,1,1,1));
+					const __m128i zero = _mm_setzero_si128();
+					__m128i mixLo = _mm_unpacklo_epi8(mixA,zero), mixHi = _mm_unpackhi_epi8(mixA,zero);
+					const __m128i mixBLo = _mm_unpacklo_epi8(mixB,zero), mixBHi = _mm_unpackhi_epi8(mixB,zero);
+					mixLo = _mm_add_epi16(_mm_add_epi16(_mm_slli_epi16(mixLo,2),mixLo),_mm_add_epi16(_mm_slli_epi16(mixBLo,1),mixBLo));
+					mixHi = _mm_add_epi16(_mm_add_epi16(_mm_slli_epi16(mixHi,2),mixHi),_mm_add_epi16(_mm_slli_epi16(mixBHi,1),mixBHi));
+					mixLo = _mm_slli_epi16(_mm_srli_epi16(mixLo,6),3);
+					mixHi = _mm_slli_epi16(_mm_srli_epi16(mixHi,6),3);
+					const __m128i mix = _mm_or_si128(_mm_packus_epi16(mixLo,mixHi),_mm_set1_epi32(0xFF000000));
+
+					cols = selectTexels(_mm_load_si128((__m128i*)texel4x4AvgMasks[mode]),cols,avg);
+					cols = selectTexels(_mm_load_si128((__m128i*)texel4x4MixMasks[mode]),cols,mix);
+					cols = selectTexels(_mm_load_si128((__m128i*)texel4x4ClearMasks[mode]),cols,_mm_set1_epi32(RGB16TO32(0x7FFF,0)));
+
+					if(TEXFORMAT==TexFormat_15bpp)
+					{
+						cols = _mm_and_si128(_mm_srli_epi32(cols,2),_mm_set1_epi32(0x3F3F3F3F));
+						cols = _mm_or_si128(_mm_and_si128(cols,_mm_set1_epi32(0x00FFFFFF)),
+							_mm_and_si128(_mm_srli_epi32(cols,1),_mm_set1_epi32(0xFF000000)));
+					}
+
+					//pick each row's four texels out of the four colors with masks
+					const __m128i col0 = _mm_shuffle_epi32(cols,0x00), col1 = _mm_shuffle_epi32(cols,0x55);
+					const __m128i col2 = _mm_shuffle_epi32(cols,0xAA), col3 = _mm_shuffle_epi32(cols,0xFF);
+
+					for (int sy = 0; sy < 4; sy++)
+					{
+						const u8 currRow = (u8)((currBlock>>(sy<<3))&0xFF);
+						const __m128i bit0 = _mm_load_si128((__m128i*)texel4x4Bit0Masks[currRow]);
+						const __m128i bit1 = _mm_load_si128((__m128i*)texel4x4Bit1Masks[currRow]);
+						const __m128i texels = selectTexels(bit1,selectTexels(bit0,col0,col1),selectTexels(bit0,col2,col3));
+						_mm_storeu_si128((__m128i*)&dwdst[(x<<2) + tmpPos[sy]],texels);
+					}
+#else
+					u32 currBlock	= map[d];
+					u16 pal1		= slot1[d];
+					u16 pal1offset	= (pal1 & 0x3FFF)<<1;
+					u8  mode		= pal1>>14;
+					u32 tmp_col[4];
+					
+					tmp_col[0]=RGB16TO32(PAL4X4(pal1offset),255);
+					tmp_col[1]=RGB16TO32(PAL4X4(pal1offset+1),255);
+
+					switch (mode) 
+					{
+					case 0:
+						tmp_col[2]=RGB16TO32(PAL4X4(pal1offset+2),255);
+						tmp_col[3]=RGB16TO32(0x7FFF,0);
+						break;
+					case 1:
+						tmp_col[2]=(((tmp_col[0]&0xFF)+(tmp_col[1]&0xff))>>1)|
+							(((tmp_col[0]&(0xFF<<8))+(tmp_col[1]&(0xFF<<8)))>>1)|
+							(((tmp_col[0]&(0xFF<<16))+(tmp_col[1]&(0xFF<<16)))>>1)|
+							(0xff<<24);
+						tmp_col[3]=RGB16TO32(0x7FFF,0);
+						break;
+					case 2:
+						tmp_col[2]=RGB16TO32(PAL4X4(pal1offset+2),255);
+						tmp_col[3]=RGB16TO32(PAL4X4(pal1offset+3),255);
+						break;
+					case 3: 
+						{
+							u32 red1, red2;
+							u32 green1, green2;
+							u32 blue1, blue2;
+							u16 tmp1, tmp2;
+
+							red1=tmp_col[0]&0xff;
+							green1=(tmp_col[0]>>8)&0xff;
+							blue1=(tmp_col[0]>>16)&0xff;
+							red2=tmp_col[1]&0xff;
+							green2=(tmp_col[1]>>8)&0xff;
+							blue2=(tmp_col[1]>>16)&0xff;
+
+							tmp1=((red1*5+red2*3)>>6)|
+								(((green1*5+green2*3)>>6)<<5)|
+								(((blue1*5+blue2*3)>>6)<<10);
+							tmp2=((red2*5+red1*3)>>6)|
+								(((green2*5+green1*3)>>6)<<5)|
+								(((blue2*5+blue1*3)>>6)<<10);
+
+							tmp_col[2]=RGB16TO32(tmp1,255);
+							tmp_col[3]=RGB16TO32(tmp2,255);
+							break;
+						}
+					}
+
+					if(TEXFORMAT==TexFormat_15bpp)
+					{
+						for(int i=0;i<4;i++)
+						{
+							tmp_col[i] >>= 2;
+							tmp_col[i] &= 0x3F3F3F3F;
+							u32 a = tmp_col[i]>>24;
+							tmp_col[i] &= 0x00FFFFFF;
+							tmp_col[i] |= (a>>1)<<24;
+						}
+					}
+
+					//TODO - this could be more precise for 32bpp mode (run it through the color separation table)
+
+					//set all 16 texels
+					for (int sy = 0; sy < 4; sy++)
+					{
+						// Texture offset
+						u32 currentPos = (x<<2) + tmpPos[sy];
+						u8 currRow = (u8)((currBlock>>(sy<<3))&0xFF);
+
+						dwdst[currentPos] = tmp_col[currRow&3];
+						dwdst[currentPos+1] = tmp_col[(currRow>>2)&3];
+						dwdst[currentPos+2] = tmp_col[(currRow>>4)&3];
+						dwdst[currentPos+3] = tmp_col[(currRow>>6)&3];
+					}
+#endif
+				}
+			}
+
+#undef PAL4X4
+
+			break;
+		}
+	case TEXMODE_A5I3:
+		{
+			for(int i=0;i<256;i++)
+			{
+				u16 c = pal[i&0x07];
+				u8 alpha = i>>3;
+				if(TEXFORMAT == TexFormat_15bpp)
+					lut[i] = RGB15TO6665(c,alpha);
+				else
+					lut[i] = RGB15TO32(c,material_5bit_to_8bit[alpha]);
+			}
+			for(int j=0;j<ms.numItems;j++) {
+				adr = ms.items[j].ptr;
+				for(u32 x = 0; x < ms.items[j].len; ++x)
+					*dwdst++ = lut[*adr++];
+			}
+			break;
+		}
+	case TEXMODE_16BPP:
+		{
+			for(int j=0;j<ms.numItems;j++) {
+				u16* map = (u16*)ms.items[j].ptr;
+				int len = ms.items[j].len>>1;
+				int x = 0;
+#if defined(ENABLE_SSE2) && !defined(WORDS_BIGENDIAN)
+				//the 6665 conversion of eight texels at a time: (r<<1)+1 | (g<<1)+1 | (b<<1)+1 | alpha5
+				if(TEXFORMAT == TexFormat_15bpp)
+				{
+					const __m128i mask5 = _mm_set1_epi16(0x1F), one = _mm_set1_epi16(1);
+					for(; x + 8 <= len; x += 8, dwdst += 8)
+					{
+						const __m128i c = _mm_loadu_si128((__m128i*)&map[x]);
+						const __m128i r = _mm_add_epi16(_mm_slli_epi16(_mm_and_si128(c,mask5),1),one);
+						const __m128i g = _mm_add_epi16(_mm_slli_epi16(_mm_and_si128(_mm_srli_epi16(c,5),mask5),1),one);
+						const __m128i b = _mm_add_epi16(_mm_slli_epi16(_mm_and_si128(_mm_srli_epi16(c,10),mask5),1),one);
+						const __m128i a = _mm_and_si128(_mm_srai_epi16(c,15),mask5);
+						const __m128i lo = _mm_or_si128(r,_mm_slli_epi16(g,8));
+						const __m128i hi = _mm_or_si128(b,_mm_slli_epi16(a,8));
+						_mm_storeu_si128((__m128i*)dwdst,_mm_unpacklo_epi16(lo,hi));
+						_mm_storeu_si128((__m128i*)(dwdst+4),_mm_unpackhi_epi16(lo,hi));
+					}
+				}
+#endif
+				for(; x < len; ++x)
+				{
+					u16 c = map[x];
+					int alpha = ((c&0x8000)?opaqueColor:0);
+					*dwdst++ = CONVERT(c&0x7FFF,alpha);
+				}
+			}
+			break;
+		}
+	} //switch(texture format)
+
+#ifdef DO_DEBUG_DUMP_TEXTURE
+	DebugDumpTexture(item);
+#endif
+}
+
+//murmur3's 64bit block mix, used to hash texture and palette data
+static FORCEINLINE u64 HashMix(u64 h, u64 k)
+{
+	k *= 0x87C37B91114253D5ULL;
+	k = (k << 31) | (k >> 33);
+	k *= 0x4CF5AD432745937FULL;
+	h ^= k;
+	h = (h << 27) | (h >> 37);
+	return h*5 + 0x52DCE729;
+}
+
+static u64 HashBytes(const u8* ptr, u32 len, u64 h)
+{
+	for(;len >= 8;len -= 8, ptr += 8)
+	{
+		u64 k;
+		memcpy(&k,ptr,8);
+		h = HashMix(h,k);
+	}
+	if(len)
+	{
+		u64 k = 0;
+		memcpy(&k,ptr,len);
+		h = HashMix(h,k);
+	}
+	return h;
+}
+
+static u64 HashMemSpan(const MemSpan& span, u64 h)
+{
+	for(int i=0;i<span.numItems;i++)
+		h = HashBytes(span.items[i].ptr,span.items[i].len,h);
+	return h;
+}
+
+//identifies the vram a MemSpan reads as it currently stands: the bank memory each piece points to, and those banks' generations.
+//(each piece lies within a single texture or palette slot, and so within a single bank)
+static u64 StampMemSpan(const MemSpan& span, u64 h)
+{
+	for(int i=0;i<span.numItems;i++)
+	{
+		h = HashMix(h,(u64)(uintptr_t)span.items[i].ptr);
+		h = HashMix(h,MMU_VRAM_generation(span.items[i].ptr));
+	}
+	return h;
+}
+
+//the cache is a hash table of every texture decoded, keyed on (format, texpal, hash of the data it was decoded from).
+//since several versions of a texture (animation frames, say) can be cached at once, nothing needs to be thrown out
+//when its data changes; the old versions just age out.
+//
+//the data can only change when vram gets remapped, which bumps the epoch. a texture which was found to match
+//the data in the current epoch is taken as is, so the buckets are picked by format and texpal alone.
+//after a remap, a texture is still good if the banks its data lies in are the same and haven't been written
+//(see MMU_VRAM_generation), so the data only gets hashed again if one of them was remapped or written.
+//
+//items are also kept on a list from most to least recently used, and trimmed from the tail
+//down to the budget at the end of each frame.
 class TexCache
 {
 public:
 	TexCache()
 		: cache_size(0)
-	{}
-
-	TTexCacheItemMultimap index;
+		, items(0)
+		, epoch(1)
+		, frame(1)
+		, lruHead(NULL)
+		, lruTail(NULL)
+	{
+		memset(buckets,0,sizeof(buckets));
+		memset(&stats,0,sizeof(stats));
+#if defined(ENABLE_SSE2) && !defined(WORDS_BIGENDIAN)
+		generateTexel4x4Masks();
+#endif
+	}
 
-	//this ought to be enough for anyone
-	//static const u32 kMaxCacheSize = 64*1024*1024; 
-	//changed by zeromus on 15-dec. I couldnt find any games that were getting anywhere NEAR 64
-	static const u32 kMaxCacheSize = 16*1024*1024; 
-	//metal slug burns through sprites so fast, it can test it pretty quickly though
+	static const int kBucketBits = 12;
+	TexCacheItem* buckets[1<<kBucketBits];
 
 	//this is not really precise, it is off by a constant factor
 	u32 cache_size;
+	u32 items;
+
+	u32 epoch, frame;
+	TexCacheItem *lruHead, *lruTail;
 
-	void list_remove(TexCacheItem* item)
+	TexCacheStats stats;
+
+	//the textures looked up with their decoding deferred since the last end of frame
+	std::vector<TexCacheItem*> pending;
+
+	static FORCEINLINE u32 bucketOf(u32 format, u32 texpal)
 	{
-		index.erase(item->iterator);
-		cache_size -= item->decode_len;
+		return (u32)(((format * 0x9E3779B1U) ^ (texpal * 0x85EBCA6BU)) >> (32-kBucketBits));
 	}
 
-	void list_push_front(TexCacheItem* item)
+	void lru_unlink(TexCacheItem* item)
 	{
-		item->iterator = index.insert(std::make_pair(item->texformat,item));
+		if(item->lruPrev) item->lruPrev->lruNext = item->lruNext; else lruHead = item->lruNext;
+		if(item->lruNext) item->lruNext->lruPrev = item->lruPrev; else lruTail = item->lruPrev;
+		item->lruPrev = item->lruNext = NULL;
+	}
+
+	void lru_push_front(TexCacheItem* item)
+	{
+		item->lruNext = lruHead;
+		item->lruPrev = NULL;
+		if(lruHead) lruHead->lruPrev = item; else lruTail = item;
+		lruHead = item;
+	}
+
+	//marks an item as used in this frame
+	void touch(TexCacheItem* item)
+	{
+		item->lastUsedFrame = frame;
+		if(item != lruHead)
+		{
+			lru_unlink(item);
+			lru_push_front(item);
+		}
+	}
+
+	void insert(TexCacheItem* item)
+	{
+		TexCacheItem* &bucket = buckets[bucketOf(item->texformat,item->texpal)];
+		item->hashNext = bucket;
+		bucket = item;
+		lru_push_front(item);
 		cache_size += item->decode_len;
+		items++;
+	}
+
+	void remove(TexCacheItem* item)
+	{
+		for(TexCacheItem** link = &buckets[bucketOf(item->texformat,item->texpal)]; *link; link = &(*link)->hashNext)
+		{
+			if(*link == item)
+			{
+				*link = item->hashNext;
+				break;
+			}
+		}
+		lru_unlink(item);
+		cache_size -= item->decode_len;
+		items--;
 	}
 
 	template<TexCache_TexFormat TEXFORMAT>
-	TexCacheItem* scan(u32 format, u32 texpal)
+	TexCacheItem* scan(u32 format, u32 texpal, bool deferDecode)
 	{
 		//for each texformat, number of palette entries
 		static const int palSizes[] = {0, 32, 4, 16, 256, 0, 8, 0};
@@ -239,6 +731,17 @@ public:
 		//for each texformat, multiplier from numtexels to numbytes (fixed point 30.2)
 		static const int texSizes[] = {0, 4, 1, 2, 4, 1, 4, 8};
 
+		//the version of this texture which was found to match its data since vram was last remapped is still good
+		for(TexCacheItem* curr = buckets[bucketOf(format,texpal)]; curr; curr = curr->hashNext)
+		{
+			if(curr->texformat == format && curr->texpal == texpal && curr->cacheFormat == TEXFORMAT && curr->validatedEpoch == epoch)
+			{
+				stats.hits++;
+				touch(curr);
+				return curr;
+			}
+		}
+
 		//used to hold a copy of the palette specified for this texture
 		u16 pal[256];
 
@@ -247,8 +750,6 @@ public:
 		u32 sizeY=(8 << ((format>>23)&0x07));
 		u32 imageSize = sizeX*sizeY;
 
-		u8 *adr;
-
 		u32 paletteAddress;
 
 		switch (textureMode)
@@ -289,6 +790,23 @@ public:
 		}
 
 
+		//a version read from the same untouched banks is still good
+		u64 bankStamp = StampMemSpan(ms,0);
+		if(textureMode == TEXMODE_4X4)
+			bankStamp = StampMemSpan(msIndex,bankStamp);
+		bankStamp = StampMemSpan(mspal,bankStamp);
+
+		for(TexCacheItem* curr = buckets[bucketOf(format,texpal)]; curr; curr = curr->hashNext)
+		{
+			if(curr->texformat == format && curr->texpal == texpal && curr->cacheFormat == TEXFORMAT && curr->bankStamp == bankStamp)
+			{
+				stats.hits++;
+				curr->validatedEpoch = epoch;
+				touch(curr);
+				return curr;
+			}
+		}
+
 		//dump the palette to a temp buffer, so that we don't have to worry about memory mapping.
 		//this isnt such a problem with texture memory, because we read sequentially from it.
 		//however, we read randomly from palette memory, so the mapping is more costly.
@@ -298,67 +816,32 @@ public:
 			mspal.dump(pal);
 		#endif
 
-			//TODO - as a special optimization, keep the last item returned and check it first
+		//otherwise look for a version decoded from the same data
+		u64 contentHash = HashMemSpan(ms,0);
+		if(textureMode == TEXMODE_4X4)
+			contentHash = HashMemSpan(msIndex,contentHash);
+		contentHash = HashBytes((u8*)pal,palSize*2,contentHash);
+		stats.hashedBytes += ms.size + indexSize + palSize*2;
 
-		for(std::pair<TTexCacheItemMultimap::iterator,TTexCacheItemMultimap::iterator>
-			iters = index.equal_range(format);
-			iters.first != iters.second;
-			++iters.first)
+		for(TexCacheItem* curr = buckets[bucketOf(format,texpal)]; curr; curr = curr->hashNext)
 		{
-			TexCacheItem* curr = iters.first->second;
-			
-			//conditions where we reject matches:
-			//when the teximage or texpal params dont match 
-			//(this is our key for identifying textures in the cache)
-			//NEW: due to using format as a key we dont need to check this anymore
-			//if(curr->texformat != format) continue;
-			if(curr->texpal != texpal) continue;
-
-			//we're being asked for a different format than what we had cached.
-			//TODO - this could be done at the entire cache level instead of checking repeatedly
-			if(curr->cacheFormat != TEXFORMAT) goto REJECT;
-
-			//the texture matches params, but isnt suspected invalid. accept it.
-			if (!curr->suspectedInvalid) return curr;
-
-			//we suspect the texture may be invalid. we need to do a byte-for-byte comparison to re-establish that it is valid:
-
-			//when the palettes dont match:
 			//note that we are considering 4x4 textures to have a palette size of 0.
 			//they really have a potentially HUGE palette, too big for us to handle like a normal palette,
 			//so they go through a different system
-			if(mspal.size != 0 && memcmp(curr->dump.palette,pal,mspal.size)) goto REJECT;
-
-			//when the texture data doesn't match
-			if(ms.memcmp(&curr->dump.texture[0],curr->dump.textureSize)) goto REJECT;
-
-			//if the texture is 4x4 then the index data must match
-			if(textureMode == TEXMODE_4X4)
+			if(curr->texformat == format && curr->texpal == texpal && curr->cacheFormat == TEXFORMAT && curr->contentHash == contentHash)
 			{
-				if(msIndex.memcmp(curr->dump.texture + curr->dump.textureSize,curr->dump.indexSize)) goto REJECT; 
+				stats.hits++;
+				curr->validatedEpoch = epoch;
+				curr->bankStamp = bankStamp;
+				touch(curr);
+				return curr;
 			}
-
-			//we found a match. just return it
-			//REMINDER to make it primary/newest when we have smarter code
-			//list_remove(curr);
-			//list_push_front(curr);
-			curr->suspectedInvalid = false;
-			return curr;
-
-		REJECT:
-			//we found a cached item for the current address, but the data is stale.
-			//for a variety of complicated reasons, we need to throw it out right this instant.
-			list_remove(curr);
-			delete curr;
-			break;
 		}
 
-		//item was not found. recruit an existing one (the oldest), or create a new one
-		//evict(); //reduce the size of the cache if necessary
-		//TODO - as a peculiarity of the texcache, eviction must happen after the entire 3d frame runs
-		//to support separate cache and read passes
+		//item was not found. create a new one
+		//(as a peculiarity of the texcache, eviction must happen after the entire 3d frame runs
+		//to support separate cache and read passes)
 		TexCacheItem* newitem = new TexCacheItem();
-		newitem->suspectedInvalid = false;
 		newitem->texformat = format;
 		newitem->cacheFormat = TEXFORMAT;
 		newitem->texpal = texpal;
@@ -369,317 +852,108 @@ public:
 		newitem->decode_len = sizeX*sizeY*4;
 		newitem->mode = textureMode;
 		newitem->decoded = new u8[newitem->decode_len];
-		list_push_front(newitem);
-		//printf("allocating: up to %d with %d items\n",cache_size,index.size());
-
-		u32 *dwdst = (u32*)newitem->decoded;
-		
-		//dump palette data for cache keying
-		if(palSize)
-		{
-			memcpy(newitem->dump.palette, pal, palSize*2);
-		}
-
-		//dump texture and 4x4 index data for cache keying
-		const int texsize = newitem->dump.textureSize = ms.size;
-		const int indexsize = newitem->dump.indexSize = msIndex.size;
-		newitem->dump.texture = new u8[texsize+indexsize];
-		ms.dump(&newitem->dump.texture[0],newitem->dump.maxTextureSize); //dump texture
-		if(textureMode == TEXMODE_4X4)
-			msIndex.dump(newitem->dump.texture+newitem->dump.textureSize,newitem->dump.indexSize); //dump 4x4
+		newitem->contentHash = contentHash;
+		newitem->bankStamp = bankStamp;
+		newitem->validatedEpoch = epoch;
+		newitem->lastUsedFrame = frame;
+		insert(newitem);
+		//printf("allocating: up to %d with %d items\n",cache_size,items);
+
+		stats.misses++;
+		stats.decodedBytes += newitem->decode_len;
+
+		TexCacheDecodeJob* job = new TexCacheDecodeJob();
+		job->ms = ms;
+		memcpy(job->pal,pal,sizeof(pal));
+		//a 4x4 palette address may run past the six palette slots, into the two slots after them.
+		//those have always been read from the texture slot table, which follows the palette slots in MMU.texInfo
+		memcpy(job->texPalSlot,MMU.texInfo.texPalSlot,sizeof(MMU.texInfo.texPalSlot));
+		job->texPalSlot[6] = MMU.texInfo.textureSlotAddr[0];
+		job->texPalSlot[7] = MMU.texInfo.textureSlotAddr[1];
+		job->indexSlot = MMU.texInfo.textureSlotAddr[1];
+		job->paletteAddress = paletteAddress;
+		newitem->decodeJob = job;
+		newitem->decodeState = TexCacheItem::DECODE_PENDING;
+
+		if(deferDecode)
+			pending.push_back(newitem);
+		else
+			tryDecode(newitem);
 
+		return newitem;
+	} //scan()
 
-		//============================================================================ 
-		//Texture conversion
-		//============================================================================ 
+	//decodes a texture whose decoding was deferred, unless somebody else already took it on. (any thread)
+	static bool tryDecode(TexCacheItem* item)
+	{
+		if(Task_AtomicCompareExchange(&item->decodeState,TexCacheItem::DECODE_PENDING,TexCacheItem::DECODE_BUSY) != TexCacheItem::DECODE_PENDING)
+			return false;
+
+		if(item->cacheFormat == TexFormat_32bpp)
+			DecodeTexture<TexFormat_32bpp>(item,*item->decodeJob);
+		else
+			DecodeTexture<TexFormat_15bpp>(item,*item->decodeJob);
+		delete item->decodeJob;
+		item->decodeJob = NULL;
+
+		Task_AtomicCompareExchange(&item->decodeState,TexCacheItem::DECODE_BUSY,TexCacheItem::DECODE_DONE);
+		return true;
+	}
 
-		const u32 opaqueColor = TEXFORMAT==TexFormat_32bpp?255:31;
-		u32 palZeroTransparent = (1-((format>>29)&1))*opaqueColor;
+	//makes sure a texture is decoded. if another thread is busy decoding it, the other pending textures get decoded meanwhile. (any thread)
+	void decode(TexCacheItem* item)
+	{
+		if(tryDecode(item)) return;
 
-		switch (newitem->mode)
+		size_t next = 0;
+		while(Task_AtomicCompareExchange(&item->decodeState,TexCacheItem::DECODE_DONE,TexCacheItem::DECODE_DONE) != TexCacheItem::DECODE_DONE)
 		{
-		case TEXMODE_A3I5:
-			{
-				for(int j=0;j<ms.numItems;j++) {
-					adr = ms.items[j].ptr;
-					for(u32 x = 0; x < ms.items[j].len; x++)
-					{
-						u16 c = pal[*adr&31];
-						u8 alpha = *adr>>5;
-						if(TEXFORMAT == TexFormat_15bpp)
-							*dwdst++ = RGB15TO6665(c,material_3bit_to_5bit[alpha]);
-						else
-							*dwdst++ = RGB15TO32(c,material_3bit_to_8bit[alpha]);
-						adr++;
-					}
-				}
-				break;
-			}
-
-		case TEXMODE_I2:
-			{
-				for(int j=0;j<ms.numItems;j++) {
-					adr = ms.items[j].ptr;
-					for(u32 x = 0; x < ms.items[j].len; x++)
-					{
-						u8 bits;
-						u16 c;
-
-						bits = (*adr)&0x3;
-						c = pal[bits];
-						*dwdst++ = CONVERT(c,(bits == 0) ? palZeroTransparent : opaqueColor);
-
-						bits = ((*adr)>>2)&0x3;
-						c = pal[bits];
-						*dwdst++ = CONVERT(c,(bits == 0) ? palZeroTransparent : opaqueColor);
-
-						bits = ((*adr)>>4)&0x3;
-						c = pal[bits];
-						*dwdst++ = CONVERT(c,(bits == 0) ? palZeroTransparent : opaqueColor);
-
-						bits = ((*adr)>>6)&0x3;
-						c = pal[bits];
-						*dwdst++ = CONVERT(c,(bits == 0) ? palZeroTransparent : opaqueColor);
-
-						adr++;
-					}
-				}
-				break;
-			}
-		case TEXMODE_I4:
-			{
-				for(int j=0;j<ms.numItems;j++) {
-					adr = ms.items[j].ptr;
-					for(u32 x = 0; x < ms.items[j].len; x++)
-					{
-						u8 bits;
-						u16 c;
-
-						bits = (*adr)&0xF;
-						c = pal[bits];
-						*dwdst++ = CONVERT(c,(bits == 0) ? palZeroTransparent : opaqueColor);
-
-						bits = ((*adr)>>4);
-						c = pal[bits];
-						*dwdst++ = CONVERT(c,(bits == 0) ? palZeroTransparent : opaqueColor);
-						adr++;
-					}
-				}
-				break;
-			}
-		case TEXMODE_I8:
-			{
-				for(int j=0;j<ms.numItems;j++) {
-					adr = ms.items[j].ptr;
-					for(u32 x = 0; x < ms.items[j].len; ++x)
-					{
-						u16 c = pal[*adr];
-						*dwdst++ = CONVERT(c,(*adr == 0) ? palZeroTransparent : opaqueColor);
-						adr++;
-					}
-				}
-			}
-			break;
-		case TEXMODE_4X4:
-			{
-				//RGB16TO32 is used here because the other conversion macros result in broken interpolation logic
-
-				if(ms.numItems != 1) {
-					PROGINFO("Your 4x4 texture has overrun its texture slot.\n");
-				}
-				//this check isnt necessary since the addressing is tied to the texture data which will also run out:
-				//if(msIndex.numItems != 1) PROGINFO("Your 4x4 texture index has overrun its slot.\n");
-
-	#define PAL4X4(offset) ( *(u16*)( MMU.texInfo.texPalSlot[((paletteAddress + (offset)*2)>>14)&0x7] + ((paletteAddress + (offset)*2)&0x3FFF) ) )
-
-				u16* slot1;
-				u32* map = (u32*)ms.items[0].ptr;
-				u32 limit = ms.items[0].len<<2;
-				u32 d = 0;
-				if ( (format & 0xc000) == 0x8000)
-					// texel are in slot 2
-					slot1=(u16*)&MMU.texInfo.textureSlotAddr[1][((format & 0x3FFF)<<2)+0x010000];
-				else 
-					slot1=(u16*)&MMU.texInfo.textureSlotAddr[1][(format & 0x3FFF)<<2];
-
-				u16 yTmpSize = (sizeY>>2);
-				u16 xTmpSize = (sizeX>>2);
-
-				//this is flagged whenever a 4x4 overruns its slot.
-				//i am guessing we just generate black in that case
-				bool dead = false;
-
-				for (int y = 0; y < yTmpSize; y ++)
-				{
-					u32 tmpPos[4]={(y<<2)*sizeX,((y<<2)+1)*sizeX,
-						((y<<2)+2)*sizeX,((y<<2)+3)*sizeX};
-					for (int x = 0; x < xTmpSize; x ++, d++)
-					{
-						if(d >= limit)
-							dead = true;
-
-						if(dead) {
-							for (int sy = 0; sy < 4; sy++)
-							{
-								u32 currentPos = (x<<2) + tmpPos[sy];
-								dwdst[currentPos] = dwdst[currentPos+1] = dwdst[currentPos+2] = dwdst[currentPos+3] = 0;
-							}
-							continue;
-						}
-
-						u32 currBlock	= map[d];
-						u16 pal1		= slot1[d];
-						u16 pal1offset	= (pal1 & 0x3FFF)<<1;
-						u8  mode		= pal1>>14;
-						u32 tmp_col[4];
-						
-						tmp_col[0]=RGB16TO32(PAL4X4(pal1offset),255);
-						tmp_col[1]=RGB16TO32(PAL4X4(pal1offset+1),255);
-
-						switch (mode) 
-						{
-						case 0:
-							tmp_col[2]=RGB16TO32(PAL4X4(pal1offset+2),255);
-							tmp_col[3]=RGB16TO32(0x7FFF,0);
-							break;
-						case 1:
-							tmp_col[2]=(((tmp_col[0]&0xFF)+(tmp_col[1]&0xff))>>1)|
-								(((tmp_col[0]&(0xFF<<8))+(tmp_col[1]&(0xFF<<8)))>>1)|
-								(((tmp_col[0]&(0xFF<<16))+(tmp_col[1]&(0xFF<<16)))>>1)|
-								(0xff<<24);
-							tmp_col[3]=RGB16TO32(0x7FFF,0);
-							break;
-						case 2:
-							tmp_col[2]=RGB16TO32(PAL4X4(pal1offset+2),255);
-							tmp_col[3]=RGB16TO32(PAL4X4(pal1offset+3),255);
-							break;
-						case 3: 
-							{
-								u32 red1, red2;
-								u32 green1, green2;
-								u32 blue1, blue2;
-								u16 tmp1, tmp2;
-
-								red1=tmp_col[0]&0xff;
-								green1=(tmp_col[0]>>8)&0xff;
-								blue1=(tmp_col[0]>>16)&0xff;
-								red2=tmp_col[1]&0xff;
-								green2=(tmp_col[1]>>8)&0xff;
-								blue2=(tmp_col[1]>>16)&0xff;
-
-								tmp1=((red1*5+red2*3)>>6)|
-									(((green1*5+green2*3)>>6)<<5)|
-									(((blue1*5+blue2*3)>>6)<<10);
-								tmp2=((red2*5+red1*3)>>6)|
-									(((green2*5+green1*3)>>6)<<5)|
-									(((blue2*5+blue1*3)>>6)<<10);
-
-								tmp_col[2]=RGB16TO32(tmp1,255);
-								tmp_col[3]=RGB16TO32(tmp2,255);
-								break;
-							}
-						}
-
-						if(TEXFORMAT==TexFormat_15bpp)
-						{
-							for(int i=0;i<4;i++)
-							{
-								tmp_col[i] >>= 2;
-								tmp_col[i] &= 0x3F3F3F3F;
-								u32 a = tmp_col[i]>>24;
-								tmp_col[i] &= 0x00FFFFFF;
-								tmp_col[i] |= (a>>1)<<24;
-							}
-						}
-
-						//TODO - this could be more precise for 32bpp mode (run it through the color separation table)
-
-						//set all 16 texels
-						for (int sy = 0; sy < 4; sy++)
-						{
-							// Texture offset
-							u32 currentPos = (x<<2) + tmpPos[sy];
-							u8 currRow = (u8)((currBlock>>(sy<<3))&0xFF);
-
-							dwdst[currentPos] = tmp_col[currRow&3];
-							dwdst[currentPos+1] = tmp_col[(currRow>>2)&3];
-							dwdst[currentPos+2] = tmp_col[(currRow>>4)&3];
-							dwdst[currentPos+3] = tmp_col[(currRow>>6)&3];
-						}
-
-
-					}
-				}
-
-
-				break;
-			}
-		case TEXMODE_A5I3:
-			{
-				for(int j=0;j<ms.numItems;j++) {
-					adr = ms.items[j].ptr;
-					for(u32 x = 0; x < ms.items[j].len; ++x)
-					{
-						u16 c = pal[*adr&0x07];
-						u8 alpha = (*adr>>3);
-						if(TEXFORMAT == TexFormat_15bpp)
-							*dwdst++ = RGB15TO6665(c,alpha);
-						else
-							*dwdst++ = RGB15TO32(c,material_5bit_to_8bit[alpha]);
-						adr++;
-					}
-				}
-				break;
-			}
-		case TEXMODE_16BPP:
-			{
-				for(int j=0;j<ms.numItems;j++) {
-					u16* map = (u16*)ms.items[j].ptr;
-					int len = ms.items[j].len>>1;
-					for(int x = 0; x < len; ++x)
-					{
-						u16 c = map[x];
-						int alpha = ((c&0x8000)?opaqueColor:0);
-						*dwdst++ = CONVERT(c&0x7FFF,alpha);
-					}
-				}
-				break;
-			}
-		} //switch(texture format)
+			if(next < pending.size())
+				tryDecode(pending[next++]);
+		}
+	}
 
-#ifdef DO_DEBUG_DUMP_TEXTURE
-	DebugDumpTexture(newitem);
-#endif
+	//(any thread)
+	void decodePending()
+	{
+		for(size_t i=0;i<pending.size();i++)
+			tryDecode(pending[i]);
+	}
 
-		return newitem;
-	} //scan()
+	//waits for every deferred decode to be done. the pending list is only cleared where nothing else can be looking at it
+	void finishPending()
+	{
+		for(size_t i=0;i<pending.size();i++)
+			decode(pending[i]);
+	}
 
 	void invalidate()
 	{
-		for(TTexCacheItemMultimap::iterator it(index.begin()); it != index.end(); ++it)
-			it->second->suspectedInvalid = true;
+		//the banks the pending decodes read from may be written once they're remapped
+		finishPending();
+
+		//every texture now has to be matched against its data again before it is used
+		epoch++;
 	}
 
-	void evict(u32 target = kMaxCacheSize)
+	//evicts the least recently used items until the cache is within the budget.
+	//items used in the current frame may be needed again right away, so they are kept unless everything is to go
+	void evict(u32 budget, bool keepCurrentFrame)
 	{
-		//debug print
-		//printf("%d %d/%d\n",index.size(),cache_size/1024,target/1024);
-
-		//dont do anything unless we're over the target
-		if(cache_size<target) return;
+		finishPending();
+		pending.clear();
 
-		//aim at cutting the cache to half of the max size
-		target/=2;
+		//debug print
+		//printf("%d %d/%d\n",items,cache_size/1024,budget/1024);
 
-		//evicts items in an arbitrary order until it is less than the max cache size
-		//TODO - do this based on age and not arbitrarily
-		while(cache_size > target)
+		while(cache_size > budget && lruTail)
 		{
-			if(index.size()==0) break; //just in case.. doesnt seem possible, cache_size wouldve been 0
-
-			TexCacheItem* item = index.begin()->second;
-			list_remove(item);
+			TexCacheItem* item = lruTail;
+			if(keepCurrentFrame && item->lastUsedFrame == frame) break;
+			remove(item);
+			stats.evictions++;
 			//printf("evicting! totalsize:%d\n",cache_size);
+			delete item->decodeJob;
 			delete item;
 		}
 	}
@@ -687,7 +961,9 @@ public:
 
 void TexCache_Reset()
 {
-	texCache.evict(0);
+	//nothing may be decoding anymore here
+	texCache.pending.clear();
+	texCache.evict(0,false);
 }
 
 void TexCache_Invalidate()
@@ -696,18 +972,54 @@ void TexCache_Invalidate()
 	texCache.invalidate();
 }
 
-TexCacheItem* TexCache_SetTexture(TexCache_TexFormat TEXFORMAT, u32 format, u32 texpal)
+static TexCacheItem* TexCache_Scan(TexCache_TexFormat TEXFORMAT, u32 format, u32 texpal, bool deferDecode)
 {
 	switch(TEXFORMAT)
 	{
-	case TexFormat_32bpp: return texCache.scan<TexFormat_32bpp>(format,texpal);
-	case TexFormat_15bpp: return texCache.scan<TexFormat_15bpp>(format,texpal);
+	case TexFormat_32bpp: return texCache.scan<TexFormat_32bpp>(format,texpal,deferDecode);
+	case TexFormat_15bpp: return texCache.scan<TexFormat_15bpp>(format,texpal,deferDecode);
 	default: assert(false); return NULL;
 	}
 }
 
+TexCacheItem* TexCache_SetTexture(TexCache_TexFormat TEXFORMAT, u32 format, u32 texpal)
+{
+	TexCacheItem* item = TexCache_Scan(TEXFORMAT,format,texpal,false);
+	//it may have been looked up deferred earlier on
+	if(item) texCache.decode(item);
+	return item;
+}
+
+TexCacheItem* TexCache_SetTextureDeferred(TexCache_TexFormat TEXFORMAT, u32 format, u32 texpal)
+{
+	return TexCache_Scan(TEXFORMAT,format,texpal,true);
+}
+
+void TexCache_Decode(TexCacheItem* item)
+{
+	texCache.decode(item);
+}
+
+void TexCache_DecodePending()
+{
+	texCache.decodePending();
+}
+
 //call this periodically to keep the tex cache clean
 void TexCache_EvictFrame()
 {
-	texCache.evict();
+	texCache.evict((u32)CommonSettings.GFX3D_TexCacheSizeMB*1024*1024,true);
+	texCache.frame++;
+}
+
+void TexCache_GetStats(TexCacheStats &stats)
+{
+	stats = texCache.stats;
+	stats.items = texCache.items;
+	stats.size = texCache.cache_size;
+}
+
+void TexCache_ResetStats()
+{
+	memset(&texCache.stats,0,sizeof(texCache.stats));
 }
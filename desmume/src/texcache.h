@@ -21,7 +21,6 @@
 #define _TEXCACHE_H_
 
 #include "common.h"
-#include <map>
 
 enum TexCache_TexFormat
 {
@@ -30,9 +29,7 @@ enum TexCache_TexFormat
 	TexFormat_15bpp //used by rasterizer
 };
 
-class TexCacheItem;
-
-typedef std::multimap<u32,TexCacheItem*> TTexCacheItemMultimap;
+struct TexCacheDecodeJob;
 
 class TexCacheItem
 {
@@ -40,9 +37,17 @@ public:
 	TexCacheItem() 
 		: decode_len(0)
 		, decoded(NULL)
-		, suspectedInvalid(false)
 		, deleteCallback(NULL)
 		, cacheFormat(TexFormat_None)
+		, contentHash(0)
+		, bankStamp(0)
+		, validatedEpoch(0)
+		, lastUsedFrame(0)
+		, hashNext(NULL)
+		, lruPrev(NULL)
+		, lruNext(NULL)
+		, decodeState(DECODE_DONE)
+		, decodeJob(NULL)
 	{}
 	~TexCacheItem() {
 		delete[] decoded;
@@ -51,8 +56,6 @@ public:
 	u32 decode_len;
 	u32 mode;
 	u8* decoded; //decoded texture data
-	bool suspectedInvalid;
-	TTexCacheItemMultimap::iterator iterator;
 
 	u32 texformat, texpal;
 	u32 sizeX, sizeY;
@@ -63,21 +66,41 @@ public:
 
 	TexCache_TexFormat cacheFormat;
 
-	struct Dump {
-		~Dump() {
-			delete[] texture;
-		}
-		int textureSize, indexSize;
-		static const int maxTextureSize=128*1024;
-		u8* texture;
-		u8 palette[256*2];
-	} dump;
+	u64 contentHash; //hash of the texture, 4x4 index and palette data this was decoded from
+	u64 bankStamp; //identifies the vram banks and their generations this was last found to match (see MMU_VRAM_generation)
+	u32 validatedEpoch; //the last vram mapping this was found to match
+	u32 lastUsedFrame;
+	TexCacheItem *hashNext, *lruPrev, *lruNext;
+
+	//whether decoded holds the texture yet (see TexCache_SetTextureDeferred)
+	enum { DECODE_DONE, DECODE_PENDING, DECODE_BUSY };
+	volatile s32 decodeState;
+	TexCacheDecodeJob* decodeJob; //what the decoding needs, until it is done
+};
+
+struct TexCacheStats
+{
+	u64 hits, misses, decodedBytes, hashedBytes, evictions;
+	u32 items, size;
 };
 
 void TexCache_Invalidate();
 void TexCache_Reset();
 void TexCache_EvictFrame();
+void TexCache_GetStats(TexCacheStats &stats);
+void TexCache_ResetStats();
 
 TexCacheItem* TexCache_SetTexture(TexCache_TexFormat TEXFORMAT, u32 format, u32 texpal);
 
+//like TexCache_SetTexture, but a texture which isn't cached yet comes back without having been decoded.
+//TexCache_Decode has to be called on it before its decoded data is used, which may happen on any thread
+//until the next TexCache_EvictFrame (that finishes whatever is still pending).
+TexCacheItem* TexCache_SetTextureDeferred(TexCache_TexFormat TEXFORMAT, u32 format, u32 texpal);
+
+//makes sure a texture is decoded: decodes it, or waits for the thread decoding it while helping out with the other pending ones
+void TexCache_Decode(TexCacheItem* item);
+
+//decodes the pending textures nobody has taken on yet, without waiting for anybody else's
+void TexCache_DecodePending();
+
 #endif
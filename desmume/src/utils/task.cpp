@@ -23,6 +23,7 @@
 #include <windows.h>
 #else
 #include <pthread.h>
+#include <time.h>
 #endif
 
 #ifdef _MSC_VER
@@ -317,3 +318,26 @@ void Task::execute(const TWork &work, void* param) { impl->execute(work,param);
 void* Task::finish() { return impl->finish(); }
 
 
+
+#ifdef _WINDOWS
+s32 Task_AtomicIncrement(volatile s32 *value) { return (s32)InterlockedIncrement((volatile LONG*)value); }
+s32 Task_AtomicCompareExchange(volatile s32 *value, s32 expected, s32 desired) { return (s32)InterlockedCompareExchange((volatile LONG*)value,desired,expected); }
+
+u64 Task_GetTimeMicros()
+{
+	LARGE_INTEGER freq, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (u64)((double)now.QuadPart * 1000000.0 / (double)freq.QuadPart);
+}
+#else
+s32 Task_AtomicIncrement(volatile s32 *value) { return __sync_add_and_fetch(value,1); }
+s32 Task_AtomicCompareExchange(volatile s32 *value, s32 expected, s32 desired) { return __sync_val_compare_and_swap(value,expected,desired); }
+
+u64 Task_GetTimeMicros()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (u64)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+#endif
@@ -18,6 +18,8 @@
 #ifndef _TASK_H_
 #define _TASK_H_
 
+#include "types.h"
+
 //Sort of like a single-thread thread pool.
 //You hand it a worker function and then call finish() to synch with its completion
 class Task
@@ -45,5 +47,16 @@ public:
 
 };
 
+//atomically increments the value and returns the incremented value.
+//useful for handing out chunks of work to several tasks without a lock
+s32 Task_AtomicIncrement(volatile s32 *value);
+
+//atomically sets the value to desired if it equals expected, and returns what it was before.
+//this is a full barrier, so it also works for publishing or picking up the results of some work
+s32 Task_AtomicCompareExchange(volatile s32 *value, s32 expected, s32 desired);
+
+//monotonic time in microseconds (not wall-clock), for timing work spread across tasks
+u64 Task_GetTimeMicros();
+
 
 #endif
@@ -17,11 +17,13 @@
 */
 
 #include <assert.h>
+#include <algorithm>
 #include "wifi.h"
 #include "armcpu.h"
 #include "NDSSystem.h"
 #include "debug.h"
 #include "bits.h"
+#include "utils/task.h"
 
 
 #ifdef _WINDOWS
@@ -331,6 +333,14 @@ WifiComInterface* wifiCom;
 // however this is guessed, like a lot of the wifi here
 #define WIFI_CMDCOUNT_SLICE 100
 
+// 2196372 ~= (ARM7_CLOCK << 16) / 1000000
+// This value makes more sense to me, because:
+// ARM7_CLOCK   = 33.51 mhz
+//				= 33513982 cycles per second
+// 				= 33.513982 cycles per microsecond
+static const u64 kWifiCycles = 67;//34*2;
+//(this isn't very precise. I don't think it needs to be)
+
 /*******************************************************************************
 
 	Helpers
@@ -344,12 +354,12 @@ INLINE u32 WIFI_alignedLen(u32 len)
 
 // Fast MAC compares
 
-INLINE bool WIFI_compareMAC(u8* a, u8* b)
+INLINE bool WIFI_compareMAC(const u8* a, const u8* b)
 {
-	return ((*(u32*)&a[0]) == (*(u32*)&b[0])) && ((*(u16*)&a[4]) == (*(u16*)&b[4]));
+	return ((*(const u32*)&a[0]) == (*(const u32*)&b[0])) && ((*(const u16*)&a[4]) == (*(const u16*)&b[4]));
 }
 
-INLINE bool WIFI_isBroadcastMAC(u8* a)
+INLINE bool WIFI_isBroadcastMAC(const u8* a)
 {
 	return (a[0] & 0x01);
 	//return ((*(u32*)&a[0]) == 0xFFFFFFFF) && ((*(u16*)&a[4]) == 0xFFFF);
@@ -677,6 +687,7 @@ void WIFI_Reset()
 	wifiMac.powerOnPending = FALSE;
 
 	wifiMac.GlobalUsecTimer = wifiMac.usec = wifiMac.ucmp = 0ULL;
+	wifiMac.usecTime = 0ULL;
 	
 	//wifiMac.rfStatus = 0x0000;
 	//wifiMac.rfPins = 0x0004;
@@ -705,10 +716,10 @@ void WIFI_Reset()
 }
 
 
-INLINE u16 WIFI_GetRXFlags(u8* packet)
+INLINE u16 WIFI_GetRXFlags(const u8* packet)
 {
 	u16 ret = 0x0010;
-	u16 frameCtl = *(u16*)&packet[0];
+	u16 frameCtl = *(const u16*)&packet[0];
 	u32 bssid_offset = 10;
 
 	frameCtl &= 0xE7FF;
@@ -989,6 +1000,9 @@ void WIFI_write16(u32 address, u16 val)
 	// only the first mirror (0x0000 - 0x0FFF) causes a special action
 	if (page == 0x0000) action = TRUE;
 
+	// bring the timers up to date before the write changes how they run
+	WIFI_usSync();
+
 	address &= 0x0FFF;
 	switch (address)
 	{
@@ -1347,6 +1361,10 @@ void WIFI_write16(u32 address, u16 val)
 	}
 
 	WIFI_IOREG(address) = val;
+
+#ifdef EXPERIMENTAL_WIFI_COMM
+	NDS_RescheduleWifi();
+#endif
 }
 
 u16 WIFI_read16(u32 address)
@@ -1372,6 +1390,8 @@ u16 WIFI_read16(u32 address)
 	// only the first mirror causes a special action
 	if (page == 0x0000) action = TRUE;
 
+	WIFI_usSync();
+
 	address &= 0x0FFF;
 	switch (address)
 	{
@@ -1564,7 +1584,7 @@ u16 WIFI_read16(u32 address)
 }
 
 
-void WIFI_usTrigger()
+static void WIFI_usTick()
 {
 	wifiMac.GlobalUsecTimer++;
 
@@ -1751,6 +1771,85 @@ void WIFI_usTrigger()
 			wifiCom->msTrigger();
 }
 
+// The number of microseconds to the next one where WIFI_usTick has more to do than
+// count: a transfer in progress, the extra counter or the usec compare running out,
+// a beacon counter tick or the host connection's millisecond poll. The microseconds
+// before it only advance the counters, so they can be counted off all at once.
+static u64 WIFI_usToEvent()
+{
+	if ((wifiMac.TXCurSlot >= 0) || !wifiMac.RXPacketQueue.empty())
+		return 1;
+
+	u64 next = 1024 - (wifiMac.GlobalUsecTimer & 1023);
+	bool counting = wifiMac.crystalEnabled && wifiMac.usecEnable;
+
+	if (wifiMac.crystalEnabled)
+	{
+		if (wifiMac.eCountEnable && (wifiMac.eCount > 0))
+			next = std::min<u64>(next, wifiMac.eCount);
+
+		// a stopped usec counter sitting on a beacon boundary ticks the beacon counters every usec
+		if (counting)
+			next = std::min<u64>(next, 1024 - (wifiMac.usec & 1023));
+		else if (!(wifiMac.usec & 1023))
+			return 1;
+	}
+
+	if (wifiMac.ucmpEnable)
+	{
+		if (!counting && (wifiMac.ucmp == wifiMac.usec))
+			return 1;
+		if (counting && (wifiMac.ucmp > wifiMac.usec))
+			next = std::min<u64>(next, wifiMac.ucmp - wifiMac.usec);
+	}
+
+	return next;
+}
+
+static void WIFI_usSkip(u64 usecs)
+{
+	wifiMac.GlobalUsecTimer += usecs;
+
+	if (wifiMac.crystalEnabled)
+	{
+		if (wifiMac.usecEnable)
+			wifiMac.usec += usecs;
+		if (wifiMac.eCountEnable && (wifiMac.eCount > 0))
+			wifiMac.eCount -= (u32)usecs;
+	}
+}
+
+void WIFI_usSync()
+{
+#ifdef EXPERIMENTAL_WIFI_COMM
+	// a savestate can leave us ahead of the clock
+	if (wifiMac.usecTime > nds_timer)
+		wifiMac.usecTime = nds_timer;
+
+	u64 usecs = (nds_timer - wifiMac.usecTime) / kWifiCycles;
+	wifiMac.usecTime += usecs * kWifiCycles;
+
+	while (usecs > 0)
+	{
+		u64 next = WIFI_usToEvent();
+		if (next > usecs)
+		{
+			WIFI_usSkip(usecs);
+			break;
+		}
+
+		WIFI_usSkip(next - 1);
+		WIFI_usTick();
+		usecs -= next;
+	}
+#endif
+}
+
+u64 WIFI_usNextEvent()
+{
+	return wifiMac.usecTime + WIFI_usToEvent() * kWifiCycles;
+}
+
 /*******************************************************************************
 
 	Ad-hoc communication interface
@@ -1769,8 +1868,38 @@ typedef struct _Adhoc_FrameHeader
 
 } Adhoc_FrameHeader;
 
+#define ADHOC_FRAME_MAX				1536
 
-bool Adhoc_Init()
+// The ad-hoc frames travel over a transport:
+//  - UDP: broadcast on port 7000, reaches every instance on the LAN
+//  - hub: a ring of frames in shared memory, reaches the instances on this computer
+// A frame is written straight into the transport's own buffer (BeginFrame/EndFrame), and
+// Poll flushes the frames queued since the last poll and hands over every frame that arrived.
+struct AdhocTransport
+{
+	const char* name;
+	bool (*Open)();
+	void (*Close)();
+	u8* (*BeginFrame)();
+	void (*EndFrame)(u32 len);
+	void (*Poll)(void (*receive)(const u8* frame, u32 len));
+};
+
+/* UDP */
+
+#define ADHOC_UDP_BATCH				16
+
+#if defined(__linux__)
+#define ADHOC_UDP_MMSG
+#include <sys/uio.h>
+#endif
+
+static u8 Adhoc_UDP_SendBuf[ADHOC_UDP_BATCH][ADHOC_FRAME_MAX];
+static u32 Adhoc_UDP_SendLen[ADHOC_UDP_BATCH];
+static int Adhoc_UDP_SendCount;
+static u8 Adhoc_UDP_RecvBuf[ADHOC_UDP_BATCH][ADHOC_FRAME_MAX];
+
+static bool Adhoc_UDP_Open()
 {
 	BOOL opt_true = TRUE;
 	int res;
@@ -1822,17 +1951,396 @@ bool Adhoc_Init()
 	*(u32*)&sendAddr.sa_data[2] = htonl(INADDR_BROADCAST); 
 	*(u16*)&sendAddr.sa_data[0] = htons(BASEPORT);
 
+	Adhoc_UDP_SendCount = 0;
+
+	return true;
+}
+
+static void Adhoc_UDP_Close()
+{
+	if (wifi_socket >= 0)
+		closesocket(wifi_socket);
+	wifi_socket = INVALID_SOCKET;
+}
+
+static void Adhoc_UDP_Flush()
+{
+	if (Adhoc_UDP_SendCount == 0)
+		return;
+
+#ifdef ADHOC_UDP_MMSG
+	struct mmsghdr msgs[ADHOC_UDP_BATCH];
+	struct iovec iov[ADHOC_UDP_BATCH];
+	memset(msgs, 0, sizeof(msgs));
+	for (int i = 0; i < Adhoc_UDP_SendCount; i++)
+	{
+		iov[i].iov_base = Adhoc_UDP_SendBuf[i];
+		iov[i].iov_len = Adhoc_UDP_SendLen[i];
+		msgs[i].msg_hdr.msg_name = &sendAddr;
+		msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_t);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int nsent = sendmmsg(wifi_socket, msgs, Adhoc_UDP_SendCount, 0);
+	WIFI_LOG(4, "Ad-hoc: sent %i/%i frames.\n", nsent, Adhoc_UDP_SendCount);
+#else
+	for (int i = 0; i < Adhoc_UDP_SendCount; i++)
+	{
+		int nbytes = sendto(wifi_socket, (const char*)Adhoc_UDP_SendBuf[i], Adhoc_UDP_SendLen[i], 0, &sendAddr, sizeof(sockaddr_t));
+		WIFI_LOG(4, "Ad-hoc: sent %i/%i bytes of packet.\n", nbytes, Adhoc_UDP_SendLen[i]);
+	}
+#endif
+
+	Adhoc_UDP_SendCount = 0;
+}
+
+static u8* Adhoc_UDP_BeginFrame()
+{
+	if (Adhoc_UDP_SendCount == ADHOC_UDP_BATCH)
+		Adhoc_UDP_Flush();
+	return Adhoc_UDP_SendBuf[Adhoc_UDP_SendCount];
+}
+
+static void Adhoc_UDP_EndFrame(u32 len)
+{
+	Adhoc_UDP_SendLen[Adhoc_UDP_SendCount++] = len;
+}
+
+static void Adhoc_UDP_Poll(void (*receive)(const u8* frame, u32 len))
+{
+	Adhoc_UDP_Flush();
+
+#ifdef ADHOC_UDP_MMSG
+	struct mmsghdr msgs[ADHOC_UDP_BATCH];
+	struct iovec iov[ADHOC_UDP_BATCH];
+	memset(msgs, 0, sizeof(msgs));
+	for (int i = 0; i < ADHOC_UDP_BATCH; i++)
+	{
+		iov[i].iov_base = Adhoc_UDP_RecvBuf[i];
+		iov[i].iov_len = ADHOC_FRAME_MAX;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	// drain the socket a batch at a time
+	for (;;)
+	{
+		int n = recvmmsg(wifi_socket, msgs, ADHOC_UDP_BATCH, MSG_DONTWAIT, NULL);
+		if (n <= 0)
+			return;
+		for (int i = 0; i < n; i++)
+			receive(Adhoc_UDP_RecvBuf[i], msgs[i].msg_len);
+		if (n < ADHOC_UDP_BATCH)
+			return;
+	}
+#else
+	for (;;)
+	{
+		fd_set fd;
+		struct timeval tv;
+
+		FD_ZERO(&fd);
+		FD_SET(wifi_socket, &fd);
+		tv.tv_sec = 0; 
+		tv.tv_usec = 0;
+
+		if (select((int)wifi_socket + 1, &fd, 0, 0, &tv) <= 0)
+			return;
+
+		sockaddr_t fromAddr;
+		socklen_t fromLen = sizeof(sockaddr_t);
+		int nbytes = recvfrom(wifi_socket, (char*)Adhoc_UDP_RecvBuf[0], ADHOC_FRAME_MAX, 0, &fromAddr, &fromLen);
+
+		// No packet arrived (or there was an error)
+		if (nbytes <= 0)
+			return;
+
+		receive(Adhoc_UDP_RecvBuf[0], nbytes);
+	}
+#endif
+}
+
+static const AdhocTransport Adhoc_UDP = {
+	"UDP",
+	Adhoc_UDP_Open,
+	Adhoc_UDP_Close,
+	Adhoc_UDP_BeginFrame,
+	Adhoc_UDP_EndFrame,
+	Adhoc_UDP_Poll
+};
+
+/* hub */
+
+// Every instance maps the same ring. A sender claims the next slot with an atomic increment
+// of head, clears the slot's seq, writes its frame there and publishes it by setting seq to its
+// index + 1. Each instance reads from its own cursor and skips its own frames; one that falls a
+// whole ring behind loses the frames it missed, as it would over the air. Readers copy a frame
+// out before using it and check seq again afterwards, dropping it if a sender reused the slot
+// in the meantime.
+#define ADHOC_HUB_NAME				"/desmume-adhoc"
+#define ADHOC_HUB_MAGIC				0x42554844 // "DHUB"
+#define ADHOC_HUB_SLOTS				256
+// how long a claimed slot may stay unpublished before readers give up on it (its sender
+// may have died between claiming and publishing it)
+#define ADHOC_HUB_STALL_USEC		100000
+
+struct Adhoc_HubSlot
+{
+	volatile u32 seq;
+	u32 sender;
+	u32 len;
+	u8 data[ADHOC_FRAME_MAX];
+};
+
+struct Adhoc_Hub
+{
+	volatile u32 magic;
+	volatile u32 head;
+	Adhoc_HubSlot slots[ADHOC_HUB_SLOTS];
+};
+
+#ifndef _WINDOWS
+#include <fcntl.h>
+#include <sys/mman.h>
+
+static Adhoc_Hub* Adhoc_hub = NULL;
+static u32 Adhoc_hubCursor;
+static u32 Adhoc_hubSlot;
+static u32 Adhoc_hubSender;
+static u32 Adhoc_hubStallCursor;
+static u64 Adhoc_hubStallStart;
+static u8 Adhoc_hubRecvBuf[ADHOC_FRAME_MAX];
+
+static bool Adhoc_Hub_Open()
+{
+	int fd = shm_open(ADHOC_HUB_NAME, O_RDWR | O_CREAT, 0600);
+	if (fd < 0)
+	{
+		WIFI_LOG(1, "Ad-hoc: failed to open the hub.\n");
+		return false;
+	}
+
+	// a new segment comes zero filled, and growing it to the size it already has is harmless
+	void* mem = MAP_FAILED;
+	if (ftruncate(fd, sizeof(Adhoc_Hub)) == 0)
+		mem = mmap(NULL, sizeof(Adhoc_Hub), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+	{
+		WIFI_LOG(1, "Ad-hoc: failed to map the hub.\n");
+		return false;
+	}
+
+	Adhoc_hub = (Adhoc_Hub*)mem;
+	__sync_bool_compare_and_swap(&Adhoc_hub->magic, 0, ADHOC_HUB_MAGIC);
+	if (Adhoc_hub->magic != ADHOC_HUB_MAGIC)
+	{
+		WIFI_LOG(1, "Ad-hoc: the hub was made by something else.\n");
+		munmap(mem, sizeof(Adhoc_Hub));
+		Adhoc_hub = NULL;
+		return false;
+	}
+
+	Adhoc_hubCursor = Adhoc_hub->head;
+	Adhoc_hubStallCursor = 0;
+	Adhoc_hubSender = (u32)getpid();
+
+	return true;
+}
+
+static void Adhoc_Hub_Close()
+{
+	if (Adhoc_hub)
+		munmap(Adhoc_hub, sizeof(Adhoc_Hub));
+	Adhoc_hub = NULL;
+}
+
+static u8* Adhoc_Hub_BeginFrame()
+{
+	Adhoc_hubSlot = __sync_fetch_and_add(&Adhoc_hub->head, 1);
+	Adhoc_HubSlot& slot = Adhoc_hub->slots[Adhoc_hubSlot % ADHOC_HUB_SLOTS];
+	slot.seq = 0;
+	__sync_synchronize();
+	return slot.data;
+}
+
+static void Adhoc_Hub_EndFrame(u32 len)
+{
+	Adhoc_HubSlot& slot = Adhoc_hub->slots[Adhoc_hubSlot % ADHOC_HUB_SLOTS];
+	slot.sender = Adhoc_hubSender;
+	slot.len = len;
+	__sync_synchronize();
+	slot.seq = Adhoc_hubSlot + 1;
+}
+
+static void Adhoc_Hub_Poll(void (*receive)(const u8* frame, u32 len))
+{
+	for (;;)
+	{
+		u32 head = Adhoc_hub->head;
+		if (Adhoc_hubCursor == head)
+			return;
+
+		// lapped: the slot under the cursor was claimed again, skip to the oldest frame still in the ring
+		if (head - Adhoc_hubCursor > ADHOC_HUB_SLOTS)
+		{
+			Adhoc_hubCursor = head - ADHOC_HUB_SLOTS;
+			continue;
+		}
+
+		Adhoc_HubSlot& slot = Adhoc_hub->slots[Adhoc_hubCursor % ADHOC_HUB_SLOTS];
+		const u32 seq = Adhoc_hubCursor + 1;
+
+		if (slot.seq != seq)
+		{
+			// claimed but not written yet: pick it up on a later poll, unless it has been like that
+			// for too long
+			u64 now = Task_GetTimeMicros();
+			if (Adhoc_hubStallCursor != seq)
+			{
+				Adhoc_hubStallCursor = seq;
+				Adhoc_hubStallStart = now;
+				return;
+			}
+			if (now - Adhoc_hubStallStart < ADHOC_HUB_STALL_USEC)
+				return;
+
+			WIFI_LOG(2, "Ad-hoc: skipping a hub slot that was never published.\n");
+			Adhoc_hubCursor++;
+			continue;
+		}
+
+		__sync_synchronize();
+		u32 sender = slot.sender;
+		u32 len = std::min<u32>(slot.len, ADHOC_FRAME_MAX);
+		memcpy(Adhoc_hubRecvBuf, slot.data, len);
+		__sync_synchronize();
+
+		// a sender that lapped us may have rewritten the slot while it was being copied
+		if ((slot.seq == seq) && (sender != Adhoc_hubSender))
+			receive(Adhoc_hubRecvBuf, len);
+		Adhoc_hubCursor++;
+	}
+}
+#else
+static bool Adhoc_Hub_Open()
+{
+	WIFI_LOG(1, "Ad-hoc: the hub isn't available on this platform.\n");
+	return false;
+}
+static void Adhoc_Hub_Close() {}
+static u8* Adhoc_Hub_BeginFrame() { return NULL; }
+static void Adhoc_Hub_EndFrame(u32 len) {}
+static void Adhoc_Hub_Poll(void (*receive)(const u8* frame, u32 len)) {}
+#endif
+
+static const AdhocTransport Adhoc_HubTransport = {
+	"hub",
+	Adhoc_Hub_Open,
+	Adhoc_Hub_Close,
+	Adhoc_Hub_BeginFrame,
+	Adhoc_Hub_EndFrame,
+	Adhoc_Hub_Poll
+};
+
+static const AdhocTransport* Adhoc_transports[] = {
+	&Adhoc_UDP,
+	&Adhoc_HubTransport
+};
+static const AdhocTransport* Adhoc_transport = NULL;
+
+static bool Adhoc_OpenTransport()
+{
+	if ((u32)CommonSettings.wifi.adhocTransport >= ARRAY_SIZE(Adhoc_transports))
+		CommonSettings.wifi.adhocTransport = 0;
+
+	const AdhocTransport* transport = Adhoc_transports[CommonSettings.wifi.adhocTransport];
+	if (!transport->Open())
+		return false;
+
+	Adhoc_transport = transport;
+	return true;
+}
+
+static void Adhoc_CloseTransport()
+{
+	if (Adhoc_transport)
+		Adhoc_transport->Close();
+	Adhoc_transport = NULL;
+}
+
+static u32 Adhoc_WriteFrame(u8* frame, const u8* packet, u32 len)
+{
+	len = std::min<u32>(len, ADHOC_FRAME_MAX - sizeof(Adhoc_FrameHeader));
+
+	Adhoc_FrameHeader* header = (Adhoc_FrameHeader*)frame;
+	memcpy(header->magic, ADHOC_MAGIC, 8);
+	header->version = ADHOC_PROTOCOL_VERSION;
+	header->packetLen = len;
+	memcpy(frame + sizeof(Adhoc_FrameHeader), packet, len);
+
+	return sizeof(Adhoc_FrameHeader) + len;
+}
+
+static void Adhoc_ReceiveFrame(const u8* frame, u32 len)
+{
+	if (len < sizeof(Adhoc_FrameHeader) + 24)
+		return;
+
+	const u8* ptr = frame;
+	Adhoc_FrameHeader header = *(Adhoc_FrameHeader*)ptr;
+	u16 packetLen;
+	
+	// Check the magic string in header
+	if (strncmp(header.magic, ADHOC_MAGIC, 8))
+		return;
+
+	// Check the ad-hoc protocol version
+	if (header.version != ADHOC_PROTOCOL_VERSION)
+		return;
+
+	if (header.packetLen < 4 || header.packetLen > len - sizeof(Adhoc_FrameHeader))
+		return;
+
+	packetLen = header.packetLen - 4;
+	ptr += sizeof(Adhoc_FrameHeader);
+
+	// If the packet is for us, send it to the wifi core
+	if (!WIFI_compareMAC(&ptr[10], &wifiMac.mac.bytes[0]))
+	{
+		if (WIFI_isBroadcastMAC(&ptr[16]) ||
+			WIFI_compareMAC(&ptr[16], &wifiMac.bss.bytes[0]) ||
+			WIFI_isBroadcastMAC(&wifiMac.bss.bytes[0]))
+		{
+			WIFI_LOG(3, "Ad-hoc: received a packet of %i bytes, frame control: %04X\n", packetLen, *(u16*)&ptr[0]);
+			WIFI_LOG(4, "Storing packet at %08X.\n", 0x04804000 + (wifiMac.RXWriteCursor<<1));
+
+			u8* packet = new u8[12 + packetLen];
+
+			WIFI_MakeRXHeader(packet, WIFI_GetRXFlags(ptr), 20, packetLen, 0, 0);
+			memcpy(&packet[12], ptr, packetLen);
+			WIFI_RXQueuePacket(packet, 12+packetLen);
+		}
+	}
+}
+
+
+bool Adhoc_Init()
+{
+	if (!Adhoc_OpenTransport())
+		return false;
+
 	Adhoc_Reset();
 
-	WIFI_LOG(1, "Ad-hoc: initialization successful.\n");
+	WIFI_LOG(1, "Ad-hoc: initialization successful (%s).\n", Adhoc_transport->name);
 
 	return true;
 }
 
 void Adhoc_DeInit()
 {
-	if (wifi_socket >= 0)
-		closesocket(wifi_socket);
+	Adhoc_CloseTransport();
 }
 
 void Adhoc_Reset()
@@ -1846,98 +2354,220 @@ void Adhoc_Reset()
 
 void Adhoc_SendPacket(u8* packet, u32 len)
 {
-	if (wifi_socket < 0)
+	if (!Adhoc_transport)
 		return;
 
 	WIFI_LOG(3, "Ad-hoc: sending a packet of %i bytes, frame control: %04X\n", len, *(u16*)&packet[0]);
 
-	u32 frameLen = sizeof(Adhoc_FrameHeader) + len;
+	u8* frame = Adhoc_transport->BeginFrame();
+	Adhoc_transport->EndFrame(Adhoc_WriteFrame(frame, packet, len));
+}
+
+void Adhoc_msTrigger()
+{
+	if (!Adhoc_transport)
+		return;
 
-	u8* frame = new u8[frameLen];
-	u8* ptr = frame;
+	// Every millisecond, send what was queued and take in what arrived
+	Adhoc_transport->Poll(Adhoc_ReceiveFrame);
+}
 
-	Adhoc_FrameHeader header;
-	strncpy(header.magic, ADHOC_MAGIC, 8);
-	header.version = ADHOC_PROTOCOL_VERSION;
-	header.packetLen = len;
-	memcpy(ptr, &header, sizeof(Adhoc_FrameHeader));
-	ptr += sizeof(Adhoc_FrameHeader);
+#ifndef _WINDOWS
+#include <sched.h>
+#include <sys/wait.h>
 
-	memcpy(ptr, packet, len);
+// Ping-pongs and then streams frames between this instance and a forked copy of it, over
+// the transport picked in CommonSettings.wifi.adhocTransport, and prints the round trip time
+// and the throughput. The frames bypass the wifi core, so this measures the transport alone.
+// the stream is sent in windows of this many frames, each acknowledged before the next goes
+// out, so that neither transport just drops what the other side had no time to read
+#define ADHOC_BENCH_WINDOW			64
 
-	int nbytes = sendto(wifi_socket, (const char*)frame, frameLen, 0, &sendAddr, sizeof(sockaddr_t));
-	
-	WIFI_LOG(4, "Ad-hoc: sent %i/%i bytes of packet.\n", nbytes, frameLen);
+enum { ADHOC_BENCH_HELLO, ADHOC_BENCH_PING, ADHOC_BENCH_DATA, ADHOC_BENCH_DONE, ADHOC_BENCH_REPLY, ADHOC_BENCH_RESULT };
+
+struct Adhoc_BenchMsg
+{
+	u32 kind;
+	u32 sender;
+	u32 seq;
+};
 
-	delete[] frame;
+static u32 Adhoc_benchSelf;
+static Adhoc_BenchMsg Adhoc_benchLast;
+static bool Adhoc_benchGot;
+static u32 Adhoc_benchData;
+
+static void Adhoc_BenchSend(u32 kind, u32 seq, u32 size)
+{
+	u8 packet[ADHOC_FRAME_MAX];
+	memset(packet, 0, size);
+	Adhoc_BenchMsg msg = { kind, Adhoc_benchSelf, seq };
+	memcpy(packet, &msg, sizeof(msg));
+
+	u8* frame = Adhoc_transport->BeginFrame();
+	Adhoc_transport->EndFrame(Adhoc_WriteFrame(frame, packet, size));
 }
 
-void Adhoc_msTrigger()
+static void Adhoc_BenchReceive(const u8* frame, u32 len)
 {
-	if (wifi_socket < 0)
+	if (len < sizeof(Adhoc_FrameHeader) + sizeof(Adhoc_BenchMsg))
+		return;
+	Adhoc_BenchMsg msg;
+	memcpy(&msg, frame + sizeof(Adhoc_FrameHeader), sizeof(msg));
+	// udp broadcasts come back to the sender too
+	if (msg.sender == Adhoc_benchSelf)
 		return;
 
-	// Check every millisecond if we received a packet
-	fd_set fd;
-	struct timeval tv;
+	if (msg.kind == ADHOC_BENCH_DATA)
+	{
+		Adhoc_benchData++;
+		// only the last frame of each window asks for an answer
+		if ((msg.seq % ADHOC_BENCH_WINDOW) != ADHOC_BENCH_WINDOW-1)
+			return;
+	}
 
-	FD_ZERO(&fd);
-	FD_SET(wifi_socket, &fd);
-	tv.tv_sec = 0; 
-	tv.tv_usec = 0;
+	Adhoc_benchLast = msg;
+	Adhoc_benchGot = true;
+}
 
-	if (select(1, &fd, 0, 0, &tv))
+// polls until a message of that kind (and seq, unless it is -1) arrives, or the timeout runs out
+static bool Adhoc_BenchWait(u32 kind, s64 seq, u64 timeoutMicros)
+{
+	u64 start = Task_GetTimeMicros();
+	do
 	{
-		sockaddr_t fromAddr;
-		socklen_t fromLen = sizeof(sockaddr_t);
-		u8 buf[1536];
-		u8* ptr;
-		u16 packetLen;
+		Adhoc_benchGot = false;
+		Adhoc_transport->Poll(Adhoc_BenchReceive);
+		if (Adhoc_benchGot && (Adhoc_benchLast.kind == kind) && ((seq < 0) || (Adhoc_benchLast.seq == seq)))
+			return true;
+		// on a single core the other side only gets to run if we let it
+		sched_yield();
+	} while (Task_GetTimeMicros() - start < timeoutMicros);
+	return false;
+}
 
-		int nbytes = recvfrom(wifi_socket, (char*)buf, 1536, 0, &fromAddr, &fromLen);
+static void Adhoc_BenchEcho()
+{
+	u64 idle = Task_GetTimeMicros();
+	for (;;)
+	{
+		Adhoc_benchGot = false;
+		Adhoc_transport->Poll(Adhoc_BenchReceive);
+		if (!Adhoc_benchGot)
+		{
+			// give up when the other side went away
+			if (Task_GetTimeMicros() - idle > 5000000)
+				return;
+			sched_yield();
+			continue;
+		}
+		idle = Task_GetTimeMicros();
 
-		// No packet arrived (or there was an error)
-		if (nbytes <= 0)
+		Adhoc_BenchMsg msg = Adhoc_benchLast;
+		if (msg.kind == ADHOC_BENCH_DONE)
+		{
+			Adhoc_BenchSend(ADHOC_BENCH_RESULT, Adhoc_benchData, 64);
+			Adhoc_transport->Poll(Adhoc_BenchReceive);
 			return;
+		}
+		Adhoc_BenchSend(ADHOC_BENCH_REPLY, msg.seq, 64);
+	}
+}
 
-		ptr = buf;
-		Adhoc_FrameHeader header = *(Adhoc_FrameHeader*)ptr;
-		
-		// Check the magic string in header
-		if (strncmp(header.magic, ADHOC_MAGIC, 8))
-			return;
+void Adhoc_Benchmark(int frames)
+{
+	static const int pings = 1000;
+	static const u32 frameSize = 1024;
 
-		// Check the ad-hoc protocol version
-		if (header.version != ADHOC_PROTOCOL_VERSION)
-			return;
+	if ((u32)CommonSettings.wifi.adhocTransport >= ARRAY_SIZE(Adhoc_transports))
+		CommonSettings.wifi.adhocTransport = 0;
+	const char* name = Adhoc_transports[CommonSettings.wifi.adhocTransport]->name;
+
+	Adhoc_CloseTransport();
+
+	pid_t child = fork();
+	if (child < 0)
+	{
+		printf("Ad-hoc benchmark: fork failed\n");
+		return;
+	}
+
+	Adhoc_benchSelf = (u32)getpid();
+	if (!Adhoc_OpenTransport())
+	{
+		printf("Ad-hoc benchmark: couldn't open the %s transport\n", name);
+		if (child == 0) _exit(1);
+		waitpid(child, NULL, 0);
+		return;
+	}
+
+	if (child == 0)
+	{
+		Adhoc_BenchEcho();
+		Adhoc_CloseTransport();
+		_exit(0);
+	}
+
+	// the copy needs a moment to open its end
+	bool ready = false;
+	for (int i = 0; i < 100 && !ready; i++)
+	{
+		Adhoc_BenchSend(ADHOC_BENCH_HELLO, 0, 64);
+		ready = Adhoc_BenchWait(ADHOC_BENCH_REPLY, 0, 20000);
+	}
+	if (!ready)
+	{
+		printf("Ad-hoc benchmark (%s): no answer from the other instance\n", name);
+		Adhoc_CloseTransport();
+		waitpid(child, NULL, 0);
+		return;
+	}
 
-		packetLen = header.packetLen - 4;
-		ptr += sizeof(Adhoc_FrameHeader);
+	int answered = 0;
+	u64 start = Task_GetTimeMicros();
+	for (int i = 1; i <= pings; i++)
+	{
+		Adhoc_BenchSend(ADHOC_BENCH_PING, i, 64);
+		if (Adhoc_BenchWait(ADHOC_BENCH_REPLY, i, 100000))
+			answered++;
+	}
+	u64 pingTime = Task_GetTimeMicros() - start;
 
-		// If the packet is for us, send it to the wifi core
-		if (!WIFI_compareMAC(&ptr[10], &wifiMac.mac.bytes[0]))
+	Adhoc_benchData = 0;
+	start = Task_GetTimeMicros();
+	for (int i = 0; i < frames; i++)
+	{
+		Adhoc_BenchSend(ADHOC_BENCH_DATA, i, frameSize);
+		if ((i % ADHOC_BENCH_WINDOW) == ADHOC_BENCH_WINDOW-1)
+			Adhoc_BenchWait(ADHOC_BENCH_REPLY, i, 100000);
+	}
+	u32 received = 0;
+	for (int tries = 0; tries < 20; tries++)
+	{
+		Adhoc_BenchSend(ADHOC_BENCH_DONE, 0, 64);
+		if (Adhoc_BenchWait(ADHOC_BENCH_RESULT, -1, 100000))
 		{
-			if (WIFI_isBroadcastMAC(&ptr[16]) ||
-				WIFI_compareMAC(&ptr[16], &wifiMac.bss.bytes[0]) ||
-				WIFI_isBroadcastMAC(&wifiMac.bss.bytes[0]))
-			{
-			/*	WIFI_LOG(3, "Ad-hoc: received a packet of %i bytes from %i.%i.%i.%i (port %i).\n",
-					nbytes,
-					(u8)fromAddr.sa_data[2], (u8)fromAddr.sa_data[3], 
-					(u8)fromAddr.sa_data[4], (u8)fromAddr.sa_data[5],
-					ntohs(*(u16*)&fromAddr.sa_data[0]));*/
-				WIFI_LOG(3, "Ad-hoc: received a packet of %i bytes, frame control: %04X\n", packetLen, *(u16*)&ptr[0]);
-				WIFI_LOG(4, "Storing packet at %08X.\n", 0x04804000 + (wifiMac.RXWriteCursor<<1));
-
-				u8* packet = new u8[12 + packetLen];
-
-				WIFI_MakeRXHeader(packet, WIFI_GetRXFlags(ptr), 20, packetLen, 0, 0);
-				memcpy(&packet[12], ptr, packetLen);
-				WIFI_RXQueuePacket(packet, 12+packetLen);
-			}
+			received = Adhoc_benchLast.seq;
+			break;
 		}
 	}
+	u64 streamTime = std::max<u64>(1, Task_GetTimeMicros() - start);
+
+	printf("Ad-hoc benchmark (%s): %d/%d pings answered, %.1f us round trip\n",
+		name, answered, pings, answered ? pingTime / (double)answered : 0.0);
+	printf("Ad-hoc benchmark (%s): %u/%d frames of %u bytes delivered in %.1f ms, %.0f frames/s, %.1f MB/s\n",
+		name, received, frames, frameSize, streamTime / 1000.0,
+		received * 1000000.0 / streamTime, received * (double)frameSize / streamTime);
+
+	Adhoc_CloseTransport();
+	waitpid(child, NULL, 0);
 }
+#else
+void Adhoc_Benchmark(int frames)
+{
+	printf("Ad-hoc benchmark: needs fork(), not available on this platform\n");
+}
+#endif
 
 /*******************************************************************************
 
@@ -507,6 +507,7 @@ typedef struct
 
 	/* timing */
 	u64 GlobalUsecTimer;
+	u64 usecTime;	/* nds_timer of the last usec that was counted */
 	BOOL crystalEnabled;
 	u64 usec;
 	BOOL usecEnable;
@@ -589,7 +590,15 @@ void WIFI_write16(u32 address, u16 val);
 u16  WIFI_read16(u32 address);
 
 /* wifimac timing */
-void WIFI_usTrigger();
+/* the timers only run when the sequencer reaches the next event or the registers are accessed,
+   and then catch up on the microseconds since */
+void WIFI_usSync();
+u64  WIFI_usNextEvent();
+
+#ifdef EXPERIMENTAL_WIFI_COMM
+/* ad-hoc transport round trip and throughput, against a forked copy of this instance */
+void Adhoc_Benchmark(int frames);
+#endif
 
 
 /* DS WFC profile data documented here : */